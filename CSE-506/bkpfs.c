@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <asm/unistd.h>
 #include <stdio.h>
 #include <errno.h>
@@ -6,7 +7,9 @@
 #include <unistd.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/sendfile.h>
 #include <stdlib.h>
+#include <time.h>
 
 typedef struct {
     int min_ver, max_ver;
@@ -19,6 +22,142 @@ typedef struct {
 #define VIEW_VERSION   		_IOWR('q', 3, int)
 #define RESTORE_VERSION  	_IOW('q', 4, int)
 
+typedef struct {
+    unsigned long long logical_bytes, stored_bytes, chunks;
+    unsigned long long views, view_bytes;
+} stats_arg_t;
+
+#define STORE_STATS		_IOR('q', 5, stats_arg_t)
+
+typedef struct {
+    int version;
+    int encoding;
+    unsigned long long size, stored, cpu_ns;
+} version_info_t;
+
+#define VERSION_INFO		_IOWR('q', 6, version_info_t)
+
+typedef struct {
+    unsigned long long done, total;
+} progress_arg_t;
+
+#define BACKUP_PROGRESS		_IOR('q', 7, progress_arg_t)
+
+typedef struct {
+    int state;
+    unsigned long long dirs, files, versioned, fixed, records, errors;
+    unsigned long long msecs;
+} scan_arg_t;
+
+#define SCAN_PROGRESS		_IOR('q', 8, scan_arg_t)
+
+typedef struct {
+    long long time;
+    int version;
+    unsigned long long ctime_ns;
+} time_arg_t;
+
+#define VERSION_AT		_IOWR('q', 9, time_arg_t)
+
+typedef struct {
+    int version;
+    int encoding;
+    unsigned int flags;
+    unsigned int crc;
+    unsigned long long ctime_ns;
+    unsigned long long size;
+    unsigned long long stored;
+} version_rec_t;
+
+#define VREC_LIVE		0x1
+#define VREC_CRC		0x2
+
+#define LIST_ABI		1
+
+typedef struct {
+    unsigned int abi;
+    unsigned int rec_size;
+    int start;
+    int next;
+    unsigned int count;
+    int min_ver, max_ver;
+    unsigned long long buf;
+} list_arg_t;
+
+#define LIST_RECORDS		_IOWR('q', 10, list_arg_t)
+
+typedef struct {
+    unsigned short reclen;
+    unsigned short namelen;
+    int versions;
+    unsigned long long ino;
+    unsigned long long newest_ns;
+    unsigned long long bytes;
+    char name[];
+} dirsum_ent_t;
+
+#define DIRSUM_ABI		1
+
+typedef struct {
+    unsigned int abi;
+    unsigned int eof;
+    unsigned long long cookie;
+    unsigned int size;
+    unsigned int count;
+    unsigned long long buf;
+} dirsum_arg_t;
+
+#define DIR_SUMMARY		_IOWR('q', 11, dirsum_arg_t)
+#define OPEN_VERSION		_IOW('q', 12, int)
+#define RESTORE_INPLACE		_IOW('q', 13, int)
+
+typedef struct {
+    int version;
+    unsigned long long src_offset, dst_offset, length;
+    unsigned long long copied;
+} range_arg_t;
+
+#define RESTORE_RANGE		_IOWR('q', 14, range_arg_t)
+
+typedef struct {
+    unsigned long long offset, length;
+} diff_ext_t;
+
+#define DIFF_LIVE		0
+
+typedef struct {
+    int from, to;
+    unsigned long long start;
+    unsigned long long next;
+    unsigned int count;
+    unsigned int eof;
+    unsigned long long shared;
+    unsigned long long buf;
+} diff_arg_t;
+
+#define DIFF_VERSIONS		_IOWR('q', 15, diff_arg_t)
+
+typedef struct {
+    int version;
+    int fd;
+    unsigned long long sent;
+} send_arg_t;
+
+#define SEND_VERSION		_IOWR('q', 16, send_arg_t)
+
+/* extents asked for per DIFF_VERSIONS call */
+#define DIFF_BATCH		1024
+
+/* bytes of children asked for per DIR_SUMMARY call */
+#define DIRSUM_BUFSIZE		(64 * 1024)
+
+/* records asked for per LIST_RECORDS call */
+#define LIST_BATCH		1024
+
+static const char *encodings[] = {
+	"full", "pre-image", "delta", "chunks", "compressed"
+};
+
 #define OLDEST_VERSION 		-2
 #define NEWEST_VERSION 		-1
 #define ALL_VERSIONS 		 0
@@ -53,16 +192,147 @@ void list_versions(int fd) {
 		printf(".%s.%d.swp\n", q.filename, i);
 }        	
 
+/* every version with its time, sizes and checksum, LIST_BATCH per call */
+int list_records(int fd) {
+	version_rec_t *recs;
+	list_arg_t la;
+	char when[32], crc[16];
+	unsigned int i;
+	time_t t;
+	int err = 0;
+
+	recs = calloc(LIST_BATCH, sizeof(*recs));
+	if (!recs)
+		return -ENOMEM;
+	memset(&la, 0, sizeof(la));
+	printf("%8s  %-19s  %12s  %12s  %-8s  %s\n", "VERSION", "MADE",
+	       "SIZE", "STORED", "CRC32C", "STORED AS");
+	do {
+		la.abi = LIST_ABI;
+		la.rec_size = sizeof(*recs);
+		la.start = la.next;
+		la.count = LIST_BATCH;
+		la.buf = (unsigned long)recs;
+		if (ioctl(fd, LIST_RECORDS, &la) < 0) {
+			perror("LIST_RECORDS");
+			err = -errno;
+			break;
+		}
+		for (i = 0; i < la.count; i++) {
+			if (!(recs[i].flags & VREC_LIVE)) {
+				printf("%8d  (missing)\n", recs[i].version);
+				continue;
+			}
+			t = recs[i].ctime_ns / 1000000000ULL;
+			strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S",
+				 localtime(&t));
+			if (recs[i].flags & VREC_CRC)
+				snprintf(crc, sizeof(crc), "%08x", recs[i].crc);
+			else
+				snprintf(crc, sizeof(crc), "-");
+			printf("%8d  %-19s  %12llu  %12llu  %-8s  %s\n",
+			       recs[i].version, when, recs[i].size,
+			       recs[i].stored, crc,
+			       recs[i].encoding >= 0 && recs[i].encoding < 5 ?
+			       encodings[recs[i].encoding] : "unknown");
+		}
+	} while (la.next);
+	free(recs);
+	return err;
+}
+
+/* versions of every child of a directory, DIRSUM_BUFSIZE per call */
+int dir_summary(int fd) {
+	unsigned long long files = 0, versions = 0, bytes = 0;
+	dirsum_arg_t da;
+	dirsum_ent_t *e;
+	char when[32], *buf;
+	unsigned int i, off;
+	time_t t;
+	int err = 0;
+
+	buf = malloc(DIRSUM_BUFSIZE);
+	if (!buf)
+		return -ENOMEM;
+	memset(&da, 0, sizeof(da));
+	printf("%10s  %8s  %-19s  %12s  %s\n", "INODE", "VERSIONS",
+	       "NEWEST", "BYTES", "NAME");
+	do {
+		da.abi = DIRSUM_ABI;
+		da.size = DIRSUM_BUFSIZE;
+		da.buf = (unsigned long)buf;
+		if (ioctl(fd, DIR_SUMMARY, &da) < 0) {
+			perror("DIR_SUMMARY");
+			err = -errno;
+			break;
+		}
+		for (i = 0, off = 0; i < da.count; i++, off += e->reclen) {
+			e = (dirsum_ent_t *)(buf + off);
+			if (e->newest_ns) {
+				t = e->newest_ns / 1000000000ULL;
+				strftime(when, sizeof(when),
+					 "%Y-%m-%d %H:%M:%S", localtime(&t));
+			} else {
+				snprintf(when, sizeof(when), "-");
+			}
+			printf("%10llu  %8d  %-19s  %12llu  %s\n", e->ino,
+			       e->versions, when, e->bytes, e->name);
+			files++;
+			versions += e->versions;
+			bytes += e->bytes;
+		}
+	} while (!da.eof);
+	printf("%llu children, %llu versions, %llu bytes of versions\n",
+	       files, versions, bytes);
+	free(buf);
+	return err;
+}
+
 void delete_version(int fd, int ver) {
 	ioctl(fd, DELETE_VERSION, ver);
 	printf("Done deleting the backup version\n");
 }
 
+/* copies the rest of a descriptor to stdout, in the kernel when it can */
+int send_file(int in) {
+	char buf[65536];
+	ssize_t n, off, w;
+
+	fflush(stdout);
+	do {
+		n = sendfile(STDOUT_FILENO, in, NULL, 1 << 30);
+	} while (n > 0);
+	if (n == 0)
+		return 0;
+	// stdout is something sendfile cannot write to
+	while ((n = read(in, buf, sizeof(buf))) > 0) {
+		for (off = 0; off < n; off += w) {
+			w = write(STDOUT_FILENO, buf + off, n - off);
+			if (w < 0)
+				return -errno;
+		}
+	}
+	return n < 0 ? -errno : 0;
+}
+
 void view_version(int fd, int ver, char* filename) {
 	char *new_file, *s_version;
 	int len = strlen(filename);
 	int ver_len;   	
- 
+	int vfd;
+
+	vfd = ioctl(fd, OPEN_VERSION, ver);
+	if (vfd >= 0) {
+		send_file(vfd);
+		close(vfd);
+		return;
+	}
+	if (errno != ENOTTY) {
+		printf("Cannot open file \n");
+		exit(0);
+	}
+
+	// Older modules only view through a .vue file
 	ioctl(fd, VIEW_VERSION, ver);
     	new_file = (char *) malloc (len + 7);
     	strcpy(new_file, filename);
@@ -84,13 +354,265 @@ void restore_version(int fd, int ver) {
 	printf("Restored the backup file\n");
 }
 
+int restore_inplace(int fd, int ver) {
+	if (ioctl(fd, RESTORE_INPLACE, ver) < 0) {
+		if (errno == EBUSY)
+			printf("The file is open for writing\n");
+		else if (errno == EMLINK)
+			printf("The file has other links\n");
+		else
+			perror("RESTORE_INPLACE");
+		return -errno;
+	}
+	printf("Restored the file in place\n");
+	return 0;
+}
+
+/* 'newest', 'oldest' or N */
+int version_arg(const char *ver) {
+	if (strcmp(ver, "newest") == 0)
+		return NEWEST_VERSION;
+	if (strcmp(ver, "oldest") == 0)
+		return OLDEST_VERSION;
+	return atoi(ver);
+}
+
+/* ARG is VERSION:OFFSET:LENGTH[:DEST], DEST defaults to OFFSET */
+int restore_range(int fd, const char *arg) {
+	range_arg_t ra;
+	char ver[16];
+	int n;
+
+	n = sscanf(arg, "%15[^:]:%llu:%llu:%llu", ver, &ra.src_offset,
+		   &ra.length, &ra.dst_offset);
+	if (n < 3) {
+		printf("Invalid range %s\n", arg);
+		return -EINVAL;
+	}
+	if (n == 3)
+		ra.dst_offset = ra.src_offset;
+	ra.version = version_arg(ver);
+
+	if (ioctl(fd, RESTORE_RANGE, &ra) < 0) {
+		perror("RESTORE_RANGE");
+		return -errno;
+	}
+	printf("Restored %llu bytes of version %s at offset %llu\n",
+	       ra.copied, ver, ra.dst_offset);
+	return 0;
+}
+
+/* the version goes straight to stdout, a pipe, socket or file */
+int send_version(int fd, const char *ver) {
+	send_arg_t sa;
+
+	sa.version = version_arg(ver);
+	sa.fd = STDOUT_FILENO;
+	fflush(stdout);
+	if (ioctl(fd, SEND_VERSION, &sa) < 0) {
+		if (errno == EBADF)
+			fprintf(stderr, "Standard output cannot be written to in place (O_APPEND?)\n");
+		else
+			perror("SEND_VERSION");
+		return -errno;
+	}
+	fprintf(stderr, "Sent %llu bytes of version %s\n", sa.sent, ver);
+	return 0;
+}
+
+/* ARG is FROM:TO, TO may be 'live' for the file itself */
+int diff_versions(int fd, const char *arg) {
+	diff_ext_t *ext;
+	diff_arg_t da;
+	char from[16], to[16];
+	unsigned long long bytes = 0, shared = 0;
+	unsigned int i, extents = 0;
+
+	if (sscanf(arg, "%15[^:]:%15s", from, to) != 2) {
+		printf("Invalid versions %s\n", arg);
+		return -EINVAL;
+	}
+	ext = malloc(DIFF_BATCH * sizeof(*ext));
+	if (!ext)
+		return -ENOMEM;
+
+	memset(&da, 0, sizeof(da));
+	da.from = version_arg(from);
+	da.to = strcmp(to, "live") == 0 ? DIFF_LIVE : version_arg(to);
+	da.buf = (unsigned long)ext;
+	printf("Differences of version %s and %s%s:\n", from,
+	       da.to == DIFF_LIVE ? "the file" : "version ",
+	       da.to == DIFF_LIVE ? "" : to);
+	printf("%-20s %s\n", "OFFSET", "LENGTH");
+	do {
+		da.count = DIFF_BATCH;
+		if (ioctl(fd, DIFF_VERSIONS, &da) < 0) {
+			perror("DIFF_VERSIONS");
+			free(ext);
+			return -errno;
+		}
+		for (i = 0; i < da.count; i++) {
+			printf("%-20llu %llu\n", ext[i].offset, ext[i].length);
+			bytes += ext[i].length;
+		}
+		extents += da.count;
+		shared += da.shared;
+		da.start = da.next;
+	} while (!da.eof);
+	printf("%u extents, %llu bytes differ, %llu bytes shared\n",
+	       extents, bytes, shared);
+	free(ext);
+	return 0;
+}
+
+void store_stats(int fd) {
+	stats_arg_t st;
+
+	if (ioctl(fd, STORE_STATS, &st) < 0) {
+		perror("STORE_STATS");
+		return;
+	}
+	printf("Chunks stored    : %llu\n", st.chunks);
+	printf("Bytes in versions: %llu\n", st.logical_bytes);
+	printf("Bytes stored     : %llu\n", st.stored_bytes);
+	printf("Bytes saved      : %llu\n", st.logical_bytes - st.stored_bytes);
+	printf("Rebuilt copies   : %llu\n", st.views);
+	printf("Bytes in copies  : %llu\n", st.view_bytes);
+}
+
+void version_info(int fd, int ver) {
+	const char **enc = encodings;
+	version_info_t vi;
+
+	vi.version = ver;
+	if (ioctl(fd, VERSION_INFO, &vi) < 0) {
+		perror("VERSION_INFO");
+		return;
+	}
+	printf("Version          : %d\n", vi.version);
+	printf("Stored as        : %s\n", vi.encoding >= 0 && vi.encoding < 5 ?
+	       enc[vi.encoding] : "unknown");
+	printf("File size        : %llu\n", vi.size);
+	printf("Stored size      : %llu\n", vi.stored);
+	if (vi.size && vi.stored)
+		printf("Ratio            : %.2f\n",
+		       (double)vi.size / vi.stored);
+	printf("Compression time : %llu ns\n", vi.cpu_ns);
+}
+
+void backup_progress(int fd) {
+	progress_arg_t p;
+
+	if (ioctl(fd, BACKUP_PROGRESS, &p) < 0) {
+		perror("BACKUP_PROGRESS");
+		return;
+	}
+	if (!p.total) {
+		printf("No backup running\n");
+		return;
+	}
+	if (p.done > p.total)
+		p.done = p.total;
+	printf("Copied : %llu of %llu bytes (%llu%%)\n", p.done, p.total,
+	       p.done * 100 / p.total);
+}
+
+void scan_progress(int fd) {
+	static const char *state[] = { "not run", "running", "done" };
+	scan_arg_t s;
+
+	if (ioctl(fd, SCAN_PROGRESS, &s) < 0) {
+		perror("SCAN_PROGRESS");
+		return;
+	}
+	printf("Scan             : %s\n", s.state >= 0 && s.state < 3 ?
+	       state[s.state] : "unknown");
+	if (!s.state)
+		return;
+	printf("Directories      : %llu\n", s.dirs);
+	printf("Files            : %llu\n", s.files);
+	printf("Versioned files  : %llu\n", s.versioned);
+	printf("Ranges fixed     : %llu\n", s.fixed);
+	printf("Records rebuilt  : %llu\n", s.records);
+	printf("Errors           : %llu\n", s.errors);
+	printf("Elapsed          : %llu ms", s.msecs);
+	if (s.msecs)
+		printf(" (%llu files/s)", s.files * 1000 / s.msecs);
+	printf("\n");
+}
+
+/* "@SECONDS", "YYYY-MM-DD HH:MM[:SS]" or "HH:MM[:SS]" (today), local */
+int parse_time(const char *s, time_t *t) {
+	struct tm tm;
+	time_t now = time(NULL);
+	char *end;
+
+	if (s[0] == '@') {
+		*t = strtoll(s + 1, &end, 10);
+		return *end ? -1 : 0;
+	}
+	localtime_r(&now, &tm);
+	tm.tm_sec = 0;
+	end = strptime(s, "%Y-%m-%d %H:%M", &tm);
+	if (!end) {
+		/* a failed parse may have set some fields */
+		localtime_r(&now, &tm);
+		tm.tm_sec = 0;
+		end = strptime(s, "%H:%M", &tm);
+	}
+	if (!end)
+		return -1;
+	if (*end == ':')
+		end = strptime(end + 1, "%S", &tm);
+	if (!end || *end)
+		return -1;
+	tm.tm_isdst = -1;
+	*t = mktime(&tm);
+	return *t == (time_t)-1 ? -1 : 0;
+}
+
+int version_at(int fd, const char *when, char *filename) {
+	time_arg_t ta;
+	time_t t;
+	char buf[64];
+
+	if (parse_time(when, &t) < 0) {
+		printf("Invalid time %s\n", when);
+		return -EINVAL;
+	}
+	ta.time = t;
+	if (ioctl(fd, VERSION_AT, &ta) < 0) {
+		if (errno == ENOENT)
+			printf("No version as old as %s\n", when);
+		else
+			perror("VERSION_AT");
+		return -errno;
+	}
+	t = ta.ctime_ns / 1000000000ULL;
+	strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&t));
+	printf("Version as of %s : %d (made %s)\n", when, ta.version, buf);
+	view_version(fd, ta.version, filename);
+	return 0;
+}
+
 void print_help() {
-	printf("./bkpctl -[ld:v:r:] FILE\n");
+	printf("./bkpctl -[lLSspcd:v:e:r:R:b:D:i:t:] FILE\n");
 	printf("FILE: the file's name to operate on\n");
 	printf("-l: option to list versions\n");
+	printf("-L: option to list versions with their time, sizes, checksum and encoding\n");
+	printf("-S: option to summarize the versions of every file in a directory (FILE: the directory)\n");
 	printf("-d ARG: option to 'delete' versions; ARG can be 'newest', 'oldest', or 'all'\n");
 	printf("-v ARG: option to 'view' contents of versions (ARG: 'newest', 'oldest', or N)\n");
-	printf("-r ARG: option to 'restore' file (ARG: 'newest' or N)\n");				
+	printf("-e ARG: option to write a version to standard output in one pass, e.g. to a pipe (ARG: 'newest', 'oldest', or N)\n");
+	printf("-r ARG: option to 'restore' file (ARG: 'newest' or N)\n");
+	printf("-R ARG: option to restore a version over the file itself (ARG: 'newest', 'oldest', or N)\n");
+	printf("-b ARG: option to restore bytes of a version into the file (ARG: 'V:OFFSET:LENGTH[:DEST]', V: 'newest', 'oldest', or N)\n");
+	printf("-D ARG: option to list the byte ranges that differ between two versions (ARG: 'V:V', V: 'newest', 'oldest', or N; the second may be 'live' for the file)\n");
+	printf("-s: option to show what the chunk store saves (format=dedup) and the rebuilt copies cached\n");
+	printf("-p: option to show how far the running backup or restore got\n");
+	printf("-i ARG: option to show how a version is stored (ARG: 'newest', 'oldest', or N)\n");
+	printf("-c: option to show how far the mount-time scan got (FILE: any file of the mount)\n");
+	printf("-t TIME: option to view the version the file had at TIME ('HH:MM[:SS]' today, 'YYYY-MM-DD HH:MM[:SS]' or '@SECONDS')\n");				
 }
 
 int main(int argc, char * const argv[]) {
@@ -98,14 +620,19 @@ int main(int argc, char * const argv[]) {
 	int option = 0;
     	int fd = 0;
 	int version;
-	char *ver_str;	
-    	char *optstring = "ld:v:r:h";
+	char *ver_str = "all";
+    	char *optstring = "lLSspcd:v:e:r:R:b:D:i:t:h";
 	char* file;
 
     	if ((option = getopt(argc, argv, optstring)) != -1) {
 		switch(option) {
 			printf("option: %c\n", option);
 			case 'l':
+			case 'L':
+			case 'S':
+			case 's':
+			case 'p':
+			case 'c':
 				if (argc != 3) {
                                         print_help();
                                         return -1;
@@ -113,7 +640,13 @@ int main(int argc, char * const argv[]) {
 				break;
 			case 'd':
 			case 'v':
+			case 'e':
 			case 'r':
+			case 'R':
+			case 'b':
+			case 'D':
+			case 'i':
+			case 't':
 				if (argc != 4) {
                         		print_help();
 					return -1;
@@ -130,7 +663,9 @@ int main(int argc, char * const argv[]) {
 		}
     	}
 
-        if(option != 'l' &&  optind + 1 != argc) {
+        if(option != 'l' && option != 'L' && option != 'S' &&
+	   option != 's' && option != 'p' && option != 'c' &&
+	   optind + 1 != argc) {
                 printf("INVOPT:Invalid file info \n");
                 err = -EINVAL;
                 goto out;
@@ -138,7 +673,8 @@ int main(int argc, char * const argv[]) {
 		file = argv[optind];
 	}
         
-	fd = open(file, O_RDONLY);
+	// Restoring a range writes to the file
+	fd = open(file, option == 'b' ? O_RDWR : O_RDONLY);
         if(fd < 0) {
         	printf("Could Not Open Descriptor\n");
                 return 1;
@@ -150,6 +686,8 @@ int main(int argc, char * const argv[]) {
 		version = OLDEST_VERSION;
 	else if(strcmp(ver_str, "all") == 0)
 		version = ALL_VERSIONS;
+	else if(option == 't')
+		version = 0;
 	else
 		version = atoi(ver_str);
 
@@ -158,6 +696,12 @@ int main(int argc, char * const argv[]) {
 			printf("INFO: List all files\n");
 			list_versions(fd);
 			break;
+		case 'L':
+			err = list_records(fd);
+			break;
+		case 'S':
+			err = dir_summary(fd);
+			break;
 		case 'd':
 			if(version > 0) {
 				printf("Invalid version %d. Use [olderst | newest | all]\n", version);
@@ -172,6 +716,33 @@ int main(int argc, char * const argv[]) {
                 case 'r':
 			restore_version(fd, version);
 			break;
+		case 'R':
+			err = restore_inplace(fd, version);
+			break;
+		case 'b':
+			err = restore_range(fd, ver_str);
+			break;
+		case 'D':
+			err = diff_versions(fd, ver_str);
+			break;
+		case 'e':
+			err = send_version(fd, ver_str);
+			break;
+		case 's':
+			store_stats(fd);
+			break;
+		case 'i':
+			version_info(fd, version);
+			break;
+		case 'p':
+			backup_progress(fd);
+			break;
+		case 'c':
+			scan_progress(fd);
+			break;
+		case 't':
+			err = version_at(fd, ver_str, file);
+			break;
 
 	}    
 out:
@@ -0,0 +1,41 @@
+#!/bin/sh
+# Test the backup_mode mount option
+# set -x
+separator="---------------------------------------------------------------"
+echo $separator
+echo $'Test the backup_mode mount option'
+echo $separator
+
+myvar=$(cat /proc/mounts | grep bkpfs)
+chrlen=${#myvar}
+if [ "$chrlen" -gt 0 ]; then
+        umount /test/mntpt/
+fi
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
+
+# an unknown mode must be refused
+if mount -t bkpfs -o backup_mode=bogus /test/lowerdir /test/mntpt 2>/dev/null ; then
+        printf "FAILED : Invalid backup_mode accepted!\n"
+        umount /test/mntpt/
+else
+        printf "SUCCESS : Invalid backup_mode refused!\n"
+fi
+
+for mode in copy auto ; do
+        mount -t bkpfs -o maxver=5,backup_mode=$mode /test/lowerdir /test/mntpt
+
+        echo dwight >  /test/mntpt/office.txt
+        echo dwight >> /test/mntpt/office.txt
+
+        # the newest version must hold the same bytes as the file
+        if cmp /test/mntpt/office.txt /test/lowerdir/.office.txt.bkp/.office.txt.2 ; then
+                printf "SUCCESS : Backup created with backup_mode=$mode!\n"
+        else
+                printf "FAILED : Backup differs with backup_mode=$mode!\n"
+        fi
+
+        umount /test/mntpt/
+        cd /test/lowerdir
+        rm -rf ..?* .[!.]* *
+done
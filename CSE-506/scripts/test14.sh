@@ -0,0 +1,42 @@
+#!/bin/sh
+# Test asynchronous backups (backup=async)
+# set -x
+separator="---------------------------------------------------------------"
+echo $separator
+echo $'Test asynchronous backups (backup=async)'
+echo $separator
+
+myvar=$(cat /proc/mounts | grep bkpfs)
+chrlen=${#myvar}
+if [ "$chrlen" -gt 0 ]; then
+        umount /test/mntpt/
+fi
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
+mount -t bkpfs -o maxver=5,backup=async,queue_depth=4 /test/lowerdir /test/mntpt
+
+echo dwight >  /test/mntpt/office.txt # 1
+echo jim    >> /test/mntpt/office.txt # 2
+echo pam    >> /test/mntpt/office.txt # 3
+cat /test/mntpt/office.txt > /tmp/ideal.txt
+
+# unmount waits for the queued backups
+umount /test/mntpt/
+
+if cmp /tmp/ideal.txt /test/lowerdir/.office.txt.bkp/.office.txt.3 ; then
+        printf "SUCCESS : Asynchronous backup matches the file!\n"
+else
+        printf "FAILED : Asynchronous backup differs from the file!\n"
+fi
+
+var=$(ls -1a /test/lowerdir/.office.txt.bkp | wc -l)
+# 3 backups and 2 for . and ..
+if [ "$var" -eq 5 ] ; then
+        printf "SUCCESS : One backup per close!\n"
+else
+        printf "FAILED : Wrong number of backups!\n"
+fi
+
+/bin/rm -f /tmp/ideal.txt
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
@@ -0,0 +1,43 @@
+#!/bin/sh
+# Test pre-image versions (format=preimage)
+# set -x
+separator="---------------------------------------------------------------"
+echo $separator
+echo $'Test pre-image versions (format=preimage)'
+echo $separator
+
+myvar=$(cat /proc/mounts | grep bkpfs)
+chrlen=${#myvar}
+if [ "$chrlen" -gt 0 ]; then
+        umount /test/mntpt/
+fi
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
+mount -t bkpfs -o maxver=5,format=preimage /test/lowerdir /test/mntpt
+
+echo dwight >  /test/mntpt/office.txt # 1: empty file
+cat /test/mntpt/office.txt > /tmp/ideal.txt
+echo jim    >> /test/mntpt/office.txt # 2: "dwight"
+echo pam    >  /test/mntpt/office.txt # 3: "dwight jim", truncated away
+
+# version 2 is the file before the append
+cd /usr/src/hw2-kanirudh/CSE-506/
+./bkpctl -v 2 /test/mntpt/office.txt > /tmp/state.txt
+if cmp /tmp/ideal.txt /tmp/state.txt ; then
+        printf "SUCCESS : Pre-image version rebuilt!\n"
+else
+        printf "FAILED : Pre-image version differs!\n"
+fi
+
+# the append saved nothing, only the truncate saved data
+var=$(stat -c %s /test/lowerdir/.office.txt.bkp/.office.txt.3)
+if [ "$var" -lt 4096 ] ; then
+        printf "SUCCESS : Pre-image holds only the changed bytes!\n"
+else
+        printf "FAILED : Pre-image is too large!\n"
+fi
+
+/bin/rm -f /tmp/ideal.txt /tmp/state.txt
+umount /test/mntpt/
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
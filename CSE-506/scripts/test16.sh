@@ -0,0 +1,50 @@
+#!/bin/sh
+# Test delta versions (format=delta)
+# set -x
+separator="---------------------------------------------------------------"
+echo $separator
+echo $'Test delta versions (format=delta)'
+echo $separator
+
+myvar=$(cat /proc/mounts | grep bkpfs)
+chrlen=${#myvar}
+if [ "$chrlen" -gt 0 ]; then
+        umount /test/mntpt/
+fi
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
+mount -t bkpfs -o maxver=2,format=delta /test/lowerdir /test/mntpt
+
+dd if=/dev/urandom of=/test/mntpt/big.bin bs=64k count=16 2> /dev/null # 1
+echo dwight >> /test/mntpt/big.bin # 2: delta on 1
+cat /test/mntpt/big.bin > /tmp/ideal.txt
+
+# an append stores only the appended bytes
+var=$(stat -c %s /test/lowerdir/.big.bin.bkp/.big.bin.2)
+if [ "$var" -lt 4096 ] ; then
+        printf "SUCCESS : Delta holds only the written bytes!\n"
+else
+        printf "FAILED : Delta is too large!\n"
+fi
+
+cd /usr/src/hw2-kanirudh/CSE-506/
+./bkpctl -v 2 /test/mntpt/big.bin > /tmp/state.txt
+if cmp /tmp/ideal.txt /tmp/state.txt ; then
+        printf "SUCCESS : Delta version rebuilt!\n"
+else
+        printf "FAILED : Delta version differs!\n"
+fi
+
+# maxver=2 drops version 1, version 2 becomes a full copy
+echo jim >> /test/mntpt/big.bin # 3: delta on 2
+./bkpctl -v 2 /test/mntpt/big.bin > /tmp/state.txt
+if cmp /tmp/ideal.txt /tmp/state.txt ; then
+        printf "SUCCESS : Delta survived the loss of its base!\n"
+else
+        printf "FAILED : Delta lost with its base!\n"
+fi
+
+/bin/rm -f /tmp/ideal.txt /tmp/state.txt
+umount /test/mntpt/
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
@@ -0,0 +1,51 @@
+#!/bin/sh
+# Test deduplicated versions (format=dedup)
+# set -x
+separator="---------------------------------------------------------------"
+echo $separator
+echo $'Test deduplicated versions (format=dedup)'
+echo $separator
+
+myvar=$(cat /proc/mounts | grep bkpfs)
+chrlen=${#myvar}
+if [ "$chrlen" -gt 0 ]; then
+        umount /test/mntpt/
+fi
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
+mount -t bkpfs -o maxver=5,format=dedup /test/lowerdir /test/mntpt
+
+dd if=/dev/urandom of=/tmp/ideal.txt bs=64k count=16 2> /dev/null
+cp /tmp/ideal.txt /test/mntpt/a.bin # 1
+cp /tmp/ideal.txt /test/mntpt/b.bin # 1: same chunks as a.bin
+
+cd /usr/src/hw2-kanirudh/CSE-506/
+./bkpctl -v 1 /test/mntpt/b.bin > /tmp/state.txt
+if cmp /tmp/ideal.txt /tmp/state.txt ; then
+        printf "SUCCESS : Version rebuilt from chunks!\n"
+else
+        printf "FAILED : Version differs!\n"
+fi
+
+# the second copy is stored only as a manifest
+saved=$(./bkpctl -s /test/mntpt/a.bin | grep saved | awk '{print $4}')
+if [ "$saved" -ge 1048576 ] ; then
+        printf "SUCCESS : Identical files share their chunks!\n"
+else
+        printf "FAILED : Chunks were stored twice!\n"
+fi
+
+# dropping both versions frees the chunks
+./bkpctl -d all /test/mntpt/a.bin > /dev/null
+./bkpctl -d all /test/mntpt/b.bin > /dev/null
+var=$(ls -1a /test/lowerdir/..bkp | wc -l)
+if [ "$var" -eq 2 ] ; then
+        printf "SUCCESS : Unreferenced chunks freed!\n"
+else
+        printf "FAILED : Chunks leaked!\n"
+fi
+
+/bin/rm -f /tmp/ideal.txt /tmp/state.txt
+umount /test/mntpt/
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
@@ -0,0 +1,40 @@
+#!/bin/sh
+# Test that rewriting the same contents makes no version
+# set -x
+separator="---------------------------------------------------------------"
+echo $separator
+echo $'Test that rewriting the same contents makes no version'
+echo $separator
+
+myvar=$(cat /proc/mounts | grep bkpfs)
+chrlen=${#myvar}
+if [ "$chrlen" -gt 0 ]; then
+        umount /test/mntpt/
+fi
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
+mount -t bkpfs -o maxver=2,unchanged=skip /test/lowerdir /test/mntpt
+
+echo dwight > /test/mntpt/office.txt # 1
+echo jim    > /test/mntpt/office.txt # 2
+echo jim    > /test/mntpt/office.txt # same as 2
+echo jim    > /test/mntpt/office.txt # same as 2
+
+var=$(ls -1a /test/lowerdir/.office.txt.bkp | wc -l)
+# 2 backups and 2 for . and ..
+if [ "$var" -eq 4 ] ; then
+        printf "SUCCESS : Identical rewrites made no version!\n"
+else
+        printf "FAILED : Identical rewrites made versions!\n"
+fi
+
+# the oldest real version was not evicted
+if grep -q dwight /test/lowerdir/.office.txt.bkp/.office.txt.1 ; then
+        printf "SUCCESS : Oldest version kept!\n"
+else
+        printf "FAILED : Oldest version evicted!\n"
+fi
+
+umount /test/mntpt/
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
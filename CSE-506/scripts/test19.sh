@@ -0,0 +1,40 @@
+#!/bin/sh
+# Test that compressed versions are smaller and view back unchanged
+# set -x
+separator="---------------------------------------------------------------"
+echo $separator
+echo $'Test that compressed versions are smaller and view back unchanged'
+echo $separator
+
+myvar=$(cat /proc/mounts | grep bkpfs)
+chrlen=${#myvar}
+if [ "$chrlen" -gt 0 ]; then
+        umount /test/mntpt/
+fi
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
+mount -t bkpfs -o compress=zstd /test/lowerdir /test/mntpt
+
+for i in $(seq 1 20000); do
+        echo "that's what she said $i"
+done > /test/mntpt/office.txt # 1
+
+size=$(stat -c %s /test/lowerdir/office.txt)
+stored=$(stat -c %s /test/lowerdir/.office.txt.bkp/.office.txt.1)
+if [ "$stored" -lt "$size" ] ; then
+        printf "SUCCESS : Version is compressed!\n"
+else
+        printf "FAILED : Version is not compressed!\n"
+fi
+
+cd /usr/src/hw2-kanirudh/CSE-506/
+./bkpctl -v 1 /test/mntpt/office.txt > /tmp/state.txt
+if cmp /test/mntpt/office.txt /tmp/state.txt ; then
+        printf "SUCCESS : Compressed version views back unchanged!\n"
+else
+        printf "FAILED : Compressed version views back changed!\n"
+fi
+
+umount /test/mntpt/
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
@@ -0,0 +1,40 @@
+#!/bin/sh
+# Test that a burst of appends makes a single version
+# set -x
+separator="---------------------------------------------------------------"
+echo $separator
+echo $'Test that a burst of appends makes a single version'
+echo $separator
+
+myvar=$(cat /proc/mounts | grep bkpfs)
+chrlen=${#myvar}
+if [ "$chrlen" -gt 0 ]; then
+        umount /test/mntpt/
+fi
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
+mount -t bkpfs -o maxver=5,coalesce_ms=2000 /test/lowerdir /test/mntpt
+
+for i in $(seq 1 100); do
+        echo "michael $i" >> /test/mntpt/office.txt
+done
+cat /test/mntpt/office.txt > /tmp/ideal.txt
+sleep 3
+
+var=$(ls -1a /test/lowerdir/.office.txt.bkp | wc -l)
+# 1 backup and 2 for . and ..
+if [ "$var" -eq 3 ] ; then
+        printf "SUCCESS : Appends folded into one version!\n"
+else
+        printf "FAILED : Appends made $(($var - 2)) versions!\n"
+fi
+
+if cmp /tmp/ideal.txt /test/lowerdir/.office.txt.bkp/.office.txt.1 ; then
+        printf "SUCCESS : Version holds the last append!\n"
+else
+        printf "FAILED : Version misses appends!\n"
+fi
+
+umount /test/mntpt/
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
@@ -0,0 +1,44 @@
+#!/bin/sh
+# Test that closing a file only read makes no version of another one
+# set -x
+separator="---------------------------------------------------------------"
+echo $separator
+echo $'Test that closing a file only read makes no version of another one'
+echo $separator
+
+myvar=$(cat /proc/mounts | grep bkpfs)
+chrlen=${#myvar}
+if [ "$chrlen" -gt 0 ]; then
+        umount /test/mntpt/
+fi
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
+mount -t bkpfs -o maxver=5,unchanged=keep /test/lowerdir /test/mntpt
+
+echo angela > /test/mntpt/office.txt # 1
+echo oscar  > /test/mntpt/accounts.txt # 1
+
+# keep office.txt open for writing while accounts.txt is read and closed
+exec 3>>/test/mntpt/office.txt
+echo kevin >&3
+cat /test/mntpt/accounts.txt > /dev/null
+exec 3>&-
+
+var=$(ls -1a /test/lowerdir/.accounts.txt.bkp | wc -l)
+# 1 backup and 2 for . and ..
+if [ "$var" -eq 3 ] ; then
+        printf "SUCCESS : Reading a file made no version!\n"
+else
+        printf "FAILED : Reading a file made a version!\n"
+fi
+
+var=$(ls -1a /test/lowerdir/.office.txt.bkp | wc -l)
+if [ "$var" -eq 4 ] ; then
+        printf "SUCCESS : The written file got its version!\n"
+else
+        printf "FAILED : The written file lost its version!\n"
+fi
+
+umount /test/mntpt/
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
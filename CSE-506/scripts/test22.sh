@@ -0,0 +1,42 @@
+#!/bin/sh
+# Test that the version index follows versions being made and deleted
+# set -x
+separator="---------------------------------------------------------------"
+echo $separator
+echo $'Test that the version index follows versions being made and deleted'
+echo $separator
+
+myvar=$(cat /proc/mounts | grep bkpfs)
+chrlen=${#myvar}
+if [ "$chrlen" -gt 0 ]; then
+        umount /test/mntpt/
+fi
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
+mount -t bkpfs -o maxver=5 /test/lowerdir /test/mntpt
+
+echo creed    > /test/mntpt/office.txt # 1
+echo meredith > /test/mntpt/office.txt # 2
+echo toby     > /test/mntpt/office.txt # 3
+
+# records 1 to 3, 40 bytes each after record 0
+var=$(stat -c %s /test/lowerdir/.office.txt.bkp/.index)
+if [ "$var" -eq 160 ] ; then
+        printf "SUCCESS : One index record per version!\n"
+else
+        printf "FAILED : Index is $var bytes!\n"
+fi
+
+cd /usr/src/hw2-kanirudh/CSE-506/
+./bkpctl -d all /test/mntpt/office.txt > /dev/null
+var=$(ls -1a /test/lowerdir/.office.txt.bkp | wc -l)
+# only .index, . and ..
+if [ "$var" -eq 3 ] ; then
+        printf "SUCCESS : Deleting all versions walked the index!\n"
+else
+        printf "FAILED : Versions left after deleting all!\n"
+fi
+
+umount /test/mntpt/
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
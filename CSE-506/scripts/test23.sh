@@ -0,0 +1,46 @@
+#!/bin/sh
+# Test that journal=on logs versions and empties the journal on unmount
+# set -x
+separator="---------------------------------------------------------------"
+echo $separator
+echo $'Test that journal=on logs versions and empties the journal on unmount'
+echo $separator
+
+myvar=$(cat /proc/mounts | grep bkpfs)
+chrlen=${#myvar}
+if [ "$chrlen" -gt 0 ]; then
+        umount /test/mntpt/
+fi
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
+mount -t bkpfs -o maxver=5,journal=on /test/lowerdir /test/mntpt
+
+echo creed    > /test/mntpt/office.txt # 1
+echo meredith > /test/mntpt/office.txt # 2
+echo toby     > /test/mntpt/office.txt # 3
+
+var=$(stat -c %s /test/lowerdir/..bkp/journal)
+if [ "$var" -gt 0 ] ; then
+        printf "SUCCESS : Versions were journaled!\n"
+else
+        printf "FAILED : Journal is empty!\n"
+fi
+
+cd /usr/src/hw2-kanirudh/CSE-506/
+var=$(./bkpctl -l /test/mntpt/office.txt | grep -c '\.swp')
+if [ "$var" -eq 3 ] ; then
+        printf "SUCCESS : All versions listed!\n"
+else
+        printf "FAILED : $var versions listed!\n"
+fi
+
+umount /test/mntpt/
+var=$(stat -c %s /test/lowerdir/..bkp/journal)
+if [ "$var" -eq 0 ] ; then
+        printf "SUCCESS : Unmount checkpointed the journal!\n"
+else
+        printf "FAILED : Journal is $var bytes after unmount!\n"
+fi
+
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
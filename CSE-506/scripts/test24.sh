@@ -0,0 +1,51 @@
+#!/bin/sh
+# Test that scan=foreground fixes a range naming deleted versions
+# set -x
+separator="---------------------------------------------------------------"
+echo $separator
+echo $'Test that scan=foreground fixes a range naming deleted versions'
+echo $separator
+
+myvar=$(cat /proc/mounts | grep bkpfs)
+chrlen=${#myvar}
+if [ "$chrlen" -gt 0 ]; then
+        umount /test/mntpt/
+fi
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
+mount -t bkpfs -o maxver=5 /test/lowerdir /test/mntpt
+
+echo creed    > /test/mntpt/office.txt # 1
+echo meredith > /test/mntpt/office.txt # 2
+echo toby     > /test/mntpt/office.txt # 3
+umount /test/mntpt/
+
+# out-of-band edit of the lower directory: the newest version is lost
+rm -f /test/lowerdir/.office.txt.bkp/.office.txt.3
+mount -t bkpfs -o maxver=5,scan=foreground /test/lowerdir /test/mntpt
+
+cd /usr/src/hw2-kanirudh/CSE-506/
+var=$(./bkpctl -c /test/mntpt/office.txt | grep "Ranges fixed" | awk '{print $4}')
+if [ "$var" -eq 1 ] ; then
+        printf "SUCCESS : Scan fixed the range!\n"
+else
+        printf "FAILED : Scan fixed $var ranges!\n"
+fi
+
+var=$(./bkpctl -l /test/mntpt/office.txt | grep -c '\.swp')
+if [ "$var" -eq 2 ] ; then
+        printf "SUCCESS : Only existing versions listed!\n"
+else
+        printf "FAILED : $var versions listed!\n"
+fi
+
+var=$(./bkpctl -v newest /test/mntpt/office.txt | grep -c meredith)
+if [ "$var" -eq 1 ] ; then
+        printf "SUCCESS : Newest version is the one left!\n"
+else
+        printf "FAILED : Newest version is not version 2!\n"
+fi
+
+umount /test/mntpt/
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
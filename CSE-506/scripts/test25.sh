@@ -0,0 +1,46 @@
+#!/bin/sh
+# Test that store=central keeps versions out of the lower directories
+# set -x
+separator="---------------------------------------------------------------"
+echo $separator
+echo $'Test that store=central keeps versions out of the lower directories'
+echo $separator
+
+myvar=$(cat /proc/mounts | grep bkpfs)
+chrlen=${#myvar}
+if [ "$chrlen" -gt 0 ]; then
+        umount /test/mntpt/
+fi
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
+mount -t bkpfs -o maxver=5,store=central /test/lowerdir /test/mntpt
+
+echo creed    > /test/mntpt/office.txt # 1
+echo meredith > /test/mntpt/office.txt # 2
+
+if [ ! -e /test/lowerdir/.office.txt.bkp ] ; then
+        printf "SUCCESS : No backup directory next to the file!\n"
+else
+        printf "FAILED : Backup directory made next to the file!\n"
+fi
+
+var=$(find /test/lowerdir/..bkp/ino -name '.v.*' | wc -l)
+if [ "$var" -eq 2 ] ; then
+        printf "SUCCESS : Versions are in the central store!\n"
+else
+        printf "FAILED : $var versions in the central store!\n"
+fi
+
+# the versions follow the inode
+mv /test/mntpt/office.txt /test/mntpt/dunder.txt
+cd /usr/src/hw2-kanirudh/CSE-506/
+var=$(./bkpctl -v newest /test/mntpt/dunder.txt | grep -c meredith)
+if [ "$var" -eq 1 ] ; then
+        printf "SUCCESS : Renamed file kept its versions!\n"
+else
+        printf "FAILED : Renamed file lost its versions!\n"
+fi
+
+umount /test/mntpt/
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
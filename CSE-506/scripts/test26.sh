@@ -0,0 +1,50 @@
+#!/bin/sh
+# Test that bkpctl -t finds the version a file had at a given time
+# set -x
+separator="---------------------------------------------------------------"
+echo $separator
+echo $'Test that bkpctl -t finds the version a file had at a given time'
+echo $separator
+
+myvar=$(cat /proc/mounts | grep bkpfs)
+chrlen=${#myvar}
+if [ "$chrlen" -gt 0 ]; then
+        umount /test/mntpt/
+fi
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
+mount -t bkpfs -o maxver=5 /test/lowerdir /test/mntpt
+
+before=$(date +%s)
+sleep 2
+echo creed    > /test/mntpt/office.txt # 1
+sleep 2
+between=$(date +%s)
+sleep 2
+echo meredith > /test/mntpt/office.txt # 2
+
+cd /usr/src/hw2-kanirudh/CSE-506/
+var=$(./bkpctl -t @$between /test/mntpt/office.txt | grep "as of" | awk '{print $6}')
+if [ "$var" -eq 1 ] ; then
+        printf "SUCCESS : Version 1 found between the writes!\n"
+else
+        printf "FAILED : Version $var found between the writes!\n"
+fi
+
+var=$(./bkpctl -t @$between /test/mntpt/office.txt | grep -c creed)
+if [ "$var" -eq 1 ] ; then
+        printf "SUCCESS : Contents as of that time shown!\n"
+else
+        printf "FAILED : Wrong contents shown!\n"
+fi
+
+var=$(./bkpctl -t @$before /test/mntpt/office.txt | grep -c "No version")
+if [ "$var" -eq 1 ] ; then
+        printf "SUCCESS : No version before the first write!\n"
+else
+        printf "FAILED : A version found before the first write!\n"
+fi
+
+umount /test/mntpt/
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
@@ -0,0 +1,43 @@
+#!/bin/sh
+# Test that bkpctl -L lists every version with its record
+# set -x
+separator="---------------------------------------------------------------"
+echo $separator
+echo $'Test that bkpctl -L lists every version with its record'
+echo $separator
+
+myvar=$(cat /proc/mounts | grep bkpfs)
+chrlen=${#myvar}
+if [ "$chrlen" -gt 0 ]; then
+        umount /test/mntpt/
+fi
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
+mount -t bkpfs -o maxver=2000 /test/lowerdir /test/mntpt
+
+# more versions than one LIST_RECORDS call returns
+i=1
+while [ $i -le 1500 ]; do
+        echo "version $i" > /test/mntpt/office.txt
+        i=$((i + 1))
+done
+
+cd /usr/src/hw2-kanirudh/CSE-506/
+var=$(./bkpctl -L /test/mntpt/office.txt | grep -c full)
+if [ "$var" -eq 1500 ] ; then
+        printf "SUCCESS : All 1500 versions listed!\n"
+else
+        printf "FAILED : $var versions listed!\n"
+fi
+
+# "version 1500\n" is 13 bytes
+var=$(./bkpctl -L /test/mntpt/office.txt | awk '$1 == 1500 {print $4}')
+if [ "$var" -eq 13 ] ; then
+        printf "SUCCESS : Size of the newest version is right!\n"
+else
+        printf "FAILED : Size of the newest version is $var!\n"
+fi
+
+umount /test/mntpt/
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
@@ -0,0 +1,47 @@
+#!/bin/sh
+# Test that bkpctl -S summarizes the versions of a whole directory
+# set -x
+separator="---------------------------------------------------------------"
+echo $separator
+echo $'Test that bkpctl -S summarizes the versions of a whole directory'
+echo $separator
+
+myvar=$(cat /proc/mounts | grep bkpfs)
+chrlen=${#myvar}
+if [ "$chrlen" -gt 0 ]; then
+        umount /test/mntpt/
+fi
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
+mount -t bkpfs -o maxver=5 /test/lowerdir /test/mntpt
+
+echo creed    > /test/mntpt/office.txt # 1
+echo meredith > /test/mntpt/office.txt # 2
+echo toby     > /test/mntpt/dunder.txt # 1
+mkdir /test/mntpt/annex
+
+cd /usr/src/hw2-kanirudh/CSE-506/
+var=$(./bkpctl -S /test/mntpt | grep children | awk '{print $3}')
+if [ "$var" -eq 3 ] ; then
+        printf "SUCCESS : All versions of the directory counted!\n"
+else
+        printf "FAILED : $var versions counted!\n"
+fi
+
+var=$(./bkpctl -S /test/mntpt | awk '$NF == "office.txt" {print $2}')
+if [ "$var" -eq 2 ] ; then
+        printf "SUCCESS : Versions of office.txt counted!\n"
+else
+        printf "FAILED : $var versions of office.txt counted!\n"
+fi
+
+var=$(./bkpctl -S /test/mntpt | grep -c '\.bkp')
+if [ "$var" -eq 0 ] ; then
+        printf "SUCCESS : Backup directories are not children!\n"
+else
+        printf "FAILED : Backup directories listed!\n"
+fi
+
+umount /test/mntpt/
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
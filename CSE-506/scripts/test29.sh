@@ -0,0 +1,65 @@
+#!/bin/sh
+# Test that bkpctl -v reads versions in place, without a .vue file
+# set -x
+separator="---------------------------------------------------------------"
+echo $separator
+echo $'Test that bkpctl -v reads versions in place, without a .vue file'
+echo $separator
+
+myvar=$(cat /proc/mounts | grep bkpfs)
+chrlen=${#myvar}
+if [ "$chrlen" -gt 0 ]; then
+        umount /test/mntpt/
+fi
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
+mount -t bkpfs -o maxver=5 /test/lowerdir /test/mntpt
+
+echo creed    > /test/mntpt/office.txt # 1
+echo meredith > /test/mntpt/office.txt # 2
+
+# a .vue file would be created and unlinked in the lower directory
+before=$(stat -c %y /test/lowerdir)
+cd /usr/src/hw2-kanirudh/CSE-506/
+var=$(./bkpctl -v oldest /test/mntpt/office.txt)
+after=$(stat -c %y /test/lowerdir)
+if [ "$var" == "creed" ] ; then
+        printf "SUCCESS : Oldest version viewed!\n"
+else
+        printf "FAILED : Viewed $var!\n"
+fi
+if [ "$before" == "$after" ] ; then
+        printf "SUCCESS : Nothing created in the directory of the file!\n"
+else
+        printf "FAILED : The directory of the file changed!\n"
+fi
+
+umount /test/mntpt/
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
+
+# other encodings are rebuilt into an unnamed file
+mount -t bkpfs -o maxver=5,format=delta /test/lowerdir /test/mntpt
+
+echo creed    > /test/mntpt/office.txt # 1
+echo meredith > /test/mntpt/office.txt # 2
+echo kevin    > /test/mntpt/office.txt # 3
+
+cd /usr/src/hw2-kanirudh/CSE-506/
+var=$(./bkpctl -v 2 /test/mntpt/office.txt)
+if [ "$var" == "meredith" ] ; then
+        printf "SUCCESS : Delta version viewed!\n"
+else
+        printf "FAILED : Viewed $var!\n"
+fi
+
+var=$(ls -a /test/lowerdir/.office.txt.bkp | wc -l)
+if [ "$var" -eq 6 ] ; then
+        printf "SUCCESS : Nothing left in the backup directory!\n"
+else
+        printf "FAILED : $var entries in the backup directory!\n"
+fi
+
+umount /test/mntpt/
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
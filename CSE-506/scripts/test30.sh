@@ -0,0 +1,44 @@
+#!/bin/sh
+# Test that a rebuilt version viewed again is not stale once its number is reused
+# set -x
+separator="---------------------------------------------------------------"
+echo $separator
+echo $'Test that a rebuilt version viewed again is not stale once its number is reused'
+echo $separator
+
+myvar=$(cat /proc/mounts | grep bkpfs)
+chrlen=${#myvar}
+if [ "$chrlen" -gt 0 ]; then
+        umount /test/mntpt/
+fi
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
+mount -t bkpfs -o maxver=5,format=delta /test/lowerdir /test/mntpt
+
+echo creed    > /test/mntpt/office.txt # 1
+echo meredith > /test/mntpt/office.txt # 2
+echo kevin    > /test/mntpt/office.txt # 3
+
+cd /usr/src/hw2-kanirudh/CSE-506/
+# the second view reads the copy the first one rebuilt
+./bkpctl -v newest /test/mntpt/office.txt > /dev/null
+var=$(./bkpctl -v newest /test/mntpt/office.txt)
+if [ "$var" == "kevin" ] ; then
+        printf "SUCCESS : Rebuilt version viewed twice!\n"
+else
+        printf "FAILED : Viewed $var!\n"
+fi
+
+# version 3 is deleted and made again with other contents
+./bkpctl -d newest /test/mntpt/office.txt > /dev/null
+echo oscar    > /test/mntpt/office.txt # 3
+var=$(./bkpctl -v newest /test/mntpt/office.txt)
+if [ "$var" == "oscar" ] ; then
+        printf "SUCCESS : New version 3 viewed!\n"
+else
+        printf "FAILED : Viewed $var!\n"
+fi
+
+umount /test/mntpt/
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
@@ -0,0 +1,57 @@
+#!/bin/sh
+# Test that bkpctl -R restores a version over the file itself
+# set -x
+separator="---------------------------------------------------------------"
+echo $separator
+echo $'Test that bkpctl -R restores a version over the file itself'
+echo $separator
+
+myvar=$(cat /proc/mounts | grep bkpfs)
+chrlen=${#myvar}
+if [ "$chrlen" -gt 0 ]; then
+        umount /test/mntpt/
+fi
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
+mount -t bkpfs -o maxver=5 /test/lowerdir /test/mntpt
+
+echo creed    > /test/mntpt/office.txt # 1
+echo meredith > /test/mntpt/office.txt # 2
+
+cd /usr/src/hw2-kanirudh/CSE-506/
+./bkpctl -R oldest /test/mntpt/office.txt > /dev/null
+var=$(cat /test/mntpt/office.txt)
+if [ "$var" == "creed" ] ; then
+        printf "SUCCESS : Oldest version restored in place!\n"
+else
+        printf "FAILED : The file holds $var!\n"
+fi
+
+# "meredith" is not lost: it is the newest version now
+var=$(./bkpctl -v newest /test/mntpt/office.txt)
+if [ "$var" == "meredith" ] ; then
+        printf "SUCCESS : Contents replaced kept as a version!\n"
+else
+        printf "FAILED : Newest version holds $var!\n"
+fi
+
+var=$(ls -a /test/lowerdir | grep -c -e '\.swp$' -e '\.rst$')
+if [ "$var" -eq 0 ] ; then
+        printf "SUCCESS : No temporary file left!\n"
+else
+        printf "FAILED : $var temporary files left!\n"
+fi
+
+# a writer would write to the file being replaced
+exec 3>>/test/mntpt/office.txt
+var=$(./bkpctl -R newest /test/mntpt/office.txt)
+exec 3>&-
+if [ "$var" == "The file is open for writing" ] ; then
+        printf "SUCCESS : File open for writing not restored!\n"
+else
+        printf "FAILED : $var!\n"
+fi
+
+umount /test/mntpt/
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
@@ -0,0 +1,49 @@
+#!/bin/sh
+# Test that bkpctl -b restores a byte range of a version into the file
+# set -x
+separator="---------------------------------------------------------------"
+echo $separator
+echo $'Test that bkpctl -b restores a byte range of a version into the file'
+echo $separator
+
+myvar=$(cat /proc/mounts | grep bkpfs)
+chrlen=${#myvar}
+if [ "$chrlen" -gt 0 ]; then
+        umount /test/mntpt/
+fi
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
+mount -t bkpfs -o maxver=5 /test/lowerdir /test/mntpt
+
+echo creed > /test/mntpt/office.txt # 1
+echo kevin > /test/mntpt/office.txt # 2
+
+cd /usr/src/hw2-kanirudh/CSE-506/
+# the first two bytes of version 1, over those of the file
+./bkpctl -b 1:0:2 /test/mntpt/office.txt > /dev/null
+var=$(cat /test/mntpt/office.txt)
+if [ "$var" == "crvin" ] ; then
+        printf "SUCCESS : Range of version 1 restored!\n"
+else
+        printf "FAILED : The file holds $var!\n"
+fi
+
+# the restore is a write: the file got a version on close
+var=$(./bkpctl -v newest /test/mntpt/office.txt)
+if [ "$var" == "crvin" ] ; then
+        printf "SUCCESS : Version made of the restored file!\n"
+else
+        printf "FAILED : Newest version holds $var!\n"
+fi
+
+# the copy stops at the end of the version
+var=$(./bkpctl -b 1:4:100:0 /test/mntpt/office.txt | awk '{print $2}')
+if [ "$var" -eq 2 ] ; then
+        printf "SUCCESS : Range cut at the end of the version!\n"
+else
+        printf "FAILED : $var bytes restored!\n"
+fi
+
+umount /test/mntpt/
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
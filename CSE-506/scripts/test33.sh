@@ -0,0 +1,57 @@
+#!/bin/sh
+# Test that bkpctl -D lists the byte ranges that differ between versions
+# set -x
+separator="---------------------------------------------------------------"
+echo $separator
+echo $'Test that bkpctl -D lists the byte ranges that differ between versions'
+echo $separator
+
+myvar=$(cat /proc/mounts | grep bkpfs)
+chrlen=${#myvar}
+if [ "$chrlen" -gt 0 ]; then
+        umount /test/mntpt/
+fi
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
+mount -t bkpfs -o maxver=5,blocksums=on /test/lowerdir /test/mntpt
+
+# four 64 KB blocks, the last one partial
+head -c 200000 /dev/zero | tr '\0' a > /test/mntpt/office.txt # 1
+echo dwight | dd of=/test/mntpt/office.txt bs=1 seek=70000 conv=notrunc 2> /dev/null # 2
+
+if [ -f /test/lowerdir/.office.txt.bkp/.office.txt.2.sum ] ; then
+        printf "SUCCESS : Block sums made with the version!\n"
+else
+        printf "FAILED : No block sums for version 2!\n"
+fi
+
+cd /usr/src/hw2-kanirudh/CSE-506/
+# only the second block changed
+var=$(./bkpctl -D 1:2 /test/mntpt/office.txt | sed -n 3p | awk '{print $1":"$2}')
+if [ "$var" == "65536:65536" ] ; then
+        printf "SUCCESS : Changed block of version 2 found!\n"
+else
+        printf "FAILED : Extent $var listed!\n"
+fi
+
+# the file against its oldest version: the second block, and the last
+# one, which grew
+echo jim >> /test/mntpt/office.txt
+var=$(./bkpctl -D oldest:live /test/mntpt/office.txt | sed -n 4p | awk '{print $1":"$2}')
+if [ "$var" == "196608:3396" ] ; then
+        printf "SUCCESS : Changed tail of the file found!\n"
+else
+        printf "FAILED : Extent $var listed!\n"
+fi
+
+# a version against itself
+var=$(./bkpctl -D 2:2 /test/mntpt/office.txt | tail -1 | awk '{print $1}')
+if [ "$var" -eq 0 ] ; then
+        printf "SUCCESS : No extents between a version and itself!\n"
+else
+        printf "FAILED : $var extents listed!\n"
+fi
+
+umount /test/mntpt/
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
@@ -0,0 +1,50 @@
+#!/bin/sh
+# Test that bkpctl -e writes a version to a pipe or file in one pass
+# set -x
+separator="---------------------------------------------------------------"
+echo $separator
+echo $'Test that bkpctl -e writes a version to a pipe or file in one pass'
+echo $separator
+
+myvar=$(cat /proc/mounts | grep bkpfs)
+chrlen=${#myvar}
+if [ "$chrlen" -gt 0 ]; then
+        umount /test/mntpt/
+fi
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
+mount -t bkpfs -o maxver=5,format=delta /test/lowerdir /test/mntpt
+
+echo creed > /test/mntpt/office.txt # 1
+echo kevin > /test/mntpt/office.txt # 2, a delta
+
+cd /usr/src/hw2-kanirudh/CSE-506/
+# a full copy, into a pipe
+var=$(./bkpctl -e 1 /test/mntpt/office.txt 2> /dev/null | cat)
+if [ "$var" == "creed" ] ; then
+        printf "SUCCESS : Version 1 sent to a pipe!\n"
+else
+        printf "FAILED : Pipe got $var!\n"
+fi
+
+# a delta, rebuilt in the kernel, into a file
+./bkpctl -e newest /test/mntpt/office.txt > /tmp/office.out 2> /dev/null
+var=$(cat /tmp/office.out)
+if [ "$var" == "kevin" ] ; then
+        printf "SUCCESS : Version 2 sent to a file!\n"
+else
+        printf "FAILED : File got $var!\n"
+fi
+rm -f /tmp/office.out
+
+# nothing was left next to the file
+var=$(ls -a /test/lowerdir | wc -l)
+if [ "$var" -eq 4 ] ; then
+        printf "SUCCESS : No file made in the directory!\n"
+else
+        printf "FAILED : $var entries in the directory!\n"
+fi
+
+umount /test/mntpt/
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
@@ -0,0 +1,53 @@
+#!/bin/sh
+# Test pre-image versions viewed while the file is open for writing
+# set -x
+separator="---------------------------------------------------------------"
+echo $separator
+echo $'Test pre-image versions viewed while the file is open for writing'
+echo $separator
+
+myvar=$(cat /proc/mounts | grep bkpfs)
+chrlen=${#myvar}
+if [ "$chrlen" -gt 0 ]; then
+        umount /test/mntpt/
+fi
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
+mount -t bkpfs -o maxver=5,format=preimage /test/lowerdir /test/mntpt
+
+echo dwight >  /test/mntpt/office.txt # 1: empty file
+cat /test/mntpt/office.txt > /tmp/ideal.txt
+echo jim    >> /test/mntpt/office.txt # 2: "dwight"
+cat /test/mntpt/office.txt > /tmp/ideal3.txt
+
+# a writer keeps the file open: its session is not sealed yet
+exec 3<> /test/mntpt/office.txt
+echo pam >&3
+
+cd /usr/src/hw2-kanirudh/CSE-506/
+./bkpctl -v 2 /test/mntpt/office.txt > /tmp/state.txt
+if cmp /tmp/ideal.txt /tmp/state.txt ; then
+        printf "SUCCESS : Version rebuilt without the open session!\n"
+else
+        printf "FAILED : Version holds writes of the open session!\n"
+fi
+
+# the session becomes version 3 on close, and the cached copy is not reused
+exec 3>&-
+./bkpctl -v 3 /test/mntpt/office.txt > /tmp/state.txt
+if cmp /tmp/ideal3.txt /tmp/state.txt ; then
+        printf "SUCCESS : Sealed session rebuilt!\n"
+else
+        printf "FAILED : Sealed session differs!\n"
+fi
+./bkpctl -v 2 /test/mntpt/office.txt > /tmp/state.txt
+if cmp /tmp/ideal.txt /tmp/state.txt ; then
+        printf "SUCCESS : Older version unchanged after the seal!\n"
+else
+        printf "FAILED : Older version differs after the seal!\n"
+fi
+
+/bin/rm -f /tmp/ideal.txt /tmp/ideal3.txt /tmp/state.txt
+umount /test/mntpt/
+cd /test/lowerdir
+rm -rf ..?* .[!.]* *
@@ -27,6 +27,10 @@
 #include <linux/sched.h>
 #include <linux/xattr.h>
 #include <linux/exportfs.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/cred.h>
+#include <linux/rbtree.h>
 
 /* the file system name */
 #define BKPFS_NAME "bkpfs"
@@ -34,6 +38,89 @@
 /* bkpfs root inode number */
 #define BKPFS_ROOT_INO     1
 
+/* number of versions kept per file when maxver= is not given */
+#define BKPFS_DEFAULT_MAXVER	5
+
+/* backups waiting in the per-mount workqueue when queue_depth= is not given */
+#define BKPFS_DEFAULT_QUEUE_DEPTH	64
+
+/* xattr of a version file telling how its contents are stored */
+#define BKPFS_XATTR_ENCODING	"user.bkpfs_encoding"
+
+enum bkpfs_encoding {
+	BKPFS_ENC_RAW,		/* a plain copy of the file */
+	BKPFS_ENC_PREIMAGE,	/* old contents of the ranges a session changed */
+	BKPFS_ENC_DELTA,	/* new contents of those ranges, on top of N-1 */
+	BKPFS_ENC_CHUNKED,	/* manifest of chunks in the mount's store */
+	BKPFS_ENC_COMPRESSED,	/* a copy of the file, compressed */
+};
+
+/* compress= algorithms */
+enum bkpfs_compress {
+	BKPFS_COMPRESS_NONE,
+	BKPFS_COMPRESS_LZ4,
+	BKPFS_COMPRESS_ZSTD,
+};
+
+/* xattr of a compressed version: struct bkpfs_zstat */
+#define BKPFS_XATTR_ZSTAT	"user.bkpfs_zstat"
+
+struct bkpfs_zstat {
+	__le64 size;		/* bytes of the file */
+	__le64 stored;		/* bytes of the version file */
+	__le64 cpu_ns;		/* time spent compressing */
+};
+
+/* chunks of format=dedup are named after their sha256 */
+#define BKPFS_CHUNK_ID_SIZE	32
+
+/* xattr of a version file: struct bkpfs_csum of its contents */
+#define BKPFS_XATTR_CSUM	"user.bkpfs_csum"
+
+struct bkpfs_csum {
+	__le64 size;
+	__le32 crc;		/* crc32c, valid if flags has BKPFS_CSUM_CRC */
+	__le32 flags;
+};
+#define BKPFS_CSUM_CRC		0x1
+
+/* xattr of the lower file: version the dirty extents are relative to */
+#define BKPFS_XATTR_DELTA_BASE	"user.bkpfs_delta_base"
+
+/* xattr of the lower file: struct bkpfs_meta, replaces the three above */
+#define BKPFS_XATTR_META	"user.bkpfs_meta"
+
+struct bkpfs_meta {
+	__le32 oldest;		/* oldest version kept */
+	__le32 next;		/* one past the newest version */
+	__le32 delta_base;	/* -1 if none */
+	__le32 flags;		/* unused, 0 */
+};
+
+/* record of one version in the ".index" file of a backup directory */
+struct bkpfs_index_rec {
+	__le32 version;		/* 0 if never written */
+	__le32 encoding;	/* enum bkpfs_encoding */
+	__le64 ctime;		/* ns since the epoch */
+	__le64 size;		/* bytes of the file */
+	__le64 stored;		/* bytes of the version file */
+	__le32 crc;		/* crc32c of the file, if BKPFS_INDEX_CRC */
+	__le32 flags;
+};
+#define BKPFS_INDEX_LIVE	0x1	/* not unlinked yet */
+#define BKPFS_INDEX_CRC		0x2
+
+/* index records read at a time when walking the versions of a file */
+#define BKPFS_INDEX_BATCH	64
+
+/* bkpfs_inode_info.meta_state */
+enum bkpfs_meta_state {
+	BKPFS_META_UNLOADED,	/* not read from the lower file yet */
+	BKPFS_META_NONE,	/* the file is not versioned */
+	BKPFS_META_CLEAN,
+	BKPFS_META_DIRTY,	/* to be written by bkpfs_meta_sync */
+};
+
 /* useful for tracking code reachability */
 #define UDBG printk(KERN_DEFAULT "DBG:%s:%s:%d\n", __FILE__, __func__, __LINE__)
 
@@ -60,18 +147,329 @@ extern struct dentry *bkpfs_lookup(struct inode *dir, struct dentry *dentry,
 				    unsigned int flags);
 extern struct inode *bkpfs_iget(struct super_block *sb,
 				 struct inode *lower_inode);
+extern struct inode *bkpfs_ilookup(struct super_block *sb,
+				   struct inode *lower_inode);
 extern int bkpfs_interpose(struct dentry *dentry, struct super_block *sb,
 			    struct path *lower_path);
+extern int bkpfs_wait_backups(struct inode *inode);
+extern void bkpfs_coalesce_work(struct work_struct *work);
+extern void bkpfs_coalesce_flush_all(struct super_block *sb);
+
+/* file.c */
+extern struct dentry *bkpfs_bkp_dir(struct dentry *dentry);
+extern struct dentry *bkpfs_bkp_dir_make(struct dentry *dentry);
+extern void bkpfs_bkp_dir_set(struct inode *inode, struct dentry *dir);
+extern void bkpfs_view_drop(struct inode *inode, int version);
+struct bkpfs_extent_tree;
+extern int bkpfs_create_new_backup(struct dentry *dentry,
+				   struct file *lower_file,
+				   struct bkpfs_extent_tree *dirty);
+extern struct file *bkpfs_open_bkp_file(struct dentry *dentry,
+					struct dentry *bkp_dir,
+					const char *name, int flags);
+extern struct file *bkpfs_open_version(struct dentry *dentry,
+				       struct dentry *bkp_dir, int version,
+				       int flags);
+extern struct file *bkpfs_view_rebuilt(struct file *file,
+				       struct dentry *bkp_dir, int version,
+				       int newest);
+extern int bkpfs_version_encoding(struct dentry *version_dentry);
+extern int bkpfs_set_version_encoding(struct dentry *version_dentry, int enc);
+extern void bkpfs_commit_version(struct dentry *dentry,
+				 struct dentry *bkp_dir, int version,
+				 bool live);
+
+/* copy.c */
+
+/* the copy a version is being made or restored with, per inode */
+struct bkpfs_progress {
+	atomic64_t done;	/* bytes copied so far */
+	atomic64_t total;	/* bytes to copy, 0 when no copy runs */
+};
+
+extern struct file *bkpfs_open_tmpfile(const struct path *dir);
+extern struct file *bkpfs_open_sealed(const struct path *dir);
+extern struct file *bkpfs_open_linkable(const struct path *dir);
+extern struct file *bkpfs_snapshot_file(struct file *file);
+extern bool bkpfs_probe_reflink(const struct path *lower_root);
+extern int bkpfs_copy_file(struct super_block *sb, struct file *src,
+			   struct file *dst, loff_t len,
+			   struct bkpfs_progress *prog);
+extern int bkpfs_copy_range(struct file *src, loff_t src_pos,
+			    struct file *dst, loff_t dst_pos, loff_t len);
+extern int bkpfs_send_file(struct file *src, struct file *dst,
+			   loff_t *dst_pos, loff_t len,
+			   struct bkpfs_progress *prog);
+extern int bkpfs_truncate_file(struct file *file, loff_t size);
+extern int bkpfs_copy_xattrs(struct dentry *src, struct dentry *dst);
+extern int bkpfs_file_crc(struct file *file, loff_t len, u32 *crc);
+extern int bkpfs_file_cmp(struct file *a, struct file *b, loff_t len);
+
+/* extent.c */
+struct bkpfs_extent {
+	struct rb_node node;
+	loff_t start;
+	loff_t end;		/* exclusive */
+};
+
+struct bkpfs_extent_tree {
+	struct rb_root root;
+	unsigned int nr;	/* number of extents */
+	u64 bytes;		/* bytes covered */
+};
+
+extern void bkpfs_extents_init(struct bkpfs_extent_tree *tree);
+extern void bkpfs_extents_clear(struct bkpfs_extent_tree *tree);
+extern int bkpfs_extents_add(struct bkpfs_extent_tree *tree, loff_t start,
+			     loff_t end);
+extern loff_t bkpfs_extents_gap(struct bkpfs_extent_tree *tree, loff_t *pos,
+				loff_t end);
+extern struct bkpfs_extent *bkpfs_extent_first(struct bkpfs_extent_tree *tree);
+extern struct bkpfs_extent *bkpfs_extent_next(struct bkpfs_extent *ext);
+
+/*
+ * An extent log is how pre-image and delta versions are stored:
+ *
+ *	+--------+--------+-----+--------------------+--------+
+ *	| data 0 | data 1 | ... | extent table (N x) | footer |
+ *	+--------+--------+-----+--------------------+--------+
+ *
+ * Data pieces are laid out in table order; entry i of the table gives
+ * the file offset and length of piece i.  Applying a log to a file
+ * writes every piece at its offset, then sets the size from the footer.
+ */
+#define BKPFS_LOG_MAGIC	0x3165727066706b62ULL	/* "bkpfpre1" */
+
+struct bkpfs_log_extent {
+	__le64 off;
+	__le64 len;
+};
+
+struct bkpfs_log_footer {
+	__le64 magic;
+	__le64 size;		/* file size once the log is applied */
+	__le32 nr;		/* entries in the extent table */
+	__le32 base;		/* delta: version it applies to, else 0 */
+};
+
+extern int bkpfs_extent_log_finish(struct file *log, loff_t pos,
+				   struct bkpfs_log_extent *table,
+				   unsigned int nr, loff_t size, int base);
+extern int bkpfs_extent_log_apply(struct file *log, struct file *dst,
+				  int *base, struct bkpfs_progress *prog);
+
+/* preimage.c */
+extern int bkpfs_capture_range(struct dentry *dentry, loff_t start,
+			       loff_t end);
+extern void bkpfs_capture_seal(struct dentry *dentry);
+extern int bkpfs_preimage_restore(struct dentry *dentry,
+				  struct dentry *bkp_dir, int version,
+				  int newest, struct file *dst);
+
+/* chunk.c */
+struct bkpfs_sb_info;
+extern void bkpfs_chunk_init_gear(void);
+extern struct dentry *bkpfs_store_dir(const struct path *lower_root,
+				      bool create);
+extern int bkpfs_chunk_store_init(struct bkpfs_sb_info *sbi,
+				  const struct path *lower_root);
+extern void bkpfs_chunk_store_exit(struct bkpfs_sb_info *sbi);
+extern int bkpfs_chunk_backup(struct super_block *sb, struct file *src,
+			      struct file *dst, struct bkpfs_progress *prog);
+extern void bkpfs_chunk_release(struct dentry *dentry,
+				struct dentry *version_dentry);
+extern void bkpfs_chunk_release_path(struct bkpfs_sb_info *sbi,
+				     const struct path *path);
+extern int bkpfs_chunk_materialize(struct super_block *sb,
+				   struct file *manifest, struct file *dst,
+				   struct bkpfs_progress *prog);
+extern int bkpfs_chunk_stats(struct super_block *sb, u64 *logical,
+			     u64 *stored, u64 *chunks);
+
+/* compress.c */
+extern int bkpfs_compress_parse(char *val, int *alg, int *level);
+extern int bkpfs_compress_file(struct super_block *sb, struct file *src,
+			       struct file *dst, loff_t len,
+			       struct bkpfs_progress *prog);
+extern int bkpfs_decompress_file(struct file *src, struct file *dst,
+				 struct bkpfs_progress *prog);
+
+/* version.c */
+extern void bkpfs_dirty_add(struct file *file, loff_t start, loff_t end);
+extern void bkpfs_dirty_truncate(struct inode *inode, loff_t size);
+extern bool bkpfs_delta_usable(struct dentry *dentry, struct file *lower_file,
+			       struct dentry *bkp_dir, int version,
+			       struct bkpfs_extent_tree *dirty);
+extern int bkpfs_delta_write(struct file *lower_file, struct file *log,
+			     struct bkpfs_extent_tree *dirty, int base,
+			     struct bkpfs_progress *prog);
+extern int bkpfs_delta_detach(struct dentry *dentry, struct dentry *bkp_dir,
+			      int version);
+extern bool bkpfs_version_unchanged(struct dentry *dentry, struct file *src,
+				    struct dentry *bkp_dir, int version,
+				    struct bkpfs_csum *csum);
+extern int bkpfs_version_materialize(struct dentry *dentry,
+				     struct dentry *bkp_dir, int version,
+				     int newest, struct file *dst);
+
+/* meta.c */
+extern int bkpfs_meta_read(struct dentry *lower_dentry,
+			   struct bkpfs_meta *meta);
+extern int bkpfs_get_versions(struct dentry *dentry, int *oldest, int *next);
+extern int bkpfs_meta_peek(struct inode *inode, int *oldest, int *next);
+extern void bkpfs_set_versions(struct dentry *dentry, int oldest, int next);
+extern int bkpfs_get_delta_base(struct dentry *dentry);
+extern void bkpfs_set_delta_base(struct dentry *dentry, int base);
+extern int bkpfs_meta_init(struct dentry *dentry);
+extern int bkpfs_meta_sync(struct dentry *dentry);
+
+/* index.c */
+extern struct file *bkpfs_index_file(struct vfsmount *mnt,
+				     struct dentry *bkp_dir, int flags);
+extern int bkpfs_index_read(struct dentry *dentry, struct dentry *bkp_dir,
+			    int first, int last, struct bkpfs_index_rec *recs);
+extern int bkpfs_index_get(struct dentry *dentry, struct dentry *bkp_dir,
+			   int version, struct bkpfs_index_rec *rec);
+extern int bkpfs_index_put(struct dentry *dentry, struct dentry *bkp_dir,
+			   const struct bkpfs_index_rec *rec);
+extern int bkpfs_index_add(struct dentry *dentry, struct dentry *bkp_dir,
+			   struct file *vfile, int version, int enc,
+			   const struct bkpfs_csum *csum, u64 ctime);
+extern void bkpfs_index_drop(struct dentry *dentry, struct dentry *bkp_dir,
+			     int first, int last, int oldest);
+extern void bkpfs_index_from_file(struct dentry *vdentry,
+				  struct dentry *prev, int version,
+				  struct bkpfs_index_rec *rec);
+extern int bkpfs_index_of_version(struct dentry *dentry,
+				  struct dentry *bkp_dir, int version,
+				  struct bkpfs_index_rec *rec);
+extern int bkpfs_index_at(struct dentry *dentry, struct dentry *bkp_dir,
+			  int oldest, int next, u64 ns, u64 *ctime);
+
+/* journal.c */
+extern int bkpfs_journal_init(struct bkpfs_sb_info *sbi,
+			      const struct path *lower_root);
+extern void bkpfs_journal_exit(struct bkpfs_sb_info *sbi);
+extern void bkpfs_journal_begin(struct dentry *dentry, int version);
+extern void bkpfs_journal_data(struct super_block *sb, struct file *vfile);
+extern int bkpfs_journal_range(struct dentry *dentry,
+			       const struct bkpfs_meta *meta);
+extern int bkpfs_journal_unlink(struct dentry *dentry, int first, int last);
+extern void bkpfs_journal_end(struct super_block *sb);
+
+/* scan.c */
+extern int bkpfs_scan_start(struct super_block *sb,
+			    const struct path *lower_root);
+extern void bkpfs_scan_stop(struct super_block *sb);
+
+/* summary.c */
+struct bkpfs_summary {
+	const char *name;
+	int namelen;
+	u64 ino;
+	int versions;		/* 0 if not versioned */
+	u64 newest_ns;		/* creation time of the newest version */
+	u64 bytes;		/* stored by all its versions */
+};
+
+/* called for each child; non-zero stops the walk before that child */
+typedef int (*bkpfs_summary_fn)(void *arg, const struct bkpfs_summary *s);
+
+extern int bkpfs_dir_summary(struct file *file, loff_t *cookie, bool *eof,
+			     bkpfs_summary_fn fn, void *arg);
+
+/* store.c */
+extern struct dentry *bkpfs_store_subdir(struct dentry *parent,
+					 const char *name, bool create);
+extern int bkpfs_version_store_init(struct bkpfs_sb_info *sbi,
+				    const struct path *lower_root);
+extern void bkpfs_version_store_exit(struct bkpfs_sb_info *sbi);
+extern const char *bkpfs_version_stem(struct bkpfs_sb_info *sbi,
+				      const char *name);
+extern struct dentry *bkpfs_version_dir(struct bkpfs_sb_info *sbi,
+					struct dentry *lower, bool create);
+extern int bkpfs_version_dir_move(struct bkpfs_sb_info *sbi,
+				  struct inode *from, struct inode *to);
+extern void bkpfs_version_dir_remove(struct bkpfs_sb_info *sbi,
+				     struct inode *lower_inode);
+extern bool bkpfs_version_dir_orphan(struct bkpfs_sb_info *sbi,
+				     const char *name);
+extern int bkpfs_version_dir_reap(struct bkpfs_sb_info *sbi,
+				  struct dentry *parent, const char *name);
+
+/* restore.c */
+extern int bkpfs_restore_inplace(struct file *file, int version);
+
+/* diff.c */
+/* called for each differing extent, returns non-zero to stop */
+typedef int (*bkpfs_diff_fn)(void *arg, loff_t offset, loff_t len);
+
+extern int bkpfs_sum_write(struct dentry *dentry, struct dentry *bkp_dir,
+			   int version, struct file *src, struct file *vfile);
+extern void bkpfs_sum_unlink(struct dentry *dentry, struct dentry *bkp_dir,
+			     int version);
+extern int bkpfs_diff(struct file *file, int from, int to, loff_t *pos,
+		      bool *eof, u64 *shared, bkpfs_diff_fn fn, void *arg);
 
 /* file private data */
+/* bkpfs_file_info.flags */
+#define BKPFS_FILE_WRITTEN	0	/* changed the file: version on release */
+
 struct bkpfs_file_info {
 	struct file *lower_file;
 	const struct vm_operations_struct *lower_vm_ops;
+	unsigned long flags;		/* BKPFS_FILE_* bits */
+	/* format=delta: ranges written through this file */
+	struct mutex dirty_mutex;
+	struct bkpfs_extent_tree dirty;
+	bool dirty_lost;		/* could not record a range */
+};
+
+/*
+ * coalesce_ms=: closes of an inode folded into one version, made when
+ * the window opened by the first of them ends
+ */
+struct bkpfs_coalesce {
+	struct delayed_work work;	/* bkpfs_coalesce_work */
+	struct mutex lock;		/* protects the fields below */
+	struct list_head list;		/* on bkpfs_sb_info.coalesce_pending */
+	struct dentry *dentry;		/* pinned, NULL if nothing pending */
+	struct file *lower_file;	/* lower file of the last close */
+	const struct cred *cred;	/* creds of the last closer */
+	struct bkpfs_extent_tree dirty;	/* union of the folded sessions */
+	bool delta;			/* dirty is usable */
+	unsigned int closes;		/* closes folded so far */
 };
 
 /* bkpfs inode data in memory */
 struct bkpfs_inode_info {
 	struct inode *lower_inode;
+	struct mutex backup_mutex;	/* one new version at a time */
+	spinlock_t bkp_dir_lock;
+	struct dentry *bkp_dir;		/* lower ".F.bkp", see bkpfs_bkp_dir */
+	atomic_t backups_pending;	/* backups queued, not yet taken */
+	wait_queue_head_t backup_waitq;	/* writers wait for pending backups */
+	atomic_t writers;		/* files open for writing */
+	atomic_t restoring;		/* in-place restores running */
+	atomic64_t write_seq;		/* bumped by every write */
+	atomic64_t backup_seq;		/* write_seq the newest version holds */
+	struct bkpfs_capture *capture;	/* format=preimage session */
+	loff_t trunc_floor;		/* format=delta: lowest size cut to */
+	struct bkpfs_coalesce coalesce;
+	struct bkpfs_progress progress;	/* see BACKUP_PROGRESS */
+	struct mutex view_mutex;	/* one rebuild at a time */
+	spinlock_t view_lock;		/* protects view, view_version, view_gen */
+	struct file *view;		/* rebuilt copy of a version, lower */
+	int view_version;		/* the version view holds */
+	unsigned int view_gen;		/* bumped by bkpfs_view_drop */
+	atomic_t openers;		/* files open, view goes with the last */
+	/* version range, see meta.c */
+	spinlock_t meta_lock;
+	struct mutex meta_mutex;	/* one bkpfs_meta_sync at a time */
+	int meta_state;			/* enum bkpfs_meta_state */
+	int oldest_version;
+	int next_version;
+	int delta_base;
 	struct inode vfs_inode;
 };
 
@@ -81,10 +479,99 @@ struct bkpfs_dentry_info {
 	struct path lower_path;
 };
 
+/* how the data of a new version is taken from the lower file */
+enum bkpfs_backup_mode {
+	BKPFS_BACKUP_AUTO,	/* clone if the lower fs can, else copy */
+	BKPFS_BACKUP_REFLINK,	/* always clone, fail the mount otherwise */
+	BKPFS_BACKUP_COPY,	/* always copy the bytes */
+};
+
+/* what a version holds */
+enum bkpfs_format {
+	BKPFS_FORMAT_FULL,	/* the file as it was at close */
+	BKPFS_FORMAT_PREIMAGE,	/* the ranges as they were before the writes */
+	BKPFS_FORMAT_DELTA,	/* the ranges written, on top of the last one */
+	BKPFS_FORMAT_DEDUP,	/* chunks shared by every file of the mount */
+};
+
+/* journal=on: group-committed log of version events, see journal.c */
+struct bkpfs_journal {
+	struct file *file;		/* ..bkp/journal */
+	struct mutex lock;		/* appends, data */
+	loff_t pos;			/* end of the last record */
+	u64 seq;			/* records appended */
+	struct list_head data;		/* version files to write back */
+	struct mutex commit_mutex;	/* one commit at a time */
+	u64 committed;			/* records known durable */
+	u64 failed;			/* records whose commit failed... */
+	int err;			/* ...with this error */
+	struct rw_semaphore ckpt_rwsem;	/* RANGE writers vs checkpoint */
+};
+
+/* store=: where the versions of a file live, see store.c */
+enum bkpfs_store {
+	BKPFS_STORE_SIBLING,	/* ".F.bkp" next to the file */
+	BKPFS_STORE_CENTRAL,	/* "..bkp/ino/..." under the lower root */
+};
+
+/* scan=: consistency scan of the lower tree at mount, see scan.c */
+enum bkpfs_scan_mode {
+	BKPFS_SCAN_OFF,
+	BKPFS_SCAN_FOREGROUND,	/* mount returns when it is done */
+	BKPFS_SCAN_BACKGROUND,
+};
+
+struct bkpfs_scan {
+	struct super_block *sb;
+	struct vfsmount *mnt;		/* lower mount */
+	struct workqueue_struct *wq;	/* the threads walking the tree */
+	atomic_t pending;		/* directories queued or being read */
+	struct completion done;
+	bool stop;			/* unmounting */
+	unsigned long start, end;	/* jiffies, end 0 while running */
+	atomic64_t dirs, files;		/* read so far */
+	atomic64_t versioned;		/* files with versions */
+	atomic64_t fixed;		/* ranges rewritten */
+	atomic64_t records;		/* index records rebuilt */
+	atomic64_t reaped;		/* central dirs of inodes gone */
+	atomic64_t errors;
+};
+
 /* bkpfs super-block data in memory */
 struct bkpfs_sb_info {
 	struct super_block *lower_sb;
 	int maxver;
+	int backup_mode;	/* enum bkpfs_backup_mode */
+	int format;		/* enum bkpfs_format */
+	bool skip_unchanged;	/* no new version if the contents match */
+	int compress;		/* enum bkpfs_compress, for full copies */
+	int compress_level;	/* 0: the algorithm's default */
+	bool can_reflink;	/* lower fs supports clone_file_range */
+	/* asynchronous backups (backup=async[:N]) */
+	struct workqueue_struct *backup_wq;	/* NULL for backup=sync */
+	loff_t async_min_size;	/* smaller files are backed up inline */
+	int queue_depth;	/* max jobs in backup_wq */
+	atomic_t backups_queued;
+	unsigned int coalesce_ms;	/* 0: a version per close */
+	spinlock_t coalesce_lock;
+	struct list_head coalesce_pending;	/* struct bkpfs_coalesce */
+	/* chunk store (format=dedup), counters persisted in its xattrs */
+	struct path chunk_store;
+	struct mutex chunk_mutex;	/* refcounts and counters */
+	struct crypto_shash *chunk_tfm;	/* NULL without format=dedup */
+	u64 chunk_logical;		/* bytes referenced by manifests */
+	u64 chunk_stored;		/* bytes in the store */
+	u64 chunk_count;
+	bool journal_on;		/* journal=on */
+	struct bkpfs_journal *journal;	/* NULL without journal=on */
+	int scan_mode;			/* enum bkpfs_scan_mode */
+	struct bkpfs_scan *scan;	/* NULL with scan=off */
+	int store;			/* enum bkpfs_store */
+	struct path central;		/* "..bkp/ino", store=central */
+	bool blocksums;			/* blocksums=on */
+	const struct cred *mounter_cred;	/* for upkeep of the stores */
+	atomic64_t views;		/* rebuilt copies cached by inodes */
+	atomic64_t view_bytes;		/* and their size */
 };
 
 /*
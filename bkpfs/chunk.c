@@ -0,0 +1,634 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "bkpfs.h"
+#include <crypto/hash.h>
+#include <linux/sched/signal.h>
+
+/*
+ * Deduplicated versions (format=dedup).
+ *
+ * Files are cut into chunks at content-defined boundaries (FastCDC: a
+ * gear rolling hash, with a stricter mask before the average chunk size
+ * and a looser one after it), so an insertion only changes the chunks
+ * around it.  Chunks are stored once per mount, in the lower root:
+ *
+ *	..bkp/<sha256 of the chunk, in hex>	user.bkpfs_refs = N
+ *
+ * "..bkp" is the one backup-looking name no file can own (it would be
+ * the backup directory of a file with an empty name), and like every
+ * name ending in ".bkp" it is hidden by bkpfs_filldir; the journal of
+ * the mount (journal.c) and the versions of store=central (store.c)
+ * live there too.  A version is then a manifest
+ * listing the chunks of the file in order; unlinking it drops one
+ * reference to each chunk and frees the chunks left unused.
+ */
+
+#define BKPFS_CHUNK_STORE	"..bkp"
+#define BKPFS_XATTR_REFS	"user.bkpfs_refs"
+#define BKPFS_XATTR_LOGICAL	"user.bkpfs_logical"
+#define BKPFS_XATTR_STORED	"user.bkpfs_stored"
+#define BKPFS_XATTR_CHUNKS	"user.bkpfs_chunks"
+
+#define BKPFS_CDC_MIN		(2 * 1024)
+#define BKPFS_CDC_AVG		(8 * 1024)
+#define BKPFS_CDC_MAX		(64 * 1024)
+#define BKPFS_CDC_MASK_S	0x0003590703530000ULL	/* 15 bits */
+#define BKPFS_CDC_MASK_L	0x0000d90003530000ULL	/* 11 bits */
+#define BKPFS_CDC_BUFSIZE	(2 * BKPFS_CDC_MAX)
+
+#define BKPFS_MANIFEST_MAGIC	0x3174736e66706b62ULL	/* "bkpfnst1" */
+
+struct bkpfs_manifest_header {
+	__le64 magic;
+	__le64 size;		/* file size */
+	__le32 nr;		/* entries following the header */
+	__le32 pad;
+};
+
+struct bkpfs_manifest_entry {
+	u8 id[BKPFS_CHUNK_ID_SIZE];
+	__le32 len;
+	__le32 pad;
+};
+
+static u64 bkpfs_gear[256];
+
+/* fill the gear table from a fixed seed, so boundaries survive reboots */
+void bkpfs_chunk_init_gear(void)
+{
+	u64 x = 0x62706b6673676561ULL, z;
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		/* splitmix64 */
+		z = (x += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		bkpfs_gear[i] = z ^ (z >> 31);
+	}
+}
+
+/* length of the chunk starting at @p, @n bytes being available */
+static size_t bkpfs_cdc_cut(const u8 *p, size_t n)
+{
+	size_t i, normal = BKPFS_CDC_AVG;
+	u64 fp = 0;
+
+	if (n <= BKPFS_CDC_MIN)
+		return n;
+	if (n > BKPFS_CDC_MAX)
+		n = BKPFS_CDC_MAX;
+	if (n < normal)
+		normal = n;
+
+	for (i = BKPFS_CDC_MIN; i < normal; i++) {
+		fp = (fp << 1) + bkpfs_gear[p[i]];
+		if (!(fp & BKPFS_CDC_MASK_S))
+			return i + 1;
+	}
+	for (; i < n; i++) {
+		fp = (fp << 1) + bkpfs_gear[p[i]];
+		if (!(fp & BKPFS_CDC_MASK_L))
+			return i + 1;
+	}
+	return n;
+}
+
+static void bkpfs_chunk_stat_load(struct dentry *dir, const char *name,
+				  u64 *val)
+{
+	*val = 0;
+	vfs_getxattr(dir, name, (void *)val, sizeof(*val));
+}
+
+/* write the counters back, under chunk_mutex */
+static void bkpfs_chunk_stats_sync(struct bkpfs_sb_info *sbi)
+{
+	struct dentry *dir = sbi->chunk_store.dentry;
+
+	vfs_setxattr(dir, BKPFS_XATTR_LOGICAL, (void *)&sbi->chunk_logical,
+		     sizeof(u64), 0);
+	vfs_setxattr(dir, BKPFS_XATTR_STORED, (void *)&sbi->chunk_stored,
+		     sizeof(u64), 0);
+	vfs_setxattr(dir, BKPFS_XATTR_CHUNKS, (void *)&sbi->chunk_count,
+		     sizeof(u64), 0);
+}
+
+/*
+ * bkpfs_store_dir - the "..bkp" directory of a mount
+ * @lower_root : root of the lower directory being mounted
+ * @create     : make it if it does not exist
+ *
+ * Returns a reference to its dentry, -ENOENT if it does not exist and
+ * @create is false, else the corresponding error code.
+ */
+struct dentry *bkpfs_store_dir(const struct path *lower_root, bool create)
+{
+	return bkpfs_store_subdir(lower_root->dentry, BKPFS_CHUNK_STORE,
+				  create);
+}
+
+/*
+ * bkpfs_chunk_store_init - open (or create) the chunk store of a mount
+ * @sbi        : super block info, format=dedup
+ * @lower_root : root of the lower directory
+ *
+ * Returns 0 on success, else the corresponding error code.
+ */
+int bkpfs_chunk_store_init(struct bkpfs_sb_info *sbi,
+			   const struct path *lower_root)
+{
+	struct dentry *dir;
+	int err;
+
+	mutex_init(&sbi->chunk_mutex);
+	sbi->chunk_tfm = crypto_alloc_shash("sha256", 0, 0);
+	if (IS_ERR(sbi->chunk_tfm)) {
+		err = PTR_ERR(sbi->chunk_tfm);
+		sbi->chunk_tfm = NULL;
+		return err;
+	}
+
+	dir = bkpfs_store_dir(lower_root, true);
+	if (IS_ERR(dir)) {
+		err = PTR_ERR(dir);
+		goto out_err;
+	}
+
+	sbi->chunk_store.mnt = mntget(lower_root->mnt);
+	sbi->chunk_store.dentry = dir;
+	bkpfs_chunk_stat_load(dir, BKPFS_XATTR_LOGICAL, &sbi->chunk_logical);
+	bkpfs_chunk_stat_load(dir, BKPFS_XATTR_STORED, &sbi->chunk_stored);
+	bkpfs_chunk_stat_load(dir, BKPFS_XATTR_CHUNKS, &sbi->chunk_count);
+	return 0;
+
+out_err:
+	crypto_free_shash(sbi->chunk_tfm);
+	sbi->chunk_tfm = NULL;
+	return err;
+}
+
+void bkpfs_chunk_store_exit(struct bkpfs_sb_info *sbi)
+{
+	if (!sbi->chunk_tfm)
+		return;
+	path_put(&sbi->chunk_store);
+	crypto_free_shash(sbi->chunk_tfm);
+	sbi->chunk_tfm = NULL;
+}
+
+/* look up the chunk named after @id, in hex */
+static struct dentry *bkpfs_chunk_lookup(struct bkpfs_sb_info *sbi,
+					 const u8 *id)
+{
+	char name[2 * BKPFS_CHUNK_ID_SIZE + 1];
+
+	bin2hex(name, id, BKPFS_CHUNK_ID_SIZE);
+	name[2 * BKPFS_CHUNK_ID_SIZE] = '\0';
+	return lookup_one_len_unlocked(name, sbi->chunk_store.dentry,
+				       2 * BKPFS_CHUNK_ID_SIZE);
+}
+
+static struct file *bkpfs_chunk_open(struct bkpfs_sb_info *sbi,
+				     struct dentry *chunk, int flags)
+{
+	struct path path;
+
+	path.mnt = sbi->chunk_store.mnt;
+	path.dentry = chunk;
+	return dentry_open(&path, flags, current_cred());
+}
+
+static int bkpfs_chunk_unlink(struct bkpfs_sb_info *sbi,
+			      struct dentry *chunk)
+{
+	struct inode *dir = d_inode(sbi->chunk_store.dentry);
+	int err;
+
+	inode_lock_nested(dir, I_MUTEX_PARENT);
+	err = vfs_unlink(dir, chunk, NULL);
+	inode_unlock(dir);
+	return err;
+}
+
+/* a new chunk holding @data, not linked into the store yet */
+static struct file *bkpfs_chunk_write(struct bkpfs_sb_info *sbi,
+				      const u8 *data, size_t len)
+{
+	struct file *file;
+	loff_t pos = 0;
+	ssize_t ret;
+	int refs = 1;
+	int err;
+
+	file = bkpfs_open_linkable(&sbi->chunk_store);
+	if (IS_ERR(file))
+		return file;
+	ret = kernel_write(file, data, len, &pos);
+	if (ret != len) {
+		err = ret < 0 ? ret : -EIO;
+		goto out_err;
+	}
+	/* the reference of whoever links it */
+	err = vfs_setxattr(file->f_path.dentry, BKPFS_XATTR_REFS,
+			   (void *)&refs, sizeof(int), 0);
+	if (err)
+		goto out_err;
+	return file;
+
+out_err:
+	fput(file);
+	return ERR_PTR(err);
+}
+
+/*
+ * bkpfs_chunk_get - take a reference to the chunk holding @data
+ * @sbi  : super block info
+ * @data : chunk contents
+ * @len  : chunk length
+ * @id   : out: chunk id
+ *
+ * Stores the chunk if nobody references it yet.  Only the reference
+ * count and the link into the store are updated under chunk_mutex: a
+ * new chunk is written to an unnamed file first, which is dropped if
+ * another version stored the same chunk meanwhile.
+ */
+static int bkpfs_chunk_get(struct bkpfs_sb_info *sbi, const u8 *data,
+			   size_t len, u8 *id)
+{
+	SHASH_DESC_ON_STACK(desc, sbi->chunk_tfm);
+	struct inode *dir = d_inode(sbi->chunk_store.dentry);
+	struct dentry *chunk;
+	struct file *new = NULL;
+	int refs, err;
+
+	desc->tfm = sbi->chunk_tfm;
+	desc->flags = 0;
+	err = crypto_shash_digest(desc, data, len, id);
+	shash_desc_zero(desc);
+	if (err)
+		return err;
+
+	for (;;) {
+		mutex_lock(&sbi->chunk_mutex);
+		chunk = bkpfs_chunk_lookup(sbi, id);
+		if (IS_ERR(chunk)) {
+			err = PTR_ERR(chunk);
+			break;
+		}
+		if (d_is_positive(chunk)) {
+			refs = 0;
+			vfs_getxattr(chunk, BKPFS_XATTR_REFS, (void *)&refs,
+				     sizeof(int));
+			refs++;
+			err = vfs_setxattr(chunk, BKPFS_XATTR_REFS,
+					   (void *)&refs, sizeof(int), 0);
+			if (!err)
+				sbi->chunk_logical += len;
+			break;
+		}
+		if (new) {
+			inode_lock_nested(dir, I_MUTEX_PARENT);
+			err = vfs_link(new->f_path.dentry, dir, chunk, NULL);
+			inode_unlock(dir);
+			if (!err) {
+				sbi->chunk_logical += len;
+				sbi->chunk_stored += len;
+				sbi->chunk_count++;
+			}
+			break;
+		}
+		dput(chunk);
+		mutex_unlock(&sbi->chunk_mutex);
+
+		/* the data is written without holding up other files */
+		new = bkpfs_chunk_write(sbi, data, len);
+		if (IS_ERR(new))
+			return PTR_ERR(new);
+	}
+	if (!IS_ERR(chunk))
+		dput(chunk);
+	mutex_unlock(&sbi->chunk_mutex);
+	if (new)
+		fput(new);
+	return err;
+}
+
+/* drop a reference to a chunk, under chunk_mutex */
+static void bkpfs_chunk_put(struct bkpfs_sb_info *sbi, const u8 *id,
+			    size_t len)
+{
+	struct dentry *chunk;
+	int refs = 0;
+
+	chunk = bkpfs_chunk_lookup(sbi, id);
+	if (IS_ERR(chunk))
+		return;
+	if (d_is_negative(chunk))
+		goto out;
+
+	vfs_getxattr(chunk, BKPFS_XATTR_REFS, (void *)&refs, sizeof(int));
+	sbi->chunk_logical -= len;
+	if (--refs > 0) {
+		vfs_setxattr(chunk, BKPFS_XATTR_REFS, (void *)&refs,
+			     sizeof(int), 0);
+	} else if (!bkpfs_chunk_unlink(sbi, chunk)) {
+		sbi->chunk_stored -= len;
+		sbi->chunk_count--;
+	}
+out:
+	dput(chunk);
+}
+
+/*
+ * bkpfs_chunk_backup - store a file as a manifest of chunks
+ * @sb  : bkpfs superblock, format=dedup
+ * @src : lower file to read, from offset 0, opened in any mode
+ * @dst : empty version file, opened for writing
+ * @prog : progress counter to advance, or NULL
+ *
+ * The file is read and hashed without chunk_mutex, which is only taken
+ * per chunk to update its reference count.
+ *
+ * Returns 0 on success, else the corresponding error code.  On error
+ * the references taken so far are dropped again.
+ */
+int bkpfs_chunk_backup(struct super_block *sb, struct file *src,
+		       struct file *dst, struct bkpfs_progress *prog)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	struct bkpfs_manifest_header hdr;
+	struct bkpfs_manifest_entry *ents = NULL, *tmp;
+	unsigned int nr = 0, max = 0;
+	loff_t rpos = 0, wpos = 0, size = 0;
+	size_t len = 0, off = 0, cut;
+	bool eof = false;
+	ssize_t ret;
+	u8 *buf;
+	int err = 0;
+
+	/* the file being released may be write-only: read our own */
+	src = dentry_open(&src->f_path, O_RDONLY, current_cred());
+	if (IS_ERR(src))
+		return PTR_ERR(src);
+	buf = kvmalloc(BKPFS_CDC_BUFSIZE, GFP_KERNEL);
+	if (!buf) {
+		fput(src);
+		return -ENOMEM;
+	}
+
+	for (;;) {
+		/* keep at least one maximal chunk in the buffer */
+		if (len - off < BKPFS_CDC_MAX && !eof) {
+			if (fatal_signal_pending(current)) {
+				err = -EINTR;
+				goto out_put;
+			}
+			cond_resched();
+			memmove(buf, buf + off, len - off);
+			len -= off;
+			off = 0;
+			while (len < BKPFS_CDC_BUFSIZE && !eof) {
+				ret = kernel_read(src, buf + len,
+						  BKPFS_CDC_BUFSIZE - len,
+						  &rpos);
+				if (ret < 0) {
+					err = ret;
+					goto out_put;
+				}
+				if (ret == 0)
+					eof = true;
+				len += ret;
+			}
+		}
+		if (off == len)
+			break;
+
+		if (nr == max) {
+			max = max ? max * 2 : 64;
+			tmp = kvmalloc_array(max, sizeof(*ents), GFP_KERNEL);
+			if (!tmp) {
+				err = -ENOMEM;
+				goto out_put;
+			}
+			if (nr)
+				memcpy(tmp, ents, nr * sizeof(*ents));
+			kvfree(ents);
+			ents = tmp;
+		}
+
+		cut = bkpfs_cdc_cut(buf + off, len - off);
+		memset(&ents[nr], 0, sizeof(*ents));
+		err = bkpfs_chunk_get(sbi, buf + off, cut, ents[nr].id);
+		if (err)
+			goto out_put;
+		ents[nr++].len = cpu_to_le32(cut);
+		off += cut;
+		size += cut;
+		if (prog)
+			atomic64_add(cut, &prog->done);
+	}
+
+	hdr.magic = cpu_to_le64(BKPFS_MANIFEST_MAGIC);
+	hdr.size = cpu_to_le64(size);
+	hdr.nr = cpu_to_le32(nr);
+	hdr.pad = 0;
+	ret = kernel_write(dst, &hdr, sizeof(hdr), &wpos);
+	if (ret != sizeof(hdr)) {
+		err = ret < 0 ? ret : -EIO;
+		goto out_put;
+	}
+	ret = kernel_write(dst, ents, nr * sizeof(*ents), &wpos);
+	if (ret != nr * sizeof(*ents)) {
+		err = ret < 0 ? ret : -EIO;
+		goto out_put;
+	}
+	printk("INFO:dedup version: %u chunks, %lld bytes\n", nr, size);
+	goto out;
+
+out_put:
+	mutex_lock(&sbi->chunk_mutex);
+	while (nr--)
+		bkpfs_chunk_put(sbi, ents[nr].id, le32_to_cpu(ents[nr].len));
+	mutex_unlock(&sbi->chunk_mutex);
+out:
+	mutex_lock(&sbi->chunk_mutex);
+	bkpfs_chunk_stats_sync(sbi);
+	mutex_unlock(&sbi->chunk_mutex);
+	kvfree(ents);
+	kvfree(buf);
+	fput(src);
+	return err;
+}
+
+/* read the header and the entries of a manifest */
+static struct bkpfs_manifest_entry *
+bkpfs_manifest_read(struct file *manifest, struct bkpfs_manifest_header *hdr)
+{
+	struct bkpfs_manifest_entry *ents;
+	loff_t pos = 0;
+	unsigned int nr;
+	ssize_t ret;
+
+	ret = kernel_read(manifest, hdr, sizeof(*hdr), &pos);
+	if (ret != sizeof(*hdr) ||
+	    le64_to_cpu(hdr->magic) != BKPFS_MANIFEST_MAGIC)
+		return ERR_PTR(-EIO);
+
+	nr = le32_to_cpu(hdr->nr);
+	ents = kvmalloc_array(nr ? nr : 1, sizeof(*ents), GFP_KERNEL);
+	if (!ents)
+		return ERR_PTR(-ENOMEM);
+	ret = kernel_read(manifest, ents, nr * sizeof(*ents), &pos);
+	if (ret != nr * sizeof(*ents)) {
+		kvfree(ents);
+		return ERR_PTR(-EIO);
+	}
+	return ents;
+}
+
+/*
+ * bkpfs_chunk_release_path - drop the references held by a manifest
+ * @sbi  : super block info
+ * @path : lower path of the manifest, about to be unlinked
+ *
+ * Chunks nobody references any more are unlinked.
+ */
+void bkpfs_chunk_release_path(struct bkpfs_sb_info *sbi,
+			      const struct path *path)
+{
+	struct bkpfs_manifest_header hdr;
+	struct bkpfs_manifest_entry *ents;
+	struct file *manifest;
+	unsigned int i;
+
+	if (!sbi->chunk_tfm) {
+		printk(KERN_ERR "bkpfs: cannot release a manifest "
+		       "without format=dedup, chunks leaked\n");
+		return;
+	}
+
+	manifest = dentry_open(path, O_RDONLY, current_cred());
+	if (IS_ERR(manifest))
+		return;
+
+	ents = bkpfs_manifest_read(manifest, &hdr);
+	fput(manifest);
+	if (IS_ERR(ents))
+		return;
+
+	mutex_lock(&sbi->chunk_mutex);
+	for (i = 0; i < le32_to_cpu(hdr.nr); i++)
+		bkpfs_chunk_put(sbi, ents[i].id, le32_to_cpu(ents[i].len));
+	bkpfs_chunk_stats_sync(sbi);
+	mutex_unlock(&sbi->chunk_mutex);
+	kvfree(ents);
+}
+
+/*
+ * bkpfs_chunk_release - drop the references held by a manifest
+ * @dentry         : upper dentry of the file
+ * @version_dentry : lower dentry of the manifest, about to be unlinked
+ */
+void bkpfs_chunk_release(struct dentry *dentry, struct dentry *version_dentry)
+{
+	struct path path, lower_path;
+
+	bkpfs_get_lower_path(dentry, &lower_path);
+	path.mnt = lower_path.mnt;
+	path.dentry = version_dentry;
+	bkpfs_chunk_release_path(BKPFS_SB(dentry->d_sb), &path);
+	bkpfs_put_lower_path(dentry, &lower_path);
+}
+
+/*
+ * bkpfs_chunk_materialize - rebuild a file from its manifest
+ * @sb       : bkpfs superblock
+ * @manifest : version file holding the manifest, opened for reading
+ * @dst      : empty lower file, opened for writing
+ * @prog     : progress counter to advance, or NULL
+ *
+ * Returns 0 on success, -EIO if a chunk is missing or the manifest is
+ * damaged, else the corresponding error code.
+ */
+int bkpfs_chunk_materialize(struct super_block *sb, struct file *manifest,
+			    struct file *dst, struct bkpfs_progress *prog)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	struct bkpfs_manifest_header hdr;
+	struct bkpfs_manifest_entry *ents;
+	struct dentry *chunk;
+	struct file *file;
+	loff_t pos = 0, len;
+	unsigned int i;
+	int err = 0;
+
+	if (!sbi->chunk_tfm)
+		return -EOPNOTSUPP;
+
+	ents = bkpfs_manifest_read(manifest, &hdr);
+	if (IS_ERR(ents))
+		return PTR_ERR(ents);
+
+	for (i = 0; !err && i < le32_to_cpu(hdr.nr); i++) {
+		len = le32_to_cpu(ents[i].len);
+		chunk = bkpfs_chunk_lookup(sbi, ents[i].id);
+		if (IS_ERR(chunk)) {
+			err = PTR_ERR(chunk);
+			break;
+		}
+		if (d_is_negative(chunk)) {
+			dput(chunk);
+			err = -EIO;
+			break;
+		}
+		file = bkpfs_chunk_open(sbi, chunk, O_RDONLY);
+		dput(chunk);
+		if (IS_ERR(file)) {
+			err = PTR_ERR(file);
+			break;
+		}
+		err = bkpfs_copy_range(file, 0, dst, pos, len);
+		fput(file);
+		pos += len;
+		if (!err && prog)
+			atomic64_add(len, &prog->done);
+	}
+	if (!err)
+		err = bkpfs_truncate_file(dst, le64_to_cpu(hdr.size));
+	kvfree(ents);
+	return err;
+}
+
+/*
+ * bkpfs_chunk_stats - what the chunk store of a mount saves
+ * @sb      : bkpfs superblock
+ * @logical : out: bytes referenced by manifests
+ * @stored  : out: bytes actually stored
+ * @chunks  : out: number of chunks stored
+ *
+ * Returns 0, or -EOPNOTSUPP unless the mount uses format=dedup.
+ */
+int bkpfs_chunk_stats(struct super_block *sb, u64 *logical, u64 *stored,
+		      u64 *chunks)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+
+	if (!sbi->chunk_tfm)
+		return -EOPNOTSUPP;
+	mutex_lock(&sbi->chunk_mutex);
+	*logical = sbi->chunk_logical;
+	*stored = sbi->chunk_stored;
+	*chunks = sbi->chunk_count;
+	mutex_unlock(&sbi->chunk_mutex);
+	return 0;
+}
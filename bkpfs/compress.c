@@ -0,0 +1,348 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "bkpfs.h"
+#include <linux/lz4.h>
+#include <linux/zstd.h>
+#include <linux/ktime.h>
+#include <linux/sched/signal.h>
+
+/*
+ * Compressed versions (compress=lz4|zstd[:level]).
+ *
+ * A full copy is compressed in independent blocks, so it can be
+ * rebuilt while streaming through two block-sized buffers:
+ *
+ *	+--------+-----------+---------+-----------+---------+-----+
+ *	| header | block hdr | data 0  | block hdr | data 1  | ... |
+ *	+--------+-----------+---------+-----------+---------+-----+
+ *
+ * A block that does not shrink is stored as is (clen == ulen).  How
+ * much a version saved and the time spent compressing it are kept in
+ * the user.bkpfs_zstat xattr of the version file.
+ */
+
+#define BKPFS_ZBLOCK		(128 * 1024)
+#define BKPFS_ZMAGIC		0x31706d7a66706b62ULL	/* "bkpfzmp1" */
+
+struct bkpfs_zhdr {
+	__le64 magic;
+	__le64 size;		/* uncompressed size */
+	__le32 alg;		/* enum bkpfs_compress */
+	__le32 block;		/* uncompressed block size */
+};
+
+struct bkpfs_zblk {
+	__le32 clen;
+	__le32 ulen;
+};
+
+/* compression state of one version */
+struct bkpfs_zctx {
+	int alg;
+	int level;
+	void *wrk;
+	ZSTD_CCtx *cctx;
+	ZSTD_DCtx *dctx;
+	ZSTD_parameters params;
+};
+
+/*
+ * bkpfs_compress_parse - parse the value of compress=
+ * @val   : "none", "lz4", "zstd", optionally followed by ":level"
+ * @alg   : out: enum bkpfs_compress
+ * @level : out: level, 0 for the default one
+ *
+ * lz4 levels select lz4hc (1 to LZ4HC_MAX_CLEVEL), zstd levels go from
+ * 1 to ZSTD_maxCLevel().  Returns 0 or -EINVAL.
+ */
+int bkpfs_compress_parse(char *val, int *alg, int *level)
+{
+	char *name = strsep(&val, ":");
+
+	*level = 0;
+	if (!strcmp(name, "none"))
+		*alg = BKPFS_COMPRESS_NONE;
+	else if (!strcmp(name, "lz4"))
+		*alg = BKPFS_COMPRESS_LZ4;
+	else if (!strcmp(name, "zstd"))
+		*alg = BKPFS_COMPRESS_ZSTD;
+	else
+		return -EINVAL;
+
+	if (!val)
+		return 0;
+	if (*alg == BKPFS_COMPRESS_NONE || kstrtoint(val, 10, level) ||
+	    *level < 1)
+		return -EINVAL;
+	if (*alg == BKPFS_COMPRESS_LZ4 && *level > LZ4HC_MAX_CLEVEL)
+		return -EINVAL;
+	if (*alg == BKPFS_COMPRESS_ZSTD && *level > ZSTD_maxCLevel())
+		return -EINVAL;
+	return 0;
+}
+
+static int bkpfs_zctx_init(struct bkpfs_zctx *z, int alg, int level,
+			   bool compress)
+{
+	size_t size;
+
+	memset(z, 0, sizeof(*z));
+	z->alg = alg;
+	z->level = level;
+
+	if (alg == BKPFS_COMPRESS_LZ4) {
+		if (!compress)
+			return 0;
+		size = level ? LZ4HC_MEM_COMPRESS : LZ4_MEM_COMPRESS;
+		z->wrk = kvmalloc(size, GFP_KERNEL);
+		return z->wrk ? 0 : -ENOMEM;
+	}
+	if (alg != BKPFS_COMPRESS_ZSTD)
+		return -EINVAL;
+
+	if (compress) {
+		z->params = ZSTD_getParams(level ? level : 3, BKPFS_ZBLOCK, 0);
+		size = ZSTD_CCtxWorkspaceBound(z->params.cParams);
+	} else {
+		size = ZSTD_DCtxWorkspaceBound();
+	}
+	z->wrk = kvmalloc(size, GFP_KERNEL);
+	if (!z->wrk)
+		return -ENOMEM;
+	if (compress)
+		z->cctx = ZSTD_initCCtx(z->wrk, size);
+	else
+		z->dctx = ZSTD_initDCtx(z->wrk, size);
+	if (!z->cctx && !z->dctx) {
+		kvfree(z->wrk);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/* compress one block, returns its size or 0 if it does not shrink */
+static size_t bkpfs_zblock(struct bkpfs_zctx *z, const void *src, size_t len,
+			   void *dst)
+{
+	size_t ret;
+	int n;
+
+	if (z->alg == BKPFS_COMPRESS_LZ4) {
+		if (z->level)
+			n = LZ4_compress_HC(src, dst, len, len - 1, z->level,
+					    z->wrk);
+		else
+			n = LZ4_compress_default(src, dst, len, len - 1,
+						 z->wrk);
+		return n > 0 ? n : 0;
+	}
+
+	ret = ZSTD_compressCCtx(z->cctx, dst, len - 1, src, len, z->params);
+	return ZSTD_isError(ret) ? 0 : ret;
+}
+
+/* decompress one block of exactly @ulen bytes */
+static int bkpfs_zunblock(struct bkpfs_zctx *z, const void *src, size_t clen,
+			  void *dst, size_t ulen)
+{
+	size_t ret;
+	int n;
+
+	if (z->alg == BKPFS_COMPRESS_LZ4) {
+		n = LZ4_decompress_safe(src, dst, clen, ulen);
+		return n == ulen ? 0 : -EIO;
+	}
+
+	ret = ZSTD_decompressDCtx(z->dctx, dst, ulen, src, clen);
+	return (ZSTD_isError(ret) || ret != ulen) ? -EIO : 0;
+}
+
+/*
+ * bkpfs_compress_file - write a compressed full copy of a file
+ * @sb  : bkpfs superblock, to pick the algorithm and level
+ * @src : lower file to read, from offset 0
+ * @dst : empty version file, opened for writing
+ * @len : number of bytes to store
+ * @prog : progress counter to advance, or NULL
+ *
+ * Returns 0 on success, else the corresponding error code.
+ */
+int bkpfs_compress_file(struct super_block *sb, struct file *src,
+			struct file *dst, loff_t len,
+			struct bkpfs_progress *prog)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	struct bkpfs_zstat st = { 0 };
+	struct bkpfs_zhdr hdr;
+	struct bkpfs_zblk blk;
+	struct bkpfs_zctx z;
+	loff_t rpos = 0, wpos = sizeof(hdr), done = 0;
+	u64 t, ns = 0;
+	size_t ulen, clen;
+	void *in, *out, *data;
+	ssize_t ret;
+	int err;
+
+	err = bkpfs_zctx_init(&z, sbi->compress, sbi->compress_level, true);
+	if (err)
+		return err;
+	in = kvmalloc(BKPFS_ZBLOCK, GFP_KERNEL);
+	out = kvmalloc(BKPFS_ZBLOCK, GFP_KERNEL);
+	if (!in || !out) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	while (done < len) {
+		if (fatal_signal_pending(current)) {
+			err = -EINTR;
+			goto out;
+		}
+		ulen = min_t(loff_t, len - done, BKPFS_ZBLOCK);
+		ret = kernel_read(src, in, ulen, &rpos);
+		if (ret != ulen) {
+			err = ret < 0 ? ret : -EIO;
+			goto out;
+		}
+
+		t = ktime_get_ns();
+		clen = bkpfs_zblock(&z, in, ulen, out);
+		ns += ktime_get_ns() - t;
+		data = clen ? out : in;
+		if (!clen)
+			clen = ulen;
+
+		blk.clen = cpu_to_le32(clen);
+		blk.ulen = cpu_to_le32(ulen);
+		ret = kernel_write(dst, &blk, sizeof(blk), &wpos);
+		if (ret != sizeof(blk)) {
+			err = ret < 0 ? ret : -EIO;
+			goto out;
+		}
+		ret = kernel_write(dst, data, clen, &wpos);
+		if (ret != clen) {
+			err = ret < 0 ? ret : -EIO;
+			goto out;
+		}
+		done += ulen;
+		if (prog)
+			atomic64_add(ulen, &prog->done);
+		cond_resched();
+	}
+
+	hdr.magic = cpu_to_le64(BKPFS_ZMAGIC);
+	hdr.size = cpu_to_le64(len);
+	hdr.alg = cpu_to_le32(z.alg);
+	hdr.block = cpu_to_le32(BKPFS_ZBLOCK);
+	rpos = 0;
+	ret = kernel_write(dst, &hdr, sizeof(hdr), &rpos);
+	if (ret != sizeof(hdr)) {
+		err = ret < 0 ? ret : -EIO;
+		goto out;
+	}
+
+	st.size = cpu_to_le64(len);
+	st.stored = cpu_to_le64(wpos);
+	st.cpu_ns = cpu_to_le64(ns);
+	vfs_setxattr(dst->f_path.dentry, BKPFS_XATTR_ZSTAT, (void *)&st,
+		     sizeof(st), 0);
+	printk("INFO:compressed %lld bytes to %lld in %llu ns\n",
+	       len, wpos, ns);
+out:
+	kvfree(out);
+	kvfree(in);
+	kvfree(z.wrk);
+	return err;
+}
+
+/*
+ * bkpfs_decompress_file - rebuild a compressed full copy
+ * @src : version file, opened for reading
+ * @dst : empty lower file, opened for writing
+ * @prog : progress counter to advance, or NULL
+ *
+ * Returns 0 on success, -EIO if @src is damaged, else the corresponding
+ * error code.
+ */
+int bkpfs_decompress_file(struct file *src, struct file *dst,
+			  struct bkpfs_progress *prog)
+{
+	struct bkpfs_zhdr hdr;
+	struct bkpfs_zblk blk;
+	struct bkpfs_zctx z;
+	loff_t rpos = 0, wpos = 0, size;
+	size_t ulen, clen, block;
+	void *in = NULL, *out = NULL;
+	ssize_t ret;
+	int err;
+
+	ret = kernel_read(src, &hdr, sizeof(hdr), &rpos);
+	if (ret != sizeof(hdr) || le64_to_cpu(hdr.magic) != BKPFS_ZMAGIC)
+		return -EIO;
+	size = le64_to_cpu(hdr.size);
+	block = le32_to_cpu(hdr.block);
+	if (!block || block > BKPFS_ZBLOCK)
+		return -EIO;
+
+	err = bkpfs_zctx_init(&z, le32_to_cpu(hdr.alg), 0, false);
+	if (err)
+		return err;
+	in = kvmalloc(block, GFP_KERNEL);
+	out = kvmalloc(block, GFP_KERNEL);
+	if (!in || !out) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	while (wpos < size) {
+		if (fatal_signal_pending(current)) {
+			err = -EINTR;
+			goto out;
+		}
+		ret = kernel_read(src, &blk, sizeof(blk), &rpos);
+		if (ret != sizeof(blk)) {
+			err = ret < 0 ? ret : -EIO;
+			goto out;
+		}
+		clen = le32_to_cpu(blk.clen);
+		ulen = le32_to_cpu(blk.ulen);
+		if (!ulen || ulen > block || clen > ulen ||
+		    ulen > size - wpos) {
+			err = -EIO;
+			goto out;
+		}
+		ret = kernel_read(src, in, clen, &rpos);
+		if (ret != clen) {
+			err = ret < 0 ? ret : -EIO;
+			goto out;
+		}
+		if (clen < ulen) {
+			err = bkpfs_zunblock(&z, in, clen, out, ulen);
+			if (err)
+				goto out;
+		}
+		ret = kernel_write(dst, clen < ulen ? out : in, ulen, &wpos);
+		if (ret != ulen) {
+			err = ret < 0 ? ret : -EIO;
+			goto out;
+		}
+		if (prog)
+			atomic64_add(ulen, &prog->done);
+		cond_resched();
+	}
+	err = bkpfs_truncate_file(dst, size);
+out:
+	kvfree(out);
+	kvfree(in);
+	kvfree(z.wrk);
+	return err;
+}
@@ -0,0 +1,440 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "bkpfs.h"
+#include <linux/splice.h>
+#include <linux/crc32c.h>
+#include <linux/sched/signal.h>
+
+/*
+ * Copies are issued in pieces of this size, so that a multi-GB version
+ * neither holds the CPU nor ignores a kill for the whole copy.
+ */
+#define BKPFS_COPY_CHUNK	(8 * 1024 * 1024)
+
+enum bkpfs_copy_how {
+	BKPFS_COPY_CLONE,	/* share the extents */
+	BKPFS_COPY_RANGE,	/* vfs_copy_file_range, may still clone */
+	BKPFS_COPY_SPLICE,	/* through the page cache */
+};
+
+/* make an unnamed file of @mode in @dir and open it read-write */
+static struct file *bkpfs_open_unnamed(const struct path *dir, umode_t mode,
+				       int flags)
+{
+	struct dentry *dentry;
+	struct path path;
+	struct file *file;
+
+	dentry = vfs_tmpfile(dir->dentry, S_IFREG | mode, O_RDWR | flags);
+	if (IS_ERR(dentry))
+		return ERR_CAST(dentry);
+
+	/* no permission check: the mode is for who opens it later */
+	path.dentry = dentry;
+	path.mnt = dir->mnt;
+	file = dentry_open(&path, O_RDWR, current_cred());
+	dput(dentry);
+	return file;
+}
+
+/*
+ * bkpfs_open_tmpfile - open an unnamed regular file in a lower dir
+ * @dir : lower directory the file is created in
+ *
+ * The file has no name and disappears on the last fput.  It is made
+ * with O_EXCL so that it cannot be given one with linkat() either.
+ */
+struct file *bkpfs_open_tmpfile(const struct path *dir)
+{
+	return bkpfs_open_unnamed(dir, 0600, O_EXCL);
+}
+
+/*
+ * bkpfs_open_sealed - open an unnamed file only its creator may write
+ * @dir : lower directory the file is created in
+ *
+ * Like bkpfs_open_tmpfile, but read-only (0400) and owned by the
+ * credentials of the caller: read-only descriptors of it handed to
+ * other users cannot be reopened for writing through /proc/self/fd.
+ */
+struct file *bkpfs_open_sealed(const struct path *dir)
+{
+	return bkpfs_open_unnamed(dir, 0400, O_EXCL);
+}
+
+/*
+ * bkpfs_open_linkable - open an unnamed file that may be linked later
+ * @dir : lower directory the file is created in
+ *
+ * Like bkpfs_open_tmpfile, but without O_EXCL, so that it can be given
+ * a name once complete; read-only (0444), like versions and chunks.
+ */
+struct file *bkpfs_open_linkable(const struct path *dir)
+{
+	return bkpfs_open_unnamed(dir, 0444, 0);
+}
+
+/*
+ * bkpfs_snapshot_file - freeze the contents of a lower file
+ * @file : the lower file, opened in any mode
+ *
+ * Clones all of @file into an unnamed file in its directory in a single
+ * call, which the lower file system makes atomic with writes: each of
+ * them is in the snapshot or not at all.  Needs sbi->can_reflink.
+ *
+ * Returns the snapshot, or an ERR_PTR.
+ */
+struct file *bkpfs_snapshot_file(struct file *file)
+{
+	struct path dir;
+	struct file *src, *snap;
+	int err;
+
+	dir.mnt = file->f_path.mnt;
+	dir.dentry = dget_parent(file->f_path.dentry);
+	snap = bkpfs_open_tmpfile(&dir);
+	dput(dir.dentry);
+	if (IS_ERR(snap))
+		return snap;
+
+	/* a file being released may be write-only */
+	src = dentry_open(&file->f_path, O_RDONLY, current_cred());
+	if (IS_ERR(src)) {
+		fput(snap);
+		return src;
+	}
+	/* a length of 0 clones up to the end of @src, as it is then */
+	err = vfs_clone_file_range(src, 0, snap, 0, 0);
+	fput(src);
+	if (err) {
+		fput(snap);
+		return ERR_PTR(err);
+	}
+	return snap;
+}
+
+/*
+ * bkpfs_probe_reflink - find out if the lower fs can clone file ranges
+ * @lower_root : root of the lower directory being mounted
+ *
+ * Clones a one-byte file into another one in the lower root.  Whether
+ * clone_file_range is supported is a property of the file system
+ * instance (e.g. XFS formatted without reflink=1 refuses it), so looking
+ * at the file operations alone is not enough.
+ *
+ * Returns true if the clone succeeded.
+ */
+bool bkpfs_probe_reflink(const struct path *lower_root)
+{
+	struct file *src, *dst;
+	char byte = 0;
+	loff_t pos = 0;
+	bool ok = false;
+
+	src = bkpfs_open_tmpfile(lower_root);
+	if (IS_ERR(src))
+		goto out;
+	dst = bkpfs_open_tmpfile(lower_root);
+	if (IS_ERR(dst))
+		goto out_src;
+
+	if (kernel_write(src, &byte, 1, &pos) == 1)
+		ok = !vfs_clone_file_range(src, 0, dst, 0, 1);
+
+	fput(dst);
+out_src:
+	fput(src);
+out:
+	return ok;
+}
+
+/*
+ * bkpfs_copy_stream - copy @len bytes, one BKPFS_COPY_CHUNK at a time
+ * @src, @src_pos : where to read from, advanced by what was copied
+ * @dst, @dst_pos : where to write to, advanced by what was copied
+ * @len           : number of bytes
+ * @how           : enum bkpfs_copy_how
+ * @prog          : progress counter to advance, or NULL
+ *
+ * Short copies are resumed.  Between pieces the CPU is given up and a
+ * fatal signal stops the copy, leaving @dst partly written.
+ *
+ * Returns 0 on success, -EINTR if killed, -EIO if @src ended early,
+ * else the corresponding error code.
+ */
+static int bkpfs_copy_stream(struct file *src, loff_t *src_pos,
+			     struct file *dst, loff_t *dst_pos, loff_t len,
+			     int how, struct bkpfs_progress *prog)
+{
+	loff_t chunk;
+	ssize_t ret;
+
+	while (len > 0) {
+		if (fatal_signal_pending(current))
+			return -EINTR;
+		chunk = min_t(loff_t, len, BKPFS_COPY_CHUNK);
+
+		if (how == BKPFS_COPY_SPLICE) {
+			ret = do_splice_direct(src, src_pos, dst, dst_pos,
+					       chunk, 0);
+		} else {
+			if (how == BKPFS_COPY_CLONE)
+				ret = vfs_clone_file_range(src, *src_pos, dst,
+							   *dst_pos, chunk);
+			else
+				ret = vfs_copy_file_range(src, *src_pos, dst,
+							  *dst_pos, chunk, 0);
+			if (how == BKPFS_COPY_CLONE && !ret)
+				ret = chunk;
+			if (ret > 0) {
+				*src_pos += ret;
+				*dst_pos += ret;
+			}
+		}
+		if (ret < 0)
+			return ret;
+		if (ret == 0)
+			return -EIO;	/* source shrank under us */
+
+		len -= ret;
+		if (prog)
+			atomic64_add(ret, &prog->done);
+		cond_resched();
+	}
+	return 0;
+}
+
+/*
+ * bkpfs_copy_file - fill a freshly created version file
+ * @sb   : bkpfs superblock, to pick the backup_mode
+ * @src  : lower file to copy from (must be readable)
+ * @dst  : lower version file to copy into (must be writable)
+ * @len  : number of bytes to copy, from offset 0
+ * @prog : progress counter to advance, or NULL
+ *
+ * With backup_mode=auto or reflink the extents of @src are cloned into
+ * @dst, so a version costs metadata proportional to the number of
+ * extents instead of the file size.  In auto mode a refused clone falls
+ * back to vfs_copy_file_range from where it stopped; with
+ * backup_mode=copy the bytes are always spliced so the version never
+ * shares blocks with the live file.
+ *
+ * Returns 0 on success, else the corresponding error code.
+ */
+int bkpfs_copy_file(struct super_block *sb, struct file *src,
+		    struct file *dst, loff_t len, struct bkpfs_progress *prog)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	loff_t src_pos = 0, dst_pos = 0;
+	int err;
+
+	if (len <= 0)
+		return 0;
+
+	if (sbi->backup_mode == BKPFS_BACKUP_COPY)
+		return bkpfs_copy_stream(src, &src_pos, dst, &dst_pos, len,
+					 BKPFS_COPY_SPLICE, prog);
+
+	if (sbi->can_reflink) {
+		err = bkpfs_copy_stream(src, &src_pos, dst, &dst_pos, len,
+					BKPFS_COPY_CLONE, prog);
+		if (!err || err == -EINTR ||
+		    sbi->backup_mode == BKPFS_BACKUP_REFLINK)
+			return err;
+		printk(KERN_DEBUG "bkpfs: clone failed (%d), copying\n", err);
+	}
+
+	return bkpfs_copy_stream(src, &src_pos, dst, &dst_pos, len - src_pos,
+				 BKPFS_COPY_RANGE, prog);
+}
+
+/*
+ * bkpfs_copy_range - copy @len bytes between arbitrary offsets
+ *
+ * Unlike a single vfs_copy_file_range call, short copies are resumed.
+ * Aligned ranges may still be cloned by the lower file system.
+ */
+int bkpfs_copy_range(struct file *src, loff_t src_pos, struct file *dst,
+		     loff_t dst_pos, loff_t len)
+{
+	return bkpfs_copy_stream(src, &src_pos, dst, &dst_pos, len,
+				 BKPFS_COPY_RANGE, NULL);
+}
+
+/*
+ * bkpfs_send_file - copy the first @len bytes of @src to any writable file
+ * @src     : lower file to copy from
+ * @dst     : file of the caller: regular file, pipe, socket, ...
+ * @dst_pos : where to write to in @dst, advanced by what was copied
+ * @len     : number of bytes
+ * @prog    : progress counter to advance, or NULL
+ *
+ * A regular file of the lower file system may get the extents cloned;
+ * anything else is spliced through the page cache of @src.
+ */
+int bkpfs_send_file(struct file *src, struct file *dst, loff_t *dst_pos,
+		    loff_t len, struct bkpfs_progress *prog)
+{
+	loff_t src_pos = 0;
+	int how = BKPFS_COPY_SPLICE;
+
+	if (S_ISREG(file_inode(dst)->i_mode) &&
+	    file_inode(dst)->i_sb == file_inode(src)->i_sb)
+		how = BKPFS_COPY_RANGE;
+	return bkpfs_copy_stream(src, &src_pos, dst, dst_pos, len, how, prog);
+}
+
+/*
+ * bkpfs_truncate_file - set the size of a lower file we opened
+ *
+ * Version files are read-only (0444), so vfs_truncate's permission
+ * check would refuse them; like bkpfs_setattr we go to notify_change.
+ */
+int bkpfs_truncate_file(struct file *file, loff_t size)
+{
+	struct dentry *dentry = file->f_path.dentry;
+	struct iattr ia = {
+		.ia_valid = ATTR_SIZE | ATTR_FILE,
+		.ia_size = size,
+		.ia_file = file,
+	};
+	int err;
+
+	inode_lock(d_inode(dentry));
+	err = notify_change(dentry, &ia, NULL);
+	inode_unlock(d_inode(dentry));
+	return err;
+}
+
+/*
+ * bkpfs_copy_xattrs - copy the extended attributes of a lower file
+ * @src : lower dentry to copy from
+ * @dst : lower dentry to copy into
+ *
+ * Attributes @dst refuses (e.g. security labels it already has) are
+ * skipped, except user.bkpfs_meta, which holds the version range.
+ *
+ * Returns 0 on success, else the corresponding error code.
+ */
+int bkpfs_copy_xattrs(struct dentry *src, struct dentry *dst)
+{
+	char *list, *name, *value = NULL;
+	ssize_t len, size;
+	int err = 0;
+
+	len = vfs_listxattr(src, NULL, 0);
+	if (len <= 0)
+		return len == -EOPNOTSUPP ? 0 : len;
+	list = kmalloc(len, GFP_KERNEL);
+	value = kvmalloc(XATTR_SIZE_MAX, GFP_KERNEL);
+	if (!list || !value) {
+		err = -ENOMEM;
+		goto out;
+	}
+	len = vfs_listxattr(src, list, len);
+	if (len < 0) {
+		err = len;
+		goto out;
+	}
+
+	for (name = list; name < list + len; name += strlen(name) + 1) {
+		size = vfs_getxattr(src, name, value, XATTR_SIZE_MAX);
+		if (size < 0)
+			continue;
+		err = vfs_setxattr(dst, name, value, size, 0);
+		if (err && !strcmp(name, BKPFS_XATTR_META))
+			break;
+		err = 0;
+	}
+out:
+	kvfree(value);
+	kfree(list);
+	return err;
+}
+
+/*
+ * bkpfs_file_crc - crc32c of the first @len bytes of a lower file
+ * @file : lower file, opened for reading
+ * @len  : number of bytes to checksum
+ * @crc  : out: the checksum
+ *
+ * Returns 0 on success, -EIO if the file is shorter than @len, else the
+ * corresponding error code.
+ */
+int bkpfs_file_crc(struct file *file, loff_t len, u32 *crc)
+{
+	loff_t pos = 0;
+	ssize_t ret;
+	void *buf;
+	int err = 0;
+
+	buf = kmalloc(PAGE_SIZE * 16, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	*crc = ~0;
+	while (pos < len) {
+		ret = kernel_read(file, buf,
+				  min_t(loff_t, len - pos, PAGE_SIZE * 16), &pos);
+		if (ret <= 0) {
+			err = ret < 0 ? ret : -EIO;
+			break;
+		}
+		*crc = crc32c(*crc, buf, ret);
+	}
+	kfree(buf);
+	return err;
+}
+
+/*
+ * bkpfs_file_cmp - compare the first @len bytes of two lower files
+ * @a   : lower file, opened for reading
+ * @b   : lower file, opened for reading
+ * @len : number of bytes to compare
+ *
+ * Returns 0 if they are the same, 1 if they differ, -EIO if either is
+ * shorter than @len, else the corresponding error code.
+ */
+int bkpfs_file_cmp(struct file *a, struct file *b, loff_t len)
+{
+	loff_t apos = 0, bpos = 0;
+	void *abuf, *bbuf;
+	ssize_t ret;
+	size_t n;
+	int err = 0;
+
+	abuf = kmalloc(PAGE_SIZE * 16, GFP_KERNEL);
+	bbuf = kmalloc(PAGE_SIZE * 16, GFP_KERNEL);
+	if (!abuf || !bbuf) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	while (apos < len) {
+		n = min_t(loff_t, len - apos, PAGE_SIZE * 16);
+		ret = kernel_read(a, abuf, n, &apos);
+		if (ret == n)
+			ret = kernel_read(b, bbuf, n, &bpos);
+		if (ret != n) {
+			err = ret < 0 ? ret : -EIO;
+			break;
+		}
+		if (memcmp(abuf, bbuf, n)) {
+			err = 1;
+			break;
+		}
+	}
+out:
+	kfree(bbuf);
+	kfree(abuf);
+	return err;
+}
@@ -28,6 +28,11 @@ static int bkpfs_d_revalidate(struct dentry *dentry, unsigned int flags)
 
 	bkpfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
+	/* renamed over, e.g. by RESTORE_INPLACE: look the name up again */
+	if (d_unhashed(lower_dentry)) {
+		err = 0;
+		goto out;
+	}
 	if (!(lower_dentry->d_flags & DCACHE_OP_REVALIDATE))
 		goto out;
 	err = lower_dentry->d_op->d_revalidate(lower_dentry, flags);
@@ -0,0 +1,598 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "bkpfs.h"
+#include <linux/fiemap.h>
+#include <linux/sched/signal.h>
+#include <linux/xxhash.h>
+
+/*
+ * Which byte ranges differ between two versions, or a version and the
+ * live file (DIFF_VERSIONS).
+ *
+ * Both sides are compared a 64 KB block at a time.  A block is known to
+ * be equal without reading it when FIEMAP maps it to the same physical
+ * extent on both sides, as after backup_mode cloned it, or to a hole on
+ * both.  FIEMAP only applies to what holds the contents as they are: the
+ * live file and raw versions.  FIEMAP of the live file is only trusted
+ * if no write came through bkpfs between the map and the comparison of
+ * the window: write_seq is read around each window, and a window with
+ * a write in it is compared again without FIEMAP.  Any other block is
+ * read on both sides and compared byte for byte.
+ *
+ * With blocksums=on, each version gets a ".F.N.sum" next to it, made
+ * along with it: a header, then the xxh64 of each block of the file.
+ * The sums of a version are then read from it instead of from the
+ * version, which delta, compressed and dedup versions would have to be
+ * rebuilt for; the block of the other side is then hashed, and a
+ * collision, one in 2^64 per block, reports a changed block as equal.
+ * The header names the inode of the version file, so sums left by a
+ * version that was replaced since are not used.
+ *
+ * Adjacent differing blocks are reported as one extent.  The walk stops
+ * where the caller runs out of room and returns the offset to resume
+ * from.
+ */
+
+#define BKPFS_SUM_SUFFIX	"sum"
+#define BKPFS_SUM_MAGIC		0x32757362	/* "bsu2": xxh64 */
+#define BKPFS_SUM_SHIFT		16
+#define BKPFS_SUM_BLOCK		(1 << BKPFS_SUM_SHIFT)
+#define BKPFS_DIFF_WINDOW	256		/* blocks per FIEMAP call */
+#define BKPFS_DIFF_EXTENTS	64		/* extents per FIEMAP call */
+
+/* FIEMAP does not say where the data of such extents is */
+#define BKPFS_DIFF_OPAQUE	(FIEMAP_EXTENT_UNKNOWN |		\
+				 FIEMAP_EXTENT_DELALLOC |		\
+				 FIEMAP_EXTENT_ENCODED |		\
+				 FIEMAP_EXTENT_DATA_INLINE |		\
+				 FIEMAP_EXTENT_DATA_TAIL |		\
+				 FIEMAP_EXTENT_NOT_ALIGNED)
+
+/* first bytes of a ".F.N.sum", followed by a __le64 xxh64 per block */
+struct bkpfs_sum_hdr {
+	__le32 magic;			/* BKPFS_SUM_MAGIC */
+	__le32 block;			/* BKPFS_SUM_BLOCK */
+	__le64 size;			/* of the file the sums are of */
+	__le64 ino;			/* of the version file */
+	__le32 gen;
+	__le32 pad;
+};
+
+/* one side of a diff */
+struct bkpfs_diff_side {
+	struct file *file;		/* the contents, NULL if sums has all */
+	struct file *sums;		/* usable ".F.N.sum", or NULL */
+	bool mapped;			/* file is a version or the live file */
+	atomic64_t *write_seq;		/* live file only, see diff_window() */
+	loff_t size;
+	/* FIEMAP of the current window */
+	struct fiemap_extent ext[BKPFS_DIFF_EXTENTS];
+	unsigned int nr;
+	loff_t known;			/* ext is complete below this */
+	/* hashes read from sums */
+	__le64 hash[BKPFS_DIFF_WINDOW];
+	loff_t hash_first;		/* block of hash[0], -1 if none */
+};
+
+static int bkpfs_sum_name(struct dentry *dentry, int version, char *name)
+{
+	if (snprintf(name, NAME_MAX + 1, ".%s.%d." BKPFS_SUM_SUFFIX,
+		     bkpfs_version_stem(BKPFS_SB(dentry->d_sb),
+					dentry->d_name.name),
+		     version) > NAME_MAX)
+		return -ENAMETOOLONG;
+	return 0;
+}
+
+/* read the block of @file at @pos, of a file of @size bytes, into @buf */
+static int bkpfs_block_read(struct file *file, loff_t pos, loff_t size,
+			    void *buf)
+{
+	loff_t end = min_t(loff_t, pos + BKPFS_SUM_BLOCK, size);
+	size_t done = 0;
+	ssize_t ret;
+
+	while (pos < end) {
+		ret = kernel_read(file, buf + done, end - pos, &pos);
+		if (ret <= 0)
+			return ret < 0 ? ret : -EIO;
+		done += ret;
+	}
+	return 0;
+}
+
+/* xxh64 of the block of @file at @pos, of a file of @size bytes */
+static int bkpfs_block_hash(struct file *file, loff_t pos, loff_t size,
+			    void *buf, u64 *hash)
+{
+	loff_t len = clamp_t(loff_t, size - pos, 0, BKPFS_SUM_BLOCK);
+	int err;
+
+	err = bkpfs_block_read(file, pos, size, buf);
+	if (!err)
+		*hash = xxh64(buf, len, 0);
+	return err;
+}
+
+/*
+ * bkpfs_sum_write - record the block hashes of a new version
+ * @dentry  : upper dentry of the file
+ * @bkp_dir : its lower backup directory
+ * @version : the version
+ * @src     : the contents the version holds
+ * @vfile   : the version file
+ *
+ * The header is written last, so sums cut short by an error or a crash
+ * are never used.  Returns 0 on success, else the corresponding error
+ * code.
+ */
+int bkpfs_sum_write(struct dentry *dentry, struct dentry *bkp_dir,
+		    int version, struct file *src, struct file *vfile)
+{
+	char name[NAME_MAX + 1];
+	struct bkpfs_sum_hdr hdr;
+	struct file *sums;
+	loff_t size = i_size_read(file_inode(src));
+	loff_t pos = 0, out = sizeof(hdr);
+	__le64 *hashes;
+	void *buf;
+	ssize_t ret;
+	u64 hash;
+	int n, err;
+
+	err = bkpfs_sum_name(dentry, version, name);
+	if (err)
+		return err;
+	sums = bkpfs_open_bkp_file(dentry, bkp_dir, name, O_WRONLY);
+	if (IS_ERR(sums))
+		return PTR_ERR(sums);
+	buf = kvmalloc(BKPFS_SUM_BLOCK, GFP_KERNEL);
+	hashes = kmalloc_array(BKPFS_DIFF_WINDOW, sizeof(*hashes), GFP_KERNEL);
+	if (!buf || !hashes) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	while (pos < size) {
+		for (n = 0; n < BKPFS_DIFF_WINDOW && pos < size; n++) {
+			err = bkpfs_block_hash(src, pos, size, buf, &hash);
+			if (err)
+				goto out;
+			hashes[n] = cpu_to_le64(hash);
+			pos += BKPFS_SUM_BLOCK;
+		}
+		ret = kernel_write(sums, hashes, n * sizeof(*hashes), &out);
+		if (ret != n * sizeof(*hashes)) {
+			err = ret < 0 ? ret : -EIO;
+			goto out;
+		}
+		cond_resched();
+	}
+
+	hdr.magic = cpu_to_le32(BKPFS_SUM_MAGIC);
+	hdr.block = cpu_to_le32(BKPFS_SUM_BLOCK);
+	hdr.size = cpu_to_le64(size);
+	hdr.ino = cpu_to_le64(file_inode(vfile)->i_ino);
+	hdr.gen = cpu_to_le32(file_inode(vfile)->i_generation);
+	hdr.pad = 0;
+	pos = 0;
+	ret = kernel_write(sums, &hdr, sizeof(hdr), &pos);
+	if (ret != sizeof(hdr))
+		err = ret < 0 ? ret : -EIO;
+out:
+	if (err)
+		printk(KERN_ERR "bkpfs: no block sums for %s: %d\n",
+		       name, err);
+	kfree(hashes);
+	kvfree(buf);
+	fput(sums);
+	return err;
+}
+
+/* unlink the sums of a version that is gone */
+void bkpfs_sum_unlink(struct dentry *dentry, struct dentry *bkp_dir,
+		      int version)
+{
+	char name[NAME_MAX + 1];
+	struct dentry *sums;
+
+	if (bkpfs_sum_name(dentry, version, name))
+		return;
+	inode_lock_nested(d_inode(bkp_dir), I_MUTEX_PARENT);
+	sums = lookup_one_len(name, bkp_dir, strlen(name));
+	if (!IS_ERR(sums)) {
+		if (d_is_positive(sums))
+			vfs_unlink(d_inode(bkp_dir), sums, NULL);
+		dput(sums);
+	}
+	inode_unlock(d_inode(bkp_dir));
+}
+
+/* the sums of version @vfile if they are its own, their size in @size */
+static struct file *bkpfs_sum_open(struct dentry *dentry,
+				   struct dentry *bkp_dir, int version,
+				   struct file *vfile, loff_t *size)
+{
+	char name[NAME_MAX + 1];
+	struct bkpfs_sum_hdr hdr;
+	struct file *sums;
+	loff_t pos = 0, blocks;
+
+	if (bkpfs_sum_name(dentry, version, name))
+		return NULL;
+	sums = bkpfs_open_bkp_file(dentry, bkp_dir, name, O_RDONLY);
+	if (IS_ERR(sums))
+		return NULL;
+	if (kernel_read(sums, &hdr, sizeof(hdr), &pos) != sizeof(hdr) ||
+	    le32_to_cpu(hdr.magic) != BKPFS_SUM_MAGIC ||
+	    le32_to_cpu(hdr.block) != BKPFS_SUM_BLOCK ||
+	    le64_to_cpu(hdr.ino) != file_inode(vfile)->i_ino ||
+	    le32_to_cpu(hdr.gen) != file_inode(vfile)->i_generation ||
+	    le64_to_cpu(hdr.size) > LLONG_MAX)
+		goto stale;
+	*size = le64_to_cpu(hdr.size);
+	blocks = DIV_ROUND_UP(*size, BKPFS_SUM_BLOCK);
+	if (i_size_read(file_inode(sums)) < sizeof(hdr) + blocks * sizeof(u64))
+		goto stale;
+	return sums;
+stale:
+	fput(sums);
+	return NULL;
+}
+
+/* set up @s for version @version of @file, 0 for the file itself */
+static int bkpfs_diff_open(struct file *file, struct dentry *bkp_dir,
+			   int version, int newest, struct bkpfs_diff_side *s)
+{
+	struct dentry *dentry = file->f_path.dentry;
+	struct file *vfile;
+
+	s->hash_first = -1;
+	if (!version) {
+		/* our own file: the position of the caller is not moved */
+		vfile = dentry_open(&bkpfs_lower_file(file)->f_path, O_RDONLY,
+				    current_cred());
+		if (IS_ERR(vfile))
+			return PTR_ERR(vfile);
+		s->file = vfile;
+		s->mapped = true;
+		s->write_seq = &BKPFS_I(d_inode(dentry))->write_seq;
+		s->size = i_size_read(file_inode(vfile));
+		return 0;
+	}
+
+	vfile = bkpfs_open_version(dentry, bkp_dir, version, O_RDONLY);
+	if (IS_ERR(vfile))
+		return PTR_ERR(vfile);
+	s->sums = bkpfs_sum_open(dentry, bkp_dir, version, vfile, &s->size);
+	if (bkpfs_version_encoding(vfile->f_path.dentry) == BKPFS_ENC_RAW) {
+		s->file = vfile;
+		s->mapped = true;
+		s->size = i_size_read(file_inode(vfile));
+		return 0;
+	}
+	fput(vfile);
+	if (s->sums)
+		return 0;
+	s->file = bkpfs_view_rebuilt(file, bkp_dir, version, newest);
+	if (IS_ERR(s->file)) {
+		int err = PTR_ERR(s->file);
+
+		s->file = NULL;
+		return err;
+	}
+	s->size = i_size_read(file_inode(s->file));
+	return 0;
+}
+
+static void bkpfs_diff_close(struct bkpfs_diff_side *s)
+{
+	if (s->file)
+		fput(s->file);
+	if (s->sums)
+		fput(s->sums);
+}
+
+/* FIEMAP of [start, end) of the file of @s, as much as fits in s->ext */
+static void bkpfs_diff_map(struct bkpfs_diff_side *s, loff_t start,
+			   loff_t end)
+{
+	struct inode *inode;
+	struct fiemap_extent_info fieinfo = {
+		.fi_extents_max = BKPFS_DIFF_EXTENTS,
+		.fi_extents_start = (struct fiemap_extent __user *)s->ext,
+	};
+	struct fiemap_extent *last;
+	mm_segment_t old_fs;
+	int err;
+
+	s->nr = 0;
+	s->known = start;
+	if (!s->mapped)
+		return;
+	inode = file_inode(s->file);
+	if (!inode->i_op->fiemap)
+		return;
+	/* dirty pages are not where FIEMAP says the data is yet */
+	if (filemap_write_and_wait_range(inode->i_mapping, start, end - 1))
+		return;
+
+	/* fiemap_fill_next_extent copies the extents "to user" */
+	old_fs = get_fs();
+	set_fs(KERNEL_DS);
+	err = inode->i_op->fiemap(inode, &fieinfo, start, end - start);
+	set_fs(old_fs);
+	if (err)
+		return;
+
+	s->nr = fieinfo.fi_extents_mapped;
+	s->known = end;
+	if (s->nr == BKPFS_DIFF_EXTENTS) {
+		/* the window may go on past the extents that fit */
+		last = &s->ext[s->nr - 1];
+		if (!(last->fe_flags & FIEMAP_EXTENT_LAST))
+			s->known = last->fe_logical + last->fe_length;
+	}
+}
+
+/*
+ * where the block at @pos of @s is: 0 in a hole ending at *@end, 1 at
+ * physical address *@phys in an extent ending at *@end, -1 if unknown
+ */
+static int bkpfs_diff_where(struct bkpfs_diff_side *s, loff_t pos,
+			    u64 *phys, loff_t *end)
+{
+	struct fiemap_extent *e;
+	loff_t hole_end = s->known;
+	unsigned int i;
+
+	if (pos >= s->known)
+		return -1;
+	for (i = 0; i < s->nr; i++) {
+		e = &s->ext[i];
+		if (e->fe_logical > pos) {
+			hole_end = min_t(loff_t, hole_end, e->fe_logical);
+			break;
+		}
+		if (pos >= e->fe_logical + e->fe_length)
+			continue;
+		if (e->fe_flags & BKPFS_DIFF_OPAQUE)
+			return -1;
+		*phys = e->fe_physical + (pos - e->fe_logical);
+		*end = e->fe_logical + e->fe_length;
+		return 1;
+	}
+	*end = hole_end;
+	return 0;
+}
+
+/* xxh64 of the block at @blk of @s, from its sums if it has them */
+static int bkpfs_diff_hash(struct bkpfs_diff_side *s, loff_t blk, void *buf,
+			   u64 *hash)
+{
+	loff_t first, pos;
+	ssize_t ret;
+
+	if (!s->sums)
+		return bkpfs_block_hash(s->file, blk << BKPFS_SUM_SHIFT,
+					s->size, buf, hash);
+
+	first = blk - blk % BKPFS_DIFF_WINDOW;
+	if (s->hash_first != first) {
+		pos = sizeof(struct bkpfs_sum_hdr) + first * sizeof(__le64);
+		ret = kernel_read(s->sums, s->hash, sizeof(s->hash), &pos);
+		if (ret < 0)
+			return ret;
+		if ((blk - first + 1) * sizeof(__le64) > ret)
+			return -EIO;
+		s->hash_first = first;
+	}
+	*hash = le64_to_cpu(s->hash[blk - first]);
+	return 0;
+}
+
+/*
+ * are the blocks at @blk of @a and @b the same; @buf holds two blocks
+ *
+ * When both sides have their contents, both blocks are read and
+ * compared; hashes are only for a side that has nothing but its sums.
+ */
+static int bkpfs_diff_block(struct bkpfs_diff_side *a,
+			    struct bkpfs_diff_side *b, loff_t blk,
+			    void *buf, u64 *shared)
+{
+	loff_t pos = blk << BKPFS_SUM_SHIFT;
+	loff_t len, end_a, end_b;
+	u64 phys_a = 0, phys_b = 0;
+	u64 hash_a, hash_b;
+	int where;
+	int err;
+
+	len = clamp_t(loff_t, a->size - pos, 0, BKPFS_SUM_BLOCK);
+	if (len != clamp_t(loff_t, b->size - pos, 0, BKPFS_SUM_BLOCK))
+		return 0;
+
+	where = bkpfs_diff_where(a, pos, &phys_a, &end_a);
+	if (where >= 0 &&
+	    where == bkpfs_diff_where(b, pos, &phys_b, &end_b) &&
+	    phys_a == phys_b && end_a >= pos + len && end_b >= pos + len) {
+		*shared += len;
+		return 1;
+	}
+
+	if (a->file && b->file) {
+		err = bkpfs_block_read(a->file, pos, a->size, buf);
+		if (!err)
+			err = bkpfs_block_read(b->file, pos, b->size,
+					       buf + BKPFS_SUM_BLOCK);
+		if (err)
+			return err;
+		return !memcmp(buf, buf + BKPFS_SUM_BLOCK, len);
+	}
+
+	err = bkpfs_diff_hash(a, blk, buf, &hash_a);
+	if (!err)
+		err = bkpfs_diff_hash(b, blk, buf, &hash_b);
+	if (err)
+		return err;
+	return hash_a == hash_b;
+}
+
+/*
+ * compare the blocks of [@blk, @end) of @a and @b into @same
+ *
+ * The live file may be written while FIEMAP is read and the blocks are
+ * compared.  Writes bump its write_seq, so if it moved the mapping may
+ * be stale and the window is compared again from the contents only.
+ */
+static int bkpfs_diff_window(struct bkpfs_diff_side *a,
+			     struct bkpfs_diff_side *b, loff_t blk,
+			     loff_t end, void *buf, u8 *same, u64 *shared)
+{
+	atomic64_t *write_seq = a->write_seq ? a->write_seq : b->write_seq;
+	loff_t start = blk << BKPFS_SUM_SHIFT;
+	s64 seq = 0;
+	u64 found;
+	loff_t i;
+	int ret;
+
+	if (write_seq)
+		seq = atomic64_read(write_seq);
+	bkpfs_diff_map(a, start, end);
+	bkpfs_diff_map(b, start, end);
+again:
+	found = 0;
+	for (i = blk; i << BKPFS_SUM_SHIFT < end; i++) {
+		ret = bkpfs_diff_block(a, b, i, buf, &found);
+		if (ret < 0)
+			return ret;
+		same[i - blk] = ret;
+	}
+	if (write_seq) {
+		smp_rmb();
+		if (atomic64_read(write_seq) != seq) {
+			/* nothing is known from FIEMAP any more */
+			a->nr = b->nr = 0;
+			a->known = b->known = start;
+			write_seq = NULL;
+			goto again;
+		}
+	}
+	*shared += found;
+	return 0;
+}
+
+/*
+ * bkpfs_diff - report the extents that differ between two versions
+ * @file   : the file
+ * @from   : a version, may be -1 or -2
+ * @to     : another one, or 0 for the file itself
+ * @pos    : in: where to start; out: where the next call should start
+ * @eof    : out: every extent was passed to @fn
+ * @shared : out: bytes found equal by FIEMAP alone
+ * @fn     : called for each differing extent, in file order
+ * @arg    : passed to @fn
+ *
+ * Extents are aligned to BKPFS_SUM_BLOCK, but for the last one, which
+ * ends at the end of the larger side.  Returns 0 on success, else the
+ * corresponding error code.
+ */
+int bkpfs_diff(struct file *file, int from, int to, loff_t *pos,
+	       bool *eof, u64 *shared, bkpfs_diff_fn fn, void *arg)
+{
+	struct dentry *dentry = file->f_path.dentry;
+	struct bkpfs_diff_side *sides;
+	struct dentry *bkp_dir;
+	loff_t size, blk, first, wend, start = -1;
+	int min_ver, max_ver;
+	u8 *same;
+	void *buf;
+	int err = 0;
+
+	*eof = false;
+	*shared = 0;
+	bkpfs_get_versions(dentry, &min_ver, &max_ver);
+	if (from == -2)
+		from = min_ver;
+	else if (from == -1)
+		from = max_ver - 1;
+	if (to == -2)
+		to = min_ver;
+	else if (to == -1)
+		to = max_ver - 1;
+	if (from < min_ver || from >= max_ver ||
+	    (to && (to < min_ver || to >= max_ver)))
+		return -EINVAL;
+
+	sides = kcalloc(2, sizeof(*sides), GFP_KERNEL);
+	buf = kvmalloc(2 * BKPFS_SUM_BLOCK, GFP_KERNEL);
+	same = kmalloc(BKPFS_DIFF_WINDOW, GFP_KERNEL);
+	if (!sides || !buf || !same) {
+		err = -ENOMEM;
+		goto out_free;
+	}
+	bkp_dir = bkpfs_bkp_dir(dentry);
+	if (IS_ERR(bkp_dir)) {
+		err = PTR_ERR(bkp_dir);
+		goto out_free;
+	}
+	err = bkpfs_diff_open(file, bkp_dir, from, max_ver, &sides[0]);
+	if (!err)
+		err = bkpfs_diff_open(file, bkp_dir, to, max_ver, &sides[1]);
+	dput(bkp_dir);
+	if (err)
+		goto out;
+
+	size = max(sides[0].size, sides[1].size);
+	blk = *pos >> BKPFS_SUM_SHIFT;
+	while (blk << BKPFS_SUM_SHIFT < size) {
+		wend = min(size, (blk + BKPFS_DIFF_WINDOW) << BKPFS_SUM_SHIFT);
+		err = bkpfs_diff_window(&sides[0], &sides[1], blk, wend, buf,
+					same, shared);
+		if (err)
+			goto out;
+		for (first = blk; blk << BKPFS_SUM_SHIFT < wend; blk++) {
+			if (!same[blk - first]) {
+				if (start < 0)
+					start = blk << BKPFS_SUM_SHIFT;
+				continue;
+			}
+			if (start >= 0) {
+				if (fn(arg, start,
+				       (blk << BKPFS_SUM_SHIFT) - start)) {
+					*pos = start;
+					goto out;
+				}
+				start = -1;
+			}
+		}
+		if (fatal_signal_pending(current)) {
+			err = -EINTR;
+			goto out;
+		}
+		cond_resched();
+	}
+	if (start >= 0 && fn(arg, start, size - start)) {
+		*pos = start;
+		goto out;
+	}
+	*pos = size;
+	*eof = true;
+out:
+	bkpfs_diff_close(&sides[0]);
+	bkpfs_diff_close(&sides[1]);
+out_free:
+	kfree(same);
+	kvfree(buf);
+	kfree(sides);
+	return err;
+}
@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "bkpfs.h"
+
+/*
+ * A set of byte ranges of a file, kept in an rbtree ordered by start.
+ * Ranges that overlap or touch are merged on insertion, so the extents
+ * in the tree are always disjoint and sorted by both start and end.
+ */
+
+void bkpfs_extents_init(struct bkpfs_extent_tree *tree)
+{
+	tree->root = RB_ROOT;
+	tree->nr = 0;
+	tree->bytes = 0;
+}
+
+void bkpfs_extents_clear(struct bkpfs_extent_tree *tree)
+{
+	struct bkpfs_extent *ext, *next;
+
+	rbtree_postorder_for_each_entry_safe(ext, next, &tree->root, node)
+		kfree(ext);
+	bkpfs_extents_init(tree);
+}
+
+/* first extent ending after @pos (or at @pos, if @touch) */
+static struct bkpfs_extent *
+bkpfs_extents_search(struct bkpfs_extent_tree *tree, loff_t pos, bool touch)
+{
+	struct rb_node *n = tree->root.rb_node;
+	struct bkpfs_extent *ext, *found = NULL;
+
+	while (n) {
+		ext = rb_entry(n, struct bkpfs_extent, node);
+		if (ext->end > pos || (touch && ext->end == pos)) {
+			found = ext;
+			n = n->rb_left;
+		} else {
+			n = n->rb_right;
+		}
+	}
+	return found;
+}
+
+struct bkpfs_extent *bkpfs_extent_first(struct bkpfs_extent_tree *tree)
+{
+	struct rb_node *n = rb_first(&tree->root);
+
+	return n ? rb_entry(n, struct bkpfs_extent, node) : NULL;
+}
+
+struct bkpfs_extent *bkpfs_extent_next(struct bkpfs_extent *ext)
+{
+	struct rb_node *n = rb_next(&ext->node);
+
+	return n ? rb_entry(n, struct bkpfs_extent, node) : NULL;
+}
+
+/*
+ * bkpfs_extents_add - add [@start, @end) to the set
+ *
+ * Returns 0 on success, -ENOMEM if a new node could not be allocated
+ * (the set is unchanged then).
+ */
+int bkpfs_extents_add(struct bkpfs_extent_tree *tree, loff_t start,
+		      loff_t end)
+{
+	struct bkpfs_extent *ext, *next, *new;
+	struct rb_node **link, *parent = NULL;
+
+	if (start >= end)
+		return 0;
+
+	new = kmalloc(sizeof(*new), GFP_NOFS);
+	if (!new)
+		return -ENOMEM;
+
+	/* swallow every extent overlapping or touching the new one */
+	ext = bkpfs_extents_search(tree, start, true);
+	while (ext && ext->start <= end) {
+		start = min(start, ext->start);
+		end = max(end, ext->end);
+		next = bkpfs_extent_next(ext);
+		rb_erase(&ext->node, &tree->root);
+		tree->nr--;
+		tree->bytes -= ext->end - ext->start;
+		kfree(ext);
+		ext = next;
+	}
+
+	new->start = start;
+	new->end = end;
+	link = &tree->root.rb_node;
+	while (*link) {
+		parent = *link;
+		ext = rb_entry(parent, struct bkpfs_extent, node);
+		if (start < ext->start)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+	rb_link_node(&new->node, parent, link);
+	rb_insert_color(&new->node, &tree->root);
+	tree->nr++;
+	tree->bytes += end - start;
+	return 0;
+}
+
+/*
+ * bkpfs_extents_gap - find the next range not in the set
+ * @tree : the set
+ * @pos  : in: where to start looking, out: start of the gap
+ * @end  : do not look past this offset
+ *
+ * Returns the end of the gap starting at *@pos.  The gap is empty
+ * (*@pos == return value) when [*@pos, @end) is entirely in the set.
+ */
+loff_t bkpfs_extents_gap(struct bkpfs_extent_tree *tree, loff_t *pos,
+			 loff_t end)
+{
+	struct bkpfs_extent *ext;
+
+	ext = bkpfs_extents_search(tree, *pos, false);
+	if (ext && ext->start <= *pos) {
+		*pos = ext->end;
+		ext = bkpfs_extent_next(ext);
+	}
+	if (*pos >= end) {
+		*pos = end;
+		return end;
+	}
+	if (ext && ext->start < end)
+		return ext->start;
+	return end;
+}
+
+/*
+ * bkpfs_extent_log_finish - write the table and the footer of a log
+ * @log   : version file, opened for writing
+ * @pos   : end of the data pieces
+ * @table : one entry per data piece, already little endian
+ * @nr    : number of entries
+ * @size  : file size once the log is applied
+ * @base  : version a delta applies to, 0 for other logs
+ *
+ * Returns 0 on success, else the corresponding error code.
+ */
+int bkpfs_extent_log_finish(struct file *log, loff_t pos,
+			    struct bkpfs_log_extent *table, unsigned int nr,
+			    loff_t size, int base)
+{
+	struct bkpfs_log_footer footer;
+	ssize_t ret;
+
+	if (nr) {
+		ret = kernel_write(log, table, nr * sizeof(*table), &pos);
+		if (ret != nr * sizeof(*table))
+			return ret < 0 ? ret : -EIO;
+	}
+
+	footer.magic = cpu_to_le64(BKPFS_LOG_MAGIC);
+	footer.size = cpu_to_le64(size);
+	footer.nr = cpu_to_le32(nr);
+	footer.base = cpu_to_le32(base);
+	ret = kernel_write(log, &footer, sizeof(footer), &pos);
+	if (ret != sizeof(footer))
+		return ret < 0 ? ret : -EIO;
+	return 0;
+}
+
+/*
+ * bkpfs_extent_log_apply - write the pieces of a log into a file
+ * @log  : version file holding the log, opened for reading
+ * @dst  : lower file to patch, opened for writing
+ * @base : if not NULL, set to the base version from the footer
+ * @prog : progress counter to advance, or NULL
+ *
+ * Returns 0 on success, -EIO if @log is not a valid extent log, else
+ * the corresponding error code.
+ */
+int bkpfs_extent_log_apply(struct file *log, struct file *dst, int *base,
+			   struct bkpfs_progress *prog)
+{
+	struct bkpfs_log_footer footer;
+	struct bkpfs_log_extent *table;
+	loff_t pos, data = 0, len;
+	unsigned int i, nr;
+	ssize_t ret;
+	int err = 0;
+
+	pos = i_size_read(file_inode(log)) - sizeof(footer);
+	if (pos < 0)
+		return -EIO;
+	ret = kernel_read(log, &footer, sizeof(footer), &pos);
+	if (ret != sizeof(footer) ||
+	    le64_to_cpu(footer.magic) != BKPFS_LOG_MAGIC)
+		return -EIO;
+
+	nr = le32_to_cpu(footer.nr);
+	pos = i_size_read(file_inode(log)) - sizeof(footer) -
+		(loff_t)nr * sizeof(*table);
+	if (pos < 0)
+		return -EIO;
+	table = kvmalloc_array(nr ? nr : 1, sizeof(*table), GFP_KERNEL);
+	if (!table)
+		return -ENOMEM;
+	ret = kernel_read(log, table, nr * sizeof(*table), &pos);
+	if (ret != nr * sizeof(*table)) {
+		err = -EIO;
+		goto out;
+	}
+
+	for (i = 0; i < nr; i++) {
+		len = le64_to_cpu(table[i].len);
+		err = bkpfs_copy_range(log, data, dst,
+				       le64_to_cpu(table[i].off), len);
+		if (err)
+			goto out;
+		data += len;
+		if (prog)
+			atomic64_add(len, &prog->done);
+	}
+	err = bkpfs_truncate_file(dst, le64_to_cpu(footer.size));
+	if (!err && base)
+		*base = le32_to_cpu(footer.base);
+out:
+	kvfree(table);
+	return err;
+}
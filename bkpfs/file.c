@@ -21,7 +21,153 @@ typedef struct {
 #define VIEW_VERSION            _IOWR('q', 3, int)
 #define RESTORE_VERSION         _IOW('q', 4, int)
 
-int new_ver_toggle = 0;
+typedef struct {
+    unsigned long long logical_bytes, stored_bytes, chunks;
+    unsigned long long views, view_bytes;   /* rebuilt copies cached */
+} stats_arg_t;
+
+#define STORE_STATS             _IOR('q', 5, stats_arg_t)
+
+typedef struct {
+    int version;
+    int encoding;
+    unsigned long long size, stored, cpu_ns;
+} version_info_t;
+
+#define VERSION_INFO            _IOWR('q', 6, version_info_t)
+
+typedef struct {
+    unsigned long long done, total;
+} progress_arg_t;
+
+#define BACKUP_PROGRESS         _IOR('q', 7, progress_arg_t)
+
+typedef struct {
+    int state;
+    unsigned long long dirs, files, versioned, fixed, records, errors;
+    unsigned long long msecs;
+} scan_arg_t;
+
+#define SCAN_PROGRESS           _IOR('q', 8, scan_arg_t)
+
+typedef struct {
+    long long time;                     /* seconds since the epoch */
+    int version;                        /* out */
+    unsigned long long ctime_ns;        /* out: when it was made */
+} time_arg_t;
+
+#define VERSION_AT              _IOWR('q', 9, time_arg_t)
+
+/* one version, as LIST_RECORDS returns it */
+typedef struct {
+    int version;
+    int encoding;
+    unsigned int flags;                 /* VREC_* */
+    unsigned int crc;                   /* crc32c, if VREC_CRC */
+    unsigned long long ctime_ns;        /* when it was made */
+    unsigned long long size;            /* of the file, 0 if unknown */
+    unsigned long long stored;          /* of the version file */
+} version_rec_t;
+
+#define VREC_LIVE               0x1     /* the version file exists */
+#define VREC_CRC                0x2
+
+#define LIST_ABI                1
+
+typedef struct {
+    unsigned int abi;                   /* LIST_ABI */
+    unsigned int rec_size;              /* in: caller's sizeof(version_rec_t),
+                                           out: bytes filled per record */
+    int start;                          /* first version, 0: the oldest */
+    int next;                           /* out: start of the next call,
+                                           0 once the newest was returned */
+    unsigned int count;                 /* in: records buf holds,
+                                           out: records filled */
+    int min_ver, max_ver;               /* out: the version range */
+    unsigned long long buf;             /* version_rec_t[count] */
+} list_arg_t;
+
+#define LIST_RECORDS            _IOWR('q', 10, list_arg_t)
+
+/* one child of a directory, as DIR_SUMMARY returns it */
+typedef struct {
+    unsigned short reclen;              /* to the next one, 8-byte aligned */
+    unsigned short namelen;
+    int versions;                       /* 0 if not versioned */
+    unsigned long long ino;
+    unsigned long long newest_ns;       /* when the newest version was made */
+    unsigned long long bytes;           /* stored by all its versions */
+    char name[];                        /* NUL-terminated */
+} dirsum_ent_t;
+
+#define DIRSUM_ABI              1
+
+typedef struct {
+    unsigned int abi;                   /* DIRSUM_ABI */
+    unsigned int eof;                   /* out: 1 once the last child was
+                                           returned */
+    unsigned long long cookie;          /* 0, or out of the previous call */
+    unsigned int size;                  /* in: bytes at buf,
+                                           out: bytes filled */
+    unsigned int count;                 /* out: children filled */
+    unsigned long long buf;             /* dirsum_ent_t records */
+} dirsum_arg_t;
+
+#define DIR_SUMMARY             _IOWR('q', 11, dirsum_arg_t)
+
+/* returns a read-only descriptor of the version */
+#define OPEN_VERSION            _IOW('q', 12, int)
+
+/* restores a version over the file itself, see restore.c */
+#define RESTORE_INPLACE         _IOW('q', 13, int)
+
+typedef struct {
+    int version;
+    unsigned long long src_offset;      /* in the version */
+    unsigned long long dst_offset;      /* in the file */
+    unsigned long long length;
+    unsigned long long copied;          /* out: stops at the end of the
+                                           version */
+} range_arg_t;
+
+#define RESTORE_RANGE           _IOWR('q', 14, range_arg_t)
+
+/* one extent that differs, as DIFF_VERSIONS returns it */
+typedef struct {
+    unsigned long long offset;
+    unsigned long long length;
+} diff_ext_t;
+
+#define DIFF_LIVE               0       /* diff_arg_t.to: the file itself */
+
+typedef struct {
+    int from;                           /* versions, -1 and -2 allowed */
+    int to;
+    unsigned long long start;           /* offset to start from, 0 first */
+    unsigned long long next;            /* out: start of the next call */
+    unsigned int count;                 /* in: extents buf holds,
+                                           out: extents filled */
+    unsigned int eof;                   /* out: 1 once the last extent
+                                           was returned */
+    unsigned long long shared;          /* out: bytes known equal from
+                                           the extent maps alone */
+    unsigned long long buf;             /* diff_ext_t[count] */
+} diff_arg_t;
+
+#define DIFF_VERSIONS           _IOWR('q', 15, diff_arg_t)
+
+typedef struct {
+    int version;
+    int fd;                             /* written at its file position */
+    unsigned long long sent;            /* out: bytes written */
+} send_arg_t;
+
+#define SEND_VERSION            _IOWR('q', 16, send_arg_t)
+
+/* scan_arg_t.state */
+#define SCAN_NONE               0
+#define SCAN_RUNNING            1
+#define SCAN_DONE               2
 
 static ssize_t bkpfs_read(struct file *file, char __user *buf,
 			   size_t count, loff_t *ppos)
@@ -44,6 +190,7 @@ static ssize_t bkpfs_read(struct file *file, char __user *buf,
 
 /*
  * bkpfs_unlink_backup - unlink a bkpfs filesystem object
+ * @dentry  : upper dentry of the file the version belongs to
  * @parent  : parent directory
  * @name    : victim
  * @version : version to be unlinked
@@ -55,45 +202,47 @@ static ssize_t bkpfs_read(struct file *file, char __user *buf,
  * error codes.
  */
 static
-int bkpfs_unlink_backup(struct dentry *parent, char *name, int version) {
-	char bkpf_name[256];
-	int length;
-        char* curr_ver_str;
-	struct qstr this;
+int bkpfs_unlink_backup(struct dentry *dentry, struct dentry *parent,
+			char *name, int version) {
+	char bkpf_name[NAME_MAX + 1];
 	struct dentry *bkpfile_dentry = NULL;
+	struct dentry *bkp_dir = parent;
+	int length;
 	int error = 0;
 
-	length = snprintf(NULL, 0, "%d", version);
-        curr_ver_str = kmalloc(length + 1, GFP_KERNEL);
-        snprintf(curr_ver_str, length + 1, "%d", version);
-        printk("INFO:current version string : %s\n",curr_ver_str);
-
-	strcpy(bkpf_name, ".");
-	strcat(bkpf_name, name);
-        strcat(bkpf_name, ".");
-        strcat(bkpf_name, curr_ver_str);
+	length = snprintf(bkpf_name, sizeof(bkpf_name), ".%s.%d",
+			  bkpfs_version_stem(BKPFS_SB(dentry->d_sb), name),
+			  version);
+	if (length >= sizeof(bkpf_name))
+		return -ENAMETOOLONG;
         printk("Name of the backup file : %s\n", bkpf_name);
 
-        printk("Instatiate a new negative dentry\n");
-        this.name = bkpf_name;
-        this.len = strlen(bkpf_name);
-        this.hash = full_name_hash(parent, this.name, this.len);
-        bkpfile_dentry = d_lookup(parent, &this);
-	if (!bkpfile_dentry) {
+	// Versions not in the dcache (e.g. after a remount) are found too
+	bkpfile_dentry = lookup_one_len_unlocked(bkpf_name, bkp_dir, length);
+	if (IS_ERR(bkpfile_dentry))
+		return PTR_ERR(bkpfile_dentry);
+	if (d_is_negative(bkpfile_dentry)) {
                 printk("INFO: no such backup file exists!\n");
 		error = -ENOENT;
                 goto out;
         }
 	printk("INFO:Backup file found. Yay!\n");
 
+	/* format=dedup: the chunks stay as long as others reference them */
+	if (bkpfs_version_encoding(bkpfile_dentry) == BKPFS_ENC_CHUNKED)
+		bkpfs_chunk_release(dentry, bkpfile_dentry);
+
 	parent = lock_parent(bkpfile_dentry);
 	error = vfs_unlink(parent->d_inode, bkpfile_dentry, NULL);
-	if(error) {
+        unlock_dir(parent);
+	if(error)
                 printk("INFO:Failed in vfs_unlink\n");
-                goto out;
-        }
 out:
-        unlock_dir(parent);
+	dput(bkpfile_dentry);
+	if (!error) {
+		bkpfs_sum_unlink(dentry, bkp_dir, version);
+		bkpfs_view_drop(d_inode(dentry), version);
+	}
 	return error;
 }
 
@@ -103,9 +252,16 @@ static ssize_t bkpfs_write(struct file *file, const char __user *buf,
 	int err;
 	struct file *lower_file;
 	struct dentry *dentry = file->f_path.dentry;
+	loff_t pos;
 	
 	UDBG;
 	lower_file = bkpfs_lower_file(file);
+	/* format=preimage: save what is about to be overwritten */
+	pos = (file->f_flags & O_APPEND) ?
+		i_size_read(file_inode(lower_file)) : *ppos;
+	err = bkpfs_capture_range(dentry, pos, pos + count);
+	if (err)
+		return err;
 	err = vfs_write(lower_file, buf, count, ppos);
 	/* update our inode times+sizes upon a successful lower write */
 	if (err >= 0) {
@@ -113,8 +269,8 @@ static ssize_t bkpfs_write(struct file *file, const char __user *buf,
 					file_inode(lower_file));
 		fsstack_copy_attr_times(d_inode(dentry),
 					file_inode(lower_file));
+		bkpfs_dirty_add(file, *ppos - err, *ppos);
 	}
-	new_ver_toggle = 1;
 	return err;
 }
 
@@ -216,45 +372,260 @@ struct dentry  *bkpfs_get_dentry(struct dentry *parent, char *name) {
 	return dentry;
 }
 
+/* @dir still holds the versions of the lower file of @dentry */
+static bool bkpfs_bkp_dir_valid(struct dentry *dir, struct dentry *dentry,
+				struct dentry *lower_parent)
+{
+	const struct qstr *name = &dentry->d_name;
+	const unsigned char *s;
+	bool valid;
+
+	/* store=central: named after the inode, not the file */
+	if (BKPFS_SB(dentry->d_sb)->store == BKPFS_STORE_CENTRAL)
+		return !d_unhashed(dir) && d_is_dir(dir);
+
+	spin_lock(&dir->d_lock);
+	s = dir->d_name.name;
+	valid = dir->d_parent == lower_parent && !d_unhashed(dir) &&
+		d_is_dir(dir) && dir->d_name.len == name->len + 5 &&
+		s[0] == '.' && !memcmp(s + 1, name->name, name->len) &&
+		!memcmp(s + 1 + name->len, ".bkp", 4);
+	spin_unlock(&dir->d_lock);
+	return valid;
+}
+
+static struct dentry *bkpfs_bkp_dir_get(struct dentry *dentry, bool create)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(d_inode(dentry));
+	struct path lower_path;
+	struct dentry *lower_parent, *dir;
+
+	bkpfs_get_lower_path(dentry, &lower_path);
+	lower_parent = dget_parent(lower_path.dentry);
+
+	spin_lock(&info->bkp_dir_lock);
+	dir = dget(info->bkp_dir);
+	spin_unlock(&info->bkp_dir_lock);
+	if (dir && bkpfs_bkp_dir_valid(dir, dentry, lower_parent))
+		goto out;
+	dput(dir);
+
+	dir = bkpfs_version_dir(BKPFS_SB(dentry->d_sb), lower_path.dentry,
+				create);
+	if (!IS_ERR(dir))
+		bkpfs_bkp_dir_set(d_inode(dentry), dir);
+out:
+	dput(lower_parent);
+	bkpfs_put_lower_path(dentry, &lower_path);
+	return dir;
+}
+
 /*
- * bkpfs_get_attr - get the attribute for a given file.
- * @file : name of the file
- * @attr : name of the attr
+ * bkpfs_bkp_dir - look up the lower backup directory of a file
+ * @dentry : upper dentry of the file
+ *
+ * The directory is pinned in the bkpfs_inode_info on first use, later
+ * calls only check that it still belongs to @dentry: with store=sibling
+ * hard links have a backup directory per name, and renames below bkpfs
+ * are not seen.
  *
- * Return the value of the attr by lookin up the xattrs
- * of the given file.
+ * Returns the ".F.bkp" dentry (see store.c) with a reference held,
+ * ERR_PTR(-ENOENT) if the file has no backup directory, or another
+ * ERR_PTR.
  */
+struct dentry *bkpfs_bkp_dir(struct dentry *dentry)
+{
+	return bkpfs_bkp_dir_get(dentry, false);
+}
 
-static
-int bkpfs_get_attr(struct file *file, const char *attr) {
-	struct file *lower_file;
-	int attr_val = 0;
-	
-	lower_file = bkpfs_lower_file(file);
+/*
+ * bkpfs_bkp_dir_make - backup directory of a file about to get a version
+ *
+ * Like bkpfs_bkp_dir, but with store=central the directory is made by
+ * the first version of the file; sibling ones are made by bkpfs_create.
+ */
+struct dentry *bkpfs_bkp_dir_make(struct dentry *dentry)
+{
+	return bkpfs_bkp_dir_get(dentry, BKPFS_SB(dentry->d_sb)->store ==
+				 BKPFS_STORE_CENTRAL);
+}
 
-	vfs_getxattr(lower_file->f_path.dentry, attr,
-                      (void *)&attr_val, sizeof(int));
+/*
+ * bkpfs_bkp_dir_set - pin the backup directory of a file
+ * @inode : upper inode of the file
+ * @dir   : its lower backup directory, or NULL to unpin it
+ *
+ * Called when the directory is made, and with NULL when the file is
+ * unlinked or renamed so the old directory is not kept alive.
+ */
+void bkpfs_bkp_dir_set(struct inode *inode, struct dentry *dir)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+	struct dentry *old;
+
+	spin_lock(&info->bkp_dir_lock);
+	old = info->bkp_dir;
+	info->bkp_dir = dget(dir);
+	spin_unlock(&info->bkp_dir_lock);
+	dput(old);
+}
 
-	printk("INFO:attr_val for %s is  %d\n", attr, attr_val);
-	return attr_val;
+/*
+ * bkpfs_open_bkp_file - open a file of a lower backup directory
+ * @dentry  : upper dentry of the file the backups are of
+ * @bkp_dir : its lower backup directory
+ * @name    : name of the file in @bkp_dir
+ * @flags   : O_RDONLY to read an existing file, O_WRONLY to create it
+ *	      (an existing one, e.g. left by a crash, is emptied)
+ *
+ * Files are created read-only (0444), like versions.
+ * Returns the opened lower file or an ERR_PTR.
+ */
+struct file *bkpfs_open_bkp_file(struct dentry *dentry,
+				 struct dentry *bkp_dir, const char *name,
+				 int flags)
+{
+	struct path path, lower_path;
+	struct file *file;
+	int len = strlen(name);
+	int err = 0;
+
+	inode_lock_nested(d_inode(bkp_dir), I_MUTEX_PARENT);
+	path.dentry = lookup_one_len(name, bkp_dir, len);
+	if (IS_ERR(path.dentry)) {
+		inode_unlock(d_inode(bkp_dir));
+		return ERR_CAST(path.dentry);
+	}
+	if (d_is_negative(path.dentry))
+		err = (flags & O_ACCMODE) == O_RDONLY ? -ENOENT :
+			vfs_create(d_inode(bkp_dir), path.dentry, 0444, true);
+	inode_unlock(d_inode(bkp_dir));
+	if (err) {
+		dput(path.dentry);
+		return ERR_PTR(err);
+	}
+
+	bkpfs_get_lower_path(dentry, &lower_path);
+	path.mnt = lower_path.mnt;
+	file = dentry_open(&path, flags, current_cred());
+	bkpfs_put_lower_path(dentry, &lower_path);
+	dput(path.dentry);
+
+	if (!IS_ERR(file) && (flags & O_ACCMODE) != O_RDONLY &&
+	    i_size_read(file_inode(file))) {
+		err = bkpfs_truncate_file(file, 0);
+		if (err) {
+			fput(file);
+			file = ERR_PTR(err);
+		}
+	}
+	return file;
 }
 
 /*
- * bkpfs_set_attr - set the attribute for a given file.
- * @file    : name of the file
- * @attr    : name of the attr
- * attr_val : attr value
+ * bkpfs_open_version - open the file holding one version of a file
+ * @dentry  : upper dentry of the file
+ * @bkp_dir : its lower backup directory
+ * @version : version number
+ * @flags   : as for bkpfs_open_bkp_file
  *
- * sets the value of the attr by lookin up the xattrs
- * of the given file.
+ * Returns the opened lower file or an ERR_PTR.
  */
-static
-void bkpfs_set_attr(struct file *file, const char *attr, int attr_val) {
-	struct file *lower_file;
-        lower_file = bkpfs_lower_file(file);
-	
-	vfs_setxattr(lower_file->f_path.dentry, attr,
-                      (void *)&attr_val, sizeof(int), 0);
+struct file *bkpfs_open_version(struct dentry *dentry, struct dentry *bkp_dir,
+				int version, int flags)
+{
+	char name[NAME_MAX + 1];
+
+	if (snprintf(name, sizeof(name), ".%s.%d",
+		     bkpfs_version_stem(BKPFS_SB(dentry->d_sb),
+					dentry->d_name.name),
+		     version) >= sizeof(name))
+		return ERR_PTR(-ENAMETOOLONG);
+	return bkpfs_open_bkp_file(dentry, bkp_dir, name, flags);
+}
+
+/*
+ * bkpfs_version_encoding - how a version file stores its contents
+ * @version_dentry : lower dentry of the version file
+ *
+ * Versions without the attribute are plain copies (BKPFS_ENC_RAW).
+ */
+int bkpfs_version_encoding(struct dentry *version_dentry)
+{
+	int enc = BKPFS_ENC_RAW;
+
+	vfs_getxattr(version_dentry, BKPFS_XATTR_ENCODING, (void *)&enc,
+		     sizeof(int));
+	return enc;
+}
+
+int bkpfs_set_version_encoding(struct dentry *version_dentry, int enc)
+{
+	return vfs_setxattr(version_dentry, BKPFS_XATTR_ENCODING,
+			    (void *)&enc, sizeof(int), 0);
+}
+
+/* true if @version of the file is stored as a pre-image */
+static bool bkpfs_version_is_preimage(struct dentry *dentry,
+				      struct dentry *bkp_dir, int version)
+{
+	struct file *vfile;
+	int enc;
+
+	vfile = bkpfs_open_version(dentry, bkp_dir, version, O_RDONLY);
+	if (IS_ERR(vfile))
+		return false;
+	enc = bkpfs_version_encoding(vfile->f_path.dentry);
+	fput(vfile);
+	return enc == BKPFS_ENC_PREIMAGE;
+}
+
+/*
+ * bkpfs_delete_all - unlink versions [@first, @last) of a file
+ * @dentry  : upper dentry of the file
+ * @bkp_dir : its lower backup directory
+ * @first   : oldest version
+ * @last    : one past the newest version
+ *
+ * Walks the version index a batch of records at a time, so only the
+ * versions it lists as live, or that predate it, are looked up.  The
+ * index itself is updated once all of them are gone.
+ *
+ * Returns 0 on success, else the corresponding error code.
+ */
+static int bkpfs_delete_all(struct dentry *dentry, struct dentry *bkp_dir,
+			    int first, int last)
+{
+	struct bkpfs_index_rec *recs;
+	int v, i, n, err = 0;
+
+	recs = kmalloc_array(BKPFS_INDEX_BATCH, sizeof(*recs), GFP_KERNEL);
+	if (!recs)
+		return -ENOMEM;
+
+	for (v = first; v < last; v += n) {
+		n = min(last - v, BKPFS_INDEX_BATCH);
+		err = bkpfs_index_read(dentry, bkp_dir, v, v + n, recs);
+		if (err == -ENOENT) {
+			/* no index: every version may be there */
+			memset(recs, 0, n * sizeof(*recs));
+			err = 0;
+		}
+		if (err)
+			break;
+		for (i = 0; i < n; i++) {
+			if (recs[i].version &&
+			    !(le32_to_cpu(recs[i].flags) & BKPFS_INDEX_LIVE))
+				continue;
+			bkpfs_unlink_backup(dentry, bkp_dir,
+					    (char *)dentry->d_name.name,
+					    v + i);
+		}
+	}
+	kfree(recs);
+	if (!err)
+		bkpfs_index_drop(dentry, bkp_dir, first, last, last);
+	return err;
 }
 
 /*
@@ -271,14 +642,12 @@ bkpfs_delete_version(struct file *file, int version) {
 	int curr_version, old_version;
 	
 	struct dentry *dentry = file->f_path.dentry;
-	struct dentry *lower_parent_dentry;
-	struct file *lower_file;
-	int i;
 	struct dentry *bkpf_dentry = NULL;
-	char name[256];
 
-	old_version = bkpfs_get_attr(file, "user.old_version");
-        curr_version = bkpfs_get_attr(file, "user.curr_version");
+	// The range read here stays current until we store it back
+	mutex_lock(&BKPFS_I(d_inode(dentry))->backup_mutex);
+	bkpfs_get_versions(dentry, &old_version, &curr_version);
+	printk("INFO:versions %d to %d\n", old_version, curr_version);
 	
 	if(old_version >= curr_version) {
 		error = -EINVAL;
@@ -287,42 +656,76 @@ bkpfs_delete_version(struct file *file, int version) {
 	}
 	
 
-	lower_file = bkpfs_lower_file(file);
-	lower_parent_dentry = lower_file->f_path.dentry->d_parent;
-
-	strcpy(name, ".");
-	strcat(name, file->f_path.dentry->d_name.name);
-        strcat(name, ".bkp");
-        printk("INFO:Backup folder name:%s\n", name);
-
-	bkpf_dentry = bkpfs_get_dentry(lower_parent_dentry, name);
-	if (!bkpf_dentry) {
+	bkpf_dentry = bkpfs_bkp_dir(dentry);
+	if (IS_ERR(bkpf_dentry)) {
+		error = PTR_ERR(bkpf_dentry);
+		bkpf_dentry = NULL;
 		printk("INFO: no such file exists!\n");
 		goto out_err;
 	}
 
 	if (version == -2) {
+		/* a delta on top of the oldest version needs it */
+		error = bkpfs_delta_detach(dentry, bkpf_dentry,
+					   old_version + 1);
+		if (error)
+			goto out_err;
 		version = old_version;
-		old_version++;
-		bkpfs_unlink_backup(bkpf_dentry, (char *)dentry->d_name.name,
-					version);
+		error = bkpfs_journal_unlink(dentry, version, version + 1);
+		if (!error) {
+			old_version++;
+			bkpfs_unlink_backup(dentry, bkpf_dentry,
+					    (char *)dentry->d_name.name,
+					    version);
+			bkpfs_index_drop(dentry, bkpf_dentry, version,
+					 version + 1, old_version);
+		}
+		bkpfs_journal_end(dentry->d_sb);
+		if (error)
+			goto out_err;
 	} else if (version == -1) {
-		curr_version--;
-		version = curr_version;
-		bkpfs_unlink_backup(bkpf_dentry, (char *)dentry->d_name.name,
-					version);
-	} else if (version == 0){
-		for(i = old_version; i < curr_version ; i++) {
-			bkpfs_unlink_backup(bkpf_dentry,
-				(char *)dentry->d_name.name, i);
+		/* the older pre-images are rebuilt on top of the newest one */
+		if (curr_version - 1 > old_version &&
+		    bkpfs_version_is_preimage(dentry, bkpf_dentry,
+					      curr_version - 1)) {
+			printk("INFO: newest pre-image is needed by older ones\n");
+			error = -EBUSY;
+			goto out_err;
 		}
+		version = curr_version - 1;
+		error = bkpfs_journal_unlink(dentry, version, version + 1);
+		if (!error) {
+			curr_version--;
+			/* the live file no longer matches the newest version */
+			bkpfs_set_delta_base(dentry, -1);
+			bkpfs_unlink_backup(dentry, bkpf_dentry,
+					    (char *)dentry->d_name.name,
+					    version);
+			bkpfs_index_drop(dentry, bkpf_dentry, version,
+					 version + 1, old_version);
+		}
+		bkpfs_journal_end(dentry->d_sb);
+		if (error)
+			goto out_err;
+	} else if (version == 0){
+		error = bkpfs_journal_unlink(dentry, old_version,
+					     curr_version);
+		if (!error)
+			error = bkpfs_delete_all(dentry, bkpf_dentry,
+						 old_version, curr_version);
+		bkpfs_journal_end(dentry->d_sb);
+		if (error)
+			goto out_err;
 		old_version = curr_version;
+		bkpfs_set_delta_base(dentry, -1);
 	}
 
-	bkpfs_set_attr(file, "user.old_version", old_version);
-	bkpfs_set_attr(file, "user.curr_version", curr_version);
+	bkpfs_set_versions(dentry, old_version, curr_version);
 	
 out_err:
+	mutex_unlock(&BKPFS_I(d_inode(dentry))->backup_mutex);
+	if (bkpf_dentry)
+		dput(bkpf_dentry);
 	return error;
 }
 
@@ -347,25 +750,21 @@ bkpfs_restore_version(struct file *file, int version, int isVue) {
 	
 	struct dentry *lower_parent_dentry;
 	struct dentry *bkp_file_dentry;
-	struct dentry *bkp_dir_dentry;
+	struct dentry *bkp_dir_dentry = NULL;
         struct file *lower_file = NULL;
 	struct file *backup_file = NULL;
 
-	char bkp_dir[256];
-	char bkp_file[256];
-
+	char bkp_file[NAME_MAX + 1];
 	int length;
-        char* s_version = NULL;
 	size_t size;
-	struct path backup_path;
 
 	struct path rec_path;
 	struct file *rec_file = NULL;
 	struct dentry *rec_dentry;
+	struct bkpfs_progress *progress;
 
 	int min_ver, max_ver;
-	min_ver = bkpfs_get_attr(file, "user.old_version");
-	max_ver = bkpfs_get_attr(file, "user.curr_version");
+	bkpfs_get_versions(file->f_path.dentry, &min_ver, &max_ver);
 
 	if (version == -2) {
                 version = min_ver;
@@ -373,62 +772,42 @@ bkpfs_restore_version(struct file *file, int version, int isVue) {
                 version = max_ver - 1;
         } else if (version < min_ver || version >= max_ver) {
 		printk("ERROR: Invalid input");
+		error = -EINVAL;
 		goto out_err;
 	}
 	
 	lower_file = bkpfs_lower_file(file);
         lower_parent_dentry = lower_file->f_path.dentry->d_parent;
 	
-	strcpy(bkp_dir, ".");
-	strcat(bkp_dir, file->f_path.dentry->d_name.name);
-        strcat(bkp_dir, ".bkp");
-        printk("INFO:Backup folder name:%s\n", bkp_dir);
-
-        bkp_dir_dentry = bkpfs_get_dentry(lower_parent_dentry, bkp_dir);
-        if (!bkp_dir_dentry) {
+	bkp_dir_dentry = bkpfs_bkp_dir(file->f_path.dentry);
+	if (IS_ERR(bkp_dir_dentry)) {
+		error = PTR_ERR(bkp_dir_dentry);
+		bkp_dir_dentry = NULL;
                 printk("INFO: no such file exists!\n");
                 goto out_err;
         }
 
-	length = snprintf(NULL, 0, "%d", version);
-        s_version = kmalloc(length + 1, GFP_KERNEL);
-        snprintf(s_version, length + 1, "%d", version);
-        printk("INFO:version string : %s\n", s_version);
-
-	strcpy(bkp_file, ".");
-	strcat(bkp_file, file->f_path.dentry->d_name.name);
-	strcat(bkp_file, ".");
-	strcat(bkp_file, s_version);
-	printk("INFO:restore from : %s\n", bkp_file);
-	bkp_file_dentry = bkpfs_get_dentry(bkp_dir_dentry, bkp_file);
-	if (!bkp_file_dentry) {
-                printk("INFO: no such file exists!\n");
-                goto out_err;
-        }
-
-	// Create path struct for backup file
-	backup_path.dentry = bkp_file_dentry;
-        backup_path.mnt = lower_file->f_path.mnt;
-        printk("INFO:created backup path struct. Fetching fp.\n");
-	if (backup_path.dentry == NULL)
-		goto out_err;
-        backup_file = dentry_open(&backup_path, O_RDONLY, current_cred());
-        path_put(&backup_path);
+	backup_file = bkpfs_open_version(file->f_path.dentry, bkp_dir_dentry,
+					 version, O_RDONLY);
         if (IS_ERR(backup_file)) {
                 error = PTR_ERR(backup_file);
+		backup_file = NULL;
                 printk("ERROR:failed in dentry_open\n");
                 goto out_err;
         }
+	bkp_file_dentry = backup_file->f_path.dentry;
 
 	// Create new file for recovery 
-	if (isVue) {
-		strcpy(bkp_file, file->f_path.dentry->d_name.name);
-        	strcat(bkp_file, ".");
-        	strcat(bkp_file, s_version);	
-		strcat(bkp_file, ".vue");
-	}
+	if (isVue)
+		length = snprintf(bkp_file, sizeof(bkp_file), "%s.%d.vue",
+				  file->f_path.dentry->d_name.name, version);
 	else
-		strcat(bkp_file, ".swp");
+		length = snprintf(bkp_file, sizeof(bkp_file), ".%s.%d.swp",
+				  file->f_path.dentry->d_name.name, version);
+	if (length >= sizeof(bkp_file)) {
+		error = -ENAMETOOLONG;
+		goto out_err;
+	}
 	printk("Instatiate a new negative dentry for rec file\n");
 	rec_dentry = bkpfs_get_dentry(lower_parent_dentry , bkp_file);
 	if (rec_dentry != NULL)
@@ -462,18 +841,387 @@ bkpfs_restore_version(struct file *file, int version, int isVue) {
         backup_file->f_pos = 0;
 
         backup_file->f_flags &= ~(O_APPEND);
-        error = vfs_copy_file_range(backup_file, backup_file->f_pos, rec_file,
-                                  rec_file->f_pos, size, 0);	
+	progress = &BKPFS_I(file_inode(file))->progress;
+	atomic64_set(&progress->done, 0);
+	// Other encodings copy about as much as the file holds now
+	atomic64_set(&progress->total,
+		     bkpfs_version_encoding(bkp_file_dentry) == BKPFS_ENC_RAW ?
+		     size : i_size_read(file_inode(lower_file)));
+	if (bkpfs_version_encoding(bkp_file_dentry) == BKPFS_ENC_RAW)
+		error = bkpfs_copy_file(file->f_path.dentry->d_sb, backup_file,
+					rec_file, size, progress);
+	else
+		error = bkpfs_version_materialize(file->f_path.dentry,
+						  bkp_dir_dentry, version,
+						  max_ver, rec_file);
+	atomic64_set(&progress->total, 0);
 	
 out_err:
 	if(rec_file)
                 fput(rec_file);
 	if(backup_file)
 		fput(backup_file);
+	if (bkp_dir_dentry)
+		dput(bkp_dir_dentry);
 	printk("INFO:error code is %d\n",error);
 	return error;
 }
 
+/*
+ * bkpfs_view_tmpfile - rebuild a version into an unnamed file
+ * @file    : file whose version is rebuilt
+ * @bkp_dir : its lower backup directory
+ * @version : version to rebuild
+ * @newest  : user.curr_version, one past the newest version
+ *
+ * The file is made in @bkp_dir by bkpfs_open_sealed, so nothing is
+ * left behind if the caller dies and its blocks are freed with its
+ * last reference.  It is made as the mounter: readers of the version
+ * share it, so none of them may own it.
+ *
+ * Returns it opened read-write, else the corresponding error code.
+ */
+static struct file *bkpfs_view_tmpfile(struct file *file,
+				       struct dentry *bkp_dir, int version,
+				       int newest)
+{
+	struct bkpfs_progress *progress = &BKPFS_I(file_inode(file))->progress;
+	struct bkpfs_sb_info *sbi = BKPFS_SB(file_inode(file)->i_sb);
+	const struct cred *old_cred;
+	struct path dir;
+	struct file *tmp;
+	int err;
+
+	dir.mnt = bkpfs_lower_file(file)->f_path.mnt;
+	dir.dentry = bkp_dir;
+	old_cred = override_creds(sbi->mounter_cred);
+	tmp = bkpfs_open_sealed(&dir);
+	revert_creds(old_cred);
+	if (IS_ERR(tmp))
+		return tmp;
+
+	atomic64_set(&progress->done, 0);
+	atomic64_set(&progress->total,
+		     i_size_read(file_inode(bkpfs_lower_file(file))));
+	err = bkpfs_version_materialize(file->f_path.dentry, bkp_dir, version,
+					newest, tmp);
+	atomic64_set(&progress->total, 0);
+	if (err) {
+		fput(tmp);
+		return ERR_PTR(err);
+	}
+	return tmp;
+}
+
+/*
+ * bkpfs_view_rebuilt - open the rebuilt copy of a version
+ * @file    : file whose version is viewed
+ * @bkp_dir : its lower backup directory
+ * @version : version to open
+ * @newest  : user.curr_version, one past the newest version
+ *
+ * The inode keeps the copy of the version viewed last while the file
+ * is open, so readers of the same version, and their mappings, share
+ * one file and its page cache; a rebuild waits for the one running.
+ * bkpfs_view_drop lets it go when the last open file is released, and
+ * when its version file is unlinked, since the version number may be
+ * given to a new version.  A copy rebuilt while it was dropped is used
+ * by its caller only, not cached.
+ *
+ * The view_mutex is held across the rebuild, which may take the
+ * backup_mutex (pre-images, see bkpfs_preimage_restore); the view
+ * itself is under view_lock, so bkpfs_view_drop can be called with the
+ * backup_mutex held.
+ *
+ * Returns it opened read-only, else the corresponding error code.
+ */
+struct file *bkpfs_view_rebuilt(struct file *file, struct dentry *bkp_dir,
+				int version, int newest)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(file_inode(file));
+	struct bkpfs_sb_info *sbi = BKPFS_SB(file_inode(file)->i_sb);
+	struct file *tmp, *view = NULL, *old = NULL;
+	unsigned int gen;
+
+	mutex_lock(&info->view_mutex);
+	spin_lock(&info->view_lock);
+	if (info->view && info->view_version == version)
+		view = get_file(info->view);
+	gen = info->view_gen;
+	spin_unlock(&info->view_lock);
+
+	if (!view) {
+		view = bkpfs_view_tmpfile(file, bkp_dir, version, newest);
+		if (IS_ERR(view)) {
+			mutex_unlock(&info->view_mutex);
+			return view;
+		}
+		spin_lock(&info->view_lock);
+		if (info->view_gen == gen) {
+			old = info->view;
+			info->view = get_file(view);
+			info->view_version = version;
+			atomic64_inc(&sbi->views);
+			atomic64_add(i_size_read(file_inode(view)),
+				     &sbi->view_bytes);
+		}
+		spin_unlock(&info->view_lock);
+	}
+	mutex_unlock(&info->view_mutex);
+
+	tmp = dentry_open(&view->f_path, O_RDONLY, current_cred());
+	fput(view);
+	if (old) {
+		atomic64_dec(&sbi->views);
+		atomic64_sub(i_size_read(file_inode(old)), &sbi->view_bytes);
+		fput(old);
+	}
+	return tmp;
+}
+
+/*
+ * bkpfs_view_drop - forget the rebuilt copy of a version
+ * @inode   : the file
+ * @version : version whose copy goes, 0 for any
+ *
+ * Descriptors already returned keep the copy until they are closed.
+ */
+void bkpfs_view_drop(struct inode *inode, int version)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+	struct file *view = NULL;
+
+	spin_lock(&info->view_lock);
+	/* a rebuild running may hold what is gone */
+	info->view_gen++;
+	if (info->view && (!version || info->view_version == version)) {
+		view = info->view;
+		info->view = NULL;
+	}
+	spin_unlock(&info->view_lock);
+	if (view) {
+		atomic64_dec(&BKPFS_SB(inode->i_sb)->views);
+		atomic64_sub(i_size_read(file_inode(view)),
+			     &BKPFS_SB(inode->i_sb)->view_bytes);
+		fput(view);
+	}
+}
+
+/*
+ * bkpfs_view_version - open a version of a file for reading
+ * @file    : file whose version is viewed
+ * @version : version to open, may be -1 or -2
+ *
+ * A full copy is handed out as it is: the descriptor is the version
+ * file itself, opened read-only, so read, splice and sendfile go
+ * straight to the lower file system and nothing is copied first; an
+ * mmap of it is a mapping of the version file, served by the vm_ops
+ * and page cache of the lower file system, not by bkpfs_vm_ops.
+ * Other encodings are rebuilt by bkpfs_view_rebuilt.  Unlike
+ * VIEW_VERSION, nothing is created in the directory of the file.
+ *
+ * returns the new descriptor, else the corresponding err code.
+ */
+static int
+bkpfs_view_version(struct file *file, int version) {
+	struct dentry *dentry = file->f_path.dentry;
+	struct dentry *bkp_dir;
+	struct file *vfile;
+	int min_ver, max_ver;
+	int fd;
+
+	bkpfs_get_versions(dentry, &min_ver, &max_ver);
+	if (version == -2)
+		version = min_ver;
+	else if (version == -1)
+		version = max_ver - 1;
+	if (version < min_ver || version >= max_ver)
+		return -EINVAL;
+
+	bkp_dir = bkpfs_bkp_dir(dentry);
+	if (IS_ERR(bkp_dir))
+		return PTR_ERR(bkp_dir);
+	vfile = bkpfs_open_version(dentry, bkp_dir, version, O_RDONLY);
+	if (!IS_ERR(vfile) &&
+	    bkpfs_version_encoding(vfile->f_path.dentry) != BKPFS_ENC_RAW) {
+		fput(vfile);
+		vfile = bkpfs_view_rebuilt(file, bkp_dir, version, max_ver);
+	}
+	dput(bkp_dir);
+	if (IS_ERR(vfile))
+		return PTR_ERR(vfile);
+
+	fd = get_unused_fd_flags(O_CLOEXEC);
+	if (fd < 0) {
+		fput(vfile);
+		return fd;
+	}
+	fd_install(fd, vfile);
+	return fd;
+}
+
+/*
+ * bkpfs_restore_range - copy a range of a version back into the file
+ * @file : the file, open for writing
+ * @arg  : address of a range_arg_t, version may be -1 or -2
+ *
+ * Only the range is copied, through vfs_copy_file_range so the lower
+ * file system may clone it.  A full copy is the source as it is; other
+ * encodings are rebuilt once (see bkpfs_view_rebuilt), so restoring
+ * several ranges of one version rebuilds it once.  The copy is a write
+ * to the file like bkpfs_write_iter's: saved first with
+ * format=preimage, recorded with format=delta, and a version is made
+ * when the file is released.
+ *
+ * returns 0 on success, -EBADF if the file is not open for writing (or
+ * is O_APPEND), else the corresponding err code.
+ */
+static int
+bkpfs_restore_range(struct file *file, unsigned long arg) {
+	struct dentry *dentry = file->f_path.dentry;
+	struct file *lower_file = bkpfs_lower_file(file);
+	struct dentry *bkp_dir;
+	struct file *src;
+	range_arg_t ra;
+	loff_t size, len;
+	int min_ver, max_ver;
+	int err;
+
+	if (!(file->f_mode & FMODE_WRITE) || (file->f_flags & O_APPEND))
+		return -EBADF;
+	if (copy_from_user(&ra, (range_arg_t __user *)arg, sizeof(ra)))
+		return -EFAULT;
+	if (ra.src_offset > LLONG_MAX || ra.dst_offset > LLONG_MAX ||
+	    ra.length > LLONG_MAX - ra.dst_offset)
+		return -EINVAL;
+
+	bkpfs_get_versions(dentry, &min_ver, &max_ver);
+	if (ra.version == -2)
+		ra.version = min_ver;
+	else if (ra.version == -1)
+		ra.version = max_ver - 1;
+	if (ra.version < min_ver || ra.version >= max_ver)
+		return -EINVAL;
+
+	bkp_dir = bkpfs_bkp_dir(dentry);
+	if (IS_ERR(bkp_dir))
+		return PTR_ERR(bkp_dir);
+	src = bkpfs_open_version(dentry, bkp_dir, ra.version, O_RDONLY);
+	if (!IS_ERR(src) &&
+	    bkpfs_version_encoding(src->f_path.dentry) != BKPFS_ENC_RAW) {
+		fput(src);
+		src = bkpfs_view_rebuilt(file, bkp_dir, ra.version, max_ver);
+	}
+	dput(bkp_dir);
+	if (IS_ERR(src))
+		return PTR_ERR(src);
+
+	size = i_size_read(file_inode(src));
+	len = ra.src_offset < size ?
+		min_t(loff_t, ra.length, size - ra.src_offset) : 0;
+	/* format=preimage: save what is about to be overwritten */
+	err = bkpfs_capture_range(dentry, ra.dst_offset, ra.dst_offset + len);
+	if (err) {
+		fput(src);
+		return err;
+	}
+	err = bkpfs_copy_range(src, ra.src_offset, lower_file, ra.dst_offset,
+			       len);
+	fput(src);
+	/* what was copied before an error is in the file too */
+	if (len) {
+		fsstack_copy_inode_size(d_inode(dentry),
+					file_inode(lower_file));
+		fsstack_copy_attr_times(d_inode(dentry),
+					file_inode(lower_file));
+		bkpfs_dirty_add(file, ra.dst_offset, ra.dst_offset + len);
+	}
+	if (err)
+		return err;
+
+	ra.copied = len;
+	if (copy_to_user((range_arg_t __user *)arg, &ra, sizeof(ra)))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * bkpfs_send_version - write a version to a descriptor of the caller
+ * @file : the file
+ * @arg  : address of a send_arg_t
+ *
+ * The version is written at the file position of fd, which is advanced,
+ * like sendfile(2), and held locked meanwhile as write(2) does.  Full copies go straight from the version file;
+ * other encodings are rebuilt once into the unnamed copy readers share
+ * (see bkpfs_view_rebuilt), not into a file of the user's directory.
+ *
+ * returns 0 on success, -EBADF if fd is not open for writing or is
+ * O_APPEND, else the corresponding err code.
+ */
+static int
+bkpfs_send_version(struct file *file, unsigned long arg) {
+	struct dentry *dentry = file->f_path.dentry;
+	struct bkpfs_progress *progress = &BKPFS_I(d_inode(dentry))->progress;
+	struct dentry *bkp_dir;
+	struct file *src;
+	struct fd out;
+	send_arg_t sa;
+	loff_t pos, size;
+	int min_ver, max_ver;
+	int err;
+
+	if (copy_from_user(&sa, (send_arg_t __user *)arg, sizeof(sa)))
+		return -EFAULT;
+	bkpfs_get_versions(dentry, &min_ver, &max_ver);
+	if (sa.version == -2)
+		sa.version = min_ver;
+	else if (sa.version == -1)
+		sa.version = max_ver - 1;
+	if (sa.version < min_ver || sa.version >= max_ver)
+		return -EINVAL;
+
+	out = fdget_pos(sa.fd);
+	if (!out.file)
+		return -EBADF;
+	err = -EBADF;
+	if (!(out.file->f_mode & FMODE_WRITE) ||
+	    (out.file->f_flags & O_APPEND))
+		goto out_fdput;
+
+	bkp_dir = bkpfs_bkp_dir(dentry);
+	if (IS_ERR(bkp_dir)) {
+		err = PTR_ERR(bkp_dir);
+		goto out_fdput;
+	}
+	src = bkpfs_open_version(dentry, bkp_dir, sa.version, O_RDONLY);
+	if (!IS_ERR(src) &&
+	    bkpfs_version_encoding(src->f_path.dentry) != BKPFS_ENC_RAW) {
+		fput(src);
+		src = bkpfs_view_rebuilt(file, bkp_dir, sa.version, max_ver);
+	}
+	dput(bkp_dir);
+	if (IS_ERR(src)) {
+		err = PTR_ERR(src);
+		goto out_fdput;
+	}
+
+	size = i_size_read(file_inode(src));
+	pos = out.file->f_pos;
+	atomic64_set(&progress->done, 0);
+	atomic64_set(&progress->total, size);
+	err = bkpfs_send_file(src, out.file, &pos, size, progress);
+	atomic64_set(&progress->total, 0);
+	fput(src);
+	/* what was written before an error is in fd too */
+	sa.sent = pos - out.file->f_pos;
+	out.file->f_pos = pos;
+	if (!err && copy_to_user((send_arg_t __user *)arg, &sa, sizeof(sa)))
+		err = -EFAULT;
+out_fdput:
+	fdput_pos(out);
+	return err;
+}
+
 /*
  * bkpfs_list_version - populates the min and max version for a 
  * 			given file
@@ -492,8 +1240,8 @@ bkpfs_list_version(struct file *file, unsigned long arg) {
 	char *filename;
 	int err = 0;
 
-	old_version = bkpfs_get_attr(file, "user.old_version");
-        curr_version = bkpfs_get_attr(file, "user.curr_version");
+	// A memory read, see meta.c
+	bkpfs_get_versions(file->f_path.dentry, &old_version, &curr_version);
 
 	q.min_ver = old_version;
 	q.max_ver = curr_version;
@@ -508,32 +1256,541 @@ bkpfs_list_version(struct file *file, unsigned long arg) {
 	return err;
 }
 
+/* the record of version @v, from its file if the index has none */
+static void bkpfs_list_rec(struct dentry *dentry, struct dentry *bkp_dir,
+			   struct bkpfs_index_rec *irec, int v,
+			   version_rec_t *r)
+{
+	memset(r, 0, sizeof(*r));
+	r->version = v;
+	/* made before the index existed, or by a crashed mount */
+	if (le32_to_cpu(irec->version) != v && !IS_ERR(bkp_dir) &&
+	    bkpfs_index_of_version(dentry, bkp_dir, v, irec))
+		return;
+	if (le32_to_cpu(irec->version) != v)
+		return;
+	r->encoding = le32_to_cpu(irec->encoding);
+	if (le32_to_cpu(irec->flags) & BKPFS_INDEX_LIVE)
+		r->flags |= VREC_LIVE;
+	if (le32_to_cpu(irec->flags) & BKPFS_INDEX_CRC) {
+		r->flags |= VREC_CRC;
+		r->crc = le32_to_cpu(irec->crc);
+	}
+	r->ctime_ns = le64_to_cpu(irec->ctime);
+	r->size = le64_to_cpu(irec->size);
+	r->stored = le64_to_cpu(irec->stored);
+}
+
+/*
+ * bkpfs_list_records - describe many versions of a file in one call
+ * @file : file whose versions are listed
+ * @arg  : address of a list_arg_t
+ *
+ * Fills buf with the records of versions start, start + 1, ... up to
+ * count of them, read from the version index a batch at a time.  A
+ * caller built against a smaller or larger version_rec_t gets records
+ * of its own size, cut or zero-padded.
+ *
+ * returns 0 on success, else the corresponding err code.
+ */
+static int
+bkpfs_list_records(struct file *file, unsigned long arg) {
+	struct dentry *dentry = file->f_path.dentry;
+	struct dentry *bkp_dir;
+	struct bkpfs_index_rec *recs;
+	version_rec_t r;
+	list_arg_t la;
+	char __user *ubuf;
+	size_t len;
+	int min_ver, max_ver, v, last, i, n;
+	int err = 0;
+
+	if (copy_from_user(&la, (list_arg_t __user *)arg, sizeof(la)))
+		return -EFAULT;
+	if (la.abi != LIST_ABI || !la.rec_size)
+		return -EINVAL;
+	len = min_t(size_t, la.rec_size, sizeof(r));
+	ubuf = u64_to_user_ptr(la.buf);
+
+	bkpfs_get_versions(dentry, &min_ver, &max_ver);
+	v = max(la.start, min_ver);
+	last = v + min_t(unsigned int, la.count, INT_MAX - v);
+	if (last > max_ver)
+		last = max_ver;
+	la.count = 0;
+
+	bkp_dir = bkpfs_bkp_dir(dentry);
+	recs = kmalloc_array(BKPFS_INDEX_BATCH, sizeof(*recs), GFP_KERNEL);
+	if (!recs) {
+		err = -ENOMEM;
+		goto out;
+	}
+	for (; v < last; v += n) {
+		n = min(last - v, BKPFS_INDEX_BATCH);
+		if (IS_ERR(bkp_dir) ||
+		    bkpfs_index_read(dentry, bkp_dir, v, v + n, recs))
+			memset(recs, 0, n * sizeof(*recs));
+		for (i = 0; i < n; i++) {
+			bkpfs_list_rec(dentry, bkp_dir, &recs[i], v + i, &r);
+			if (copy_to_user(ubuf, &r, len) ||
+			    (la.rec_size > len &&
+			     clear_user(ubuf + len, la.rec_size - len))) {
+				err = -EFAULT;
+				goto out;
+			}
+			ubuf += la.rec_size;
+			la.count++;
+		}
+	}
+
+	la.rec_size = len;
+	la.next = v < max_ver ? v : 0;
+	la.min_ver = min_ver;
+	la.max_ver = max_ver;
+	if (copy_to_user((list_arg_t __user *)arg, &la, sizeof(la)))
+		err = -EFAULT;
+out:
+	kfree(recs);
+	if (!IS_ERR(bkp_dir))
+		dput(bkp_dir);
+	return err;
+}
+
+/* where bkpfs_dirsum_put copies the children to */
+struct bkpfs_dirsum_ctx {
+	char __user *buf;
+	size_t size;
+	size_t used;
+	unsigned int count;
+	int err;
+};
+
+static int bkpfs_dirsum_put(void *arg, const struct bkpfs_summary *s)
+{
+	struct bkpfs_dirsum_ctx *c = arg;
+	dirsum_ent_t e;
+	size_t reclen = ALIGN(sizeof(e) + s->namelen + 1, 8);
+
+	if (c->used + reclen > c->size)
+		return 1;
+	e.reclen = reclen;
+	e.namelen = s->namelen;
+	e.versions = s->versions;
+	e.ino = s->ino;
+	e.newest_ns = s->newest_ns;
+	e.bytes = s->bytes;
+	if (copy_to_user(c->buf + c->used, &e, sizeof(e)) ||
+	    copy_to_user(c->buf + c->used + sizeof(e), s->name,
+			 s->namelen) ||
+	    clear_user(c->buf + c->used + sizeof(e) + s->namelen,
+		       reclen - sizeof(e) - s->namelen)) {
+		c->err = -EFAULT;
+		return 1;
+	}
+	c->used += reclen;
+	c->count++;
+	return 0;
+}
+
+/*
+ * bkpfs_dir_summary_ioctl - summarize the versions of every child of a
+ *                           directory
+ * @file : the directory
+ * @arg  : address of a dirsum_arg_t
+ *
+ * Fills buf with as many dirsum_ent_t as fit, see summary.c; calls are
+ * repeated with the returned cookie until eof is set.
+ *
+ * returns 0 on success, -EOVERFLOW if not even one child fits in buf,
+ * else the corresponding err code.
+ */
+static int
+bkpfs_dir_summary_ioctl(struct file *file, unsigned long arg) {
+	struct bkpfs_dirsum_ctx c = { 0 };
+	dirsum_arg_t da;
+	loff_t cookie;
+	bool eof;
+	int err;
+
+	if (!S_ISDIR(file_inode(file)->i_mode))
+		return -ENOTDIR;
+	if (copy_from_user(&da, (dirsum_arg_t __user *)arg, sizeof(da)))
+		return -EFAULT;
+	if (da.abi != DIRSUM_ABI)
+		return -EINVAL;
+
+	c.buf = u64_to_user_ptr(da.buf);
+	c.size = da.size;
+	cookie = da.cookie;
+	err = bkpfs_dir_summary(file, &cookie, &eof, bkpfs_dirsum_put, &c);
+	if (!err)
+		err = c.err;
+	if (!err && !eof && !c.count)
+		err = -EOVERFLOW;
+	if (err)
+		return err;
+
+	da.eof = eof;
+	da.cookie = cookie;
+	da.size = c.used;
+	da.count = c.count;
+	if (copy_to_user((dirsum_arg_t __user *)arg, &da, sizeof(da)))
+		return -EFAULT;
+	return 0;
+}
+
+/* where bkpfs_diff_put copies the extents to */
+struct bkpfs_diff_ctx {
+	diff_ext_t __user *buf;
+	unsigned int size;
+	unsigned int count;
+	int err;
+};
+
+static int bkpfs_diff_put(void *arg, loff_t offset, loff_t len)
+{
+	struct bkpfs_diff_ctx *c = arg;
+	diff_ext_t e;
+
+	if (c->count == c->size)
+		return 1;
+	e.offset = offset;
+	e.length = len;
+	if (copy_to_user(c->buf + c->count, &e, sizeof(e))) {
+		c->err = -EFAULT;
+		return 1;
+	}
+	c->count++;
+	return 0;
+}
+
+/*
+ * bkpfs_diff_versions - list the extents that differ between two
+ *                       versions, or a version and the file
+ * @file : the file
+ * @arg  : address of a diff_arg_t
+ *
+ * Fills buf with as many diff_ext_t as fit, see diff.c; calls are
+ * repeated from the returned next until eof is set.
+ *
+ * returns 0 on success, else the corresponding err code.
+ */
+static int
+bkpfs_diff_versions(struct file *file, unsigned long arg) {
+	struct bkpfs_diff_ctx c = { 0 };
+	diff_arg_t da;
+	loff_t pos;
+	bool eof;
+	u64 shared;
+	int err;
+
+	if (!S_ISREG(file_inode(file)->i_mode))
+		return -EINVAL;
+	if (copy_from_user(&da, (diff_arg_t __user *)arg, sizeof(da)))
+		return -EFAULT;
+	if (!da.count || da.start > LLONG_MAX || da.from == DIFF_LIVE)
+		return -EINVAL;
+
+	c.buf = u64_to_user_ptr(da.buf);
+	c.size = da.count;
+	pos = da.start;
+	err = bkpfs_diff(file, da.from, da.to, &pos, &eof, &shared,
+			 bkpfs_diff_put, &c);
+	if (!err)
+		err = c.err;
+	if (err)
+		return err;
+
+	da.next = pos;
+	da.count = c.count;
+	da.eof = eof;
+	da.shared = shared;
+	if (copy_to_user((diff_arg_t __user *)arg, &da, sizeof(da)))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * bkpfs_store_stats - report what the stores of the mount hold
+ * @file : any file of the mount
+ * @arg  : address of a stats_arg_t
+ *
+ * What the chunk store saves, with format=dedup, and the copies of
+ * versions rebuilt for readers (see bkpfs_view_rebuilt), which take
+ * space on the lower file system too while they are cached.
+ *
+ * returns 0 on success, else the corresponding err code.
+ */
+static int
+bkpfs_store_stats(struct file *file, unsigned long arg) {
+	struct bkpfs_sb_info *sbi = BKPFS_SB(file_inode(file)->i_sb);
+	stats_arg_t st;
+	u64 logical, stored, chunks;
+	int err;
+
+	err = bkpfs_chunk_stats(file_inode(file)->i_sb, &logical, &stored,
+				&chunks);
+	if (err == -EOPNOTSUPP)
+		logical = stored = chunks = 0;
+	else if (err)
+		return err;
+	st.logical_bytes = logical;
+	st.stored_bytes = stored;
+	st.chunks = chunks;
+	st.views = atomic64_read(&sbi->views);
+	st.view_bytes = atomic64_read(&sbi->view_bytes);
+	if (copy_to_user((stats_arg_t __user *)arg, &st, sizeof(st)))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * bkpfs_version_info - describe how one version is stored
+ * @file : file whose version is asked about
+ * @arg  : address of a version_info_t, version may be -1 or -2
+ *
+ * size is the size of the file in that version when it is known (0
+ * otherwise), stored the size of the version file, and cpu_ns the time
+ * spent compressing it.
+ *
+ * returns 0 on success, else the corresponding err code.
+ */
+static int
+bkpfs_version_info(struct file *file, unsigned long arg) {
+	struct dentry *dentry = file->f_path.dentry;
+	struct dentry *bkp_dir;
+	struct file *vfile;
+	struct bkpfs_zstat st;
+	struct bkpfs_csum csum;
+	struct bkpfs_index_rec rec;
+	version_info_t vi;
+	int min_ver, max_ver;
+	int err = 0;
+
+	if (copy_from_user(&vi, (version_info_t __user *)arg, sizeof(vi)))
+		return -EFAULT;
+
+	bkpfs_get_versions(dentry, &min_ver, &max_ver);
+	if (vi.version == -2)
+		vi.version = min_ver;
+	else if (vi.version == -1)
+		vi.version = max_ver - 1;
+	if (vi.version < min_ver || vi.version >= max_ver)
+		return -EINVAL;
+
+	bkp_dir = bkpfs_bkp_dir(dentry);
+	if (IS_ERR(bkp_dir))
+		return PTR_ERR(bkp_dir);
+	/* one record of the index says it all, except the cpu time */
+	if (!bkpfs_index_get(dentry, bkp_dir, vi.version, &rec) &&
+	    (le32_to_cpu(rec.flags) & BKPFS_INDEX_LIVE) &&
+	    le32_to_cpu(rec.encoding) != BKPFS_ENC_COMPRESSED) {
+		dput(bkp_dir);
+		vi.encoding = le32_to_cpu(rec.encoding);
+		vi.size = le64_to_cpu(rec.size);
+		vi.stored = le64_to_cpu(rec.stored);
+		vi.cpu_ns = 0;
+		goto out;
+	}
+	vfile = bkpfs_open_version(dentry, bkp_dir, vi.version, O_RDONLY);
+	dput(bkp_dir);
+	if (IS_ERR(vfile))
+		return PTR_ERR(vfile);
+
+	vi.encoding = bkpfs_version_encoding(vfile->f_path.dentry);
+	vi.stored = i_size_read(file_inode(vfile));
+	vi.size = 0;
+	vi.cpu_ns = 0;
+	if (vfs_getxattr(vfile->f_path.dentry, BKPFS_XATTR_ZSTAT,
+			 (void *)&st, sizeof(st)) == sizeof(st)) {
+		vi.size = le64_to_cpu(st.size);
+		vi.cpu_ns = le64_to_cpu(st.cpu_ns);
+	} else if (vfs_getxattr(vfile->f_path.dentry, BKPFS_XATTR_CSUM,
+				(void *)&csum, sizeof(csum)) == sizeof(csum)) {
+		vi.size = le64_to_cpu(csum.size);
+	} else if (vi.encoding == BKPFS_ENC_RAW) {
+		vi.size = vi.stored;
+	}
+	fput(vfile);
+out:
+	if (copy_to_user((version_info_t __user *)arg, &vi, sizeof(vi)))
+		err = -EFAULT;
+	return err;
+}
+
+/*
+ * bkpfs_version_at - find the version a file had at a given time
+ * @file : file whose versions are searched
+ * @arg  : address of a time_arg_t
+ *
+ * The version is the newest one made at or before time, i.e. the
+ * contents the file had then if it was closed since.
+ *
+ * returns 0 on success, -ENOENT if every version is newer, else the
+ * corresponding err code.
+ */
+static int
+bkpfs_version_at(struct file *file, unsigned long arg) {
+	struct dentry *dentry = file->f_path.dentry;
+	struct dentry *bkp_dir;
+	time_arg_t ta;
+	int min_ver, max_ver;
+	u64 ctime = 0;
+	int ret;
+
+	if (copy_from_user(&ta, (time_arg_t __user *)arg, sizeof(ta)))
+		return -EFAULT;
+	if (ta.time < 0 || ta.time > S64_MAX / NSEC_PER_SEC)
+		return -EINVAL;
+
+	bkp_dir = bkpfs_bkp_dir(dentry);
+	if (IS_ERR(bkp_dir))
+		return PTR_ERR(bkp_dir);
+	// The range stays current during the search
+	mutex_lock(&BKPFS_I(d_inode(dentry))->backup_mutex);
+	bkpfs_get_versions(dentry, &min_ver, &max_ver);
+	/* the whole second: versions made at 14:05:00.7 are "at 14:05:00" */
+	ret = bkpfs_index_at(dentry, bkp_dir, min_ver, max_ver,
+			     (u64)ta.time * NSEC_PER_SEC + NSEC_PER_SEC - 1,
+			     &ctime);
+	mutex_unlock(&BKPFS_I(d_inode(dentry))->backup_mutex);
+	dput(bkp_dir);
+	if (ret < 0)
+		return ret;
+
+	ta.version = ret;
+	ta.ctime_ns = ctime;
+	if (copy_to_user((time_arg_t __user *)arg, &ta, sizeof(ta)))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * bkpfs_backup_progress - reports the copy running for a file
+ * @file : file being backed up or restored
+ * @arg  : address of a progress_arg_t, total is 0 if no copy runs
+ *
+ * Does not wait for the backup_mutex, so it can be asked while a
+ * version is being made.
+ */
+static int
+bkpfs_backup_progress(struct file *file, unsigned long arg) {
+	struct bkpfs_progress *progress = &BKPFS_I(file_inode(file))->progress;
+	progress_arg_t p;
+
+	p.total = atomic64_read(&progress->total);
+	/* a rebuild may write a range more than once */
+	p.done = min_t(u64, p.total, atomic64_read(&progress->done));
+	if (copy_to_user((progress_arg_t __user *)arg, &p, sizeof(p)))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * bkpfs_scan_progress - reports the consistency scan of the mount
+ * @file : any file or directory of the mount
+ * @arg  : address of a scan_arg_t
+ */
+static int
+bkpfs_scan_progress(struct file *file, unsigned long arg) {
+	struct bkpfs_scan *scan = BKPFS_SB(file_inode(file)->i_sb)->scan;
+	unsigned long end;
+	scan_arg_t s;
+
+	memset(&s, 0, sizeof(s));
+	if (scan) {
+		end = READ_ONCE(scan->end);
+		s.state = end ? SCAN_DONE : SCAN_RUNNING;
+		s.dirs = atomic64_read(&scan->dirs);
+		s.files = atomic64_read(&scan->files);
+		s.versioned = atomic64_read(&scan->versioned);
+		s.fixed = atomic64_read(&scan->fixed);
+		s.records = atomic64_read(&scan->records);
+		s.errors = atomic64_read(&scan->errors);
+		s.msecs = jiffies_to_msecs((end ? end : jiffies) -
+					   scan->start);
+	}
+	if (copy_to_user((scan_arg_t __user *)arg, &s, sizeof(s)))
+		return -EFAULT;
+	return 0;
+}
+
+static void bkpfs_coalesce_run(struct bkpfs_inode_info *info,
+			       struct file *own);
+
 static long bkpfs_unlocked_ioctl(struct file *file, unsigned int cmd,
 				  unsigned long arg)
 {
+	struct bkpfs_inode_info *info = BKPFS_I(file_inode(file));
 	long err = -ENOTTY;
-	int error = 0;
 	struct file *lower_file;
 	UDBG;
 	lower_file = bkpfs_lower_file(file);
 
+	/*
+	 * Versions still in a coalesce_ms window are made first, here and
+	 * now: the work would wait for our own fd if it is open for writing.
+	 */
+	if (_IOC_TYPE(cmd) == 'q' && cmd != BACKUP_PROGRESS &&
+	    cmd != SCAN_PROGRESS &&
+	    S_ISREG(file_inode(file)->i_mode)) {
+		cancel_delayed_work_sync(&info->coalesce.work);
+		bkpfs_coalesce_run(info, file);
+	}
+
 	switch(cmd) {
 		case LIST_VERSIONS:
 			printk("INFO:listing version");
-			bkpfs_list_version(file, arg);
+			err = bkpfs_list_version(file, arg);
+		break;
+		case LIST_RECORDS:
+			err = bkpfs_list_records(file, arg);
+		break;
+		case DIR_SUMMARY:
+			err = bkpfs_dir_summary_ioctl(file, arg);
 		break;
 		case DELETE_VERSION:
 			printk("INFO:deleting version %d", (int) arg);
-			error = bkpfs_delete_version(file, (int) arg);
+			err = bkpfs_delete_version(file, (int) arg);
                 break;
 		case VIEW_VERSION:
 			printk("INFO:restoring version\n");
-			bkpfs_restore_version(file, (int) arg, 1);
+			err = bkpfs_restore_version(file, (int) arg, 1);
                 break;
+		case OPEN_VERSION:
+			err = bkpfs_view_version(file, (int) arg);
+		break;
+		case RESTORE_INPLACE:
+			err = bkpfs_restore_inplace(file, (int) arg);
+		break;
+		case RESTORE_RANGE:
+			err = bkpfs_restore_range(file, arg);
+		break;
+		case DIFF_VERSIONS:
+			err = bkpfs_diff_versions(file, arg);
+		break;
+		case SEND_VERSION:
+			err = bkpfs_send_version(file, arg);
+		break;
 		case RESTORE_VERSION:
 			printk("INFO:restoring version %d",(int) arg);
-			error = bkpfs_restore_version(file, (int) arg, 0);
+			err = bkpfs_restore_version(file, (int) arg, 0);
                 break;
+		case STORE_STATS:
+			err = bkpfs_store_stats(file, arg);
+		break;
+		case VERSION_INFO:
+			err = bkpfs_version_info(file, arg);
+		break;
+		case VERSION_AT:
+			err = bkpfs_version_at(file, arg);
+		break;
+		case BACKUP_PROGRESS:
+			err = bkpfs_backup_progress(file, arg);
+		break;
+		case SCAN_PROGRESS:
+			err = bkpfs_scan_progress(file, arg);
+		break;
 		default:
 			/* XXX: use vfs_ioctl if/when VFS exports it */
 			if (!lower_file || !lower_file->f_op)
@@ -636,6 +1893,7 @@ static int bkpfs_open(struct inode *inode, struct file *file)
 	int err = 0;
 	struct file *lower_file = NULL;
 	struct path lower_path;
+	bool writer = false;
 
 	UDBG;
 	/* don't open unhashed/deleted files */
@@ -644,12 +1902,32 @@ static int bkpfs_open(struct inode *inode, struct file *file)
 		goto out_err;
 	}
 
+	/*
+	 * Count ourselves before waiting: a coalesced backup either sees
+	 * us and waits for our close, or we wait for it in
+	 * bkpfs_wait_backups (see bkpfs_coalesce_work).
+	 */
+	if ((file->f_mode & FMODE_WRITE) && S_ISREG(inode->i_mode)) {
+		atomic_inc(&BKPFS_I(inode)->writers);
+		smp_mb__after_atomic();
+		writer = true;
+	}
+
+	/* let a queued backup take its snapshot before we write again */
+	if (file->f_mode & FMODE_WRITE) {
+		err = bkpfs_wait_backups(inode);
+		if (err)
+			goto out_err;
+	}
+
 	file->private_data =
 		kzalloc(sizeof(struct bkpfs_file_info), GFP_KERNEL);
 	if (!BKPFS_F(file)) {
 		err = -ENOMEM;
 		goto out_err;
 	}
+	mutex_init(&BKPFS_F(file)->dirty_mutex);
+	bkpfs_extents_init(&BKPFS_F(file)->dirty);
 
 	/* open lower object and link bkpfs's file struct to lower's */
 	bkpfs_get_lower_path(file->f_path.dentry, &lower_path);
@@ -670,7 +1948,11 @@ static int bkpfs_open(struct inode *inode, struct file *file)
 		kfree(BKPFS_F(file));
 	else
 		fsstack_copy_attr_all(inode, bkpfs_lower_inode(inode));
+	if (!err && S_ISREG(inode->i_mode))
+		atomic_inc(&BKPFS_I(inode)->openers);
 out_err:
+	if (err && writer)
+		atomic_dec(&BKPFS_I(inode)->writers);
 	return err;
 }
 
@@ -689,178 +1971,582 @@ static int bkpfs_flush(struct file *file, fl_owner_t id)
 	return err;
 }
 
+/*
+ * bkpfs_commit_version - account for a version that was just written
+ * @dentry  : upper dentry of the file
+ * @bkp_dir : lower backup directory of the file
+ * @version : the version written, i.e. one past the newest so far
+ * @live    : the version is the file as it is now, so the next one
+ *	      may be a delta on top of it
+ *
+ * Unlinks the oldest version if keeping this one would exceed maxver,
+ * then makes @version the newest one.  Called with the backup_mutex of
+ * the inode held; the new range reaches the lower file on the next
+ * bkpfs_meta_sync.
+ */
+void bkpfs_commit_version(struct dentry *dentry, struct dentry *bkp_dir,
+			  int version, bool live)
+{
+	int old_version, next;
+
+	bkpfs_get_versions(dentry, &old_version, &next);
+	printk("INFO:oldest version : %d\n", old_version);
+	if (version - old_version >= BKPFS_SB(dentry->d_sb)->maxver &&
+	    !bkpfs_delta_detach(dentry, bkp_dir, old_version + 1)) {
+		/* not logged, not evicted: maxver is exceeded until next time */
+		if (!bkpfs_journal_unlink(dentry, old_version,
+					  old_version + 1)) {
+			bkpfs_unlink_backup(dentry, bkp_dir,
+					    (char *) dentry->d_name.name,
+					    old_version);
+			old_version++;
+			bkpfs_index_drop(dentry, bkp_dir, old_version - 1,
+					 old_version, old_version);
+			printk("INFO:oldest version as a result of max_ver exceed : %d\n",
+			       old_version);
+		}
+		bkpfs_journal_end(dentry->d_sb);
+	}
+	bkpfs_set_delta_base(dentry, live ? version : -1);
+	version++;
+	bkpfs_set_versions(dentry, old_version, version);
+	printk("INFO:Done setting version to : %d", version);
+}
+
+/*
+ * bkpfs_backup_from - make a version from the given contents
+ * @dentry     : the (upper) file for which backups need to be created.
+ * @lower_file : lower file to take the contents from: the file itself,
+ *		 or a snapshot of it (see bkpfs_queue_backup)
+ * @dirty      : ranges written since the newest version (format=delta),
+ *		 or NULL if they are not known
+ * @snap_seq   : write_seq of the inode when the snapshot was taken, or
+ *		 -1 when @lower_file is the file itself
+ *
+ * Returns 0 once the newest version holds the contents of the file,
+ * else the corresponding error code.
+ */
+static int bkpfs_backup_from(struct dentry *dentry, struct file *lower_file,
+			     struct bkpfs_extent_tree *dirty, s64 snap_seq);
+
 /*
  * bkpfs_create_new_backup - creates a new backup file, when ever 
  * 			     the file is opened in write mode
- * @file : the file for which backups need to be created.
+ * @dentry     : the (upper) file for which backups need to be created.
+ * @lower_file : the open lower file to take the contents from.
+ * @dirty      : ranges written since the newest version (format=delta),
+ *		 or NULL if they are not known
  *
  * creates a backup file by making use of the min and max versions.
+ * Only the dentry and the lower file are used, so this can run after
+ * the upper file has been released (see bkpfs_backup_work).
+ *
+ * Returns 0 once the newest version holds the contents of the file,
+ * else the corresponding error code.
  */
-static void
-bkpfs_create_new_backup(struct file *file) {
-	int error;
-	struct file *lower_file;
-	struct dentry *lower_parent_dentry = NULL;
-	struct qstr this;
-	struct qstr bkp_qstr;
-	char name[256];
-	char bkp_name[256];
+int
+bkpfs_create_new_backup(struct dentry *dentry, struct file *lower_file,
+			struct bkpfs_extent_tree *dirty) {
+	return bkpfs_backup_from(dentry, lower_file, dirty, -1);
+}
+
+static int bkpfs_backup_from(struct dentry *dentry, struct file *lower_file,
+			     struct bkpfs_extent_tree *dirty, s64 snap_seq)
+{
+	int error = 0;
 	struct dentry *bkpf_dentry = NULL;
 	struct dentry *bkpfile_dentry;
 
-	const char *v_new = "user.curr_version";
-        int curr_version;
-        int length;
-        char* curr_ver_str = NULL;
-        int version_diff;
-
-        const char *v_old = "user.old_version";
-        int old_version;
+	int old_version, curr_version;
 
 	struct file *backup_file = NULL;
 	size_t size;
-	struct path backup_path;
+	struct file *src = NULL;
+	struct bkpfs_csum csum;
+	struct bkpfs_progress *progress = &BKPFS_I(d_inode(dentry))->progress;
+	s64 seq;
+	int enc;
 
 	UDBG;
-        lower_file = bkpfs_lower_file(file);
-	lower_parent_dentry = lower_file->f_path.dentry->d_parent;
-
-	strcpy(name, ".");	
-	strcat(name, file->f_path.dentry->d_name.name);
-	strcat(name, ".bkp");
-        printk("INFO:Backup folder name:%s\n", name);
+	mutex_lock(&BKPFS_I(d_inode(dentry))->backup_mutex);
+	// Writes after this point (or the snapshot) are left for the next
+	seq = snap_seq >= 0 ? snap_seq :
+		atomic64_read(&BKPFS_I(d_inode(dentry))->write_seq);
+	// Logic to retive the current version of backup, cached in memory
+	error = bkpfs_get_versions(dentry, &old_version, &curr_version);
+	if (error)
+		goto out_err;
+        printk("INFO:current version %d\n",curr_version);
 
-	printk("Lookup for backup folder dentry\n");
-        this.name = name;
-        this.len = strlen(name);
-        this.hash = full_name_hash(lower_parent_dentry, this.name, this.len);
-        bkpf_dentry = d_lookup(lower_parent_dentry, &this);
-	if (!bkpf_dentry) {
+	// Looked up once, then pinned in the inode (see bkpfs_bkp_dir)
+	bkpf_dentry = bkpfs_bkp_dir_make(dentry);
+	if (IS_ERR(bkpf_dentry)) {
 		printk("INFO: no such backup folder exists!\n");
+		error = PTR_ERR(bkpf_dentry);
+		bkpf_dentry = NULL;
 		goto out_err;
 	}
 	printk("INFO:Backup folder found. Yay!\n");
 
-	// Logic to retive the current version of backup for xattr
-	error = vfs_getxattr(lower_file->f_path.dentry, v_new,
-                             (void *)&curr_version, sizeof(int));
-        printk("INFO:current version %d\n",curr_version);
-	
-	length = snprintf(NULL, 0, "%d", curr_version);
-        curr_ver_str = kmalloc(length + 1, GFP_KERNEL);
-        snprintf(curr_ver_str, length + 1, "%d", curr_version);
-        printk("INFO:current version string : %s\n",curr_ver_str);
-
-	strcpy(bkp_name, ".");
-	strcat(bkp_name, file->f_path.dentry->d_name.name);
-        strcat(bkp_name, ".");
-        strcat(bkp_name, curr_ver_str);
-        printk("Name of the backup file : %s\n", bkp_name);
-
-	printk("Instatiate a new negative dentry\n");
-        bkp_qstr.name = bkp_name;
-        bkp_qstr.len = strlen(bkp_name);
-        bkp_qstr.hash = full_name_hash(bkpf_dentry, bkp_qstr.name, bkp_qstr.len);
-        bkpfile_dentry = d_lookup(bkpf_dentry, &bkp_qstr);
-	if (bkpfile_dentry != NULL)
-		printk("INFO:dentry name : %s",bkpfile_dentry->d_name.name);
-        if (!bkpfile_dentry) {
-                printk("lower_dentry is null");
-                bkpfile_dentry = d_alloc(bkpf_dentry, &bkp_qstr);
-                if (!bkpfile_dentry) {
-                        error = -ENOMEM;
-                        goto out_err;
-                }
-        }
-	bkpf_dentry = lock_parent(bkpfile_dentry);
-	// Making the files read only
-        error = vfs_create(d_inode(bkpf_dentry), bkpfile_dentry,
-                        	0444, true);
-        if (error)
-                printk("ERROR:failed while vfs_create\n");
-   
-        unlock_dir(bkpf_dentry);
-        d_add(bkpfile_dentry, NULL);
-	printk("INFO:created new backup file.\n");
-
-	// Create path struct for backup file
-	backup_path.dentry = bkpfile_dentry;
-	backup_path.mnt = lower_file->f_path.mnt;
-	printk("INFO:created backup path struct. Fetching fp.\n");
-	backup_file = dentry_open(&backup_path, O_WRONLY, current_cred());
-        path_put(&backup_path);
-        if (IS_ERR(backup_file)) {
-                error = PTR_ERR(backup_file);
-                printk("ERROR:failed in dentry_open\n");
-                goto out_err;
-        }
+	// The lower file may be write-only, read through our own file
+	src = dentry_open(&lower_file->f_path, O_RDONLY, current_cred());
+	if (IS_ERR(src)) {
+		error = PTR_ERR(src);
+		src = NULL;
+		goto out_err;
+	}
+
+	// Rewriting the same bytes makes no version and evicts nothing
+	if (bkpfs_version_unchanged(dentry, src, bkpf_dentry, curr_version,
+				    &csum)) {
+		printk("INFO:contents unchanged, no new version\n");
+		BKPFS_I(d_inode(dentry))->trunc_floor = LLONG_MAX;
+		atomic64_set(&BKPFS_I(d_inode(dentry))->backup_seq, seq);
+		goto out_err;
+	}
 	
+	bkpfs_journal_begin(dentry, curr_version);
+
+	// Making the files read only, a leftover of a crash is emptied
+	backup_file = bkpfs_open_version(dentry, bkpf_dentry, curr_version,
+					 O_WRONLY);
+	if (IS_ERR(backup_file)) {
+		error = PTR_ERR(backup_file);
+		backup_file = NULL;
+		printk("ERROR:failed to create version %d\n", curr_version);
+		goto out_err;
+	}
+	bkpfile_dentry = backup_file->f_path.dentry;
+	printk("INFO:created new backup file %s\n",
+	       bkpfile_dentry->d_name.name);
+
 	// Writing contents to backup file
-	size = lower_file->f_inode->i_size;
-	lower_file->f_pos = 0;
-        backup_file->f_pos = 0;
-	
-	lower_file->f_mode |= FMODE_READ;
-        backup_file->f_mode &= ~(O_APPEND);
-        error = vfs_copy_file_range(lower_file, lower_file->f_pos, backup_file,
-                                  backup_file->f_pos, size, 0);
-        if (error >= 0) {
-                fsstack_copy_inode_size(d_inode(bkpfile_dentry),
-                                        file_inode(backup_file));
-                fsstack_copy_attr_times(d_inode(bkpfile_dentry),
-                                        file_inode(backup_file));
-        }
+	size = i_size_read(file_inode(lower_file));
+	atomic64_set(&progress->done, 0);
+	atomic64_set(&progress->total, size);
+	if (BKPFS_SB(dentry->d_sb)->format == BKPFS_FORMAT_DEDUP) {
+		error = bkpfs_chunk_backup(dentry->d_sb, src, backup_file,
+					   progress);
+		enc = BKPFS_ENC_CHUNKED;
+	} else if (bkpfs_delta_usable(dentry, src, bkpf_dentry,
+				      curr_version, dirty)) {
+		// Only the written ranges are copied
+		atomic64_set(&progress->total, min_t(loff_t, dirty->bytes,
+						     size));
+		error = bkpfs_delta_write(src, backup_file, dirty,
+					  curr_version - 1, progress);
+		enc = BKPFS_ENC_DELTA;
+	} else if (BKPFS_SB(dentry->d_sb)->compress) {
+		error = bkpfs_compress_file(dentry->d_sb, src, backup_file,
+					    size, progress);
+		enc = BKPFS_ENC_COMPRESSED;
+	} else {
+		// Clones the extents when the lower fs allows it (backup_mode)
+		error = bkpfs_copy_file(dentry->d_sb, src, backup_file, size,
+					progress);
+		enc = BKPFS_ENC_RAW;
+	}
+	atomic64_set(&progress->total, 0);
+	if (!error)
+		error = bkpfs_set_version_encoding(bkpfile_dentry, enc);
+	if (error) {
+		// A partial copy must not take the place of a version
+		printk(KERN_ERR "bkpfs: backup of %s failed: %d\n",
+		       dentry->d_name.name, error);
+		fput(backup_file);
+		backup_file = NULL;
+		bkpfs_unlink_backup(dentry, bkpf_dentry,
+				    (char *) dentry->d_name.name, curr_version);
+		goto out_err;
+	}
+	vfs_setxattr(bkpfile_dentry, BKPFS_XATTR_CSUM, (void *)&csum,
+		     sizeof(csum), 0);
+	bkpfs_index_add(dentry, bkpf_dentry, backup_file, curr_version, enc,
+			&csum, 0);
+	bkpfs_journal_data(dentry->d_sb, backup_file);
+	fsstack_copy_inode_size(d_inode(bkpfile_dentry),
+				file_inode(backup_file));
+	fsstack_copy_attr_times(d_inode(bkpfile_dentry),
+				file_inode(backup_file));
+	// Block crcs for DIFF_VERSIONS, the version is fine without them
+	if (BKPFS_SB(dentry->d_sb)->blocksums)
+		bkpfs_sum_write(dentry, bkpf_dentry, curr_version, src,
+				backup_file);
 
 	// Logic to maintain maxver number of backups
-	error = vfs_getxattr(lower_file->f_path.dentry, v_old,
-                                (void *)&old_version, sizeof(int));
-        printk("INFO:oldest version : %d\n", old_version);
-	version_diff = curr_version - old_version;
-        if (version_diff >= BKPFS_SB(file->f_path.dentry->d_sb)->maxver) {
-                bkpfs_unlink_backup(bkpf_dentry, (char *) file->f_path.dentry->d_name.name,
-				old_version);
-                old_version++;
-                printk("INFO:oldest version as a result of max_ver exceed : %d\n", old_version);
-                error = vfs_setxattr(lower_file->f_path.dentry, v_old,
-                                        (void *)&old_version, sizeof(int), 0);
-		printk("Unlinked the backup file version : %d\n", version_diff);
-	}
-	curr_version++;
-	error = vfs_setxattr(lower_file->f_path.dentry, v_new,
-				(void *)&curr_version, sizeof(int), 0);
-	printk("INFO:Done setting version to : %d", curr_version);
+	bkpfs_commit_version(dentry, bkpf_dentry, curr_version, true);
+	BKPFS_I(d_inode(dentry))->trunc_floor = LLONG_MAX;
+	atomic64_set(&BKPFS_I(d_inode(dentry))->backup_seq, seq);
 	printk("End of my code\n");
 
 out_err:
 	printk("INFO: my error code %d\n", error);
 	if (backup_file)
 		fput(backup_file);
-	if (curr_ver_str)
-		kfree(curr_ver_str);
+	if (src)
+		fput(src);
+	if (bkpf_dentry)
+		dput(bkpf_dentry);
+	mutex_unlock(&BKPFS_I(d_inode(dentry))->backup_mutex);
+	return error;
+}
+
+/* a backup queued at release time, see bkpfs_queue_backup */
+struct bkpfs_backup_job {
+	struct work_struct work;
+	struct dentry *dentry;		/* upper dentry, pinned */
+	struct file *lower_file;	/* lower file or its snapshot, pinned */
+	s64 snap_seq;			/* write_seq at the snapshot, or -1 */
+	const struct cred *cred;	/* creds of the closing process */
+	struct bkpfs_extent_tree dirty;	/* taken over from the file */
+	bool delta;			/* dirty is usable */
+};
+
+static void bkpfs_backup_work(struct work_struct *work)
+{
+	struct bkpfs_backup_job *job =
+		container_of(work, struct bkpfs_backup_job, work);
+	struct bkpfs_inode_info *info = BKPFS_I(d_inode(job->dentry));
+	struct bkpfs_sb_info *sbi = BKPFS_SB(job->dentry->d_sb);
+	const struct cred *old_cred;
+
+	UDBG;
+	old_cred = override_creds(job->cred);
+	bkpfs_backup_from(job->dentry, job->lower_file,
+			  job->delta ? &job->dirty : NULL, job->snap_seq);
+	bkpfs_meta_sync(job->dentry);
+	revert_creds(old_cred);
+	bkpfs_extents_clear(&job->dirty);
+
+	/* the version is taken, writers may go ahead */
+	if (atomic_dec_and_test(&info->backups_pending))
+		wake_up_all(&info->backup_waitq);
+	atomic_dec(&sbi->backups_queued);
+
+	fput(job->lower_file);
+	dput(job->dentry);
+	put_cred(job->cred);
+	kfree(job);
+}
+
+/*
+ * bkpfs_queue_backup - hand the backup of a released file to the workqueue
+ * @file  : upper file being released
+ * @dirty : its written ranges, moved to the job, or NULL
+ *
+ * The job pins the lower file and the dentry.  Until it has run, opens
+ * for writing and truncates of the inode wait in bkpfs_wait_backups,
+ * so versions are made in order.  That does not stop writers that had
+ * the file open already, shared writable mappings or writes to the
+ * lower file itself: when the lower file system can clone, the job
+ * copies a snapshot of the file cloned here instead, which holds it
+ * exactly as it was at close().  Otherwise it copies the file as it is
+ * when the job runs.
+ *
+ * Returns false if the backup must be made inline: backup=sync, a file
+ * below the async threshold, a full queue or no memory for the job.
+ */
+static bool bkpfs_queue_backup(struct file *file,
+			       struct bkpfs_extent_tree *dirty)
+{
+	struct dentry *dentry = file->f_path.dentry;
+	struct bkpfs_sb_info *sbi = BKPFS_SB(dentry->d_sb);
+	struct bkpfs_inode_info *info = BKPFS_I(d_inode(dentry));
+	struct file *lower_file = bkpfs_lower_file(file);
+	struct bkpfs_backup_job *job;
+
+	if (!sbi->backup_wq || sbi->async_min_size < 0 ||
+	    i_size_read(file_inode(lower_file)) < sbi->async_min_size)
+		return false;
+
+	if (atomic_inc_return(&sbi->backups_queued) > sbi->queue_depth)
+		goto out_full;
+
+	job = kmalloc(sizeof(*job), GFP_KERNEL);
+	if (!job)
+		goto out_full;
+
+	INIT_WORK(&job->work, bkpfs_backup_work);
+	job->dentry = dget(dentry);
+	job->snap_seq = -1;
+	job->lower_file = NULL;
+	if (sbi->can_reflink) {
+		/* writes racing with the clone are left for the next version */
+		job->snap_seq = atomic64_read(&info->write_seq);
+		job->lower_file = bkpfs_snapshot_file(lower_file);
+		if (IS_ERR(job->lower_file)) {
+			printk(KERN_DEBUG "bkpfs: no snapshot of %s (%ld)\n",
+			       dentry->d_name.name,
+			       PTR_ERR(job->lower_file));
+			job->snap_seq = -1;
+			job->lower_file = NULL;
+		}
+	}
+	if (!job->lower_file)
+		job->lower_file = get_file(lower_file);
+	job->cred = get_current_cred();
+	job->delta = dirty != NULL;
+	bkpfs_extents_init(&job->dirty);
+	if (dirty) {
+		job->dirty = *dirty;
+		bkpfs_extents_init(dirty);
+	}
+
+	atomic_inc(&info->backups_pending);
+	queue_work(sbi->backup_wq, &job->work);
+	return true;
+
+out_full:
+	atomic_dec(&sbi->backups_queued);
+	return false;
+}
+
+/*
+ * bkpfs_wait_backups - wait until queued backups of @inode are taken
+ *
+ * Called before anything that may change the contents of the lower
+ * file.  Also waits for an in-place restore, which replaces the lower
+ * file.  Returns 0, or -ERESTARTSYS if a fatal signal arrived.
+ */
+int bkpfs_wait_backups(struct inode *inode)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+
+	return wait_event_killable(info->backup_waitq,
+				   !atomic_read(&info->backups_pending) &&
+				   !atomic_read(&info->restoring));
+}
+
+/*
+ * bkpfs_coalesce_backup - fold the backup of a released file into a window
+ * @file  : upper file being released
+ * @dirty : its written ranges, merged into the window's, or NULL
+ *
+ * The first close of an inode opens a window of coalesce_ms; later closes
+ * inside it only replace the pinned lower file and creds, so the version
+ * made by bkpfs_coalesce_work holds the file as the last of them left it.
+ * The window is not pushed back by later closes, so a chatty writer still
+ * gets a version every coalesce_ms.
+ *
+ * Returns false if coalesce_ms= is not set.
+ */
+static bool bkpfs_coalesce_backup(struct file *file,
+				  struct bkpfs_extent_tree *dirty)
+{
+	struct dentry *dentry = file->f_path.dentry;
+	struct bkpfs_sb_info *sbi = BKPFS_SB(dentry->d_sb);
+	struct bkpfs_coalesce *c = &BKPFS_I(d_inode(dentry))->coalesce;
+	struct bkpfs_extent *ext;
+
+	if (!sbi->coalesce_ms)
+		return false;
+
+	mutex_lock(&c->lock);
+	if (!c->dentry) {
+		c->dentry = dget(dentry);
+		c->delta = true;
+		c->closes = 0;
+		spin_lock(&sbi->coalesce_lock);
+		list_add_tail(&c->list, &sbi->coalesce_pending);
+		spin_unlock(&sbi->coalesce_lock);
+	} else {
+		fput(c->lower_file);
+		put_cred(c->cred);
+	}
+	c->lower_file = get_file(bkpfs_lower_file(file));
+	c->cred = get_current_cred();
+
+	/* the union covers every change only if each session had its own */
+	if (!dirty)
+		c->delta = false;
+	for (ext = c->delta ? bkpfs_extent_first(dirty) : NULL; ext;
+	     ext = bkpfs_extent_next(ext)) {
+		if (bkpfs_extents_add(&c->dirty, ext->start, ext->end)) {
+			c->delta = false;
+			break;
+		}
+	}
+	if (!c->delta)
+		bkpfs_extents_clear(&c->dirty);
+	c->closes++;
+
+	/* a no-op while the window is open */
+	queue_delayed_work(sbi->backup_wq, &c->work,
+			   msecs_to_jiffies(sbi->coalesce_ms));
+	mutex_unlock(&c->lock);
+	return true;
+}
+
+/*
+ * bkpfs_coalesce_run - make the version a coalesce_ms window folded
+ * @info : inode whose window it is
+ * @own  : upper file of an ioctl caller, or NULL from the work
+ *
+ * If the file is open for writing again, the session is folded in too
+ * and the work tries again a window later.  The writer reference of
+ * @own does not count: the caller asked for the version and is not
+ * writing while it waits for it, but what it wrote is not in the
+ * window's ranges, so the version is then a full one.  Otherwise the
+ * run counts as a pending backup, like a queued one, so writers
+ * opening the file meanwhile wait for the copy to be taken.
+ */
+static void bkpfs_coalesce_run(struct bkpfs_inode_info *info,
+			       struct file *own)
+{
+	struct bkpfs_coalesce *c = &info->coalesce;
+	int own_writers = own && (own->f_mode & FMODE_WRITE) ? 1 : 0;
+	struct bkpfs_extent_tree dirty;
+	const struct cred *cred, *old_cred;
+	struct bkpfs_sb_info *sbi;
+	struct dentry *dentry;
+	struct file *lower_file;
+	bool delta;
+
+	UDBG;
+	mutex_lock(&c->lock);
+	dentry = c->dentry;
+	if (!dentry)
+		goto out_unlock;
+
+	/* pairs with the writers count taken in bkpfs_open */
+	atomic_inc(&info->backups_pending);
+	smp_mb__after_atomic();
+	sbi = BKPFS_SB(dentry->d_sb);
+	if (atomic_read(&info->writers) > own_writers) {
+		if (atomic_dec_and_test(&info->backups_pending))
+			wake_up_all(&info->backup_waitq);
+		queue_delayed_work(sbi->backup_wq, &c->work,
+				   msecs_to_jiffies(sbi->coalesce_ms));
+		goto out_unlock;
+	}
+
+	printk("INFO:%u closes folded into one version\n", c->closes);
+	spin_lock(&sbi->coalesce_lock);
+	list_del_init(&c->list);
+	spin_unlock(&sbi->coalesce_lock);
+	lower_file = c->lower_file;
+	cred = c->cred;
+	delta = c->delta &&
+		!(own && test_bit(BKPFS_FILE_WRITTEN, &BKPFS_F(own)->flags));
+	dirty = c->dirty;
+	bkpfs_extents_init(&c->dirty);
+	c->dentry = NULL;
+	c->lower_file = NULL;
+	c->cred = NULL;
+	mutex_unlock(&c->lock);
+
+	old_cred = override_creds(cred);
+	bkpfs_create_new_backup(dentry, lower_file, delta ? &dirty : NULL);
+	bkpfs_meta_sync(dentry);
+	revert_creds(old_cred);
+	bkpfs_extents_clear(&dirty);
+
+	if (atomic_dec_and_test(&info->backups_pending))
+		wake_up_all(&info->backup_waitq);
+	fput(lower_file);
+	dput(dentry);
+	put_cred(cred);
+	return;
+
+out_unlock:
+	mutex_unlock(&c->lock);
+}
+
+void bkpfs_coalesce_work(struct work_struct *work)
+{
+	struct bkpfs_coalesce *c = container_of(to_delayed_work(work),
+						struct bkpfs_coalesce, work);
+
+	bkpfs_coalesce_run(container_of(c, struct bkpfs_inode_info, coalesce),
+			   NULL);
+}
+
+/*
+ * bkpfs_coalesce_flush_all - make every version still in a window
+ *
+ * Called at unmount, when no file is open for writing any more, so
+ * each work makes its version.
+ */
+void bkpfs_coalesce_flush_all(struct super_block *sb)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	struct bkpfs_coalesce *c;
+
+	spin_lock(&sbi->coalesce_lock);
+	while (!list_empty(&sbi->coalesce_pending)) {
+		c = list_first_entry(&sbi->coalesce_pending,
+				     struct bkpfs_coalesce, list);
+		list_del_init(&c->list);
+		spin_unlock(&sbi->coalesce_lock);
+		flush_delayed_work(&c->work);
+		spin_lock(&sbi->coalesce_lock);
+	}
+	spin_unlock(&sbi->coalesce_lock);
+}
+
+/*
+ * bkpfs_write_seq - does @inode have writes no version holds yet
+ *
+ * When several files wrote to the inode, the first of them to be
+ * released makes a version of all their writes so far; the others
+ * only make one if they wrote again since.
+ */
+static bool bkpfs_write_seq(struct inode *inode)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+
+	return atomic64_read(&info->write_seq) !=
+		atomic64_read(&info->backup_seq);
 }
 
 /* release all lower object references & free the file info structure */
 static int bkpfs_file_release(struct inode *inode, struct file *file)
 {
+	struct bkpfs_file_info *fi = BKPFS_F(file);
+	struct bkpfs_extent_tree *dirty = NULL;
 	struct file *lower_file;
 
 	UDBG;
 	lower_file = bkpfs_lower_file(file);
-	/*
-	 * Taggle to make sure that backup is created only when bkpfs_write
-	 * is invoked
-	 */
-	if (new_ver_toggle == 1) {
-		bkpfs_create_new_backup(file);
-		new_ver_toggle = 0;
+	/* a version only if this file wrote something no version holds */
+	if (test_bit(BKPFS_FILE_WRITTEN, &fi->flags) &&
+	    bkpfs_write_seq(inode)) {
+		/*
+		 * Our ranges cover every change since the newest version only
+		 * if nobody else has the file open for writing.
+		 */
+		if (BKPFS_SB(inode->i_sb)->format == BKPFS_FORMAT_DELTA &&
+		    (file->f_mode & FMODE_WRITE) && !fi->dirty_lost &&
+		    atomic_read(&BKPFS_I(inode)->writers) == 1)
+			dirty = &fi->dirty;
+		if (BKPFS_SB(inode->i_sb)->format != BKPFS_FORMAT_PREIMAGE &&
+		    !bkpfs_coalesce_backup(file, dirty) &&
+		    !bkpfs_queue_backup(file, dirty))
+			bkpfs_create_new_backup(file->f_path.dentry, lower_file,
+						dirty);
 	}
 
+	/* the last writer ends a format=preimage session */
+	if ((file->f_mode & FMODE_WRITE) && S_ISREG(inode->i_mode) &&
+	    atomic_dec_and_test(&BKPFS_I(inode)->writers))
+		bkpfs_capture_seal(file->f_path.dentry);
+
+	/* versions made or deleted through this file reach the lower one */
+	if (S_ISREG(inode->i_mode))
+		bkpfs_meta_sync(file->f_path.dentry);
+
+	/* the rebuilt copy is shared by users of the file, not kept after */
+	if (S_ISREG(inode->i_mode) &&
+	    atomic_dec_and_test(&BKPFS_I(inode)->openers))
+		bkpfs_view_drop(inode, 0);
+
 	if (lower_file) {
 		bkpfs_set_lower_file(file, NULL);
 		fput(lower_file);
 	}
 
-	kfree(BKPFS_F(file));
+	bkpfs_extents_clear(&fi->dirty);
+	kfree(fi);
 	return 0;
 }
 
@@ -880,6 +2566,8 @@ static int bkpfs_fsync(struct file *file, loff_t start, loff_t end,
 	bkpfs_get_lower_path(dentry, &lower_path);
 	err = vfs_fsync_range(lower_file, start, end, datasync);
 	bkpfs_put_lower_path(dentry, &lower_path);
+	if (!err && S_ISREG(file_inode(file)->i_mode))
+		err = bkpfs_meta_sync(dentry);
 out:
 	return err;
 }
@@ -957,6 +2645,8 @@ bkpfs_write_iter(struct kiocb *iocb, struct iov_iter *iter)
 {
 	int err;
 	struct file *file = iocb->ki_filp, *lower_file;
+	size_t count = iov_iter_count(iter);
+	loff_t pos;
 
 	UDBG;
 	lower_file = bkpfs_lower_file(file);
@@ -965,6 +2655,13 @@ bkpfs_write_iter(struct kiocb *iocb, struct iov_iter *iter)
 		goto out;
 	}
 
+	/* format=preimage: save what is about to be overwritten */
+	pos = (iocb->ki_flags & IOCB_APPEND) ?
+		i_size_read(file_inode(lower_file)) : iocb->ki_pos;
+	err = bkpfs_capture_range(file->f_path.dentry, pos, pos + count);
+	if (err)
+		goto out;
+
 	get_file(lower_file); /* prevent lower_file from being released */
 	iocb->ki_filp = lower_file;
 	err = lower_file->f_op->write_iter(iocb, iter);
@@ -976,6 +2673,11 @@ bkpfs_write_iter(struct kiocb *iocb, struct iov_iter *iter)
 					file_inode(lower_file));
 		fsstack_copy_attr_times(d_inode(file->f_path.dentry),
 					file_inode(lower_file));
+		/* format=delta: an async write may cover the whole iter */
+		if (err == -EIOCBQUEUED)
+			bkpfs_dirty_add(file, pos, pos + count);
+		else
+			bkpfs_dirty_add(file, iocb->ki_pos - err, iocb->ki_pos);
 	}
 out:
 	return err;
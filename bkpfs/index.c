@@ -0,0 +1,374 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "bkpfs.h"
+#include <linux/falloc.h>
+
+/*
+ * Version index of a file.
+ *
+ * Every backup directory holds a ".index" file with one fixed-size
+ * struct bkpfs_index_rec per version, the record of version N at offset
+ * N * sizeof(record).  The versions of a file are a contiguous range, so
+ * enumerating them is one sequential read instead of a lookup and a
+ * stat per version, and finding the version as of a given time is a
+ * binary search over the creation times.  Versions made before the
+ * index existed have an all-zero record (a hole); callers fall back to
+ * looking them up.  The records below the oldest version are punched
+ * out a page at a time.
+ */
+
+#define BKPFS_INDEX_NAME	".index"
+
+/*
+ * bkpfs_index_file - open the index of a lower backup directory
+ * @mnt     : lower mount of @bkp_dir
+ * @bkp_dir : the backup directory
+ * @flags   : open flags; unless O_RDONLY the index is created if needed
+ */
+struct file *bkpfs_index_file(struct vfsmount *mnt, struct dentry *bkp_dir,
+			      int flags)
+{
+	struct path path;
+	struct file *file;
+	int err = 0;
+
+	if (d_is_negative(bkp_dir))
+		return ERR_PTR(-ENOENT);
+	inode_lock_nested(d_inode(bkp_dir), I_MUTEX_PARENT);
+	path.dentry = lookup_one_len(BKPFS_INDEX_NAME, bkp_dir,
+				     strlen(BKPFS_INDEX_NAME));
+	if (IS_ERR(path.dentry)) {
+		inode_unlock(d_inode(bkp_dir));
+		return ERR_CAST(path.dentry);
+	}
+	if (d_is_negative(path.dentry))
+		err = (flags & O_ACCMODE) == O_RDONLY ? -ENOENT :
+			vfs_create(d_inode(bkp_dir), path.dentry, 0600, true);
+	inode_unlock(d_inode(bkp_dir));
+	if (err) {
+		dput(path.dentry);
+		return ERR_PTR(err);
+	}
+
+	path.mnt = mnt;
+	file = dentry_open(&path, flags, current_cred());
+	dput(path.dentry);
+	return file;
+}
+
+static struct file *bkpfs_index_open(struct dentry *dentry,
+				     struct dentry *bkp_dir, int flags)
+{
+	struct path lower_path;
+	struct file *file;
+
+	bkpfs_get_lower_path(dentry, &lower_path);
+	file = bkpfs_index_file(lower_path.mnt, bkp_dir, flags);
+	bkpfs_put_lower_path(dentry, &lower_path);
+	return file;
+}
+
+/*
+ * bkpfs_index_read - read the records of versions [@first, @last)
+ * @dentry  : upper dentry of the file
+ * @bkp_dir : its lower backup directory
+ * @first   : first version
+ * @last    : one past the last version
+ * @recs    : out: @last - @first records, zeroed where none was written
+ *
+ * Returns 0 on success, -ENOENT if the file has no index, else the
+ * corresponding error code.
+ */
+int bkpfs_index_read(struct dentry *dentry, struct dentry *bkp_dir,
+		     int first, int last, struct bkpfs_index_rec *recs)
+{
+	size_t len = (last - first) * sizeof(*recs);
+	loff_t pos = (loff_t)first * sizeof(*recs);
+	struct file *file;
+	ssize_t ret;
+
+	if (first < 0 || last <= first)
+		return -EINVAL;
+	memset(recs, 0, len);
+	file = bkpfs_index_open(dentry, bkp_dir, O_RDONLY);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+	/* a short read is the end of the file: records never written */
+	ret = kernel_read(file, recs, len, &pos);
+	fput(file);
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * bkpfs_index_get - read the record of one version
+ *
+ * Returns 0 if the version has a record, -ENOENT if not, else the
+ * corresponding error code.
+ */
+int bkpfs_index_get(struct dentry *dentry, struct dentry *bkp_dir,
+		    int version, struct bkpfs_index_rec *rec)
+{
+	int err;
+
+	err = bkpfs_index_read(dentry, bkp_dir, version, version + 1, rec);
+	if (!err && le32_to_cpu(rec->version) != version)
+		err = -ENOENT;
+	return err;
+}
+
+/*
+ * bkpfs_index_put - write the record of a version
+ * @dentry  : upper dentry of the file
+ * @bkp_dir : its lower backup directory
+ * @rec     : the record, at the offset of rec->version
+ *
+ * Callers hold the backup_mutex of the inode.  Returns 0 on success,
+ * else the corresponding error code.
+ */
+int bkpfs_index_put(struct dentry *dentry, struct dentry *bkp_dir,
+		    const struct bkpfs_index_rec *rec)
+{
+	loff_t pos = (loff_t)le32_to_cpu(rec->version) * sizeof(*rec);
+	struct file *file;
+	ssize_t ret;
+
+	file = bkpfs_index_open(dentry, bkp_dir, O_RDWR);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+	ret = kernel_write(file, rec, sizeof(*rec), &pos);
+	fput(file);
+	if (ret != sizeof(*rec))
+		return ret < 0 ? ret : -EIO;
+	return 0;
+}
+
+/*
+ * bkpfs_index_add - record a version that was just written
+ * @dentry  : upper dentry of the file
+ * @bkp_dir : its lower backup directory
+ * @vfile   : the version file, still open
+ * @version : its number
+ * @enc     : enum bkpfs_encoding
+ * @csum    : size and checksum of the file it holds
+ * @ctime   : when the file held what the version does, 0 for now
+ *
+ * A pre-image version holds the file as it was when its session began,
+ * not when it was sealed, which is the time bkpfs_index_at must find.
+ */
+int bkpfs_index_add(struct dentry *dentry, struct dentry *bkp_dir,
+		    struct file *vfile, int version, int enc,
+		    const struct bkpfs_csum *csum, u64 ctime)
+{
+	struct bkpfs_index_rec rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.version = cpu_to_le32(version);
+	rec.encoding = cpu_to_le32(enc);
+	rec.ctime = cpu_to_le64(ctime ? ctime : ktime_get_real_ns());
+	rec.size = csum->size;
+	rec.stored = cpu_to_le64(i_size_read(file_inode(vfile)));
+	rec.crc = csum->crc;
+	rec.flags = cpu_to_le32(BKPFS_INDEX_LIVE |
+		((le32_to_cpu(csum->flags) & BKPFS_CSUM_CRC) ?
+		 BKPFS_INDEX_CRC : 0));
+	return bkpfs_index_put(dentry, bkp_dir, &rec);
+}
+
+/*
+ * bkpfs_index_from_file - make the record of a version from its file
+ * @vdentry : lower dentry of the version file, positive
+ * @prev    : lower dentry of version @version - 1, or NULL
+ * @version : its number
+ * @rec     : out: the record, as far as the file tells
+ *
+ * For versions without a record: the creation time is the mtime of the
+ * file, which was last written when the version was made (its ctime
+ * moves with every xattr set on it later), and the size is only known
+ * from a checksum or a raw copy.  A pre-image is dated by the version
+ * before it instead: its session began after that one was sealed, and
+ * the file did not change between.
+ */
+void bkpfs_index_from_file(struct dentry *vdentry, struct dentry *prev,
+			   int version, struct bkpfs_index_rec *rec)
+{
+	struct bkpfs_csum csum;
+	int enc;
+
+	memset(rec, 0, sizeof(*rec));
+	enc = bkpfs_version_encoding(vdentry);
+	rec->version = cpu_to_le32(version);
+	rec->encoding = cpu_to_le32(enc);
+	rec->ctime = cpu_to_le64(timespec64_to_ns(&d_inode(vdentry)->i_mtime));
+	if (enc == BKPFS_ENC_PREIMAGE && prev && d_is_positive(prev))
+		rec->ctime =
+			cpu_to_le64(timespec64_to_ns(&d_inode(prev)->i_mtime));
+	rec->stored = cpu_to_le64(i_size_read(d_inode(vdentry)));
+	rec->flags = cpu_to_le32(BKPFS_INDEX_LIVE);
+	if (vfs_getxattr(vdentry, BKPFS_XATTR_CSUM, (void *)&csum,
+			 sizeof(csum)) == sizeof(csum)) {
+		rec->size = csum.size;
+		rec->crc = csum.crc;
+		if (le32_to_cpu(csum.flags) & BKPFS_CSUM_CRC)
+			rec->flags |= cpu_to_le32(BKPFS_INDEX_CRC);
+	} else if (enc == BKPFS_ENC_RAW) {
+		rec->size = rec->stored;
+	}
+}
+
+/*
+ * bkpfs_index_of_version - make the record of a version from its files
+ * @dentry  : upper dentry of the file
+ * @bkp_dir : its lower backup directory
+ * @version : the version
+ * @rec     : out: the record, see bkpfs_index_from_file
+ *
+ * Opens the version, and the one before it if it is a pre-image, so that
+ * every reader of a version without a record dates it the same way.
+ *
+ * Returns 0 on success, else the error from opening the version.
+ */
+int bkpfs_index_of_version(struct dentry *dentry, struct dentry *bkp_dir,
+			   int version, struct bkpfs_index_rec *rec)
+{
+	struct file *vfile, *prev = NULL;
+
+	vfile = bkpfs_open_version(dentry, bkp_dir, version, O_RDONLY);
+	if (IS_ERR(vfile))
+		return PTR_ERR(vfile);
+	if (version > 0 && bkpfs_version_encoding(vfile->f_path.dentry) ==
+	    BKPFS_ENC_PREIMAGE)
+		prev = bkpfs_open_version(dentry, bkp_dir, version - 1,
+					  O_RDONLY);
+	bkpfs_index_from_file(vfile->f_path.dentry,
+			      IS_ERR_OR_NULL(prev) ? NULL :
+			      prev->f_path.dentry, version, rec);
+	if (!IS_ERR_OR_NULL(prev))
+		fput(prev);
+	fput(vfile);
+	return 0;
+}
+
+/*
+ * bkpfs_index_drop - mark versions unlinked
+ * @dentry  : upper dentry of the file
+ * @bkp_dir : its lower backup directory
+ * @first   : first version unlinked
+ * @last    : one past the last version unlinked
+ * @oldest  : oldest version kept, once they are gone
+ *
+ * The index is opened once and the records rewritten a batch at a time.
+ * The pages holding only records older than @oldest are then punched
+ * out, so the index of a file keeps the size of its live range; records
+ * in those pages are not rewritten first.
+ */
+void bkpfs_index_drop(struct dentry *dentry, struct dentry *bkp_dir,
+		      int first, int last, int oldest)
+{
+	struct bkpfs_index_rec *recs;
+	struct file *file;
+	loff_t dead, pos;
+	ssize_t ret;
+	int v, i, n;
+
+	file = bkpfs_index_open(dentry, bkp_dir, O_RDWR);
+	if (IS_ERR(file))
+		return;
+	dead = round_down((loff_t)oldest * sizeof(*recs), PAGE_SIZE);
+
+	recs = kmalloc_array(BKPFS_INDEX_BATCH, sizeof(*recs), GFP_KERNEL);
+	v = max_t(loff_t, first, dead / sizeof(*recs));
+	for (; recs && v < last; v += n) {
+		n = min(last - v, BKPFS_INDEX_BATCH);
+		pos = (loff_t)v * sizeof(*recs);
+		ret = kernel_read(file, recs, n * sizeof(*recs), &pos);
+		/* a short read is the end of the file: records never written */
+		n = ret > 0 ? ret / sizeof(*recs) : 0;
+		if (!n)
+			break;
+		for (i = 0; i < n; i++)
+			if (le32_to_cpu(recs[i].version) == v + i)
+				recs[i].flags &= ~cpu_to_le32(BKPFS_INDEX_LIVE);
+		pos = (loff_t)v * sizeof(*recs);
+		kernel_write(file, recs, n * sizeof(*recs), &pos);
+	}
+	kfree(recs);
+
+	/* only saves space, fine to fail on lower fs without holes */
+	if (dead)
+		vfs_fallocate(file, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			      0, dead);
+	fput(file);
+}
+
+/* when version @v was made, from @index (may be NULL) or its file */
+static int bkpfs_index_ctime(struct dentry *dentry, struct dentry *bkp_dir,
+			     struct file *index, int v, u64 *ns)
+{
+	struct bkpfs_index_rec rec;
+	loff_t pos = (loff_t)v * sizeof(rec);
+	int err;
+
+	if (!(index && kernel_read(index, &rec, sizeof(rec), &pos) ==
+	      sizeof(rec) && le32_to_cpu(rec.version) == v)) {
+		/* made before the index: dated as the listing dates it */
+		err = bkpfs_index_of_version(dentry, bkp_dir, v, &rec);
+		if (err)
+			return err;
+	}
+	*ns = le64_to_cpu(rec.ctime);
+	return 0;
+}
+
+/*
+ * bkpfs_index_at - newest version made at or before a time
+ * @dentry  : upper dentry of the file
+ * @bkp_dir : its lower backup directory
+ * @oldest  : oldest version kept
+ * @next    : one past the newest version
+ * @ns      : the time, in ns since the epoch
+ * @ctime   : out: when the version found was made
+ *
+ * Versions are made in order, so their creation times are sorted and a
+ * binary search reads about log2(@next - @oldest) records.
+ *
+ * Returns the version, -ENOENT if every version is newer than @ns, else
+ * the corresponding error code.
+ */
+int bkpfs_index_at(struct dentry *dentry, struct dentry *bkp_dir,
+		   int oldest, int next, u64 ns, u64 *ctime)
+{
+	struct file *index;
+	int lo = oldest, hi = next, found = -ENOENT;
+	int mid, err = 0;
+	u64 t;
+
+	index = bkpfs_index_open(dentry, bkp_dir, O_RDONLY);
+	if (IS_ERR(index))
+		index = NULL;
+	/* the answer is in [lo, hi) or none */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		err = bkpfs_index_ctime(dentry, bkp_dir, index, mid, &t);
+		if (err)
+			break;
+		if (t <= ns) {
+			found = mid;
+			*ctime = t;
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (index)
+		fput(index);
+	return err ? err : found;
+}
@@ -15,8 +15,9 @@
  * Made changes in this function to create a new directory
  * every time a new file is created i.e. bkpfs_create 
  * is called. The name of the directory is FILENAME.bkp
- * And setting up the extended attrs of the inode to 
- * hold :
+ * (not with store=central, see store.c)
+ * And setting up the version range of the inode, kept in
+ * the user.bkpfs_meta xattr of the lower file :
  * 	1. minimum version i.e old_version
  *	2. maximum version i.e curr_version
  * Both of these values are initialised to 1.
@@ -29,14 +30,6 @@ static int bkpfs_create(struct inode *dir, struct dentry *dentry,
 	struct dentry *lower_dentry;
 	struct dentry *lower_parent_dentry = NULL;
 	struct path lower_path;
-	
-	// Variables to accommodate xattrs for curr version
-	int curr_version = 1;
-	int old_version = 1;
-	const char *v_curr = "user.curr_version"; 
-	const char *v_old = "user.old_version";
-	const void *curr_val = &curr_version;
-	const void *old_val = &old_version;
 
 	// Create new folder in current location
 	struct dentry *bkpf_dentry;
@@ -82,11 +75,13 @@ static int bkpfs_create(struct inode *dir, struct dentry *dentry,
 	fsstack_copy_inode_size(dir, d_inode(lower_parent_dentry));
 	
 	
-	// Setting up xattrs
-	error = vfs_setxattr(lower_dentry, v_curr, curr_val, sizeof(int), 0);
-	printk("INFO:Done setting up inital version with : %d",curr_version);
-	error = vfs_setxattr(lower_dentry, v_old, old_val, sizeof(int), 0);
-        printk("INFO:Done setting up inital version with : %d",old_version);		
+	// Setting up the version range, one packed xattr (see meta.c)
+	error = bkpfs_meta_init(dentry);
+	printk("INFO:Done setting up inital versions : %d\n", error);
+
+	// store=central: the first version makes its directory (store.c)
+	if (BKPFS_SB(dir->i_sb)->store == BKPFS_STORE_CENTRAL)
+		goto out;
 
 	// Generate name of the bkp directory
 	strcpy(name, ".");
@@ -111,11 +106,11 @@ static int bkpfs_create(struct inode *dir, struct dentry *dentry,
 
 	lower_parent_dentry = lock_parent(bkpf_dentry);
 	error = vfs_mkdir(d_inode(lower_parent_dentry), bkpf_dentry, mode);
-	if (error) {
-		unlock_dir(lower_parent_dentry);
-                goto out;
-	}		
 	unlock_dir(lower_parent_dentry);
+	// Pinned in the inode, the first backup needs no lookup
+	if (!error)
+		bkpfs_bkp_dir_set(d_inode(dentry), bkpf_dentry);
+	dput(bkpf_dentry);
 	
 out:
 	if(error == -EPERM) 
@@ -195,9 +190,17 @@ static int bkpfs_unlink(struct inode *dir, struct dentry *dentry)
 	set_nlink(d_inode(dentry),
 		  bkpfs_lower_inode(d_inode(dentry))->i_nlink);
 	d_inode(dentry)->i_ctime = dir->i_ctime;
+	/*
+	 * the backup directory keeps its name, let it go with the file;
+	 * store=central removes it once the last link and user are gone
+	 */
+	bkpfs_bkp_dir_set(d_inode(dentry), NULL);
 	d_drop(dentry); /* this is needed, else LTP fails (VFS won't do it) */
 out:
 	unlock_dir(lower_dir_dentry);
+	/* may wait for a rebuild, not under the lock of the directory */
+	if (!err)
+		bkpfs_view_drop(d_inode(dentry), 0);
 	dput(lower_dentry);
 	bkpfs_put_lower_path(dentry, &lower_path);
 	return err;
@@ -365,6 +368,11 @@ static int bkpfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 	if (err)
 		goto out;
 
+	/* ".F.bkp" is not renamed along, it no longer matches either file */
+	bkpfs_bkp_dir_set(d_inode(old_dentry), NULL);
+	if (d_really_is_positive(new_dentry))
+		bkpfs_bkp_dir_set(d_inode(new_dentry), NULL);
+
 	fsstack_copy_attr_all(new_dir, d_inode(lower_new_dir_dentry));
 	fsstack_copy_inode_size(new_dir, d_inode(lower_new_dir_dentry));
 	if (new_dir != old_dir) {
@@ -376,6 +384,12 @@ static int bkpfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 
 out:
 	unlock_rename(lower_old_dir_dentry, lower_new_dir_dentry);
+	/* and the rebuilt versions, once the directories are unlocked */
+	if (!err) {
+		bkpfs_view_drop(d_inode(old_dentry), 0);
+		if (d_really_is_positive(new_dentry))
+			bkpfs_view_drop(d_inode(new_dentry), 0);
+	}
 	dput(lower_old_dir_dentry);
 	dput(lower_new_dir_dentry);
 	bkpfs_put_lower_path(old_dentry, &lower_old_path);
@@ -495,6 +509,19 @@ static int bkpfs_setattr(struct dentry *dentry, struct iattr *ia)
 		err = inode_newsize_ok(inode, ia->ia_size);
 		if (err)
 			goto out;
+		/* a queued backup still needs the old contents */
+		err = bkpfs_wait_backups(inode);
+		if (err)
+			goto out;
+		/* format=preimage: save the tail being cut off */
+		if (ia->ia_size < i_size_read(lower_inode)) {
+			err = bkpfs_capture_range(dentry, ia->ia_size,
+						  i_size_read(lower_inode));
+			if (err)
+				goto out;
+			/* format=delta: the tail may come back as zeroes */
+			bkpfs_dirty_truncate(inode, ia->ia_size);
+		}
 		truncate_setsize(inode, ia->ia_size);
 	}
 
@@ -520,6 +547,11 @@ static int bkpfs_setattr(struct dentry *dentry, struct iattr *ia)
 
 	/* get attributes from the lower inode */
 	fsstack_copy_attr_all(inode, lower_inode);
+
+	/* truncate(2) on a file nobody has open ends its session here */
+	if ((ia->ia_valid & ATTR_SIZE) && S_ISREG(inode->i_mode) &&
+	    !atomic_read(&BKPFS_I(inode)->writers))
+		bkpfs_capture_seal(dentry);
 	/*
 	 * Not running fsstack_copy_inode_size(inode, lower_inode), because
 	 * VFS should update our inode size, and notify_change on
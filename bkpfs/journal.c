@@ -0,0 +1,727 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "bkpfs.h"
+#include <linux/crc32c.h>
+
+/*
+ * Journal of version events (journal=on).
+ *
+ * Making a version touches several lower objects in no particular
+ * order: the version file, its index record and the user.bkpfs_meta
+ * xattr of the file.  After a crash the xattr could name versions whose
+ * data never reached the disk, or versions already unlinked.  With
+ * journal=on the mount appends three kinds of records to ..bkp/journal:
+ *
+ *	BEGIN	file, version	before a version file is created
+ *	UNLINK	file, versions	before version files are unlinked
+ *	RANGE	file, meta	before user.bkpfs_meta is written
+ *
+ * A file is named by its lower inode number and generation, and found
+ * again through a file handle of the lower file system: a path could
+ * name another file by the time the journal is replayed.
+ *
+ * RANGE and UNLINK records are durable before their xattr is written or
+ * their versions unlinked, together with the data of the versions
+ * logged before them.  Closes do not each fsync
+ * the journal: the first one needing a commit writes back every version
+ * logged so far and fsyncs the journal once, while the others queue
+ * behind it and usually find their records committed by then (group
+ * commit).  On a journaling lower file system that fsync also commits
+ * the metadata of the version files.
+ *
+ * At mount time the journal is replayed: the last RANGE of each file,
+ * less the versions unlinked after it, is written to its xattr and the
+ * versions begun past that range are rolled back.  The lower file system is then synced and the journal emptied;
+ * this checkpoint is also taken at unmount and whenever the journal
+ * grows past BKPFS_JOURNAL_MAX.
+ */
+
+#define BKPFS_JOURNAL_NAME	"journal"
+#define BKPFS_JOURNAL_MAX	(1024 * 1024)
+#define BKPFS_JMAGIC		0x6c6e726a	/* "jrnl" */
+
+#define BKPFS_JFH_WORDS		(MAX_HANDLE_SZ / sizeof(u32))
+
+enum bkpfs_jrec_type {
+	BKPFS_JREC_BEGIN = 1,
+	BKPFS_JREC_RANGE,
+	BKPFS_JREC_UNLINK,
+};
+
+/* followed by a connectable file handle of the lower file */
+struct bkpfs_jrec {
+	__le32 magic;
+	__le16 type;		/* enum bkpfs_jrec_type */
+	__le16 len;		/* bytes of the file handle */
+	__le64 seq;
+	__le64 ino;		/* lower inode of the file */
+	__le32 gen;		/* and its generation */
+	__le32 fh_type;		/* type of the file handle */
+	__le32 version;		/* BEGIN, first one of UNLINK */
+	__le32 last;		/* UNLINK: one past the last version */
+	__le32 crc;		/* crc32c of the record, with 0 here, and handle */
+	__le32 pad;
+	struct bkpfs_meta meta;	/* RANGE */
+};
+
+/* a version file the next commit writes back */
+struct bkpfs_jdata {
+	struct list_head list;
+	struct file *file;
+};
+
+/* versions unlinked, [first, last) */
+struct bkpfs_jgone {
+	int first, last;
+};
+
+/* what the journal says about one file, while replaying it */
+struct bkpfs_jfile {
+	struct list_head list;
+	u64 ino;
+	u32 gen;
+	int fh_type, fh_len;	/* fh_len in bytes */
+	u32 fh[BKPFS_JFH_WORDS];
+	bool ranged;		/* meta is the last RANGE */
+	struct bkpfs_meta meta;
+	int first, last;	/* versions begun since, first -1 if none */
+	struct bkpfs_jgone *gone;	/* versions unlinked since */
+	unsigned int nr_gone;
+};
+
+/*
+ * bkpfs_journal_key - name the lower file of @dentry in a record
+ * @dentry : upper dentry of the file
+ * @rec    : record to fill the inode number and handle type of
+ * @fh     : out: the handle, BKPFS_JFH_WORDS long
+ *
+ * The handle is connectable, so that replay finds the parent directory
+ * too, where the backup directory of the file is.
+ *
+ * Returns 0, or -EOPNOTSUPP if the lower file system cannot make one.
+ */
+static int bkpfs_journal_key(struct dentry *dentry, struct bkpfs_jrec *rec,
+			     u32 *fh)
+{
+	struct path lower_path;
+	struct inode *inode;
+	int words = BKPFS_JFH_WORDS;
+	int type;
+
+	bkpfs_get_lower_path(dentry, &lower_path);
+	inode = d_inode(lower_path.dentry);
+	rec->ino = cpu_to_le64(inode->i_ino);
+	rec->gen = cpu_to_le32(inode->i_generation);
+	type = exportfs_encode_fh(lower_path.dentry, (struct fid *)fh, &words,
+				  1);
+	bkpfs_put_lower_path(dentry, &lower_path);
+	if (type <= 0 || type == FILEID_INVALID || !words)
+		return -EOPNOTSUPP;
+	rec->fh_type = cpu_to_le32(type);
+	rec->len = cpu_to_le16(words * sizeof(u32));
+	return 0;
+}
+
+/* append a record, returns its sequence number in @seq */
+static int bkpfs_journal_append(struct bkpfs_journal *j,
+				struct bkpfs_jrec *rec, const u32 *fh,
+				u64 *seq)
+{
+	size_t len = le16_to_cpu(rec->len);
+	loff_t pos;
+	ssize_t ret;
+	int err = 0;
+	u32 crc;
+
+	rec->magic = cpu_to_le32(BKPFS_JMAGIC);
+
+	mutex_lock(&j->lock);
+	rec->seq = cpu_to_le64(j->seq + 1);
+	rec->crc = 0;
+	crc = crc32c(~0, rec, sizeof(*rec));
+	rec->crc = cpu_to_le32(crc32c(crc, fh, len));
+
+	/* a failed append is overwritten by the next one */
+	pos = j->pos;
+	ret = kernel_write(j->file, rec, sizeof(*rec), &pos);
+	if (ret != sizeof(*rec))
+		goto out_short;
+	ret = kernel_write(j->file, fh, len, &pos);
+	if (ret != len)
+		goto out_short;
+	j->pos = pos;
+	*seq = ++j->seq;
+	goto out;
+
+out_short:
+	err = ret < 0 ? ret : -EIO;
+out:
+	mutex_unlock(&j->lock);
+	return err;
+}
+
+/* name the file of @dentry in @rec and append it */
+static int bkpfs_journal_log(struct bkpfs_journal *j, struct dentry *dentry,
+			     struct bkpfs_jrec *rec, u64 *seq)
+{
+	u32 fh[BKPFS_JFH_WORDS];
+	int err;
+
+	err = bkpfs_journal_key(dentry, rec, fh);
+	if (!err)
+		err = bkpfs_journal_append(j, rec, fh, seq);
+	return err;
+}
+
+/* write back version files taken off the data list, and drop them */
+static int bkpfs_journal_writeback(struct list_head *batch)
+{
+	struct bkpfs_jdata *d, *tmp;
+	int err = 0, ret;
+
+	list_for_each_entry_safe(d, tmp, batch, list) {
+		ret = filemap_write_and_wait(d->file->f_mapping);
+		if (ret && !err)
+			err = ret;
+		list_del(&d->list);
+		fput(d->file);
+		kfree(d);
+	}
+	return err;
+}
+
+/*
+ * bkpfs_journal_commit - make the records up to @seq durable
+ *
+ * Whoever gets the commit_mutex commits every record appended so far,
+ * so the callers that waited for it usually find their records
+ * committed and return without any I/O.
+ */
+static int bkpfs_journal_commit(struct bkpfs_journal *j, u64 seq)
+{
+	LIST_HEAD(batch);
+	u64 target;
+	int err = 0;
+
+	mutex_lock(&j->commit_mutex);
+	if (j->committed >= seq)
+		goto out;
+	if (j->failed >= seq) {
+		err = j->err;
+		goto out;
+	}
+
+	mutex_lock(&j->lock);
+	target = j->seq;
+	list_splice_init(&j->data, &batch);
+	mutex_unlock(&j->lock);
+
+	/* the data of the versions first, then the records naming them */
+	err = bkpfs_journal_writeback(&batch);
+	if (!err)
+		err = vfs_fsync(j->file, 0);
+	if (err) {
+		printk(KERN_ERR "bkpfs: journal commit failed: %d\n", err);
+		j->failed = target;
+		j->err = err;
+		goto out;
+	}
+	printk("INFO:journal commit of %llu records\n",
+	       target - j->committed);
+	j->committed = target;
+out:
+	mutex_unlock(&j->commit_mutex);
+	return err;
+}
+
+/* sync the lower fs, after which the journal says nothing new */
+static int bkpfs_journal_checkpoint(struct bkpfs_journal *j, bool force)
+{
+	struct super_block *lower_sb = file_inode(j->file)->i_sb;
+	LIST_HEAD(batch);
+	int err = 0;
+
+	down_write(&j->ckpt_rwsem);
+	mutex_lock(&j->commit_mutex);
+	mutex_lock(&j->lock);
+	if (!force && j->pos < BKPFS_JOURNAL_MAX)
+		goto out;	/* somebody just did it */
+
+	list_splice_init(&j->data, &batch);
+	bkpfs_journal_writeback(&batch);
+	down_read(&lower_sb->s_umount);
+	err = sync_filesystem(lower_sb);
+	up_read(&lower_sb->s_umount);
+	if (!err)
+		err = bkpfs_truncate_file(j->file, 0);
+	if (!err)
+		err = vfs_fsync(j->file, 0);
+	if (err) {
+		printk(KERN_ERR "bkpfs: journal checkpoint failed: %d\n", err);
+		goto out;
+	}
+	j->pos = 0;
+	j->committed = j->seq;
+out:
+	mutex_unlock(&j->lock);
+	mutex_unlock(&j->commit_mutex);
+	up_write(&j->ckpt_rwsem);
+	return err;
+}
+
+/*
+ * bkpfs_journal_begin - log a version about to be created
+ * @dentry  : upper dentry of the file
+ * @version : number of the version
+ *
+ * Not committed: if it is lost the version was not made durable either,
+ * it is only left for the next version of that number to overwrite.
+ */
+void bkpfs_journal_begin(struct dentry *dentry, int version)
+{
+	struct bkpfs_journal *j = BKPFS_SB(dentry->d_sb)->journal;
+	struct bkpfs_jrec rec;
+	u64 seq;
+
+	if (!j)
+		return;
+	memset(&rec, 0, sizeof(rec));
+	rec.type = cpu_to_le16(BKPFS_JREC_BEGIN);
+	rec.version = cpu_to_le32(version);
+	bkpfs_journal_log(j, dentry, &rec, &seq);
+}
+
+/*
+ * bkpfs_journal_data - have the next commit write back a version file
+ * @sb    : bkpfs superblock
+ * @vfile : the version file, just filled
+ *
+ * Its writeback starts now, so the commit mostly waits for I/O that is
+ * already in flight.
+ */
+void bkpfs_journal_data(struct super_block *sb, struct file *vfile)
+{
+	struct bkpfs_journal *j = BKPFS_SB(sb)->journal;
+	struct bkpfs_jdata *d;
+
+	if (!j)
+		return;
+	d = kmalloc(sizeof(*d), GFP_KERNEL);
+	if (!d) {
+		filemap_write_and_wait(vfile->f_mapping);
+		return;
+	}
+	filemap_flush(vfile->f_mapping);
+	d->file = get_file(vfile);
+	mutex_lock(&j->lock);
+	list_add_tail(&d->list, &j->data);
+	mutex_unlock(&j->lock);
+}
+
+/*
+ * bkpfs_journal_range - log and commit the version range of a file
+ * @dentry : upper dentry of the file
+ * @meta   : the range about to be written to user.bkpfs_meta
+ *
+ * Must be followed by bkpfs_journal_end once the xattr is written, or
+ * was not, so that a checkpoint does not drop the record in between.
+ * Returns 0 if the xattr may be written, else the error of the commit.
+ */
+int bkpfs_journal_range(struct dentry *dentry, const struct bkpfs_meta *meta)
+{
+	struct bkpfs_journal *j = BKPFS_SB(dentry->d_sb)->journal;
+	struct bkpfs_jrec rec;
+	u64 seq;
+	int err;
+
+	if (!j)
+		return 0;
+	down_read(&j->ckpt_rwsem);
+	memset(&rec, 0, sizeof(rec));
+	rec.type = cpu_to_le16(BKPFS_JREC_RANGE);
+	rec.meta = *meta;
+	err = bkpfs_journal_log(j, dentry, &rec, &seq);
+	if (!err)
+		err = bkpfs_journal_commit(j, seq);
+	return err;
+}
+
+/*
+ * bkpfs_journal_unlink - log and commit versions about to be unlinked
+ * @dentry : upper dentry of the file
+ * @first  : first version
+ * @last   : one past the last version
+ *
+ * The range in user.bkpfs_meta is only written back later, so after a
+ * crash it may still name these versions; replay takes them out.  Must
+ * be followed by bkpfs_journal_end once they are unlinked.  Returns 0
+ * if they may be unlinked, else the error of the commit.
+ */
+int bkpfs_journal_unlink(struct dentry *dentry, int first, int last)
+{
+	struct bkpfs_journal *j = BKPFS_SB(dentry->d_sb)->journal;
+	struct bkpfs_jrec rec;
+	u64 seq;
+	int err;
+
+	if (!j)
+		return 0;
+	down_read(&j->ckpt_rwsem);
+	memset(&rec, 0, sizeof(rec));
+	rec.type = cpu_to_le16(BKPFS_JREC_UNLINK);
+	rec.version = cpu_to_le32(first);
+	rec.last = cpu_to_le32(last);
+	err = bkpfs_journal_log(j, dentry, &rec, &seq);
+	if (!err)
+		err = bkpfs_journal_commit(j, seq);
+	return err;
+}
+
+void bkpfs_journal_end(struct super_block *sb)
+{
+	struct bkpfs_journal *j = BKPFS_SB(sb)->journal;
+
+	if (!j)
+		return;
+	up_read(&j->ckpt_rwsem);
+	if (READ_ONCE(j->pos) >= BKPFS_JOURNAL_MAX)
+		bkpfs_journal_checkpoint(j, false);
+}
+
+/* the entry of the file @rec names, made on first use */
+static struct bkpfs_jfile *bkpfs_jfile_get(struct list_head *files,
+					   const struct bkpfs_jrec *rec,
+					   const u32 *fh)
+{
+	u64 ino = le64_to_cpu(rec->ino);
+	u32 gen = le32_to_cpu(rec->gen);
+	struct bkpfs_jfile *f;
+
+	list_for_each_entry(f, files, list)
+		if (f->ino == ino && f->gen == gen)
+			return f;
+	f = kzalloc(sizeof(*f), GFP_KERNEL);
+	if (!f)
+		return NULL;
+	f->ino = ino;
+	f->gen = gen;
+	f->fh_type = le32_to_cpu(rec->fh_type);
+	f->fh_len = le16_to_cpu(rec->len);
+	memcpy(f->fh, fh, f->fh_len);
+	f->first = -1;
+	list_add_tail(&f->list, files);
+	return f;
+}
+
+/* remember versions unlinked after the last RANGE of @f */
+static int bkpfs_jfile_gone(struct bkpfs_jfile *f, int first, int last)
+{
+	struct bkpfs_jgone *gone;
+
+	gone = krealloc(f->gone, (f->nr_gone + 1) * sizeof(*gone),
+			GFP_KERNEL);
+	if (!gone)
+		return -ENOMEM;
+	gone[f->nr_gone].first = first;
+	gone[f->nr_gone].last = last;
+	f->gone = gone;
+	f->nr_gone++;
+	return 0;
+}
+
+/* only a connected dentry under the lower root has a backup directory */
+static int bkpfs_journal_acceptable(void *root, struct dentry *dentry)
+{
+	return is_subdir(dentry, root);
+}
+
+/* unlink a version that was begun but never committed */
+static void bkpfs_journal_rollback(struct bkpfs_sb_info *sbi,
+				   const struct path *file, int version)
+{
+	struct dentry *dir, *victim;
+	struct bkpfs_index_rec rec;
+	struct path index;
+	struct file *ifile;
+	char name[NAME_MAX + 1];
+	loff_t pos;
+	int len;
+
+	dir = bkpfs_version_dir(sbi, file->dentry, false);
+	if (IS_ERR(dir))
+		return;
+
+	len = snprintf(name, sizeof(name), ".%s.%d",
+		       bkpfs_version_stem(sbi, file->dentry->d_name.name),
+		       version);
+	if (len >= sizeof(name))
+		goto out;
+	inode_lock_nested(d_inode(dir), I_MUTEX_PARENT);
+	victim = lookup_one_len(name, dir, len);
+	if (!IS_ERR(victim)) {
+		/* a partial manifest leaks its chunk references, only space */
+		if (d_is_positive(victim) &&
+		    !vfs_unlink(d_inode(dir), victim, NULL))
+			printk("INFO:journal rolled back %s\n", name);
+		dput(victim);
+	}
+	index.dentry = lookup_one_len(".index", dir, strlen(".index"));
+	inode_unlock(d_inode(dir));
+	if (IS_ERR(index.dentry))
+		goto out;
+
+	if (d_is_positive(index.dentry)) {
+		index.mnt = file->mnt;
+		ifile = dentry_open(&index, O_WRONLY, current_cred());
+		if (!IS_ERR(ifile)) {
+			memset(&rec, 0, sizeof(rec));
+			pos = (loff_t)version * sizeof(rec);
+			kernel_write(ifile, &rec, sizeof(rec), &pos);
+			fput(ifile);
+		}
+	}
+	dput(index.dentry);
+out:
+	dput(dir);
+}
+
+/*
+ * bkpfs_journal_recover - bring one file back to what the journal committed
+ *
+ * Versions are only unlinked at either end of the range: the oldest
+ * ones, the newest one, or all of them.
+ */
+static void bkpfs_journal_recover(struct bkpfs_sb_info *sbi,
+				  const struct path *lower_root,
+				  struct bkpfs_jfile *f)
+{
+	struct bkpfs_meta meta;
+	struct inode *inode;
+	struct path path;
+	int oldest, next, v;
+	unsigned int i;
+
+	path.dentry = exportfs_decode_fh(lower_root->mnt,
+					 (struct fid *)f->fh,
+					 f->fh_len / sizeof(u32), f->fh_type,
+					 bkpfs_journal_acceptable,
+					 lower_root->dentry);
+	if (IS_ERR_OR_NULL(path.dentry))
+		return;		/* unlinked since */
+	path.mnt = mntget(lower_root->mnt);
+	inode = d_inode(path.dentry);
+	if (inode->i_ino != f->ino || inode->i_generation != f->gen)
+		goto out;
+
+	if (f->ranged)
+		meta = f->meta;
+	else if (bkpfs_meta_read(path.dentry, &meta))
+		goto out;
+	oldest = le32_to_cpu(meta.oldest);
+	next = le32_to_cpu(meta.next);
+
+	for (i = 0; i < f->nr_gone; i++) {
+		if (f->gone[i].first <= oldest && f->gone[i].last >= next)
+			oldest = next;
+		else if (f->gone[i].first <= oldest)
+			oldest = max(oldest, f->gone[i].last);
+		else if (f->gone[i].last >= next)
+			next = min(next, f->gone[i].first);
+		/* finish the unlinks the crash cut short */
+		for (v = f->gone[i].first; v < f->gone[i].last; v++)
+			bkpfs_journal_rollback(sbi, &path, v);
+	}
+	if (f->nr_gone) {
+		meta.oldest = cpu_to_le32(oldest);
+		meta.next = cpu_to_le32(next);
+		meta.delta_base = cpu_to_le32(-1);
+	}
+	if (f->ranged || f->nr_gone)
+		vfs_setxattr(path.dentry, BKPFS_XATTR_META, (void *)&meta,
+			     sizeof(meta), 0);
+
+	if (f->first >= 0 && next > 0)
+		for (v = max(f->first, next); v <= f->last; v++)
+			bkpfs_journal_rollback(sbi, &path, v);
+out:
+	path_put(&path);
+}
+
+/*
+ * bkpfs_journal_replay - recover from the records of a journal
+ * @sbi        : super block info
+ * @lower_root : root of the lower directory
+ * @file       : the journal, opened for reading
+ *
+ * Reads up to the first torn or damaged record: the end of the last
+ * append before the crash.
+ */
+static int bkpfs_journal_replay(struct bkpfs_sb_info *sbi,
+				const struct path *lower_root,
+				struct file *file)
+{
+	struct bkpfs_jfile *f, *tmp;
+	struct bkpfs_jrec rec;
+	LIST_HEAD(files);
+	unsigned int records = 0;
+	u32 fh[BKPFS_JFH_WORDS];
+	loff_t pos = 0;
+	size_t len;
+	u32 crc;
+	int v, next, err = 0;
+
+	for (;;) {
+		if (kernel_read(file, &rec, sizeof(rec), &pos) != sizeof(rec))
+			break;
+		len = le16_to_cpu(rec.len);
+		if (le32_to_cpu(rec.magic) != BKPFS_JMAGIC || !len ||
+		    len > sizeof(fh) || len % sizeof(u32))
+			break;
+		if (kernel_read(file, fh, len, &pos) != len)
+			break;
+		crc = le32_to_cpu(rec.crc);
+		rec.crc = 0;
+		if (crc32c(crc32c(~0, &rec, sizeof(rec)), fh, len) != crc)
+			break;
+
+		f = bkpfs_jfile_get(&files, &rec, fh);
+		if (!f) {
+			err = -ENOMEM;
+			goto out;
+		}
+		if (le16_to_cpu(rec.type) == BKPFS_JREC_BEGIN) {
+			v = le32_to_cpu(rec.version);
+			if (f->first < 0 || v < f->first)
+				f->first = v;
+			f->last = max(f->last, v);
+		} else if (le16_to_cpu(rec.type) == BKPFS_JREC_RANGE) {
+			f->meta = rec.meta;
+			f->ranged = true;
+			/* everything begun so far is in the range */
+			next = le32_to_cpu(rec.meta.next);
+			if (f->first >= 0 && f->last < next)
+				f->first = -1;
+			/* and it no longer holds the versions unlinked */
+			f->nr_gone = 0;
+		} else if (le16_to_cpu(rec.type) == BKPFS_JREC_UNLINK) {
+			err = bkpfs_jfile_gone(f, le32_to_cpu(rec.version),
+					       le32_to_cpu(rec.last));
+			if (err)
+				goto out;
+		}
+		records++;
+	}
+
+	printk("INFO:journal replay of %u records\n", records);
+	list_for_each_entry(f, &files, list)
+		bkpfs_journal_recover(sbi, lower_root, f);
+out:
+	list_for_each_entry_safe(f, tmp, &files, list) {
+		list_del(&f->list);
+		kfree(f->gone);
+		kfree(f);
+	}
+	return err;
+}
+
+/*
+ * bkpfs_journal_init - recover from the journal of a mount, open it
+ * @sbi        : super block info
+ * @lower_root : root of the lower directory
+ *
+ * A journal left by a crash is replayed even without journal=on.  It is
+ * kept open, in sbi->journal, only with journal=on.
+ *
+ * Returns 0 on success, else the corresponding error code.
+ */
+int bkpfs_journal_init(struct bkpfs_sb_info *sbi,
+		       const struct path *lower_root)
+{
+	struct bkpfs_journal *j;
+	struct dentry *dir;
+	struct path path;
+	struct file *file;
+	int err = 0;
+
+	/* records name files by a handle of the lower file system */
+	if (sbi->journal_on && !lower_root->mnt->mnt_sb->s_export_op) {
+		printk(KERN_ERR "bkpfs: journal=on needs an exportable lower file system\n");
+		return -EOPNOTSUPP;
+	}
+
+	dir = bkpfs_store_dir(lower_root, sbi->journal_on);
+	if (IS_ERR(dir))
+		return PTR_ERR(dir) == -ENOENT ? 0 : PTR_ERR(dir);
+
+	inode_lock_nested(d_inode(dir), I_MUTEX_PARENT);
+	path.dentry = lookup_one_len(BKPFS_JOURNAL_NAME, dir,
+				     strlen(BKPFS_JOURNAL_NAME));
+	if (!IS_ERR(path.dentry) && d_is_negative(path.dentry) &&
+	    sbi->journal_on)
+		err = vfs_create(d_inode(dir), path.dentry, 0600, true);
+	inode_unlock(d_inode(dir));
+	dput(dir);
+	if (IS_ERR(path.dentry))
+		return PTR_ERR(path.dentry);
+	if (err || d_is_negative(path.dentry)) {
+		dput(path.dentry);
+		return err;
+	}
+
+	path.mnt = lower_root->mnt;
+	file = dentry_open(&path, O_RDWR | O_LARGEFILE, current_cred());
+	dput(path.dentry);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+
+	j = kzalloc(sizeof(*j), GFP_KERNEL);
+	if (!j) {
+		err = -ENOMEM;
+		goto out_fput;
+	}
+	j->file = file;
+	mutex_init(&j->lock);
+	mutex_init(&j->commit_mutex);
+	INIT_LIST_HEAD(&j->data);
+	init_rwsem(&j->ckpt_rwsem);
+
+	if (i_size_read(file_inode(file))) {
+		err = bkpfs_journal_replay(sbi, lower_root, file);
+		if (!err)
+			err = bkpfs_journal_checkpoint(j, true);
+		if (err)
+			goto out_free;
+	}
+	if (!sbi->journal_on)
+		goto out_free;
+	sbi->journal = j;
+	return 0;
+
+out_free:
+	kfree(j);
+out_fput:
+	fput(file);
+	return err;
+}
+
+/* checkpoint and close the journal, at unmount */
+void bkpfs_journal_exit(struct bkpfs_sb_info *sbi)
+{
+	struct bkpfs_journal *j = sbi->journal;
+
+	if (!j)
+		return;
+	bkpfs_journal_checkpoint(j, true);
+	fput(j->file);
+	kfree(j);
+	sbi->journal = NULL;
+}
@@ -74,6 +74,16 @@ static int bkpfs_inode_set(struct inode *inode, void *lower_inode)
 	return 0;
 }
 
+/*
+ * bkpfs_ilookup - the upper inode of a lower one, if it is in memory
+ *
+ * Returns a reference to it, or NULL.
+ */
+struct inode *bkpfs_ilookup(struct super_block *sb, struct inode *lower_inode)
+{
+	return ilookup5(sb, lower_inode->i_ino, bkpfs_inode_test, lower_inode);
+}
+
 struct inode *bkpfs_iget(struct super_block *sb, struct inode *lower_inode)
 {
 	struct bkpfs_inode_info *info;
@@ -11,9 +11,202 @@
 
 #include "bkpfs.h"
 #include <linux/module.h>
+#include <linux/parser.h>
 
-int maxver = 5;
-int error;
+/* passed from bkpfs_mount to bkpfs_read_super through mount_nodev */
+struct bkpfs_mount_data {
+	const char *dev_name;
+	char *options;
+};
+
+enum {
+	Opt_maxver,
+	Opt_backup_auto, Opt_backup_reflink, Opt_backup_copy,
+	Opt_backup_sync, Opt_backup_async, Opt_backup_async_min,
+	Opt_queue_depth,
+	Opt_format_full, Opt_format_preimage, Opt_format_delta,
+	Opt_format_dedup,
+	Opt_unchanged_skip, Opt_unchanged_keep,
+	Opt_compress,
+	Opt_coalesce_ms,
+	Opt_journal_on, Opt_journal_off,
+	Opt_scan_off, Opt_scan_foreground, Opt_scan_background,
+	Opt_store_sibling, Opt_store_central,
+	Opt_blocksums_on, Opt_blocksums_off,
+	Opt_err
+};
+
+static const match_table_t bkpfs_tokens = {
+	{Opt_maxver, "maxver=%d"},
+	{Opt_backup_auto, "backup_mode=auto"},
+	{Opt_backup_reflink, "backup_mode=reflink"},
+	{Opt_backup_copy, "backup_mode=copy"},
+	{Opt_backup_sync, "backup=sync"},
+	{Opt_backup_async, "backup=async"},
+	{Opt_backup_async_min, "backup=async:%s"},
+	{Opt_queue_depth, "queue_depth=%d"},
+	{Opt_format_full, "format=full"},
+	{Opt_format_preimage, "format=preimage"},
+	{Opt_format_delta, "format=delta"},
+	{Opt_format_dedup, "format=dedup"},
+	{Opt_unchanged_skip, "unchanged=skip"},
+	{Opt_unchanged_keep, "unchanged=keep"},
+	{Opt_compress, "compress=%s"},
+	{Opt_coalesce_ms, "coalesce_ms=%d"},
+	{Opt_journal_on, "journal=on"},
+	{Opt_journal_off, "journal=off"},
+	{Opt_scan_off, "scan=off"},
+	{Opt_scan_foreground, "scan=foreground"},
+	{Opt_scan_background, "scan=background"},
+	{Opt_store_sibling, "store=sibling"},
+	{Opt_store_central, "store=central"},
+	{Opt_blocksums_on, "blocksums=on"},
+	{Opt_blocksums_off, "blocksums=off"},
+	{Opt_err, NULL}
+};
+
+/*
+ * bkpfs_parse_options - parse the comma separated mount options
+ * @sbi     : superblock private data to fill in
+ * @options : option string passed to mount (may be NULL)
+ *
+ * Returns 0 on success, -EINVAL on an unknown option or bad value.
+ */
+static int bkpfs_parse_options(struct bkpfs_sb_info *sbi, char *options)
+{
+	char *p, *str, *end;
+	int token, val;
+	substring_t args[MAX_OPT_ARGS];
+
+	/* defaults */
+	sbi->maxver = BKPFS_DEFAULT_MAXVER;
+	sbi->backup_mode = BKPFS_BACKUP_AUTO;
+	sbi->async_min_size = -1;
+	sbi->queue_depth = BKPFS_DEFAULT_QUEUE_DEPTH;
+	sbi->format = BKPFS_FORMAT_FULL;
+	sbi->skip_unchanged = true;
+
+	if (!options)
+		return 0;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+		token = match_token(p, bkpfs_tokens, args);
+		switch (token) {
+		case Opt_maxver:
+			if (match_int(&args[0], &val) || val <= 0) {
+				printk(KERN_ERR "bkpfs: invalid maxver\n");
+				return -EINVAL;
+			}
+			sbi->maxver = val;
+			break;
+		case Opt_backup_auto:
+			sbi->backup_mode = BKPFS_BACKUP_AUTO;
+			break;
+		case Opt_backup_reflink:
+			sbi->backup_mode = BKPFS_BACKUP_REFLINK;
+			break;
+		case Opt_backup_copy:
+			sbi->backup_mode = BKPFS_BACKUP_COPY;
+			break;
+		case Opt_backup_sync:
+			sbi->async_min_size = -1;
+			break;
+		case Opt_backup_async:
+			sbi->async_min_size = 0;
+			break;
+		case Opt_backup_async_min:
+			/* size with an optional K/M/G suffix */
+			str = match_strdup(&args[0]);
+			if (!str)
+				return -ENOMEM;
+			sbi->async_min_size = memparse(str, &end);
+			val = *end;
+			kfree(str);
+			if (val || sbi->async_min_size < 0) {
+				printk(KERN_ERR "bkpfs: invalid backup size\n");
+				return -EINVAL;
+			}
+			break;
+		case Opt_queue_depth:
+			if (match_int(&args[0], &val) || val <= 0) {
+				printk(KERN_ERR "bkpfs: invalid queue_depth\n");
+				return -EINVAL;
+			}
+			sbi->queue_depth = val;
+			break;
+		case Opt_format_full:
+			sbi->format = BKPFS_FORMAT_FULL;
+			break;
+		case Opt_format_preimage:
+			sbi->format = BKPFS_FORMAT_PREIMAGE;
+			break;
+		case Opt_format_delta:
+			sbi->format = BKPFS_FORMAT_DELTA;
+			break;
+		case Opt_format_dedup:
+			sbi->format = BKPFS_FORMAT_DEDUP;
+			break;
+		case Opt_unchanged_skip:
+			sbi->skip_unchanged = true;
+			break;
+		case Opt_unchanged_keep:
+			sbi->skip_unchanged = false;
+			break;
+		case Opt_compress:
+			str = match_strdup(&args[0]);
+			if (!str)
+				return -ENOMEM;
+			val = bkpfs_compress_parse(str, &sbi->compress,
+						   &sbi->compress_level);
+			kfree(str);
+			if (val) {
+				printk(KERN_ERR "bkpfs: invalid compress\n");
+				return -EINVAL;
+			}
+			break;
+		case Opt_coalesce_ms:
+			if (match_int(&args[0], &val) || val < 0) {
+				printk(KERN_ERR "bkpfs: invalid coalesce_ms\n");
+				return -EINVAL;
+			}
+			sbi->coalesce_ms = val;
+			break;
+		case Opt_journal_on:
+			sbi->journal_on = true;
+			break;
+		case Opt_journal_off:
+			sbi->journal_on = false;
+			break;
+		case Opt_scan_off:
+			sbi->scan_mode = BKPFS_SCAN_OFF;
+			break;
+		case Opt_scan_foreground:
+			sbi->scan_mode = BKPFS_SCAN_FOREGROUND;
+			break;
+		case Opt_scan_background:
+			sbi->scan_mode = BKPFS_SCAN_BACKGROUND;
+			break;
+		case Opt_store_sibling:
+			sbi->store = BKPFS_STORE_SIBLING;
+			break;
+		case Opt_store_central:
+			sbi->store = BKPFS_STORE_CENTRAL;
+			break;
+		case Opt_blocksums_on:
+			sbi->blocksums = true;
+			break;
+		case Opt_blocksums_off:
+			sbi->blocksums = false;
+			break;
+		default:
+			printk(KERN_ERR "bkpfs: unknown mount option '%s'\n", p);
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
 
 /*
  * There is no need to lock the bkpfs_super_info's rwsem as there is no
@@ -24,7 +217,8 @@ static int bkpfs_read_super(struct super_block *sb, void *raw_data, int silent)
 	int err = 0;
 	struct super_block *lower_sb;
 	struct path lower_path;
-	char *dev_name = (char *) raw_data;
+	struct bkpfs_mount_data *data = raw_data;
+	const char *dev_name = data->dev_name;
 	struct inode *inode;
 	
 	UDBG;
@@ -34,10 +228,6 @@ static int bkpfs_read_super(struct super_block *sb, void *raw_data, int silent)
 		err = -EINVAL;
 		goto out;
 	}
-	if (error != 0) {
-		err = -EINVAL;
-		goto out;
-	}
 
 	/* parse lower path */
 	err = kern_path(dev_name, LOOKUP_FOLLOW | LOOKUP_DIRECTORY,
@@ -55,9 +245,67 @@ static int bkpfs_read_super(struct super_block *sb, void *raw_data, int silent)
 		err = -ENOMEM;
 		goto out_free;
 	}
+	spin_lock_init(&BKPFS_SB(sb)->coalesce_lock);
+	INIT_LIST_HEAD(&BKPFS_SB(sb)->coalesce_pending);
+	BKPFS_SB(sb)->mounter_cred = get_current_cred();
+
+	/* maxver, backup_mode, ... live in the super block struct */
+	err = bkpfs_parse_options(BKPFS_SB(sb), data->options);
+	if (err)
+		goto out_freesbi;
+
+	/*
+	 * Find out once whether the lower file system can share extents
+	 * between files, so that backups can be reflinked instead of
+	 * copied byte by byte.
+	 */
+	if (BKPFS_SB(sb)->backup_mode != BKPFS_BACKUP_COPY)
+		BKPFS_SB(sb)->can_reflink = bkpfs_probe_reflink(&lower_path);
+	if (BKPFS_SB(sb)->backup_mode == BKPFS_BACKUP_REFLINK &&
+	    !BKPFS_SB(sb)->can_reflink) {
+		printk(KERN_ERR "bkpfs: backup_mode=reflink but lower "
+		       "file system cannot clone file ranges\n");
+		err = -EOPNOTSUPP;
+		goto out_freesbi;
+	}
 
-	/* Adding the maxver to super block struct */
-	BKPFS_SB(sb)->maxver = maxver;
+	/* backups made after close() returns, or after coalesce_ms */
+	if (BKPFS_SB(sb)->async_min_size >= 0 || BKPFS_SB(sb)->coalesce_ms) {
+		BKPFS_SB(sb)->backup_wq = alloc_workqueue("bkpfs_backup",
+							  WQ_UNBOUND, 0);
+		if (!BKPFS_SB(sb)->backup_wq) {
+			err = -ENOMEM;
+			goto out_freesbi;
+		}
+	}
+
+	/* chunks shared by the versions of every file */
+	if (BKPFS_SB(sb)->format == BKPFS_FORMAT_DEDUP) {
+		err = bkpfs_chunk_store_init(BKPFS_SB(sb), &lower_path);
+		if (err) {
+			printk(KERN_ERR "bkpfs: cannot open chunk store: %d\n",
+			       err);
+			goto out_freewq;
+		}
+	}
+
+	/* versions of every file under the lower root (store=central) */
+	err = bkpfs_version_store_init(BKPFS_SB(sb), &lower_path);
+	if (err) {
+		printk(KERN_ERR "bkpfs: cannot open version store: %d\n",
+		       err);
+		bkpfs_chunk_store_exit(BKPFS_SB(sb));
+		goto out_freewq;
+	}
+
+	/* replays what a crash left in the journal, even with journal=off */
+	err = bkpfs_journal_init(BKPFS_SB(sb), &lower_path);
+	if (err) {
+		printk(KERN_ERR "bkpfs: cannot recover journal: %d\n", err);
+		bkpfs_version_store_exit(BKPFS_SB(sb));
+		bkpfs_chunk_store_exit(BKPFS_SB(sb));
+		goto out_freewq;
+	}
 
 	/* set the lower superblock field of upper superblock */
 	lower_sb = lower_path.dentry->d_sb;
@@ -108,10 +356,17 @@ static int bkpfs_read_super(struct super_block *sb, void *raw_data, int silent)
 	 * d_rehash it.
 	 */
 	d_rehash(sb->s_root);
+
+	/* after the journal replay, so it only fixes what that left */
+	if (BKPFS_SB(sb)->scan_mode != BKPFS_SCAN_OFF &&
+	    bkpfs_scan_start(sb, &lower_path))
+		printk(KERN_ERR "bkpfs: cannot start the scan\n");
+
 	if (!silent)
 		printk(KERN_INFO
-		       "bkpfs: mounted on top of %s type %s\n",
-		       dev_name, lower_sb->s_type->name);
+		       "bkpfs: mounted on top of %s type %s (%s backups)\n",
+		       dev_name, lower_sb->s_type->name,
+		       BKPFS_SB(sb)->can_reflink ? "reflinked" : "copied");
 
 	goto out; /* all is well */
 
@@ -122,7 +377,15 @@ out_iput:
 	iput(inode);
 out_sput:
 	/* drop refs we took earlier */
+	bkpfs_journal_exit(BKPFS_SB(sb));
 	atomic_dec(&lower_sb->s_active);
+	bkpfs_version_store_exit(BKPFS_SB(sb));
+	bkpfs_chunk_store_exit(BKPFS_SB(sb));
+out_freewq:
+	if (BKPFS_SB(sb)->backup_wq)
+		destroy_workqueue(BKPFS_SB(sb)->backup_wq);
+out_freesbi:
+	put_cred(BKPFS_SB(sb)->mounter_cred);
 	kfree(BKPFS_SB(sb));
 	sb->s_fs_info = NULL;
 out_free:
@@ -133,44 +396,45 @@ out:
 
 
 /*
- * Made changes here to accomodate maxver option
- * Storing the maxver in the superblock struct
+ * The options are parsed in bkpfs_read_super, once the superblock
+ * private data they are stored in exists.
  */
 struct dentry *bkpfs_mount(struct file_system_type *fs_type, int flags,
 			    const char *dev_name, void *raw_data)
 {
-	char input[15];
-	char *endptr;
-	void *lower_path_name = (void *) dev_name;
-	
+	struct bkpfs_mount_data data = {
+		.dev_name = dev_name,
+		.options = raw_data,
+	};
+
 	UDBG;
-	if (raw_data == NULL) {
-		printk("Using default value (5) for maxver");
-		maxver = 5;
-	}
-	else {
-		snprintf(input, 8, "%s", (char *)raw_data);
-		printk("%s\n", input);
-		if (strcmp("maxver=", input)) {
-			printk("Invalid mount option!");
-			error = -EINVAL;
-		}
-		strcpy(input, (char *)raw_data + 7);
-		maxver = (int)simple_strtol(input, &endptr, 10);
-		if (maxver == 0 && endptr == input) {
-			printk("Invalid value for maxver");
-			error = -EINVAL;
-		}
+	return mount_nodev(fs_type, flags, &data, bkpfs_read_super);
+}
+
+/*
+ * Queued and coalesced backups pin upper dentries, and the scan holds
+ * upper inodes, so they must be done before generic_shutdown_super
+ * looks for busy dentries.
+ */
+static void bkpfs_kill_super(struct super_block *sb)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+
+	UDBG;
+	if (sbi)
+		bkpfs_scan_stop(sb);
+	if (sbi && sbi->backup_wq) {
+		bkpfs_coalesce_flush_all(sb);
+		flush_workqueue(sbi->backup_wq);
 	}
-	return mount_nodev(fs_type, flags, lower_path_name,
-			   bkpfs_read_super);
+	generic_shutdown_super(sb);
 }
 
 static struct file_system_type bkpfs_fs_type = {
 	.owner		= THIS_MODULE,
 	.name		= BKPFS_NAME,
 	.mount		= bkpfs_mount,
-	.kill_sb	= generic_shutdown_super,
+	.kill_sb	= bkpfs_kill_super,
 	.fs_flags	= 0,
 };
 MODULE_ALIAS_FS(BKPFS_NAME);
@@ -181,6 +445,7 @@ static int __init init_bkpfs_fs(void)
 	UDBG;
 	pr_info("Registering bkpfs " BKPFS_VERSION "\n");
 
+	bkpfs_chunk_init_gear();
 	err = bkpfs_init_inode_cache();
 	if (err)
 		goto out;
@@ -0,0 +1,258 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "bkpfs.h"
+
+/*
+ * Version range of a file, cached in its bkpfs_inode_info.
+ *
+ * The range is read from the lower file the first time it is needed,
+ * then every lookup is a memory read.  Changes only mark the cache
+ * dirty; bkpfs_meta_sync writes them back as one user.bkpfs_meta xattr
+ * when a file is released or fsync'ed, and when a backup made after the
+ * release is done.  Files made before this xattr existed still have
+ * user.old_version, user.curr_version and user.bkpfs_delta_base, which
+ * are read once and replaced by it on the next write back.
+ */
+
+/*
+ * bkpfs_meta_read - version range stored in a lower file
+ * @lower_dentry : the lower file
+ * @meta         : out: its range, from user.bkpfs_meta or the legacy
+ *		   xattrs
+ *
+ * Returns 0, or -ENODATA if the file has neither.
+ */
+int bkpfs_meta_read(struct dentry *lower_dentry, struct bkpfs_meta *meta)
+{
+	int oldest = 0, next = 0, base = -1;
+
+	if (vfs_getxattr(lower_dentry, BKPFS_XATTR_META, (void *)meta,
+			 sizeof(*meta)) == sizeof(*meta))
+		return 0;
+	if (vfs_getxattr(lower_dentry, "user.curr_version", (void *)&next,
+			 sizeof(int)) != sizeof(int))
+		return -ENODATA;
+	vfs_getxattr(lower_dentry, "user.old_version", (void *)&oldest,
+		     sizeof(int));
+	vfs_getxattr(lower_dentry, BKPFS_XATTR_DELTA_BASE, (void *)&base,
+		     sizeof(int));
+	meta->oldest = cpu_to_le32(oldest);
+	meta->next = cpu_to_le32(next);
+	meta->delta_base = cpu_to_le32(base);
+	meta->flags = 0;
+	return 0;
+}
+
+/* fill the cache from the lower file, if nobody did meanwhile */
+static void bkpfs_meta_load(struct dentry *dentry)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(d_inode(dentry));
+	struct bkpfs_meta meta;
+	struct path lower_path;
+	int oldest = 0, next = 0, base = -1;
+	int state = BKPFS_META_CLEAN;
+
+	if (READ_ONCE(info->meta_state) != BKPFS_META_UNLOADED)
+		return;
+
+	bkpfs_get_lower_path(dentry, &lower_path);
+	if (!bkpfs_meta_read(lower_path.dentry, &meta)) {
+		oldest = le32_to_cpu(meta.oldest);
+		next = le32_to_cpu(meta.next);
+		base = (s32)le32_to_cpu(meta.delta_base);
+	} else {
+		/* e.g. created below bkpfs */
+		state = BKPFS_META_NONE;
+	}
+	bkpfs_put_lower_path(dentry, &lower_path);
+
+	spin_lock(&info->meta_lock);
+	if (info->meta_state == BKPFS_META_UNLOADED) {
+		info->oldest_version = oldest;
+		info->next_version = next;
+		info->delta_base = base;
+		info->meta_state = state;
+	}
+	spin_unlock(&info->meta_lock);
+}
+
+/*
+ * bkpfs_get_versions - version range of a file
+ * @dentry : upper dentry of the file
+ * @oldest : out: oldest version kept (user.old_version)
+ * @next   : out: one past the newest version (user.curr_version)
+ *
+ * Returns 0, or -ENODATA with an empty range if the file is not
+ * versioned.
+ */
+int bkpfs_get_versions(struct dentry *dentry, int *oldest, int *next)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(d_inode(dentry));
+	int err = 0;
+
+	bkpfs_meta_load(dentry);
+	spin_lock(&info->meta_lock);
+	*oldest = info->oldest_version;
+	*next = info->next_version;
+	if (info->meta_state == BKPFS_META_NONE)
+		err = -ENODATA;
+	spin_unlock(&info->meta_lock);
+	return err;
+}
+
+/*
+ * bkpfs_meta_peek - version range cached in an inode, without loading it
+ * @inode  : upper inode of the file
+ * @oldest : out: oldest version kept
+ * @next   : out: one past the newest version
+ *
+ * Returns 0, -ENODATA if the file is not versioned, or -ENOENT if the
+ * range was not read from the lower file yet.
+ */
+int bkpfs_meta_peek(struct inode *inode, int *oldest, int *next)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+	int err = 0;
+
+	spin_lock(&info->meta_lock);
+	if (info->meta_state == BKPFS_META_UNLOADED)
+		err = -ENOENT;
+	else if (info->meta_state == BKPFS_META_NONE)
+		err = -ENODATA;
+	*oldest = info->oldest_version;
+	*next = info->next_version;
+	spin_unlock(&info->meta_lock);
+	return err;
+}
+
+/*
+ * bkpfs_set_versions - change the version range of a file
+ *
+ * Callers hold the backup_mutex of the inode, so the range they read
+ * with bkpfs_get_versions is still the current one.
+ */
+void bkpfs_set_versions(struct dentry *dentry, int oldest, int next)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(d_inode(dentry));
+
+	bkpfs_meta_load(dentry);
+	spin_lock(&info->meta_lock);
+	info->oldest_version = oldest;
+	info->next_version = next;
+	info->meta_state = BKPFS_META_DIRTY;
+	spin_unlock(&info->meta_lock);
+}
+
+/* version the dirty extents of format=delta are relative to, or -1 */
+int bkpfs_get_delta_base(struct dentry *dentry)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(d_inode(dentry));
+	int base;
+
+	bkpfs_meta_load(dentry);
+	spin_lock(&info->meta_lock);
+	base = info->delta_base;
+	spin_unlock(&info->meta_lock);
+	return base;
+}
+
+void bkpfs_set_delta_base(struct dentry *dentry, int base)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(d_inode(dentry));
+
+	bkpfs_meta_load(dentry);
+	spin_lock(&info->meta_lock);
+	if (info->delta_base != base) {
+		info->delta_base = base;
+		info->meta_state = BKPFS_META_DIRTY;
+	}
+	spin_unlock(&info->meta_lock);
+}
+
+/* write the cache back, logging the new range first if @journal */
+static int bkpfs_meta_write(struct dentry *dentry, bool journal)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(d_inode(dentry));
+	struct bkpfs_meta meta;
+	struct path lower_path;
+	int err;
+
+	/* an older snapshot must not be written over a newer one */
+	mutex_lock(&info->meta_mutex);
+	spin_lock(&info->meta_lock);
+	if (info->meta_state != BKPFS_META_DIRTY) {
+		spin_unlock(&info->meta_lock);
+		mutex_unlock(&info->meta_mutex);
+		return 0;
+	}
+	meta.oldest = cpu_to_le32(info->oldest_version);
+	meta.next = cpu_to_le32(info->next_version);
+	meta.delta_base = cpu_to_le32(info->delta_base);
+	meta.flags = 0;
+	info->meta_state = BKPFS_META_CLEAN;
+	spin_unlock(&info->meta_lock);
+
+	/* journal=on: the xattr never names versions not yet on disk */
+	err = journal ? bkpfs_journal_range(dentry, &meta) : 0;
+	if (!err) {
+		bkpfs_get_lower_path(dentry, &lower_path);
+		err = vfs_setxattr(lower_path.dentry, BKPFS_XATTR_META,
+				   (void *)&meta, sizeof(meta), 0);
+		bkpfs_put_lower_path(dentry, &lower_path);
+	}
+	if (journal)
+		bkpfs_journal_end(dentry->d_sb);
+	if (err) {
+		printk(KERN_ERR "bkpfs: cannot save versions of %s: %d\n",
+		       dentry->d_name.name, err);
+		spin_lock(&info->meta_lock);
+		info->meta_state = BKPFS_META_DIRTY;
+		spin_unlock(&info->meta_lock);
+	}
+	mutex_unlock(&info->meta_mutex);
+	return err;
+}
+
+/*
+ * bkpfs_meta_init - give a new file an empty version range
+ * @dentry : upper dentry of the file, just created
+ *
+ * An empty range names no version, so it is not journaled.  Returns 0
+ * on success, else the error of writing the xattr.
+ */
+int bkpfs_meta_init(struct dentry *dentry)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(d_inode(dentry));
+
+	spin_lock(&info->meta_lock);
+	info->oldest_version = 1;
+	info->next_version = 1;
+	info->delta_base = -1;
+	info->meta_state = BKPFS_META_DIRTY;
+	spin_unlock(&info->meta_lock);
+	return bkpfs_meta_write(dentry, false);
+}
+
+/*
+ * bkpfs_meta_sync - write the cached version range back if it changed
+ * @dentry : upper dentry of the file
+ *
+ * With journal=on the range is committed to the journal first, in the
+ * same fsync as the ranges of other files being synced meanwhile.
+ *
+ * Returns 0 on success, else the error of writing the xattr; the cache
+ * then stays dirty.
+ */
+int bkpfs_meta_sync(struct dentry *dentry)
+{
+	return bkpfs_meta_write(dentry, true);
+}
@@ -47,6 +47,7 @@ static int bkpfs_page_mkwrite(struct vm_fault *vmf)
 	int err = 0;
         struct vm_area_struct *vma = vmf->vma;
 	struct file *file, *lower_file;
+	loff_t pos;
 	const struct vm_operations_struct *lower_vm_ops;
 	struct vm_area_struct lower_vma;
 	UDBG;
@@ -57,6 +58,14 @@ static int bkpfs_page_mkwrite(struct vm_fault *vmf)
 	if (!lower_vm_ops->page_mkwrite)
 		goto out;
 
+	/* format=preimage: save the page before it gets dirtied */
+	pos = (loff_t)vmf->pgoff << PAGE_SHIFT;
+	err = bkpfs_capture_range(file->f_path.dentry, pos, pos + PAGE_SIZE);
+	if (err) {
+		err = (err == -ENOMEM) ? VM_FAULT_OOM : VM_FAULT_SIGBUS;
+		goto out;
+	}
+
 	lower_file = bkpfs_lower_file(file);
 	/*
 	 * XXX: vm_ops->page_mkwrite may be called in parallel.
@@ -73,6 +82,9 @@ static int bkpfs_page_mkwrite(struct vm_fault *vmf)
 	vmf->vma = &lower_vma; /* override vma temporarily */
 	err = lower_vm_ops->page_mkwrite(vmf);
 	vmf->vma = vma; /* restore vma */
+	/* format=delta: the page will reach the lower file */
+	if (!(err & VM_FAULT_ERROR))
+		bkpfs_dirty_add(file, pos, pos + PAGE_SIZE);
 out:
 	return err;
 }
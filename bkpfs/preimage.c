@@ -0,0 +1,322 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "bkpfs.h"
+
+/*
+ * Pre-image versions (format=preimage).
+ *
+ * Instead of copying the whole file when it is released, the old
+ * contents of a byte range are saved the first time the range is about
+ * to be overwritten or truncated away.  Version N then holds the file as
+ * it was *before* the writers of session N touched it, as an extent log
+ * (see bkpfs.h) whose footer size is the file size at the start of the
+ * session.  Rebuilding version N starts from the live file and applies
+ * the pre-images of the newest version down to N, which is why every
+ * version in between must be a pre-image.
+ */
+
+/* a copy-on-first-write session, under bkpfs_inode_info.backup_mutex */
+struct bkpfs_capture {
+	struct file *src;		/* lower file, opened read-only */
+	struct file *log;		/* version file being filled */
+	struct dentry *bkp_dir;
+	int version;
+	u64 start;			/* when the session began, ns */
+	loff_t size;			/* file size before the session */
+	loff_t log_pos;
+	struct bkpfs_extent_tree captured;
+	struct bkpfs_log_extent *table;
+	unsigned int nr, max;
+};
+
+static void bkpfs_capture_free(struct bkpfs_capture *cap)
+{
+	if (!IS_ERR_OR_NULL(cap->log))
+		fput(cap->log);
+	if (!IS_ERR_OR_NULL(cap->src))
+		fput(cap->src);
+	if (!IS_ERR_OR_NULL(cap->bkp_dir))
+		dput(cap->bkp_dir);
+	bkpfs_extents_clear(&cap->captured);
+	kvfree(cap->table);
+	kfree(cap);
+}
+
+static struct bkpfs_capture *bkpfs_capture_begin(struct dentry *dentry)
+{
+	struct bkpfs_capture *cap;
+	struct path lower_path;
+	int oldest, err;
+
+	cap = kzalloc(sizeof(*cap), GFP_KERNEL);
+	if (!cap)
+		return ERR_PTR(-ENOMEM);
+	bkpfs_extents_init(&cap->captured);
+
+	bkpfs_get_lower_path(dentry, &lower_path);
+	cap->start = ktime_get_real_ns();
+	cap->size = i_size_read(d_inode(lower_path.dentry));
+	bkpfs_get_versions(dentry, &oldest, &cap->version);
+	cap->src = dentry_open(&lower_path, O_RDONLY, current_cred());
+	bkpfs_put_lower_path(dentry, &lower_path);
+	if (IS_ERR(cap->src)) {
+		err = PTR_ERR(cap->src);
+		goto out_err;
+	}
+
+	cap->bkp_dir = bkpfs_bkp_dir_make(dentry);
+	if (IS_ERR(cap->bkp_dir)) {
+		err = PTR_ERR(cap->bkp_dir);
+		goto out_err;
+	}
+
+	bkpfs_journal_begin(dentry, cap->version);
+	cap->log = bkpfs_open_version(dentry, cap->bkp_dir, cap->version,
+				      O_WRONLY);
+	if (IS_ERR(cap->log)) {
+		err = PTR_ERR(cap->log);
+		goto out_err;
+	}
+	err = bkpfs_set_version_encoding(cap->log->f_path.dentry,
+					 BKPFS_ENC_PREIMAGE);
+	if (err)
+		goto out_err;
+	return cap;
+
+out_err:
+	bkpfs_capture_free(cap);
+	return ERR_PTR(err);
+}
+
+/* save the old contents of [start, end), known not to be captured yet */
+static int bkpfs_capture_piece(struct bkpfs_capture *cap, loff_t start,
+			       loff_t end)
+{
+	struct bkpfs_log_extent *table;
+	unsigned int max;
+	int err;
+
+	if (cap->nr == cap->max) {
+		max = cap->max ? cap->max * 2 : 16;
+		table = kvmalloc_array(max, sizeof(*table), GFP_NOFS);
+		if (!table)
+			return -ENOMEM;
+		if (cap->nr)
+			memcpy(table, cap->table, cap->nr * sizeof(*table));
+		kvfree(cap->table);
+		cap->table = table;
+		cap->max = max;
+	}
+
+	err = bkpfs_copy_range(cap->src, start, cap->log, cap->log_pos,
+			       end - start);
+	if (err)
+		return err;
+	err = bkpfs_extents_add(&cap->captured, start, end);
+	if (err)
+		return err;
+
+	cap->table[cap->nr].off = cpu_to_le64(start);
+	cap->table[cap->nr].len = cpu_to_le64(end - start);
+	cap->nr++;
+	cap->log_pos += end - start;
+	return 0;
+}
+
+/*
+ * bkpfs_capture_range - save the old contents of a range about to change
+ * @dentry : upper dentry of the file being written or truncated
+ * @start  : first byte that will change
+ * @end    : one past the last byte that will change
+ *
+ * Starts a session on the first call.  Only bytes that existed when the
+ * session started and were not saved before are copied, so rewriting a
+ * range costs nothing the second time.  Does nothing unless the mount
+ * uses format=preimage or if the file has no backup directory.
+ *
+ * Returns 0 or an error that should fail the write.
+ */
+int bkpfs_capture_range(struct dentry *dentry, loff_t start, loff_t end)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(d_inode(dentry));
+	struct bkpfs_capture *cap;
+	loff_t gap_end;
+	int err = 0;
+
+	if (BKPFS_SB(dentry->d_sb)->format != BKPFS_FORMAT_PREIMAGE ||
+	    !S_ISREG(d_inode(dentry)->i_mode))
+		return 0;
+
+	mutex_lock(&info->backup_mutex);
+	cap = info->capture;
+	if (!cap) {
+		cap = bkpfs_capture_begin(dentry);
+		if (IS_ERR(cap)) {
+			err = PTR_ERR(cap);
+			/* not a versioned file (e.g. created below bkpfs) */
+			if (err == -ENOENT)
+				err = 0;
+			goto out;
+		}
+		info->capture = cap;
+	}
+
+	end = min(end, cap->size);
+	while (start < end) {
+		gap_end = bkpfs_extents_gap(&cap->captured, &start, end);
+		if (start >= gap_end)
+			break;
+		err = bkpfs_capture_piece(cap, start, gap_end);
+		if (err)
+			break;
+		start = gap_end;
+	}
+out:
+	mutex_unlock(&info->backup_mutex);
+	return err;
+}
+
+/*
+ * undo the writes of the open session @cap in @dst, a copy of the live
+ * file: what its sealed log would do, from the table still in memory
+ */
+static int bkpfs_capture_undo(struct bkpfs_capture *cap, struct file *dst,
+			      struct bkpfs_progress *prog)
+{
+	struct file *log;
+	loff_t data = 0, len;
+	unsigned int i;
+	int err = 0;
+
+	/* the session writes the log through a write-only file */
+	log = dentry_open(&cap->log->f_path, O_RDONLY, current_cred());
+	if (IS_ERR(log))
+		return PTR_ERR(log);
+	for (i = 0; i < cap->nr && !err; i++) {
+		len = le64_to_cpu(cap->table[i].len);
+		err = bkpfs_copy_range(log, data, dst,
+				       le64_to_cpu(cap->table[i].off), len);
+		data += len;
+		if (prog)
+			atomic64_add(len, &prog->done);
+	}
+	fput(log);
+	if (!err)
+		err = bkpfs_truncate_file(dst, cap->size);
+	return err;
+}
+
+/*
+ * bkpfs_capture_seal - finish the session of a file and make it a version
+ * @dentry : upper dentry of the file
+ *
+ * Called when the last writer releases the file, or after a truncate
+ * done without an open file.  Writes the extent table and the footer,
+ * then accounts for the version like bkpfs_create_new_backup does.
+ */
+void bkpfs_capture_seal(struct dentry *dentry)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(d_inode(dentry));
+	struct bkpfs_capture *cap;
+	struct bkpfs_csum csum = { 0 };
+	int err;
+
+	mutex_lock(&info->backup_mutex);
+	cap = info->capture;
+	info->capture = NULL;
+	if (!cap)
+		goto out;
+
+	err = bkpfs_extent_log_finish(cap->log, cap->log_pos, cap->table,
+				      cap->nr, cap->size, 0);
+	if (err)
+		goto out_free;
+
+	printk("INFO:pre-image version %d: %u extents, %llu bytes\n",
+	       cap->version, cap->nr, cap->captured.bytes);
+	csum.size = cpu_to_le64(cap->size);
+	/* the version is the file as it was when the session began */
+	bkpfs_index_add(dentry, cap->bkp_dir, cap->log, cap->version,
+			BKPFS_ENC_PREIMAGE, &csum, cap->start);
+	bkpfs_journal_data(dentry->d_sb, cap->log);
+	bkpfs_commit_version(dentry, cap->bkp_dir, cap->version, false);
+out_free:
+	if (err)
+		printk(KERN_ERR "bkpfs: sealing pre-image failed: %d\n", err);
+	bkpfs_capture_free(cap);
+out:
+	mutex_unlock(&info->backup_mutex);
+	bkpfs_meta_sync(dentry);
+}
+
+/*
+ * bkpfs_preimage_restore - rebuild a pre-image version into a file
+ * @dentry  : upper dentry of the file
+ * @bkp_dir : its lower backup directory
+ * @version : version to rebuild
+ * @newest  : user.curr_version, one past the newest version
+ * @dst     : empty lower file to rebuild into
+ *
+ * The live file holds the writes of the session still open, if any,
+ * whose log is not sealed yet: its pieces are undone first, from the
+ * table in memory.  The backup_mutex is held throughout, so that no
+ * write gets past bkpfs_capture_range meanwhile; writes already past it
+ * only touch ranges the session has saved, which are undone.
+ *
+ * Returns 0 on success, -EINVAL if a version between @version and the
+ * newest one is not a pre-image (the history was made with another
+ * format), else the corresponding error code.
+ */
+int bkpfs_preimage_restore(struct dentry *dentry, struct dentry *bkp_dir,
+			   int version, int newest, struct file *dst)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(d_inode(dentry));
+	struct bkpfs_progress *prog = &info->progress;
+	struct path lower_path;
+	struct file *live, *log;
+	int v, err;
+
+	mutex_lock(&info->backup_mutex);
+	bkpfs_get_lower_path(dentry, &lower_path);
+	live = dentry_open(&lower_path, O_RDONLY, current_cred());
+	bkpfs_put_lower_path(dentry, &lower_path);
+	if (IS_ERR(live)) {
+		err = PTR_ERR(live);
+		goto out;
+	}
+	err = bkpfs_copy_file(dentry->d_sb, live, dst,
+			      i_size_read(file_inode(live)), prog);
+	fput(live);
+	if (!err && info->capture)
+		err = bkpfs_capture_undo(info->capture, dst, prog);
+	if (err)
+		goto out;
+
+	for (v = newest - 1; v >= version; v--) {
+		log = bkpfs_open_version(dentry, bkp_dir, v, O_RDONLY);
+		if (IS_ERR(log)) {
+			err = PTR_ERR(log);
+			goto out;
+		}
+		if (bkpfs_version_encoding(log->f_path.dentry) !=
+		    BKPFS_ENC_PREIMAGE)
+			err = -EINVAL;
+		else
+			err = bkpfs_extent_log_apply(log, dst, NULL, prog);
+		fput(log);
+		if (err)
+			goto out;
+	}
+out:
+	mutex_unlock(&info->backup_mutex);
+	return err;
+}
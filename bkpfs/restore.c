@@ -0,0 +1,337 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "bkpfs.h"
+
+/*
+ * Restoring a version in place (RESTORE_INPLACE).
+ *
+ * RESTORE_VERSION leaves a read-only ".F.N.swp" next to the file for
+ * the user to copy over it.  In place, the version is rebuilt into an
+ * unnamed lower file instead, its extents cloned from the version file
+ * when it is a full copy and backup_mode allows, and that file is
+ * renamed over the live one:
+ *
+ *	O_TMPFILE -> linked as ".F.rst" once complete -> renamed to "F"
+ *
+ * Readers see the old contents or the restored ones, never a mix, and
+ * a crash leaves at most a complete ".F.rst".  The contents replaced
+ * are kept as a new version first.  The live file is then a new lower
+ * inode: its owner, mode and xattrs (the version range among them) are
+ * copied, store=central moves its versions along once ".F.rst" is
+ * linked, and the upper dentry is dropped so the next lookup finds the
+ * new inode.  Files still open on the old inode keep the old contents,
+ * so a file open for writing, or with other links, is not restored,
+ * and opens for writing wait until the restore is done.
+ */
+
+#define BKPFS_RESTORE_SUFFIX	"rst"
+
+/* version @version of the file, rebuilt into an unnamed lower file */
+static struct file *bkpfs_restore_image(struct dentry *dentry,
+					struct file *lower_file,
+					struct dentry *bkp_dir, int version,
+					int newest)
+{
+	struct bkpfs_progress *progress = &BKPFS_I(d_inode(dentry))->progress;
+	struct inode *lower_inode = file_inode(lower_file);
+	struct dentry *parent, *tmp;
+	struct file *vfile, *dst;
+	struct path path;
+	struct iattr ia;
+	int err = 0;
+
+	parent = dget_parent(lower_file->f_path.dentry);
+	/* not O_EXCL: it is linked once complete */
+	tmp = vfs_tmpfile(parent, lower_inode->i_mode, O_RDWR);
+	dput(parent);
+	if (IS_ERR(tmp))
+		return ERR_CAST(tmp);
+	path.mnt = lower_file->f_path.mnt;
+	path.dentry = tmp;
+	dst = dentry_open(&path, O_RDWR, current_cred());
+	dput(tmp);
+	if (IS_ERR(dst))
+		return dst;
+	tmp = dst->f_path.dentry;
+
+	/* the owner of the file, not the one restoring it */
+	if (!uid_eq(d_inode(tmp)->i_uid, lower_inode->i_uid) ||
+	    !gid_eq(d_inode(tmp)->i_gid, lower_inode->i_gid)) {
+		ia.ia_valid = ATTR_UID | ATTR_GID | ATTR_MODE;
+		ia.ia_uid = lower_inode->i_uid;
+		ia.ia_gid = lower_inode->i_gid;
+		ia.ia_mode = lower_inode->i_mode;
+		inode_lock(d_inode(tmp));
+		err = notify_change(tmp, &ia, NULL);
+		inode_unlock(d_inode(tmp));
+		if (err)
+			goto out;
+	}
+
+	vfile = bkpfs_open_version(dentry, bkp_dir, version, O_RDONLY);
+	if (IS_ERR(vfile)) {
+		err = PTR_ERR(vfile);
+		goto out;
+	}
+	atomic64_set(&progress->done, 0);
+	if (bkpfs_version_encoding(vfile->f_path.dentry) == BKPFS_ENC_RAW) {
+		atomic64_set(&progress->total, i_size_read(file_inode(vfile)));
+		err = bkpfs_copy_file(dentry->d_sb, vfile, dst,
+				      i_size_read(file_inode(vfile)), progress);
+	} else {
+		atomic64_set(&progress->total, i_size_read(lower_inode));
+		err = bkpfs_version_materialize(dentry, bkp_dir, version,
+						newest, dst);
+	}
+	atomic64_set(&progress->total, 0);
+	fput(vfile);
+out:
+	if (err) {
+		fput(dst);
+		return ERR_PTR(err);
+	}
+	return dst;
+}
+
+/*
+ * lock the upper and the lower directory of the file, like a rename of
+ * the upper file does, and check it may still be replaced
+ */
+static int bkpfs_restore_lock(struct dentry *dentry,
+			      struct dentry *lower_dentry,
+			      struct dentry **dir, struct dentry **lower_dir)
+{
+	int err = 0;
+
+	*dir = lock_parent(dentry);
+	*lower_dir = lock_parent(lower_dentry);
+	if (d_unhashed(dentry) || dentry->d_parent != *dir ||
+	    d_unhashed(lower_dentry) || lower_dentry->d_parent != *lower_dir)
+		err = -ENOENT;
+	else if (d_inode(lower_dentry)->i_nlink > 1)
+		err = -EMLINK;
+	else if (atomic_read(&BKPFS_I(d_inode(dentry))->writers))
+		err = -EBUSY;
+	if (err) {
+		unlock_dir(*lower_dir);
+		unlock_dir(*dir);
+	}
+	return err;
+}
+
+/* ".F.rst" in the lower directory, positive if it is @image */
+static struct dentry *bkpfs_restore_lookup(struct dentry *lower_dir,
+					   const char *name,
+					   struct file *image)
+{
+	struct dentry *link;
+
+	link = lookup_one_len(name, lower_dir, strlen(name));
+	if (IS_ERR(link))
+		return link;
+	if (d_is_negative(link) || d_inode(link) == file_inode(image))
+		return link;
+	dput(link);
+	return ERR_PTR(-EEXIST);
+}
+
+/* give @image the name @name next to the live lower file */
+static int bkpfs_restore_link(struct dentry *dentry,
+			      struct dentry *lower_dentry, struct file *image,
+			      const char *name)
+{
+	struct dentry *dir, *lower_dir, *link;
+	int err;
+
+	err = bkpfs_restore_lock(dentry, lower_dentry, &dir, &lower_dir);
+	if (err)
+		return err;
+	link = bkpfs_restore_lookup(lower_dir, name, image);
+	if (IS_ERR(link)) {
+		err = PTR_ERR(link);
+		goto out;
+	}
+	err = -EEXIST;
+	if (d_is_negative(link))
+		err = vfs_link(image->f_path.dentry, d_inode(lower_dir), link,
+			       NULL);
+	dput(link);
+out:
+	unlock_dir(lower_dir);
+	unlock_dir(dir);
+	return err;
+}
+
+/* rename @image, linked as @name, over the live lower file */
+static int bkpfs_restore_rename(struct dentry *dentry,
+				struct dentry *lower_dentry,
+				struct file *image, const char *name)
+{
+	struct dentry *dir, *lower_dir, *link;
+	int err;
+
+	err = bkpfs_restore_lock(dentry, lower_dentry, &dir, &lower_dir);
+	if (err)
+		return err;
+	link = bkpfs_restore_lookup(lower_dir, name, image);
+	if (IS_ERR(link)) {
+		err = PTR_ERR(link);
+		goto out;
+	}
+	err = -ENOENT;
+	if (d_is_positive(link))
+		err = vfs_rename(d_inode(lower_dir), link, d_inode(lower_dir),
+				 lower_dentry, NULL, 0);
+	dput(link);
+	if (err)
+		goto out;
+
+	fsstack_copy_attr_times(d_inode(dir), d_inode(lower_dir));
+	/* the next lookup instantiates the new lower inode */
+	d_drop(dentry);
+out:
+	unlock_dir(lower_dir);
+	unlock_dir(dir);
+	return err;
+}
+
+/* take @name away from @image again, after a failed restore */
+static void bkpfs_restore_unlink(struct dentry *lower_dentry,
+				 struct file *image, const char *name)
+{
+	struct dentry *lower_dir, *link;
+
+	lower_dir = lock_parent(lower_dentry);
+	link = bkpfs_restore_lookup(lower_dir, name, image);
+	if (!IS_ERR(link)) {
+		if (d_is_positive(link))
+			vfs_unlink(d_inode(lower_dir), link, NULL);
+		dput(link);
+	}
+	unlock_dir(lower_dir);
+}
+
+/*
+ * bkpfs_restore_inplace - replace a file with one of its versions
+ * @file    : the file
+ * @version : version to restore, may be -1 or -2
+ *
+ * Returns 0 on success, -EBUSY if the file is open for writing,
+ * -EMLINK if it has other links, -EOPNOTSUPP with format=preimage (the
+ * pre-images are undone starting from the file being replaced), else
+ * the corresponding error code.
+ */
+int bkpfs_restore_inplace(struct file *file, int version)
+{
+	struct dentry *dentry = file->f_path.dentry;
+	struct inode *inode = d_inode(dentry);
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+	struct bkpfs_sb_info *sbi = BKPFS_SB(inode->i_sb);
+	struct file *lower_file = bkpfs_lower_file(file);
+	struct dentry *lower_dentry = lower_file->f_path.dentry;
+	char name[NAME_MAX + 1];
+	struct dentry *bkp_dir;
+	struct file *image;
+	int min_ver, max_ver;
+	bool linked = false;
+	int err;
+
+	if (!S_ISREG(inode->i_mode))
+		return -EINVAL;
+	if (sbi->format == BKPFS_FORMAT_PREIMAGE)
+		return -EOPNOTSUPP;
+	if (snprintf(name, sizeof(name), ".%s." BKPFS_RESTORE_SUFFIX,
+		     dentry->d_name.name) >= sizeof(name))
+		return -ENAMETOOLONG;
+	/* backup=async: versions queued at close are made first */
+	err = bkpfs_wait_backups(inode);
+	if (err)
+		return err;
+
+	/*
+	 * Opens for writing wait in bkpfs_wait_backups until we are done,
+	 * and count themselves before: their writes would go to the inode
+	 * being replaced.  Checked again under the directory locks.
+	 */
+	atomic_inc(&info->restoring);
+	smp_mb__after_atomic();
+	err = -EBUSY;
+	if (atomic_read(&info->writers))
+		goto out_done;
+	err = -EMLINK;
+	if (inode->i_nlink > 1)
+		goto out_done;
+
+	bkpfs_get_versions(dentry, &min_ver, &max_ver);
+	if (version == -2)
+		version = min_ver;
+	else if (version == -1)
+		version = max_ver - 1;
+	err = -EINVAL;
+	if (version < min_ver || version >= max_ver)
+		goto out_done;
+
+	bkp_dir = bkpfs_bkp_dir(dentry);
+	if (IS_ERR(bkp_dir)) {
+		err = PTR_ERR(bkp_dir);
+		goto out_done;
+	}
+	image = bkpfs_restore_image(dentry, lower_file, bkp_dir, version,
+				    max_ver);
+	dput(bkp_dir);
+	if (IS_ERR(image)) {
+		err = PTR_ERR(image);
+		goto out_done;
+	}
+
+	/* what is replaced, unless the newest version holds it already */
+	err = bkpfs_create_new_backup(dentry, lower_file, NULL);
+	if (err)
+		goto out;
+
+	mutex_lock(&info->backup_mutex);
+	/* no delta may be taken against the restored contents */
+	bkpfs_set_delta_base(dentry, -1);
+	err = bkpfs_meta_sync(dentry);
+	if (!err)
+		err = bkpfs_copy_xattrs(lower_dentry, image->f_path.dentry);
+	/*
+	 * Named first, so a crash never leaves the versions with an
+	 * unnamed inode: before the rename they are with the live file or
+	 * with ".F.rst", which renamed over it finishes the restore.
+	 */
+	if (!err)
+		err = bkpfs_restore_link(dentry, lower_dentry, image, name);
+	linked = !err;
+	if (!err)
+		err = bkpfs_version_dir_move(sbi, d_inode(lower_dentry),
+					     file_inode(image));
+	if (!err) {
+		err = bkpfs_restore_rename(dentry, lower_dentry, image, name);
+		if (err)
+			bkpfs_version_dir_move(sbi, file_inode(image),
+					       d_inode(lower_dentry));
+	}
+	if (err && linked)
+		bkpfs_restore_unlink(lower_dentry, image, name);
+	if (!err)
+		bkpfs_bkp_dir_set(inode, NULL);
+	mutex_unlock(&info->backup_mutex);
+	if (!err)
+		bkpfs_view_drop(inode, 0);
+out:
+	fput(image);
+out_done:
+	atomic_dec(&info->restoring);
+	wake_up_all(&info->backup_waitq);
+	return err;
+}
@@ -0,0 +1,661 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "bkpfs.h"
+#include <linux/sort.h>
+
+/*
+ * Consistency scan (scan=foreground|background).
+ *
+ * The lower tree is walked by the threads of an unbound workqueue, one
+ * work item per directory: reading a directory queues its
+ * subdirectories, so as many directories are read at once as the
+ * workqueue runs threads.  For each versioned file the version files
+ * that exist in its backup directory are compared with its range:
+ *
+ *  - the newest version is the highest one inside the range, or above
+ *    it if its index record shows it was completed (a crash before the
+ *    range was written); versions above it were never completed and are
+ *    unlinked
+ *  - the oldest version is the lowest one such that every version up to
+ *    the newest exists
+ *  - the range is rewritten if it differs, and the index records of the
+ *    range are rebuilt from the version files where they are missing
+ *
+ * With store=central one more work item walks ..bkp/ino and reaps the
+ * directories of inodes that no longer exist: files unlinked below
+ * bkpfs, or before a crash kept their last upper inode from going.
+ *
+ * A file whose cached range is newer than its xattr (not synced yet) is
+ * left alone.  Counters of what was walked and fixed are reported by
+ * the SCAN_PROGRESS ioctl ("bkpctl -c").
+ */
+
+/* one directory to read */
+struct bkpfs_scan_dir {
+	struct work_struct work;
+	struct bkpfs_scan *scan;
+	struct dentry *dir;		/* lower, pinned */
+};
+
+/* an entry of a directory, copied out of iterate_dir */
+struct bkpfs_scan_ent {
+	unsigned int type;
+	int len;
+	char name[];
+};
+
+struct bkpfs_scan_buf {
+	struct dir_context ctx;
+	char *buf;
+	size_t used;
+	bool full;			/* stopped early, iterate again */
+};
+
+/* version numbers found in a backup directory */
+struct bkpfs_scan_vers {
+	struct dir_context ctx;
+	const char *prefix;		/* ".F." */
+	int plen;
+	int *v;
+	unsigned int nr, max;
+	int err;
+};
+
+/* the walk is done once the last directory is */
+static void bkpfs_scan_put(struct bkpfs_scan *scan)
+{
+	if (!atomic_dec_and_test(&scan->pending))
+		return;
+	WRITE_ONCE(scan->end, jiffies);
+	printk(KERN_INFO "bkpfs: scan of %lld dirs, %lld files done in %u ms: "
+	       "%lld fixed, %lld index records rebuilt, %lld version dirs "
+	       "reaped, %lld errors\n",
+	       (long long)atomic64_read(&scan->dirs),
+	       (long long)atomic64_read(&scan->files),
+	       jiffies_to_msecs(scan->end - scan->start),
+	       (long long)atomic64_read(&scan->fixed),
+	       (long long)atomic64_read(&scan->records),
+	       (long long)atomic64_read(&scan->reaped),
+	       (long long)atomic64_read(&scan->errors));
+	complete_all(&scan->done);
+}
+
+static void bkpfs_scan_dir_work(struct work_struct *work);
+
+/* have a worker run @fn on @dir */
+static void __bkpfs_scan_queue(struct bkpfs_scan *scan, struct dentry *dir,
+			       work_func_t fn)
+{
+	struct bkpfs_scan_dir *sd;
+
+	sd = kmalloc(sizeof(*sd), GFP_KERNEL);
+	if (!sd) {
+		atomic64_inc(&scan->errors);
+		return;
+	}
+	INIT_WORK(&sd->work, fn);
+	sd->scan = scan;
+	sd->dir = dget(dir);
+	atomic_inc(&scan->pending);
+	queue_work(scan->wq, &sd->work);
+}
+
+/* have a worker read @dir */
+static void bkpfs_scan_queue(struct bkpfs_scan *scan, struct dentry *dir)
+{
+	__bkpfs_scan_queue(scan, dir, bkpfs_scan_dir_work);
+}
+
+static int bkpfs_scan_fill(struct dir_context *ctx, const char *name,
+			   int len, loff_t offset, u64 ino,
+			   unsigned int d_type)
+{
+	struct bkpfs_scan_buf *b = container_of(ctx, struct bkpfs_scan_buf,
+						ctx);
+	struct bkpfs_scan_ent *ent;
+	size_t reclen;
+
+	reclen = ALIGN(sizeof(*ent) + len + 1, sizeof(int));
+	if (b->used + reclen > PAGE_SIZE) {
+		b->full = true;
+		return -ENOSPC;
+	}
+	ent = (struct bkpfs_scan_ent *)(b->buf + b->used);
+	ent->type = d_type;
+	ent->len = len;
+	memcpy(ent->name, name, len);
+	ent->name[len] = '\0';
+	b->used += reclen;
+	return 0;
+}
+
+static int bkpfs_scan_vers_fill(struct dir_context *ctx, const char *name,
+				int len, loff_t offset, u64 ino,
+				unsigned int d_type)
+{
+	struct bkpfs_scan_vers *sv = container_of(ctx, struct bkpfs_scan_vers,
+						  ctx);
+	char num[12];
+	int *v, n;
+
+	if (len <= sv->plen || len - sv->plen >= sizeof(num) ||
+	    memcmp(name, sv->prefix, sv->plen))
+		return 0;
+	memcpy(num, name + sv->plen, len - sv->plen);
+	num[len - sv->plen] = '\0';
+	if (kstrtoint(num, 10, &n) || n <= 0)
+		return 0;
+
+	if (sv->nr == sv->max) {
+		sv->max = sv->max ? sv->max * 2 : 16;
+		v = kvmalloc_array(sv->max, sizeof(*v), GFP_KERNEL);
+		if (!v) {
+			sv->err = -ENOMEM;
+			return -ENOMEM;
+		}
+		if (sv->nr)
+			memcpy(v, sv->v, sv->nr * sizeof(*v));
+		kvfree(sv->v);
+		sv->v = v;
+	}
+	sv->v[sv->nr++] = n;
+	return 0;
+}
+
+static int bkpfs_scan_cmp(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/* sorted version numbers present in a backup directory */
+static int bkpfs_scan_versions(struct bkpfs_scan *scan, struct dentry *bkp,
+			       const char *name, struct bkpfs_scan_vers *sv)
+{
+	char prefix[NAME_MAX + 1];
+	struct path path;
+	struct file *dir;
+	int err;
+
+	sv->plen = snprintf(prefix, sizeof(prefix), ".%s.", name);
+	if (sv->plen >= sizeof(prefix))
+		return -ENAMETOOLONG;
+	sv->prefix = prefix;
+
+	path.mnt = scan->mnt;
+	path.dentry = bkp;
+	dir = dentry_open(&path, O_RDONLY | O_DIRECTORY, current_cred());
+	if (IS_ERR(dir))
+		return PTR_ERR(dir);
+	err = iterate_dir(dir, &sv->ctx);
+	fput(dir);
+	sv->prefix = NULL;
+	if (!err)
+		err = sv->err;
+	if (!err)
+		sort(sv->v, sv->nr, sizeof(*sv->v), bkpfs_scan_cmp, NULL);
+	return err;
+}
+
+/* the index says version @v was completed */
+static bool bkpfs_scan_completed(struct file *index, int v)
+{
+	struct bkpfs_index_rec rec;
+	loff_t pos = (loff_t)v * sizeof(rec);
+
+	if (IS_ERR_OR_NULL(index) ||
+	    kernel_read(index, &rec, sizeof(rec), &pos) != sizeof(rec))
+		return false;
+	return le32_to_cpu(rec.version) == v &&
+		(le32_to_cpu(rec.flags) & BKPFS_INDEX_LIVE);
+}
+
+/* unlink a version that was never completed (leaks chunk references) */
+static void bkpfs_scan_unlink(struct bkpfs_scan *scan, struct dentry *bkp,
+			      const char *name, int v)
+{
+	char vname[NAME_MAX + 1];
+	struct dentry *victim;
+	int len;
+
+	len = snprintf(vname, sizeof(vname), ".%s.%d", name, v);
+	if (len >= sizeof(vname))
+		return;
+	inode_lock_nested(d_inode(bkp), I_MUTEX_PARENT);
+	victim = lookup_one_len(vname, bkp, len);
+	if (!IS_ERR(victim)) {
+		if (d_is_positive(victim) &&
+		    !vfs_unlink(d_inode(bkp), victim, NULL))
+			printk("INFO:scan unlinked partial version %s\n",
+			       vname);
+		dput(victim);
+	}
+	inode_unlock(d_inode(bkp));
+}
+
+/* make the index records of [oldest, next) match the version files */
+static void bkpfs_scan_index(struct bkpfs_scan *scan, struct dentry *bkp,
+			     struct file *index, const char *name,
+			     int oldest, int next)
+{
+	struct bkpfs_index_rec rec;
+	struct dentry *vdentry, *prev;
+	char vname[NAME_MAX + 1];
+	loff_t pos;
+	int v, len;
+
+	for (v = oldest; v < next; v++) {
+		if (bkpfs_scan_completed(index, v))
+			continue;
+		len = snprintf(vname, sizeof(vname), ".%s.%d", name, v);
+		if (len >= sizeof(vname))
+			return;
+		vdentry = lookup_one_len_unlocked(vname, bkp, len);
+		if (IS_ERR(vdentry))
+			continue;
+		if (d_is_negative(vdentry)) {
+			dput(vdentry);
+			continue;
+		}
+
+		/* a pre-image is dated by the version before it */
+		prev = NULL;
+		if (v > 0 && bkpfs_version_encoding(vdentry) ==
+		    BKPFS_ENC_PREIMAGE) {
+			len = snprintf(vname, sizeof(vname), ".%s.%d", name,
+				       v - 1);
+			prev = lookup_one_len_unlocked(vname, bkp, len);
+			if (IS_ERR(prev))
+				prev = NULL;
+		}
+		bkpfs_index_from_file(vdentry, prev, v, &rec);
+		dput(prev);
+		dput(vdentry);
+
+		pos = (loff_t)v * sizeof(rec);
+		if (kernel_write(index, &rec, sizeof(rec), &pos) ==
+		    sizeof(rec))
+			atomic64_inc(&scan->records);
+		else
+			atomic64_inc(&scan->errors);
+	}
+}
+
+/*
+ * bkpfs_scan_fix - check a versioned file against its backup directory
+ * @scan  : the scan
+ * @lower : the lower file
+ * @bkp   : its backup directory, NULL if it has none
+ * @meta  : its range, or NULL if the xattr is lost
+ *
+ * Returns true if the range was rewritten.
+ */
+static bool bkpfs_scan_fix(struct bkpfs_scan *scan, struct dentry *lower,
+			   struct dentry *bkp, struct bkpfs_meta *meta)
+{
+	struct bkpfs_scan_vers sv = {
+		.ctx.actor = bkpfs_scan_vers_fill,
+	};
+	const char *name = bkpfs_version_stem(BKPFS_SB(scan->sb),
+					      lower->d_name.name);
+	struct file *index = NULL;
+	int old_oldest = 1, old_next = INT_MAX, base = -1;
+	int oldest, next, newest = -1;
+	struct bkpfs_meta fixed;
+	int i, err;
+
+	if (meta) {
+		old_oldest = le32_to_cpu(meta->oldest);
+		old_next = le32_to_cpu(meta->next);
+		base = (s32)le32_to_cpu(meta->delta_base);
+	}
+
+	if (bkp) {
+		err = bkpfs_scan_versions(scan, bkp, name, &sv);
+		if (err) {
+			atomic64_inc(&scan->errors);
+			goto out;
+		}
+		index = bkpfs_index_file(scan->mnt, bkp, O_RDWR);
+	}
+
+	/* versions past the range count only if they were completed */
+	for (i = sv.nr - 1; i >= 0; i--) {
+		if (sv.v[i] < old_next ||
+		    bkpfs_scan_completed(index, sv.v[i])) {
+			newest = sv.v[i];
+			break;
+		}
+		bkpfs_scan_unlink(scan, bkp, name, sv.v[i]);
+	}
+
+	if (newest < 0) {
+		next = meta ? old_next : 1;
+		oldest = next;
+	} else {
+		next = newest + 1;
+		oldest = newest;
+		while (i > 0 && sv.v[i - 1] == oldest - 1 &&
+		       oldest - 1 >= old_oldest) {
+			oldest--;
+			i--;
+		}
+	}
+	/* a delta base is only good if the newest version did not change */
+	if (next != old_next || base >= next)
+		base = -1;
+
+	if (!IS_ERR_OR_NULL(index))
+		bkpfs_scan_index(scan, bkp, index, name, oldest, next);
+
+	if (meta && oldest == old_oldest && next == old_next &&
+	    base == (s32)le32_to_cpu(meta->delta_base))
+		goto out;
+	printk("INFO:scan: versions of %s were [%d, %d), now [%d, %d)\n",
+	       lower->d_name.name, old_oldest, meta ? old_next : 0, oldest, next);
+	fixed.oldest = cpu_to_le32(oldest);
+	fixed.next = cpu_to_le32(next);
+	fixed.delta_base = cpu_to_le32(base);
+	fixed.flags = 0;
+	err = vfs_setxattr(lower, BKPFS_XATTR_META, (void *)&fixed,
+			   sizeof(fixed), 0);
+	if (err) {
+		atomic64_inc(&scan->errors);
+		goto out;
+	}
+	if (!IS_ERR_OR_NULL(index))
+		fput(index);
+	kvfree(sv.v);
+	return true;
+out:
+	if (!IS_ERR_OR_NULL(index))
+		fput(index);
+	kvfree(sv.v);
+	return false;
+}
+
+/* check one regular file of @dir */
+static void bkpfs_scan_file(struct bkpfs_scan *scan, struct dentry *lower)
+{
+	struct bkpfs_inode_info *info;
+	struct bkpfs_meta meta;
+	struct dentry *bkp;
+	struct inode *inode;
+	bool has_meta;
+
+	atomic64_inc(&scan->files);
+	bkp = bkpfs_version_dir(BKPFS_SB(scan->sb), lower, false);
+	if (IS_ERR(bkp)) {
+		if (PTR_ERR(bkp) != -ENOENT) {
+			atomic64_inc(&scan->errors);
+			return;
+		}
+		bkp = NULL;
+	}
+	has_meta = !bkpfs_meta_read(lower, &meta);
+	if (!has_meta && !bkp)
+		goto out;	/* not versioned */
+	atomic64_inc(&scan->versioned);
+
+	/* keeps backups of the file out while it is checked */
+	inode = bkpfs_iget(scan->sb, d_inode(lower));
+	if (IS_ERR(inode)) {
+		atomic64_inc(&scan->errors);
+		goto out;
+	}
+	info = BKPFS_I(inode);
+	mutex_lock(&info->backup_mutex);
+	mutex_lock(&info->meta_mutex);
+	/* a range not synced yet is newer than the xattr */
+	if (READ_ONCE(info->meta_state) != BKPFS_META_DIRTY) {
+		has_meta = !bkpfs_meta_read(lower, &meta);
+		if (bkpfs_scan_fix(scan, lower, bkp, has_meta ? &meta : NULL)) {
+			atomic64_inc(&scan->fixed);
+			spin_lock(&info->meta_lock);
+			info->meta_state = BKPFS_META_UNLOADED;
+			spin_unlock(&info->meta_lock);
+		}
+	}
+	mutex_unlock(&info->meta_mutex);
+	mutex_unlock(&info->backup_mutex);
+	iput(inode);
+out:
+	dput(bkp);
+}
+
+/* one entry of a directory being read */
+static void bkpfs_scan_entry(struct bkpfs_scan *scan, struct dentry *dir,
+			     struct bkpfs_scan_ent *ent)
+{
+	struct dentry *dentry;
+
+	if (!strcmp(ent->name, ".") || !strcmp(ent->name, ".."))
+		return;
+	/* backup directories and ..bkp are checked with their files */
+	if (ent->len >= 4 && !strcmp(ent->name + ent->len - 4, ".bkp"))
+		return;
+	if (ent->type != DT_DIR && ent->type != DT_REG &&
+	    ent->type != DT_UNKNOWN)
+		return;
+
+	dentry = lookup_one_len_unlocked(ent->name, dir, ent->len);
+	if (IS_ERR(dentry)) {
+		atomic64_inc(&scan->errors);
+		return;
+	}
+	if (d_is_dir(dentry))
+		bkpfs_scan_queue(scan, dentry);
+	else if (d_is_reg(dentry))
+		bkpfs_scan_file(scan, dentry);
+	dput(dentry);
+}
+
+static void bkpfs_scan_dir_work(struct work_struct *work)
+{
+	struct bkpfs_scan_dir *sd = container_of(work, struct bkpfs_scan_dir,
+						 work);
+	struct bkpfs_scan *scan = sd->scan;
+	struct bkpfs_scan_buf b = {
+		.ctx.actor = bkpfs_scan_fill,
+	};
+	struct bkpfs_scan_ent *ent;
+	struct path path;
+	struct file *dir;
+	size_t off;
+	int err;
+
+	if (READ_ONCE(scan->stop))
+		goto out;
+	path.mnt = scan->mnt;
+	path.dentry = sd->dir;
+	dir = dentry_open(&path, O_RDONLY | O_DIRECTORY, current_cred());
+	if (IS_ERR(dir)) {
+		atomic64_inc(&scan->errors);
+		goto out;
+	}
+	b.buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!b.buf) {
+		atomic64_inc(&scan->errors);
+		goto out_fput;
+	}
+
+	/* lookups cannot be done under iterate_dir: a page at a time */
+	do {
+		b.used = 0;
+		b.full = false;
+		err = iterate_dir(dir, &b.ctx);
+		if (err) {
+			atomic64_inc(&scan->errors);
+			break;
+		}
+		for (off = 0; off < b.used;
+		     off += ALIGN(sizeof(*ent) + ent->len + 1, sizeof(int))) {
+			ent = (struct bkpfs_scan_ent *)(b.buf + off);
+			bkpfs_scan_entry(scan, sd->dir, ent);
+		}
+		cond_resched();
+	} while (b.full && !READ_ONCE(scan->stop));
+	atomic64_inc(&scan->dirs);
+
+	kfree(b.buf);
+out_fput:
+	fput(dir);
+out:
+	dput(sd->dir);
+	kfree(sd);
+	bkpfs_scan_put(scan);
+}
+
+/*
+ * bkpfs_scan_central - reap the version dirs of inodes gone, under @dir
+ * @scan  : the scan
+ * @dir   : ..bkp/ino at @depth 0, then <h1> and <h2>
+ * @depth : how far down ..bkp/ino
+ *
+ * The store is two levels of hash directories deep, then one directory
+ * per inode, named <inode number>.<generation>.
+ */
+static void bkpfs_scan_central(struct bkpfs_scan *scan, struct dentry *dir,
+			       int depth)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(scan->sb);
+	struct bkpfs_scan_buf b = {
+		.ctx.actor = bkpfs_scan_fill,
+	};
+	struct bkpfs_scan_ent *ent;
+	struct dentry *sub;
+	struct path path;
+	struct file *file;
+	size_t off;
+
+	path.mnt = scan->mnt;
+	path.dentry = dir;
+	file = dentry_open(&path, O_RDONLY | O_DIRECTORY, current_cred());
+	if (IS_ERR(file)) {
+		atomic64_inc(&scan->errors);
+		return;
+	}
+	b.buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!b.buf) {
+		atomic64_inc(&scan->errors);
+		goto out_fput;
+	}
+
+	do {
+		b.used = 0;
+		b.full = false;
+		if (iterate_dir(file, &b.ctx)) {
+			atomic64_inc(&scan->errors);
+			break;
+		}
+		for (off = 0; off < b.used && !READ_ONCE(scan->stop);
+		     off += ALIGN(sizeof(*ent) + ent->len + 1, sizeof(int))) {
+			ent = (struct bkpfs_scan_ent *)(b.buf + off);
+			if (ent->name[0] == '.')
+				continue;
+			if (depth == 2) {
+				if (!bkpfs_version_dir_orphan(sbi, ent->name))
+					continue;
+				if (bkpfs_version_dir_reap(sbi, dir, ent->name))
+					atomic64_inc(&scan->errors);
+				else
+					atomic64_inc(&scan->reaped);
+				continue;
+			}
+			sub = lookup_one_len_unlocked(ent->name, dir, ent->len);
+			if (IS_ERR(sub)) {
+				atomic64_inc(&scan->errors);
+				continue;
+			}
+			if (d_is_dir(sub))
+				bkpfs_scan_central(scan, sub, depth + 1);
+			dput(sub);
+		}
+		cond_resched();
+	} while (b.full && !READ_ONCE(scan->stop));
+
+	kfree(b.buf);
+out_fput:
+	fput(file);
+}
+
+static void bkpfs_scan_central_work(struct work_struct *work)
+{
+	struct bkpfs_scan_dir *sd = container_of(work, struct bkpfs_scan_dir,
+						 work);
+	struct bkpfs_scan *scan = sd->scan;
+
+	if (!READ_ONCE(scan->stop))
+		bkpfs_scan_central(scan, sd->dir, 0);
+	dput(sd->dir);
+	kfree(sd);
+	bkpfs_scan_put(scan);
+}
+
+/*
+ * bkpfs_scan_start - start the consistency scan of a mount
+ * @sb         : bkpfs superblock, with its root set up
+ * @lower_root : root of the lower directory
+ *
+ * With scan=foreground the mount waits for the scan to finish.  Returns
+ * 0 on success, else the corresponding error code.
+ */
+int bkpfs_scan_start(struct super_block *sb, const struct path *lower_root)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	struct bkpfs_scan *scan;
+
+	scan = kzalloc(sizeof(*scan), GFP_KERNEL);
+	if (!scan)
+		return -ENOMEM;
+	scan->wq = alloc_workqueue("bkpfs_scan", WQ_UNBOUND, 0);
+	if (!scan->wq) {
+		kfree(scan);
+		return -ENOMEM;
+	}
+	scan->sb = sb;
+	scan->mnt = lower_root->mnt;
+	init_completion(&scan->done);
+	scan->start = jiffies;
+	sbi->scan = scan;
+
+	/* held until the root is queued, so the walk cannot end early */
+	atomic_set(&scan->pending, 1);
+	bkpfs_scan_queue(scan, lower_root->dentry);
+	if (sbi->store == BKPFS_STORE_CENTRAL)
+		__bkpfs_scan_queue(scan, sbi->central.dentry,
+				   bkpfs_scan_central_work);
+	bkpfs_scan_put(scan);
+
+	if (sbi->scan_mode == BKPFS_SCAN_FOREGROUND)
+		wait_for_completion(&scan->done);
+	return 0;
+}
+
+/*
+ * bkpfs_scan_stop - end the scan of a mount, at unmount
+ *
+ * Directories not read yet are skipped; the inodes the scan holds are
+ * released before generic_shutdown_super looks for busy ones.
+ */
+void bkpfs_scan_stop(struct super_block *sb)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	struct bkpfs_scan *scan = sbi->scan;
+
+	if (!scan)
+		return;
+	WRITE_ONCE(scan->stop, true);
+	wait_for_completion(&scan->done);
+	destroy_workqueue(scan->wq);
+	kfree(scan);
+	sbi->scan = NULL;
+}
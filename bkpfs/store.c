@@ -0,0 +1,454 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "bkpfs.h"
+#include <linux/hash.h>
+
+/*
+ * Where the versions of a file are kept.
+ *
+ * store=sibling (the default) keeps them next to the file F, in a
+ * ".F.bkp" directory made by bkpfs_create, as ".F.1", ".F.2", ...
+ *
+ * store=central keeps every version of the mount under the lower root,
+ * in one directory per lower inode, made by the first version:
+ *
+ *	..bkp/ino/<h1>/<h2>/<inode number>.<generation>/.v.1, .v.2, ...
+ *
+ * where h1 and h2 are two bytes of a hash of the inode number, so no
+ * directory of the store gets large.  User directories then hold only
+ * user files: create does no mkdir and readdir has nothing to hide.
+ * The versions follow the inode, so they survive renames and are
+ * shared by hard links.  They go with the inode too: its directory is
+ * removed when the upper inode of the last link is evicted, and the
+ * scan reaps the directories of inodes that went while bkpfs was not
+ * looking.  The layouts are not converted: a tree mounted
+ * with the other store does not see the versions made before.
+ */
+
+#define BKPFS_CENTRAL_DIR	"ino"
+#define BKPFS_CENTRAL_STEM	"v"
+#define BKPFS_CENTRAL_BITS	16
+
+/*
+ * bkpfs_store_subdir - look up a directory of the version store
+ * @parent : lower directory it is in
+ * @name   : its name
+ * @create : make it (mode 0700) if it does not exist
+ *
+ * Returns a reference to its dentry, -ENOENT if it does not exist and
+ * @create is false, else the corresponding error code.
+ */
+struct dentry *bkpfs_store_subdir(struct dentry *parent, const char *name,
+				  bool create)
+{
+	struct dentry *dir;
+	int len = strlen(name);
+	int err = 0;
+
+	if (!create) {
+		dir = lookup_one_len_unlocked(name, parent, len);
+		if (!IS_ERR(dir) && d_is_negative(dir))
+			err = -ENOENT;
+	} else {
+		inode_lock_nested(d_inode(parent), I_MUTEX_PARENT);
+		dir = lookup_one_len(name, parent, len);
+		if (!IS_ERR(dir) && d_is_negative(dir))
+			err = vfs_mkdir(d_inode(parent), dir, 0700);
+		inode_unlock(d_inode(parent));
+	}
+	if (IS_ERR(dir))
+		return dir;
+	if (!err && !d_is_dir(dir))
+		err = -ENOTDIR;
+	if (err) {
+		dput(dir);
+		return ERR_PTR(err);
+	}
+	return dir;
+}
+
+/*
+ * bkpfs_version_store_init - open the central store of a mount
+ * @sbi        : super block info
+ * @lower_root : root of the lower directory
+ *
+ * Nothing to do for store=sibling.  Returns 0 on success, else the
+ * corresponding error code.
+ */
+int bkpfs_version_store_init(struct bkpfs_sb_info *sbi,
+			     const struct path *lower_root)
+{
+	struct dentry *store, *dir;
+
+	if (sbi->store != BKPFS_STORE_CENTRAL)
+		return 0;
+	store = bkpfs_store_dir(lower_root, true);
+	if (IS_ERR(store))
+		return PTR_ERR(store);
+	dir = bkpfs_store_subdir(store, BKPFS_CENTRAL_DIR, true);
+	dput(store);
+	if (IS_ERR(dir))
+		return PTR_ERR(dir);
+	sbi->central.mnt = mntget(lower_root->mnt);
+	sbi->central.dentry = dir;
+	return 0;
+}
+
+void bkpfs_version_store_exit(struct bkpfs_sb_info *sbi)
+{
+	if (!sbi->central.dentry)
+		return;
+	path_put(&sbi->central);
+	sbi->central.dentry = NULL;
+}
+
+/*
+ * bkpfs_version_stem - what the version files of a file are named after
+ * @sbi  : super block info
+ * @name : name of the file
+ *
+ * Version N of the file is ".<stem>.N".
+ */
+const char *bkpfs_version_stem(struct bkpfs_sb_info *sbi, const char *name)
+{
+	return sbi->store == BKPFS_STORE_CENTRAL ? BKPFS_CENTRAL_STEM : name;
+}
+
+/* ..bkp/ino/<h1>/<h2>, and <ino>.<gen> in @name */
+static struct dentry *bkpfs_central_parent(struct bkpfs_sb_info *sbi,
+					   struct inode *lower_inode,
+					   bool create, char *name, size_t len)
+{
+	u32 h = hash_64(lower_inode->i_ino, BKPFS_CENTRAL_BITS);
+	struct dentry *d1, *d2;
+
+	snprintf(name, len, "%02x", h >> 8);
+	d1 = bkpfs_store_subdir(sbi->central.dentry, name, create);
+	if (IS_ERR(d1))
+		return d1;
+	snprintf(name, len, "%02x", h & 0xff);
+	d2 = bkpfs_store_subdir(d1, name, create);
+	dput(d1);
+	/* an inode number is reused, its generation is not */
+	snprintf(name, len, "%lx.%x", lower_inode->i_ino,
+		 lower_inode->i_generation);
+	return d2;
+}
+
+static struct dentry *bkpfs_central_dir(struct bkpfs_sb_info *sbi,
+					struct inode *lower_inode,
+					bool create)
+{
+	char name[32];
+	struct dentry *parent, *dir;
+
+	parent = bkpfs_central_parent(sbi, lower_inode, create, name,
+				      sizeof(name));
+	if (IS_ERR(parent))
+		return parent;
+	dir = bkpfs_store_subdir(parent, name, create);
+	dput(parent);
+	return dir;
+}
+
+/*
+ * bkpfs_version_dir - the lower directory holding the versions of a file
+ * @sbi    : super block info
+ * @lower  : lower dentry of the file
+ * @create : make it if it does not exist
+ *
+ * Returns a reference to its dentry, -ENOENT if it does not exist and
+ * @create is false, else the corresponding error code.
+ */
+struct dentry *bkpfs_version_dir(struct bkpfs_sb_info *sbi,
+				 struct dentry *lower, bool create)
+{
+	char name[NAME_MAX + 1];
+	struct dentry *parent, *dir;
+
+	if (sbi->store == BKPFS_STORE_CENTRAL)
+		return bkpfs_central_dir(sbi, d_inode(lower), create);
+
+	if (snprintf(name, sizeof(name), ".%s.bkp", lower->d_name.name) >=
+	    sizeof(name))
+		return ERR_PTR(-ENAMETOOLONG);
+	parent = dget_parent(lower);
+	dir = bkpfs_store_subdir(parent, name, create);
+	dput(parent);
+	return dir;
+}
+
+/*
+ * bkpfs_version_dir_move - give the versions of a lower file to another
+ * @sbi  : super block info
+ * @from : lower inode the versions belong to
+ * @to   : lower inode taking its place, which has no versions yet
+ *
+ * Only store=central finds the versions by inode; a sibling store goes
+ * by name and has nothing to move.
+ *
+ * Returns 0 on success, also if @from has no versions, else the
+ * corresponding error code.
+ */
+int bkpfs_version_dir_move(struct bkpfs_sb_info *sbi, struct inode *from,
+			   struct inode *to)
+{
+	char old_name[32], new_name[32];
+	struct dentry *old_parent, *new_parent, *old, *new;
+	int err;
+
+	if (sbi->store != BKPFS_STORE_CENTRAL)
+		return 0;
+	old_parent = bkpfs_central_parent(sbi, from, false, old_name,
+					  sizeof(old_name));
+	if (IS_ERR(old_parent))
+		return PTR_ERR(old_parent) == -ENOENT ? 0 : PTR_ERR(old_parent);
+	new_parent = bkpfs_central_parent(sbi, to, true, new_name,
+					  sizeof(new_name));
+	if (IS_ERR(new_parent)) {
+		err = PTR_ERR(new_parent);
+		goto out_old;
+	}
+
+	/* leaves of the store, neither is an ancestor of the other */
+	lock_rename(new_parent, old_parent);
+	old = lookup_one_len(old_name, old_parent, strlen(old_name));
+	if (IS_ERR(old)) {
+		err = PTR_ERR(old);
+		goto out_unlock;
+	}
+	new = lookup_one_len(new_name, new_parent, strlen(new_name));
+	if (IS_ERR(new)) {
+		err = PTR_ERR(new);
+		goto out_dput;
+	}
+	if (d_is_negative(old))
+		err = 0;
+	else if (d_is_positive(new))
+		err = -EEXIST;
+	else
+		err = vfs_rename(d_inode(old_parent), old,
+				 d_inode(new_parent), new, NULL, 0);
+	dput(new);
+out_dput:
+	dput(old);
+out_unlock:
+	unlock_rename(new_parent, old_parent);
+	dput(new_parent);
+out_old:
+	dput(old_parent);
+	return err;
+}
+
+/* names in a directory, copied out of iterate_dir a page at a time */
+struct bkpfs_store_names {
+	struct dir_context ctx;
+	char *buf;
+	size_t used;
+	bool full;			/* stopped early, iterate again */
+};
+
+static int bkpfs_store_names_fill(struct dir_context *ctx, const char *name,
+				  int len, loff_t offset, u64 ino,
+				  unsigned int d_type)
+{
+	struct bkpfs_store_names *n =
+		container_of(ctx, struct bkpfs_store_names, ctx);
+
+	if ((len == 1 && name[0] == '.') ||
+	    (len == 2 && name[0] == '.' && name[1] == '.'))
+		return 0;
+	if (n->used + len + 1 > PAGE_SIZE) {
+		n->full = true;
+		return -ENOSPC;
+	}
+	memcpy(n->buf + n->used, name, len);
+	n->buf[n->used + len] = '\0';
+	n->used += len + 1;
+	return 0;
+}
+
+/* unlink one entry of a version directory */
+static int bkpfs_store_unlink(struct bkpfs_sb_info *sbi,
+			      const struct path *dir, const char *name)
+{
+	struct path victim;
+	int err = 0;
+
+	victim.mnt = dir->mnt;
+	victim.dentry = lookup_one_len_unlocked(name, dir->dentry,
+						strlen(name));
+	if (IS_ERR(victim.dentry))
+		return PTR_ERR(victim.dentry);
+	/* manifests hold references to chunks */
+	if (d_is_reg(victim.dentry) &&
+	    bkpfs_version_encoding(victim.dentry) == BKPFS_ENC_CHUNKED)
+		bkpfs_chunk_release_path(sbi, &victim);
+
+	inode_lock_nested(d_inode(dir->dentry), I_MUTEX_PARENT);
+	if (d_is_positive(victim.dentry) &&
+	    victim.dentry->d_parent == dir->dentry)
+		err = vfs_unlink(d_inode(dir->dentry), victim.dentry, NULL);
+	inode_unlock(d_inode(dir->dentry));
+	dput(victim.dentry);
+	return err;
+}
+
+/* unlink every entry of a version directory */
+static int bkpfs_store_empty(struct bkpfs_sb_info *sbi,
+			     const struct path *dir)
+{
+	struct bkpfs_store_names n = {
+		.ctx.actor = bkpfs_store_names_fill,
+	};
+	struct file *file;
+	size_t off;
+	int err = 0;
+
+	file = dentry_open(dir, O_RDONLY | O_DIRECTORY, current_cred());
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+	n.buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!n.buf) {
+		fput(file);
+		return -ENOMEM;
+	}
+
+	/* what was read is gone, so every pass starts over */
+	do {
+		n.used = 0;
+		n.full = false;
+		if (vfs_llseek(file, 0, SEEK_SET) < 0)
+			err = -EIO;
+		if (!err)
+			err = iterate_dir(file, &n.ctx);
+		for (off = 0; !err && off < n.used;
+		     off += strlen(n.buf + off) + 1)
+			err = bkpfs_store_unlink(sbi, dir, n.buf + off);
+	} while (!err && n.full);
+
+	kfree(n.buf);
+	fput(file);
+	return err;
+}
+
+/*
+ * bkpfs_version_dir_reap - remove a central version directory
+ * @sbi    : super block info, store=central
+ * @parent : ..bkp/ino/<h1>/<h2>
+ * @name   : <inode number>.<generation>
+ *
+ * Unlinks every version, the index and the block sums, dropping the
+ * chunk references of manifests, then the directory.  Called for
+ * inodes that are gone, so nothing adds versions meanwhile.
+ *
+ * Returns 0 on success, also if there is no such directory, else the
+ * corresponding error code.
+ */
+int bkpfs_version_dir_reap(struct bkpfs_sb_info *sbi, struct dentry *parent,
+			   const char *name)
+{
+	struct path dir;
+	int err;
+
+	dir.mnt = sbi->central.mnt;
+	dir.dentry = lookup_one_len_unlocked(name, parent, strlen(name));
+	if (IS_ERR(dir.dentry))
+		return PTR_ERR(dir.dentry);
+	if (d_is_negative(dir.dentry)) {
+		dput(dir.dentry);
+		return 0;
+	}
+
+	err = bkpfs_store_empty(sbi, &dir);
+	if (!err) {
+		inode_lock_nested(d_inode(parent), I_MUTEX_PARENT);
+		if (dir.dentry->d_parent == parent && !d_unhashed(dir.dentry))
+			err = vfs_rmdir(d_inode(parent), dir.dentry);
+		inode_unlock(d_inode(parent));
+	}
+	if (!err)
+		printk("INFO:removed the versions of inode %s\n", name);
+	dput(dir.dentry);
+	return err;
+}
+
+/*
+ * bkpfs_version_dir_remove - remove the versions of a lower inode
+ * @sbi         : super block info
+ * @lower_inode : the inode, whose last link is gone
+ *
+ * Only store=central keeps versions by inode; a sibling store keeps the
+ * backup directory under its name.
+ */
+void bkpfs_version_dir_remove(struct bkpfs_sb_info *sbi,
+			      struct inode *lower_inode)
+{
+	char name[32];
+	struct dentry *parent;
+	int err;
+
+	if (sbi->store != BKPFS_STORE_CENTRAL)
+		return;
+	parent = bkpfs_central_parent(sbi, lower_inode, false, name,
+				      sizeof(name));
+	if (IS_ERR(parent))
+		return;
+	err = bkpfs_version_dir_reap(sbi, parent, name);
+	if (err)
+		printk(KERN_ERR "bkpfs: cannot remove the versions of "
+		       "inode %s: %d\n", name, err);
+	dput(parent);
+}
+
+/*
+ * bkpfs_version_dir_orphan - is the inode of a central directory gone
+ * @sbi  : super block info
+ * @name : <inode number>.<generation>, the name of the directory
+ *
+ * An inode still in the cache, maybe open but unlinked, is not gone.
+ * Otherwise the lower file system is asked for the inode through a
+ * file handle; only its -ESTALE says the inode is gone, so nothing is
+ * reaped on file systems that cannot tell.
+ */
+bool bkpfs_version_dir_orphan(struct bkpfs_sb_info *sbi, const char *name)
+{
+	const struct export_operations *nop = sbi->lower_sb->s_export_op;
+	struct inode *inode;
+	struct dentry *dentry;
+	unsigned long ino;
+	struct fid fid;
+	bool alive;
+	u32 gen;
+
+	if (sscanf(name, "%lx.%x", &ino, &gen) != 2)
+		return false;
+	inode = ilookup(sbi->lower_sb, ino);
+	if (inode) {
+		/* the number was given to another inode */
+		alive = inode->i_generation == gen;
+		iput(inode);
+		return !alive;
+	}
+	if (!nop || !nop->fh_to_dentry || ino > U32_MAX)
+		return false;
+
+	fid.i32.ino = ino;
+	fid.i32.gen = gen;
+	dentry = nop->fh_to_dentry(sbi->lower_sb, &fid, 2, FILEID_INO32_GEN);
+	if (!dentry)
+		return true;
+	if (IS_ERR(dentry))
+		return PTR_ERR(dentry) == -ESTALE;
+	dput(dentry);
+	return false;
+}
@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "bkpfs.h"
+
+/*
+ * Version summary of the children of a directory (DIR_SUMMARY).
+ *
+ * The lower directory is read a page of names at a time; each child is
+ * then looked up outside iterate_dir.  Its version range comes from its
+ * inode if that is in memory (it may not be written back yet), else
+ * from its xattr, and its sizes and newest time from the index of its
+ * backup directory, so a child costs a lookup and two small reads and
+ * no version file is opened.  Versions made before the index existed
+ * are counted but their bytes are not.  The walk stops where the caller
+ * runs out of room and returns a cookie, the lower directory position
+ * of the next child, to resume from.
+ */
+
+struct bkpfs_summary_ent {
+	loff_t pos;			/* of this entry in the directory */
+	u64 ino;
+	unsigned int type;
+	int len;
+	char name[];
+};
+
+struct bkpfs_summary_buf {
+	struct dir_context ctx;
+	char *buf;
+	size_t used;
+	bool full;			/* stopped early, iterate again */
+};
+
+static int bkpfs_summary_fill(struct dir_context *ctx, const char *name,
+			      int len, loff_t offset, u64 ino,
+			      unsigned int d_type)
+{
+	struct bkpfs_summary_buf *b = container_of(ctx,
+						   struct bkpfs_summary_buf,
+						   ctx);
+	struct bkpfs_summary_ent *ent;
+	size_t reclen;
+
+	reclen = ALIGN(sizeof(*ent) + len + 1, sizeof(u64));
+	if (b->used + reclen > PAGE_SIZE) {
+		b->full = true;
+		return -ENOSPC;
+	}
+	ent = (struct bkpfs_summary_ent *)(b->buf + b->used);
+	ent->pos = offset;
+	ent->ino = ino;
+	ent->type = d_type;
+	ent->len = len;
+	memcpy(ent->name, name, len);
+	ent->name[len] = '\0';
+	b->used += reclen;
+	return 0;
+}
+
+/* add up the live records of [oldest, next) in the index of @bkp */
+static void bkpfs_summary_index(struct vfsmount *mnt, struct dentry *bkp,
+				int oldest, int next,
+				struct bkpfs_index_rec *recs,
+				struct bkpfs_summary *s)
+{
+	struct file *index;
+	loff_t pos;
+	ssize_t ret;
+	int v, i, n;
+
+	index = bkpfs_index_file(mnt, bkp, O_RDONLY);
+	if (IS_ERR(index))
+		return;
+	for (v = oldest; v < next; v += n) {
+		n = min(next - v, BKPFS_INDEX_BATCH);
+		pos = (loff_t)v * sizeof(*recs);
+		ret = kernel_read(index, recs, n * sizeof(*recs), &pos);
+		if (ret <= 0)
+			break;
+		for (i = 0; i < ret / sizeof(*recs); i++) {
+			if (le32_to_cpu(recs[i].version) != v + i ||
+			    !(le32_to_cpu(recs[i].flags) & BKPFS_INDEX_LIVE))
+				continue;
+			s->bytes += le64_to_cpu(recs[i].stored);
+			s->newest_ns = max_t(u64, s->newest_ns,
+					     le64_to_cpu(recs[i].ctime));
+		}
+	}
+	fput(index);
+}
+
+/* fill @s for one child of the lower directory @dir */
+static void bkpfs_summarize(struct super_block *sb, struct file *dir,
+			    struct bkpfs_summary_ent *ent,
+			    struct bkpfs_index_rec *recs,
+			    struct bkpfs_summary *s)
+{
+	struct dentry *lower, *bkp;
+	struct bkpfs_meta meta;
+	struct inode *inode;
+	int oldest, next, err = -ENOENT;
+
+	memset(s, 0, sizeof(*s));
+	s->name = ent->name;
+	s->namelen = ent->len;
+	s->ino = ent->ino;
+	if (ent->type != DT_REG && ent->type != DT_UNKNOWN)
+		return;
+
+	lower = lookup_one_len_unlocked(ent->name, dir->f_path.dentry,
+					ent->len);
+	if (IS_ERR(lower))
+		return;
+	if (!d_is_reg(lower))
+		goto out;
+
+	/* a range not synced yet is newer than the xattr */
+	inode = bkpfs_ilookup(sb, d_inode(lower));
+	if (inode) {
+		err = bkpfs_meta_peek(inode, &oldest, &next);
+		iput(inode);
+	}
+	if (err == -ENOENT) {
+		err = bkpfs_meta_read(lower, &meta);
+		oldest = le32_to_cpu(meta.oldest);
+		next = le32_to_cpu(meta.next);
+	}
+	if (err || next <= oldest)
+		goto out;
+	s->versions = next - oldest;
+
+	bkp = bkpfs_version_dir(BKPFS_SB(sb), lower, false);
+	if (IS_ERR(bkp))
+		goto out;
+	bkpfs_summary_index(dir->f_path.mnt, bkp, oldest, next, recs, s);
+	dput(bkp);
+out:
+	dput(lower);
+}
+
+/*
+ * bkpfs_dir_summary - summarize the versions of the children of a dir
+ * @file   : the upper directory
+ * @cookie : in: where to start, 0 for the first child; out: where the
+ *	     next call should start
+ * @eof    : out: every child was passed to @fn
+ * @fn     : called for each child, in directory order
+ * @arg    : passed to @fn
+ *
+ * Backup directories and the store of the mount are not children.
+ * Returns 0 on success, else the corresponding error code.
+ */
+int bkpfs_dir_summary(struct file *file, loff_t *cookie, bool *eof,
+		      bkpfs_summary_fn fn, void *arg)
+{
+	struct super_block *sb = file_inode(file)->i_sb;
+	struct bkpfs_summary_buf b = {
+		.ctx.actor = bkpfs_summary_fill,
+	};
+	struct bkpfs_summary_ent *ent;
+	struct bkpfs_index_rec *recs;
+	struct bkpfs_summary s;
+	struct file *dir;
+	size_t off;
+	loff_t pos;
+	int err = 0;
+
+	*eof = false;
+	/* our own file: readdir of the caller keeps its position */
+	dir = dentry_open(&bkpfs_lower_file(file)->f_path,
+			  O_RDONLY | O_DIRECTORY, current_cred());
+	if (IS_ERR(dir))
+		return PTR_ERR(dir);
+	if (*cookie) {
+		pos = vfs_llseek(dir, *cookie, SEEK_SET);
+		if (pos < 0) {
+			err = pos;
+			goto out_fput;
+		}
+	}
+	b.buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	recs = kmalloc_array(BKPFS_INDEX_BATCH, sizeof(*recs), GFP_KERNEL);
+	if (!b.buf || !recs) {
+		err = -ENOMEM;
+		goto out_free;
+	}
+
+	for (;;) {
+		b.used = 0;
+		b.full = false;
+		err = iterate_dir(dir, &b.ctx);
+		if (err)
+			break;
+		for (off = 0; off < b.used;
+		     off += ALIGN(sizeof(*ent) + ent->len + 1, sizeof(u64))) {
+			ent = (struct bkpfs_summary_ent *)(b.buf + off);
+			if (!strcmp(ent->name, ".") ||
+			    !strcmp(ent->name, "..") ||
+			    (ent->len >= 4 &&
+			     !strcmp(ent->name + ent->len - 4, ".bkp")))
+				continue;
+			bkpfs_summarize(sb, dir, ent, recs, &s);
+			if (fn(arg, &s)) {
+				*cookie = ent->pos;
+				goto out_free;
+			}
+		}
+		*cookie = dir->f_pos;
+		if (!b.full) {
+			*eof = true;
+			break;
+		}
+		if (fatal_signal_pending(current)) {
+			err = -EINTR;
+			break;
+		}
+		cond_resched();
+	}
+
+out_free:
+	kfree(recs);
+	kfree(b.buf);
+out_fput:
+	fput(dir);
+	return err;
+}
@@ -28,11 +28,19 @@ static void bkpfs_put_super(struct super_block *sb)
 	if (!spd)
 		return;
 
+	/* before the lower super may go away */
+	bkpfs_journal_exit(spd);
+	bkpfs_version_store_exit(spd);
+
 	/* decrement lower super references */
 	s = bkpfs_lower_super(sb);
 	bkpfs_set_lower_super(sb, NULL);
 	atomic_dec(&s->s_active);
 
+	if (spd->backup_wq)
+		destroy_workqueue(spd->backup_wq);
+	bkpfs_chunk_store_exit(spd);
+	put_cred(spd->mounter_cred);
 	kfree(spd);
 	sb->s_fs_info = NULL;
 }
@@ -83,15 +91,27 @@ static int bkpfs_remount_fs(struct super_block *sb, int *flags, char *options)
  */
 static void bkpfs_evict_inode(struct inode *inode)
 {
+	struct bkpfs_sb_info *sbi = BKPFS_SB(inode->i_sb);
+	const struct cred *old_cred;
 	struct inode *lower_inode;
 	UDBG;
 	truncate_inode_pages(&inode->i_data, 0);
 	clear_inode(inode);
+	bkpfs_bkp_dir_set(inode, NULL);
+	lower_inode = bkpfs_lower_inode(inode);
+
+	/* store=central: the last link is gone, and its versions with it */
+	if (lower_inode && S_ISREG(inode->i_mode) && !lower_inode->i_nlink &&
+	    sbi->store == BKPFS_STORE_CENTRAL) {
+		old_cred = override_creds(sbi->mounter_cred);
+		bkpfs_version_dir_remove(sbi, lower_inode);
+		revert_creds(old_cred);
+	}
+
 	/*
 	 * Decrement a reference to a lower_inode, which was incremented
 	 * by our read_inode when it was created initially.
 	 */
-	lower_inode = bkpfs_lower_inode(inode);
 	bkpfs_set_lower_inode(inode, NULL);
 	iput(lower_inode);
 }
@@ -106,6 +126,18 @@ static struct inode *bkpfs_alloc_inode(struct super_block *sb)
 
 	/* memset everything up to the inode to 0 */
 	memset(i, 0, offsetof(struct bkpfs_inode_info, vfs_inode));
+	mutex_init(&i->backup_mutex);
+	spin_lock_init(&i->bkp_dir_lock);
+	mutex_init(&i->view_mutex);
+	spin_lock_init(&i->view_lock);
+	init_waitqueue_head(&i->backup_waitq);
+	i->trunc_floor = LLONG_MAX;
+	INIT_DELAYED_WORK(&i->coalesce.work, bkpfs_coalesce_work);
+	mutex_init(&i->coalesce.lock);
+	INIT_LIST_HEAD(&i->coalesce.list);
+	bkpfs_extents_init(&i->coalesce.dirty);
+	spin_lock_init(&i->meta_lock);
+	mutex_init(&i->meta_mutex);
 
         atomic64_set(&i->vfs_inode.i_version, 1);
 	return &i->vfs_inode;
@@ -0,0 +1,464 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "bkpfs.h"
+
+/*
+ * Delta versions (format=delta).
+ *
+ * Every file opened for writing records the byte ranges written through
+ * it.  When it is released and the newest version is the file as it was
+ * when the ranges started being recorded, version N only stores the new
+ * contents of those ranges, as an extent log (see bkpfs.h) whose footer
+ * points at version N-1.  Rebuilding version N copies the newest full
+ * version at or below N, then applies the deltas above it in order.
+ *
+ * Before a version is unlinked, the delta on top of it is rewritten as a
+ * full copy (bkpfs_delta_detach), so a chain never loses its base.
+ */
+
+/*
+ * bkpfs_dirty_add - remember that [@start, @end) was written via @file
+ *
+ * Called after every successful write, with any format: the release of
+ * @file then makes a version, unless one was made since (see
+ * bkpfs_write_seq).  With format=delta, if the range cannot be recorded
+ * the file forgets all of them, and its next version is a full copy.
+ */
+void bkpfs_dirty_add(struct file *file, loff_t start, loff_t end)
+{
+	struct bkpfs_file_info *fi = BKPFS_F(file);
+
+	set_bit(BKPFS_FILE_WRITTEN, &fi->flags);
+	atomic64_inc(&BKPFS_I(file_inode(file))->write_seq);
+
+	if (BKPFS_SB(file_inode(file)->i_sb)->format != BKPFS_FORMAT_DELTA ||
+	    start >= end)
+		return;
+
+	mutex_lock(&fi->dirty_mutex);
+	if (!fi->dirty_lost && bkpfs_extents_add(&fi->dirty, start, end)) {
+		fi->dirty_lost = true;
+		bkpfs_extents_clear(&fi->dirty);
+	}
+	mutex_unlock(&fi->dirty_mutex);
+}
+
+/*
+ * bkpfs_dirty_truncate - remember that @inode was cut down to @size
+ *
+ * Bytes past the lowest size since the last version may come back as
+ * zeroes, so they count as written for the next delta.
+ */
+void bkpfs_dirty_truncate(struct inode *inode, loff_t size)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+
+	mutex_lock(&info->backup_mutex);
+	if (size < info->trunc_floor)
+		info->trunc_floor = size;
+	mutex_unlock(&info->backup_mutex);
+}
+
+/*
+ * bkpfs_delta_usable - can @version be stored as a delta
+ * @dentry     : upper dentry of the file
+ * @lower_file : lower file the version is taken from
+ * @bkp_dir    : lower backup directory of the file
+ * @version    : version about to be written
+ * @dirty      : ranges written since the newest version, or NULL
+ *
+ * Called under backup_mutex.  Adds the truncated tail to @dirty.  Says
+ * no when there is no base to build on, or when more than half of the
+ * file changed: a full copy is then about as big and cheaper to rebuild.
+ */
+bool bkpfs_delta_usable(struct dentry *dentry, struct file *lower_file,
+			struct dentry *bkp_dir, int version,
+			struct bkpfs_extent_tree *dirty)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(d_inode(dentry));
+	loff_t size = i_size_read(file_inode(lower_file));
+	int base, old_version, next, enc;
+	struct file *vfile;
+
+	if (!dirty)
+		return false;
+
+	/* the ranges are relative to the live file at the newest version */
+	base = bkpfs_get_delta_base(dentry);
+	bkpfs_get_versions(dentry, &old_version, &next);
+	if (base != version - 1 || base < old_version)
+		return false;
+
+	if (info->trunc_floor < size &&
+	    bkpfs_extents_add(dirty, info->trunc_floor, size))
+		return false;
+	if (dirty->bytes * 2 > size)
+		return false;
+
+	vfile = bkpfs_open_version(dentry, bkp_dir, base, O_RDONLY);
+	if (IS_ERR(vfile))
+		return false;
+	enc = bkpfs_version_encoding(vfile->f_path.dentry);
+	fput(vfile);
+	return enc == BKPFS_ENC_RAW || enc == BKPFS_ENC_DELTA ||
+		enc == BKPFS_ENC_COMPRESSED;
+}
+
+/*
+ * bkpfs_delta_write - store the written ranges of a file as a delta
+ * @lower_file : lower file to take the new contents from (readable)
+ * @log        : empty version file, opened for writing
+ * @dirty      : ranges written since version @base
+ * @base       : version the delta applies to
+ * @prog       : progress counter to advance, or NULL
+ *
+ * Returns 0 on success, else the corresponding error code.
+ */
+int bkpfs_delta_write(struct file *lower_file, struct file *log,
+		      struct bkpfs_extent_tree *dirty, int base,
+		      struct bkpfs_progress *prog)
+{
+	loff_t size = i_size_read(file_inode(lower_file));
+	struct bkpfs_log_extent *table;
+	struct bkpfs_extent *ext;
+	loff_t pos = 0, end;
+	unsigned int nr = 0;
+	int err = 0;
+
+	table = kvmalloc_array(dirty->nr ? dirty->nr : 1, sizeof(*table),
+			       GFP_KERNEL);
+	if (!table)
+		return -ENOMEM;
+
+	for (ext = bkpfs_extent_first(dirty); ext;
+	     ext = bkpfs_extent_next(ext)) {
+		end = min(ext->end, size);
+		if (ext->start >= end)
+			break;
+		err = bkpfs_copy_range(lower_file, ext->start, log, pos,
+				       end - ext->start);
+		if (err)
+			goto out;
+		table[nr].off = cpu_to_le64(ext->start);
+		table[nr].len = cpu_to_le64(end - ext->start);
+		nr++;
+		pos += end - ext->start;
+		if (prog)
+			atomic64_add(end - ext->start, &prog->done);
+	}
+
+	err = bkpfs_extent_log_finish(log, pos, table, nr, size, base);
+	printk("INFO:delta on version %d: %u extents, %lld bytes\n",
+	       base, nr, pos);
+out:
+	kvfree(table);
+	return err;
+}
+
+/*
+ * bkpfs_version_unchanged - does the file still match its newest version
+ * @dentry  : upper dentry of the file
+ * @src     : lower file, opened for reading
+ * @bkp_dir : lower backup directory of the file
+ * @version : version about to be written
+ * @csum    : out: checksum record to store with that version
+ *
+ * The crc32c of the file is always computed, so that every version
+ * records one, whether or not unchanged=skip is set; it is a pass of
+ * its own because clones and deltas never read the whole file, and the
+ * copy that follows finds the file in the page cache.  The sizes and
+ * crcs are then compared with the newest version.  A crc match is not
+ * trusted on its own: the bytes are then compared with the newest
+ * version, rebuilt first if it is not a plain copy.  A newest version
+ * stored without a crc gets one once its bytes are found equal.
+ * Pre-image versions are never compared, they are rebuilt from the live
+ * file itself.
+ *
+ * Returns true if no new version is needed.
+ */
+bool bkpfs_version_unchanged(struct dentry *dentry, struct file *src,
+			     struct dentry *bkp_dir, int version,
+			     struct bkpfs_csum *csum)
+{
+	loff_t size = i_size_read(file_inode(src));
+	struct path lower_path, dir;
+	struct bkpfs_csum last;
+	struct file *vfile, *cmp = NULL;
+	int old_version, next, enc;
+	bool same = false;
+	u32 crc;
+
+	csum->size = cpu_to_le64(size);
+	csum->crc = 0;
+	csum->flags = 0;
+	if (bkpfs_file_crc(src, size, &crc))
+		return false;
+	csum->crc = cpu_to_le32(crc);
+	csum->flags = cpu_to_le32(BKPFS_CSUM_CRC);
+	if (!BKPFS_SB(dentry->d_sb)->skip_unchanged)
+		return false;
+
+	bkpfs_get_versions(dentry, &old_version, &next);
+	if (version - 1 < old_version)
+		return false;
+	vfile = bkpfs_open_version(dentry, bkp_dir, version - 1, O_RDONLY);
+	if (IS_ERR(vfile))
+		return false;
+
+	if (vfs_getxattr(vfile->f_path.dentry, BKPFS_XATTR_CSUM,
+			 (void *)&last, sizeof(last)) != sizeof(last) ||
+	    le64_to_cpu(last.size) != size)
+		goto out;
+	if ((le32_to_cpu(last.flags) & BKPFS_CSUM_CRC) && last.crc != csum->crc)
+		goto out;
+
+	enc = bkpfs_version_encoding(vfile->f_path.dentry);
+	if (enc == BKPFS_ENC_PREIMAGE)
+		goto out;
+	if (enc == BKPFS_ENC_RAW) {
+		cmp = get_file(vfile);
+	} else {
+		bkpfs_get_lower_path(dentry, &lower_path);
+		dir.mnt = lower_path.mnt;
+		dir.dentry = bkp_dir;
+		cmp = bkpfs_open_tmpfile(&dir);
+		bkpfs_put_lower_path(dentry, &lower_path);
+		if (IS_ERR(cmp)) {
+			cmp = NULL;
+			goto out;
+		}
+		if (bkpfs_version_materialize(dentry, bkp_dir, version - 1,
+					      next, cmp))
+			goto out;
+	}
+	if (bkpfs_file_cmp(src, cmp, size))
+		goto out;
+	same = true;
+
+	if (!(le32_to_cpu(last.flags) & BKPFS_CSUM_CRC)) {
+		last.crc = csum->crc;
+		last.flags = cpu_to_le32(BKPFS_CSUM_CRC);
+		vfs_setxattr(vfile->f_path.dentry, BKPFS_XATTR_CSUM,
+			     (void *)&last, sizeof(last), 0);
+	}
+out:
+	if (cmp)
+		fput(cmp);
+	fput(vfile);
+	return same;
+}
+
+/*
+ * bkpfs_version_materialize - rebuild a version of a file
+ * @dentry  : upper dentry of the file
+ * @bkp_dir : its lower backup directory
+ * @version : version to rebuild
+ * @newest  : user.curr_version, one past the newest version
+ * @dst     : empty lower file to rebuild into, opened for writing
+ *
+ * Works for every encoding: full copies are copied (or cloned) or
+ * decompressed, deltas are applied on top of their base, pre-images are undone
+ * starting from the live file, manifests are filled from the chunk
+ * store.
+ *
+ * Returns 0 on success, -EIO if a delta chain is broken, else the
+ * corresponding error code.
+ */
+int bkpfs_version_materialize(struct dentry *dentry, struct dentry *bkp_dir,
+			      int version, int newest, struct file *dst)
+{
+	struct bkpfs_progress *prog = &BKPFS_I(d_inode(dentry))->progress;
+	struct file *vfile;
+	int root, v, base, enc, err;
+
+	vfile = bkpfs_open_version(dentry, bkp_dir, version, O_RDONLY);
+	if (IS_ERR(vfile))
+		return PTR_ERR(vfile);
+	enc = bkpfs_version_encoding(vfile->f_path.dentry);
+	if (enc == BKPFS_ENC_PREIMAGE) {
+		fput(vfile);
+		return bkpfs_preimage_restore(dentry, bkp_dir, version, newest,
+					      dst);
+	}
+	if (enc == BKPFS_ENC_CHUNKED) {
+		err = bkpfs_chunk_materialize(dentry->d_sb, vfile, dst, prog);
+		fput(vfile);
+		return err;
+	}
+
+	/* walk down to the full (maybe compressed) copy under the deltas */
+	root = version;
+	while (enc == BKPFS_ENC_DELTA) {
+		fput(vfile);
+		vfile = bkpfs_open_version(dentry, bkp_dir, --root, O_RDONLY);
+		if (IS_ERR(vfile))
+			return -EIO;
+		enc = bkpfs_version_encoding(vfile->f_path.dentry);
+	}
+	if (enc == BKPFS_ENC_COMPRESSED)
+		err = bkpfs_decompress_file(vfile, dst, prog);
+	else if (enc == BKPFS_ENC_RAW)
+		err = bkpfs_copy_file(dentry->d_sb, vfile, dst,
+				      i_size_read(file_inode(vfile)), prog);
+	else
+		err = -EIO;
+	fput(vfile);
+
+	for (v = root + 1; !err && v <= version; v++) {
+		vfile = bkpfs_open_version(dentry, bkp_dir, v, O_RDONLY);
+		if (IS_ERR(vfile))
+			return PTR_ERR(vfile);
+		err = bkpfs_extent_log_apply(vfile, dst, &base, prog);
+		if (!err && base != v - 1)
+			err = -EIO;
+		fput(vfile);
+	}
+	return err;
+}
+
+#define BKPFS_DETACH_SUFFIX	"new"
+
+/* link @new as ".F.N.new", then rename that over version @version */
+static int bkpfs_version_replace(struct dentry *dentry,
+				 struct dentry *bkp_dir, int version,
+				 struct file *new)
+{
+	char name[NAME_MAX + 1], link_name[NAME_MAX + 1];
+	const char *stem = bkpfs_version_stem(BKPFS_SB(dentry->d_sb),
+					      dentry->d_name.name);
+	struct inode *dir = d_inode(bkp_dir);
+	struct dentry *old, *link;
+	int err;
+
+	if (snprintf(name, sizeof(name), ".%s.%d", stem, version) >=
+	    sizeof(name) ||
+	    snprintf(link_name, sizeof(link_name), ".%s.%d."
+		     BKPFS_DETACH_SUFFIX, stem, version) >= sizeof(link_name))
+		return -ENAMETOOLONG;
+
+	inode_lock_nested(dir, I_MUTEX_PARENT);
+	old = lookup_one_len(name, bkp_dir, strlen(name));
+	if (IS_ERR(old)) {
+		err = PTR_ERR(old);
+		goto out_unlock;
+	}
+	err = -ENOENT;
+	if (d_is_negative(old))
+		goto out_old;
+	link = lookup_one_len(link_name, bkp_dir, strlen(link_name));
+	if (!IS_ERR(link) && d_is_positive(link)) {
+		/* left by a crash in the middle of an earlier detach */
+		err = vfs_unlink(dir, link, NULL);
+		dput(link);
+		link = err ? ERR_PTR(err) :
+			lookup_one_len(link_name, bkp_dir, strlen(link_name));
+	}
+	if (IS_ERR(link)) {
+		err = PTR_ERR(link);
+		goto out_old;
+	}
+	err = vfs_link(new->f_path.dentry, dir, link, NULL);
+	if (!err) {
+		err = vfs_rename(dir, link, dir, old, NULL, 0);
+		if (err)
+			vfs_unlink(dir, link, NULL);
+	}
+	dput(link);
+out_old:
+	dput(old);
+out_unlock:
+	inode_unlock(dir);
+	return err;
+}
+
+/*
+ * bkpfs_delta_detach - make @version independent of the version below
+ * @dentry  : upper dentry of the file
+ * @bkp_dir : its lower backup directory
+ * @version : version whose base is about to be unlinked
+ *
+ * A delta is rebuilt into a temporary file, then written as a full
+ * copy, compressed if the mount compresses, into an unnamed file that
+ * is renamed over the delta once complete, as restore.c does with the
+ * live file.  A crash or an error leaves the delta as it was.  Other
+ * encodings are left alone.
+ *
+ * Returns 0 if the base may go, else the corresponding error code.
+ */
+int bkpfs_delta_detach(struct dentry *dentry, struct dentry *bkp_dir,
+		       int version)
+{
+	struct path lower_path, dir;
+	struct file *vfile, *tmp, *full;
+	struct bkpfs_index_rec rec;
+	int enc, err;
+
+	vfile = bkpfs_open_version(dentry, bkp_dir, version, O_RDONLY);
+	if (IS_ERR(vfile))
+		return 0;	/* nothing on top of it */
+	enc = bkpfs_version_encoding(vfile->f_path.dentry);
+	if (enc != BKPFS_ENC_DELTA) {
+		fput(vfile);
+		return 0;
+	}
+
+	bkpfs_get_lower_path(dentry, &lower_path);
+	dir.mnt = lower_path.mnt;
+	dir.dentry = bkp_dir;
+	tmp = bkpfs_open_tmpfile(&dir);
+	full = IS_ERR(tmp) ? NULL : bkpfs_open_linkable(&dir);
+	bkpfs_put_lower_path(dentry, &lower_path);
+	if (IS_ERR(tmp)) {
+		err = PTR_ERR(tmp);
+		goto out_vfile;
+	}
+	if (IS_ERR(full)) {
+		err = PTR_ERR(full);
+		goto out_tmp;
+	}
+
+	err = bkpfs_version_materialize(dentry, bkp_dir, version, 0, tmp);
+	if (err)
+		goto out;
+	if (BKPFS_SB(dentry->d_sb)->compress) {
+		err = bkpfs_compress_file(dentry->d_sb, tmp, full,
+					  i_size_read(file_inode(tmp)), NULL);
+		enc = BKPFS_ENC_COMPRESSED;
+	} else {
+		err = bkpfs_copy_file(dentry->d_sb, tmp, full,
+				      i_size_read(file_inode(tmp)), NULL);
+		enc = BKPFS_ENC_RAW;
+	}
+	/* the checksum and the rest of what describes the version */
+	if (!err)
+		err = bkpfs_copy_xattrs(vfile->f_path.dentry,
+					full->f_path.dentry);
+	if (!err)
+		err = bkpfs_set_version_encoding(full->f_path.dentry, enc);
+	if (!err)
+		err = bkpfs_version_replace(dentry, bkp_dir, version, full);
+	if (!err && !bkpfs_index_get(dentry, bkp_dir, version, &rec)) {
+		rec.encoding = cpu_to_le32(enc);
+		rec.stored = cpu_to_le64(i_size_read(file_inode(full)));
+		bkpfs_index_put(dentry, bkp_dir, &rec);
+	}
+out:
+	fput(full);
+out_tmp:
+	fput(tmp);
+out_vfile:
+	if (err)
+		printk(KERN_ERR "bkpfs: detaching version %d failed: %d\n",
+		       version, err);
+	fput(vfile);
+	return err;
+}